@@ -0,0 +1,136 @@
+// Throughput and per-issue latency of the analysis stage with and without
+// batching. Worker threads drain a backlog of small issues spread over a
+// few repositories; the AI provider is simulated with a latency of a fixed
+// per-request overhead plus a cost per issue answered, and a limit on
+// concurrent requests like a provider's rate limit imposes.
+//
+//   make bench-batch
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "analysis_batch.h"
+
+#define ISSUES 480
+#define WORKERS 12
+#define REPOS 3
+#define REQUEST_OVERHEAD_MS 60 // Connection, queueing and prompt prefill
+#define PER_ISSUE_MS 15        // Generating one issue's analysis
+#define PROVIDER_SLOTS 2       // Concurrent requests the provider accepts
+
+static int next_issue = 0;
+static long long requests = 0;
+static double latency_ms[ISSUES];
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t provider_slots;
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void simulate_request(int issues) {
+  __atomic_add_fetch(&requests, 1, __ATOMIC_RELAXED);
+  sem_wait(&provider_slots);
+  usleep((useconds_t)(REQUEST_OVERHEAD_MS + PER_ISSUE_MS * issues) * 1000);
+  sem_post(&provider_slots);
+}
+
+// Answer every delimited issue in the batch
+static char *fake_send(const char *content, void *arg) {
+  (void)arg; // Suppress unused parameter warning
+  char *response = malloc(strlen(content) * 2 + 64);
+  size_t len = 0;
+  int issues = 0;
+  for (const char *p = strstr(content, "=== ISSUE "); p;
+       p = strstr(p + 1, "=== ISSUE ")) {
+    int number = atoi(p + 10);
+    len += (size_t)sprintf(response + len,
+                           "=== ISSUE %d ===\nTypo fix for %d.\n", number,
+                           number);
+    issues++;
+  }
+  response[len] = '\0';
+  simulate_request(issues);
+  return response;
+}
+
+static void *worker(void *arg) {
+  int batched = *(int *)arg;
+  char body[128];
+  char response[256];
+  while (1) {
+    pthread_mutex_lock(&bench_lock);
+    int issue = next_issue < ISSUES ? next_issue++ : -1;
+    pthread_mutex_unlock(&bench_lock);
+    if (issue < 0) {
+      return NULL;
+    }
+    char repo[32];
+    snprintf(repo, sizeof(repo), "owner/repo%d", issue % REPOS);
+    snprintf(body, sizeof(body), "Fix the typo in section %d of the docs.",
+             issue);
+
+    double start = now_ms();
+    int result = batched ? analysis_batch_run(repo, issue + 1, body, 60000,
+                                              fake_send, NULL, response,
+                                              sizeof(response))
+                         : 1;
+    if (result != 0) {
+      simulate_request(1);
+    }
+    latency_ms[issue] = now_ms() - start;
+  }
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void run(const char *label, int batched) {
+  pthread_t threads[WORKERS];
+  next_issue = 0;
+  requests = 0;
+  double start = now_ms();
+  for (int i = 0; i < WORKERS; i++) {
+    pthread_create(&threads[i], NULL, worker, &batched);
+  }
+  for (int i = 0; i < WORKERS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = now_ms() - start;
+
+  qsort(latency_ms, ISSUES, sizeof(double), compare_double);
+  double sum = 0;
+  for (int i = 0; i < ISSUES; i++) {
+    sum += latency_ms[i];
+  }
+  printf("%-10s %7.1f issues/s %5lld requests  latency mean %6.1f ms "
+         "p50 %6.1f ms p95 %6.1f ms\n",
+         label, ISSUES / (elapsed / 1e3), requests, sum / ISSUES,
+         latency_ms[ISSUES / 2], latency_ms[ISSUES * 95 / 100]);
+}
+
+int main(void) {
+  sem_init(&provider_slots, 0, PROVIDER_SLOTS);
+  printf("%d small issues over %d repositories, %d workers, "
+         "%d ms per request + %d ms per issue, %d concurrent requests\n",
+         ISSUES, REPOS, WORKERS, REQUEST_OVERHEAD_MS, PER_ISSUE_MS,
+         PROVIDER_SLOTS);
+  run("unbatched", 0);
+  for (int size = 2; size <= 8; size *= 2) {
+    char value[16], label[16];
+    snprintf(value, sizeof(value), "%d", size);
+    batch_config_handler("batch_size", value);
+    snprintf(label, sizeof(label), "batch=%d", size);
+    run(label, 1);
+  }
+  return 0;
+}
@@ -0,0 +1,402 @@
+// Webhook ingest under load. Issue deliveries are sent to /notify at fixed
+// open-loop rates: each request is due at its slot in the schedule whether
+// or not earlier ones have been answered, and its latency is measured from
+// that slot, so a stalled listener shows up in the tail instead of slowing
+// the generator down. Payloads are synthetic issues of a configurable body
+// size, or lines replayed from a JSONL file (whole webhook payloads, or
+// records with a title and body such as requests.jsonl). Every delivery
+// gets its own X-GitHub-Delivery id and issue number so none are dropped as
+// duplicates or coalesced. Redis queue lengths are sampled before and after
+// each rate to show how far the workers fall behind. Raise the [Admission]
+// limits to measure the listener itself rather than its throttling; 429s
+// are counted separately from errors.
+//
+// Start Redis and the service locally first, then:
+//
+//   make bench-ingest
+//   make bench-ingest INGEST_ARGS="-r 200,1000 -d 5 -s 65536"
+//   make bench-ingest INGEST_ARGS="-f requests.jsonl"
+
+#include <cjson/cJSON.h>
+#include <curl/curl.h>
+#include <hiredis/hiredis.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "json_builder.h"
+
+#define MAX_RATES 16
+#define MAX_REPLAY 100000
+
+struct request {
+  CURL *curl;
+  struct curl_slist *headers;
+  char *payload;
+  double due_ms;
+};
+
+static const char *url = "http://127.0.0.1:8080/notify";
+static const char *redis_host = "127.0.0.1";
+static int redis_port = 6379;
+static double duration_s = 10;
+static size_t body_size = 1024;
+static int repos = 64;
+static int max_connections = 256;
+static const char *replay_file = NULL;
+
+static char **replay = NULL; // Lines of replay_file
+static int replay_count = 0;
+static long long sequence = 0;
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int is_loopback(const char *host) {
+  return strncmp(host, "127.", 4) == 0 || strcmp(host, "localhost") == 0 ||
+         strcmp(host, "::1") == 0 || strcmp(host, "[::1]") == 0;
+}
+
+// Only local targets: this is a load generator
+static int url_is_local(const char *target) {
+  const char *host = strstr(target, "://");
+  if (!host) {
+    return 0;
+  }
+  host += 3;
+  char name[64];
+  size_t len = strcspn(host, host[0] == '[' ? "]" : ":/");
+  if (host[0] == '[') {
+    len++;
+  }
+  if (len == 0 || len >= sizeof(name)) {
+    return 0;
+  }
+  memcpy(name, host, len);
+  name[len] = '\0';
+  return is_loopback(name);
+}
+
+static int load_replay(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    perror(path);
+    return -1;
+  }
+  replay = calloc(MAX_REPLAY, sizeof(*replay));
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while (replay && replay_count < MAX_REPLAY &&
+         (len = getline(&line, &cap, file)) > 0) {
+    if (len > 1) {
+      replay[replay_count++] = strdup(line);
+    }
+  }
+  free(line);
+  fclose(file);
+  if (replay_count == 0) {
+    fprintf(stderr, "%s has no payloads\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+// An issues/opened payload for a fresh issue number
+static char *build_payload(long long n, const char *title, const char *body,
+                           size_t body_len) {
+  char repo[64], fallback_title[64];
+  snprintf(repo, sizeof(repo), "bench/repo-%lld", n % repos);
+  if (!title) {
+    snprintf(fallback_title, sizeof(fallback_title), "Bench issue %lld",
+             n + 1);
+    title = fallback_title;
+  }
+  struct json_builder jb;
+  json_builder_init(&jb);
+  json_object_begin(&jb, NULL);
+  json_add_string(&jb, "action", "opened");
+  json_object_begin(&jb, "issue");
+  json_add_int(&jb, "number", n + 1);
+  json_add_string(&jb, "title", title);
+  json_add_string_len(&jb, "body", body, body_len);
+  json_array_begin(&jb, "labels");
+  json_array_end(&jb);
+  json_object_end(&jb);
+  json_object_begin(&jb, "repository");
+  json_add_string(&jb, "full_name", repo);
+  json_object_end(&jb);
+  json_object_end(&jb);
+  return json_builder_finish(&jb);
+}
+
+// The next payload: a replayed line or a synthetic issue
+static char *next_payload(long long n) {
+  if (!replay) {
+    static char *filler = NULL;
+    if (!filler) {
+      filler = malloc(body_size + 1);
+      for (size_t i = 0; i < body_size; i++) {
+        filler[i] = i % 64 == 63 ? '\n' : "lorem ipsum dolor "[i % 18];
+      }
+      filler[body_size] = '\0';
+    }
+    return build_payload(n, NULL, filler, body_size);
+  }
+  const char *line = replay[n % replay_count];
+  cJSON *json = cJSON_Parse(line);
+  char *payload = NULL;
+  cJSON *issue = cJSON_GetObjectItem(json, "issue");
+  if (cJSON_IsObject(issue)) {
+    // A recorded webhook; renumber it so it is not coalesced
+    cJSON_ReplaceItemInObject(issue, "number", cJSON_CreateNumber(n + 1));
+    payload = cJSON_PrintUnformatted(json);
+  } else {
+    cJSON *title = cJSON_GetObjectItem(json, "title");
+    cJSON *body = cJSON_GetObjectItem(json, "body");
+    const char *text = cJSON_IsString(body) ? body->valuestring : line;
+    payload = build_payload(
+        n, cJSON_IsString(title) ? title->valuestring : NULL, text,
+        strlen(text));
+  }
+  cJSON_Delete(json);
+  if (!payload) {
+    // Not JSON: send the line as the issue body
+    payload = build_payload(n, NULL, line, strlen(line));
+  }
+  return payload;
+}
+
+static size_t discard(void *data, size_t size, size_t nmemb, void *arg) {
+  (void)data;
+  (void)arg;
+  return size * nmemb;
+}
+
+static struct request *start_request(CURLM *multi, double due_ms) {
+  struct request *req = calloc(1, sizeof(*req));
+  long long n = sequence++;
+  char delivery[96];
+  snprintf(delivery, sizeof(delivery), "X-GitHub-Delivery: bench-%d-%lld",
+           (int)getpid(), n);
+  req->payload = next_payload(n);
+  req->due_ms = due_ms;
+  req->headers = curl_slist_append(NULL, "Content-Type: application/json");
+  req->headers = curl_slist_append(req->headers, "X-GitHub-Event: issues");
+  req->headers = curl_slist_append(req->headers, delivery);
+  req->curl = curl_easy_init();
+  curl_easy_setopt(req->curl, CURLOPT_URL, url);
+  curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->headers);
+  curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, req->payload);
+  curl_easy_setopt(req->curl, CURLOPT_WRITEFUNCTION, discard);
+  curl_easy_setopt(req->curl, CURLOPT_PRIVATE, req);
+  curl_easy_setopt(req->curl, CURLOPT_TIMEOUT_MS, 30000L);
+  curl_multi_add_handle(multi, req->curl);
+  return req;
+}
+
+static void free_request(CURLM *multi, struct request *req) {
+  curl_multi_remove_handle(multi, req->curl);
+  curl_easy_cleanup(req->curl);
+  curl_slist_free_all(req->headers);
+  free(req->payload);
+  free(req);
+}
+
+// Issues waiting in every class queue (lists and streams)
+static long long queue_length(redisContext *redis) {
+  long long total = 0;
+  const char *patterns[] = {"issue_queue*", "issue_stream*"};
+  for (int p = 0; p < 2; p++) {
+    char cursor[32] = "0";
+    do {
+      redisReply *reply = redisCommand(redis, "SCAN %s MATCH %s COUNT 1000",
+                                       cursor, patterns[p]);
+      if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+        freeReplyObject(reply);
+        return -1;
+      }
+      snprintf(cursor, sizeof(cursor), "%s", reply->element[0]->str);
+      redisReply *keys = reply->element[1];
+      for (size_t i = 0; i < keys->elements; i++) {
+        redisReply *len = redisCommand(redis, "%s %s", p ? "XLEN" : "LLEN",
+                                       keys->element[i]->str);
+        if (len && len->type == REDIS_REPLY_INTEGER) {
+          total += len->integer;
+        }
+        freeReplyObject(len);
+      }
+      freeReplyObject(reply);
+    } while (strcmp(cursor, "0") != 0);
+  }
+  return total;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, long long count, double p) {
+  if (count == 0) {
+    return 0;
+  }
+  long long index = (long long)(p * (double)(count - 1) + 0.5);
+  return sorted[index];
+}
+
+// Offer rate requests per second for duration_s and report
+static void run(CURLM *multi, redisContext *redis, double rate) {
+  long long total = (long long)(rate * duration_s);
+  double *latency = malloc(sizeof(double) * (size_t)(total > 0 ? total : 1));
+  long long done = 0, ok = 0, throttled = 0, errors = 0, sent = 0;
+  int active = 0;
+  long long queued_before = queue_length(redis);
+
+  double start = now_ms();
+  while (done < total) {
+    double now = now_ms();
+    // Requests whose slot has come; past the connection cap they wait, and
+    // the wait counts against their latency
+    while (sent < total && active < max_connections &&
+           start + sent * 1e3 / rate <= now) {
+      start_request(multi, start + sent * 1e3 / rate);
+      sent++;
+      active++;
+    }
+    int running;
+    curl_multi_perform(multi, &running);
+    CURLMsg *msg;
+    int left;
+    while ((msg = curl_multi_info_read(multi, &left))) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      struct request *req;
+      long status = 0;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+      latency[done++] = now_ms() - req->due_ms;
+      if (msg->data.result == CURLE_OK && status >= 200 && status < 300) {
+        ok++;
+      } else if (status == 429) {
+        throttled++;
+      } else {
+        errors++;
+      }
+      free_request(multi, req);
+      active--;
+    }
+    int wait_ms = 10;
+    if (sent < total && active < max_connections) {
+      double next = start + sent * 1e3 / rate - now_ms();
+      wait_ms = next < 0 ? 0 : next < 10 ? (int)next : 10;
+    }
+    curl_multi_poll(multi, NULL, 0, wait_ms, NULL);
+  }
+  double elapsed = (now_ms() - start) / 1e3;
+  long long queued_after = queue_length(redis);
+
+  qsort(latency, (size_t)done, sizeof(double), compare_double);
+  printf("%7.0f/s offered %8.1f/s done  p50 %7.2f ms p99 %7.2f ms "
+         "p999 %7.2f ms  ok %lld 429 %lld errors %lld  queue %+lld\n",
+         rate, done / elapsed, percentile(latency, done, 0.5),
+         percentile(latency, done, 0.99), percentile(latency, done, 0.999),
+         ok, throttled, errors,
+         queued_before < 0 || queued_after < 0 ? 0
+                                               : queued_after - queued_before);
+  free(latency);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-u url] [-r rate,...] [-d seconds] [-s body_bytes]\n"
+          "          [-f replay.jsonl] [-R repos] [-c connections]\n"
+          "          [-H redis_host] [-P redis_port]\n",
+          name);
+}
+
+int main(int argc, char *argv[]) {
+  double rates[MAX_RATES] = {100, 500, 1000, 2000};
+  int rate_count = 4;
+  int opt;
+  while ((opt = getopt(argc, argv, "u:r:d:s:f:R:c:H:P:")) != -1) {
+    switch (opt) {
+    case 'u':
+      url = optarg;
+      break;
+    case 'r':
+      rate_count = 0;
+      for (char *p = strtok(optarg, ","); p && rate_count < MAX_RATES;
+           p = strtok(NULL, ",")) {
+        rates[rate_count++] = atof(p);
+      }
+      break;
+    case 'd':
+      duration_s = atof(optarg);
+      break;
+    case 's':
+      body_size = (size_t)atoll(optarg);
+      break;
+    case 'f':
+      replay_file = optarg;
+      break;
+    case 'R':
+      repos = atoi(optarg) > 0 ? atoi(optarg) : 1;
+      break;
+    case 'c':
+      max_connections = atoi(optarg) > 0 ? atoi(optarg) : 1;
+      break;
+    case 'H':
+      redis_host = optarg;
+      break;
+    case 'P':
+      redis_port = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!url_is_local(url) || !is_loopback(redis_host)) {
+    fprintf(stderr, "Only local targets are supported\n");
+    return 1;
+  }
+  if (replay_file && load_replay(replay_file) != 0) {
+    return 1;
+  }
+
+  redisContext *redis = redisConnect(redis_host, redis_port);
+  if (!redis || redis->err) {
+    fprintf(stderr, "Cannot connect to Redis at %s:%d\n", redis_host,
+            redis_port);
+    return 1;
+  }
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  CURLM *multi = curl_multi_init();
+  curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+                    (long)max_connections);
+
+  printf("%s, %s payloads, %d repositories, %.0f s per rate, "
+         "up to %d connections\n",
+         url, replay_file ? replay_file : "synthetic", repos, duration_s,
+         max_connections);
+  if (!replay_file) {
+    printf("synthetic issue bodies of %zu bytes\n", body_size);
+  }
+  for (int i = 0; i < rate_count; i++) {
+    if (rates[i] > 0) {
+      run(multi, redis, rates[i]);
+    }
+  }
+
+  curl_multi_cleanup(multi);
+  curl_global_cleanup();
+  redisFree(redis);
+  return 0;
+}
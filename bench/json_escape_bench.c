@@ -0,0 +1,114 @@
+// Microbenchmark for AI request body construction: the old snprintf path
+// (which does not escape at all) against the JSON builder with each escaper.
+//
+//   make bench-json
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "json_builder.h"
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Issue-like text: prose and pasted logs with quotes, tabs and newlines
+static char *make_prompt(size_t size) {
+  static const char *lines[] = {
+      "When I run the build it fails with the following error:\n",
+      "\terror: expected ';' before '}' token at src/main.c:42\n",
+      "The config contains \"path\": \"C:\\\\Users\\\\dev\\\\project\"\n",
+      "Steps to reproduce are below, it happens on every run of the tool.\n",
+      "2024-01-01T00:00:00Z INFO worker started pid=1234 queue=default\n",
+  };
+  char *prompt = malloc(size + 1);
+  size_t len = 0;
+  for (int i = 0; len < size; i++) {
+    const char *line = lines[i % 5];
+    size_t n = strlen(line);
+    if (n > size - len) {
+      n = size - len;
+    }
+    memcpy(prompt + len, line, n);
+    len += n;
+  }
+  prompt[size] = '\0';
+  return prompt;
+}
+
+static void bench_snprintf(const char *prompt, size_t size, int iterations) {
+  size_t cap = size + 256;
+  char *buffer = malloc(cap);
+  double start = now_seconds();
+  for (int i = 0; i < iterations; i++) {
+    snprintf(buffer, cap,
+             "{\"model\":\"%s\",\"prompt\":\"%s\",\"max_tokens\":1000,"
+             "\"temperature\":0.7}",
+             "gpt-4", prompt);
+  }
+  double elapsed = now_seconds() - start;
+  printf("  %-10s %9.1f MB/s %8.3f ms/request (invalid JSON)\n", "snprintf",
+         size * (double)iterations / elapsed / 1e6,
+         elapsed * 1e3 / iterations);
+  free(buffer);
+}
+
+static void bench_builder(const char *name, const char *prompt, size_t size,
+                          int iterations) {
+  size_t out_len = 0;
+  double start = now_seconds();
+  for (int i = 0; i < iterations; i++) {
+    struct json_builder jb;
+    json_builder_init(&jb);
+    json_object_begin(&jb, NULL);
+    json_add_string(&jb, "model", "gpt-4");
+    json_add_string_len(&jb, "prompt", prompt, size);
+    json_add_int(&jb, "max_tokens", 1000);
+    json_add_double(&jb, "temperature", 0.7);
+    json_object_end(&jb);
+    out_len = jb.len;
+    free(json_builder_finish(&jb));
+  }
+  double elapsed = now_seconds() - start;
+  printf("  %-10s %9.1f MB/s %8.3f ms/request (%zu bytes out)\n", name,
+         size * (double)iterations / elapsed / 1e6,
+         elapsed * 1e3 / iterations, out_len);
+}
+
+int main(void) {
+  static const size_t sizes[] = {100 * 1024, 1024 * 1024, 8 * 1024 * 1024};
+  static const struct {
+    const char *name;
+    enum json_escape_impl impl;
+  } impls[] = {{"scalar", JSON_ESCAPE_SCALAR},
+               {"sse2", JSON_ESCAPE_SSE2},
+               {"avx2", JSON_ESCAPE_AVX2}};
+
+  openlog("json_escape_bench", LOG_PERROR, LOG_USER);
+  if (json_builder_self_test() != 0) {
+    fprintf(stderr, "Escaper self test failed\n");
+    return 1;
+  }
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t size = sizes[s];
+    int iterations = (int)(512 * 1024 * 1024 / size);
+    char *prompt = make_prompt(size);
+    printf("prompt %zu KB, %d iterations\n", size / 1024, iterations);
+    bench_snprintf(prompt, size, iterations);
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+      if (json_set_escape_impl(impls[k].impl) != 0) {
+        printf("  %-10s not supported on this CPU\n", impls[k].name);
+        continue;
+      }
+      bench_builder(impls[k].name, prompt, size, iterations);
+    }
+    free(prompt);
+  }
+  return 0;
+}
@@ -0,0 +1,211 @@
+#!/bin/sh
+# End-to-end pipeline benchmark. Drives synthetic issues through the real
+# clone -> branch -> apply -> commit -> push -> pull request path, offline:
+# a local bare repository stands in for the GitHub remote (clone_url),
+# mock_github_server for the REST API and mock_ai_server -j for the model.
+# For each worker count it reports the time spent per stage, issues per
+# minute and the service's peak RSS.
+#
+#   make bench-pipeline PIPELINE_ARGS="-n 200 -w '1 2 4 8' -l 300"
+#
+# Options:
+#   -n issues        issues per run (default 50)
+#   -w "counts"      worker_threads values to run (default "1 2 4 8")
+#   -l ms            mean AI latency (default 200)
+#   -g ms            GitHub API latency (default 20)
+#   -r port          Redis port; a private redis-server is started there if
+#                    nothing answers (default 16379, the database is flushed)
+#   -t seconds       give up on a run after this long (default 600)
+
+set -eu
+
+ISSUES=50
+WORKERS="1 2 4 8"
+AI_LATENCY=200
+GITHUB_LATENCY=20
+REDIS_PORT=16379
+RUN_TIMEOUT=600
+while getopts n:w:l:g:r:t: opt; do
+  case $opt in
+  n) ISSUES=$OPTARG ;;
+  w) WORKERS=$OPTARG ;;
+  l) AI_LATENCY=$OPTARG ;;
+  g) GITHUB_LATENCY=$OPTARG ;;
+  r) REDIS_PORT=$OPTARG ;;
+  t) RUN_TIMEOUT=$OPTARG ;;
+  *) sed -n 's/^# \{0,1\}//; 9,18p' "$0" >&2; exit 1 ;;
+  esac
+done
+
+BIN=$(pwd)/bin
+SERVICE_PORT=18080
+AI_PORT=18090
+GITHUB_PORT=18091
+WORK=$(mktemp -d /tmp/cis-pipeline-bench.XXXXXX)
+PIDS=""
+KEEP=0 # Set when a run has failures, so the logs survive
+
+cleanup() {
+  for pid in $PIDS; do
+    kill "$pid" 2>/dev/null || true
+  done
+  wait 2>/dev/null || true
+  if [ "$KEEP" -eq 0 ]; then
+    rm -rf "$WORK"
+  else
+    echo "logs kept in $WORK/logs"
+  fi
+}
+trap cleanup EXIT INT TERM
+
+fail() {
+  echo "pipeline_bench: $*" >&2
+  exit 1
+}
+
+for tool in git curl redis-cli; do
+  command -v $tool >/dev/null || fail "$tool is required"
+done
+
+# Remote: a bare repository with one commit on main
+REMOTES=$WORK/remotes
+git init -q --bare -b main "$REMOTES/bench/repo.git"
+git init -q -b main "$WORK/seed"
+echo "Pipeline benchmark repository" >"$WORK/seed/README.md"
+git -C "$WORK/seed" add README.md
+git -C "$WORK/seed" -c user.name=bench -c user.email=bench@example.com \
+  commit -q -m "Initial commit"
+git -C "$WORK/seed" push -q "$REMOTES/bench/repo.git" main
+
+# Mock endpoints and Redis
+"$BIN/mock_ai_server" -p $AI_PORT -l "$AI_LATENCY" -j >"$WORK/mock_ai.log" &
+PIDS="$PIDS $!"
+"$BIN/mock_github_server" -p $GITHUB_PORT -l "$GITHUB_LATENCY" \
+  >"$WORK/mock_github.log" &
+PIDS="$PIDS $!"
+if ! redis-cli -p "$REDIS_PORT" ping >/dev/null 2>&1; then
+  command -v redis-server >/dev/null ||
+    fail "nothing on Redis port $REDIS_PORT and no redis-server to start"
+  redis-server --port "$REDIS_PORT" --save "" --appendonly no \
+    >"$WORK/redis.log" 2>&1 &
+  PIDS="$PIDS $!"
+  for _ in 1 2 3 4 5 6 7 8 9 10; do
+    redis-cli -p "$REDIS_PORT" ping >/dev/null 2>&1 && break
+    sleep 0.2
+  done
+fi
+
+# Sum a metric over all its label sets from the service's /metrics page
+metric() {
+  curl -s "http://127.0.0.1:$SERVICE_PORT/metrics" |
+    awk -v name="$1" 'index($1, name) == 1 { sum += $2 } END { print sum + 0 }'
+}
+
+now_ms() {
+  date +%s%3N
+}
+
+printf "%-8s %8s %10s %10s" workers issues seconds issues/min
+for stage in clone analyze implement apply review push pull_request; do
+  printf " %12s" "$stage"
+done
+printf " %10s\n" peak_rss_kb
+
+offset=0
+for workers in $WORKERS; do
+  # The shipped config with the benchmark's endpoints layered on top; inih
+  # applies later entries over earlier ones
+  conf=$WORK/bench_$workers.conf
+  cat code_issue_service.conf - >"$conf" <<EOF
+
+[Server]
+port=$SERVICE_PORT
+log_directory=$WORK/logs
+redis_port=$REDIS_PORT
+worker_threads=$workers
+handover_socket=
+dry_run=0
+
+[Queue]
+backend=list
+local_queue_path=$WORK/queue.wal
+
+[Admission]
+global_rate=0
+repo_rate=0
+
+[Cleanup]
+trash_dir=$WORK/trash
+
+[Digest]
+cache_dir=$WORK/digest
+
+[GitHub]
+personal_access_token=bench
+api_url=http://127.0.0.1:$GITHUB_PORT
+clone_url=file://$REMOTES
+
+[AI]
+api_provider=mock
+base_url=http://127.0.0.1:$AI_PORT
+EOF
+  mkdir -p "$WORK/logs"
+  redis-cli -p "$REDIS_PORT" flushdb >/dev/null
+
+  "$BIN/code_issue_service" -c "$conf" &
+  service=$!
+  for _ in $(seq 50); do
+    curl -s -o /dev/null "http://127.0.0.1:$SERVICE_PORT/metrics" && break
+    sleep 0.1
+  done
+
+  # Issue numbers differ between runs, so every run clones into fresh
+  # workspaces and pushes new branches
+  started=$(now_ms)
+  i=1
+  while [ "$i" -le "$ISSUES" ]; do
+    number=$((offset + i))
+    payload=$(printf '{"action":"opened","issue":{"number":%d,%s,%s},%s}' \
+      "$number" "\"title\":\"Benchmark issue $number\"" \
+      "\"body\":\"Synthetic issue $number for the pipeline benchmark.\"" \
+      '"repository":{"full_name":"bench/repo"}')
+    curl -s -o /dev/null -H "Content-Type: application/json" \
+      -H "X-GitHub-Event: issues" \
+      -H "X-GitHub-Delivery: pipeline-$$-$number" \
+      -d "$payload" "http://127.0.0.1:$SERVICE_PORT/notify"
+    i=$((i + 1))
+  done
+
+  deadline=$(($(date +%s) + RUN_TIMEOUT))
+  while [ "$(metric cis_issues_processed_total)" -lt "$ISSUES" ]; do
+    if [ "$(date +%s)" -ge "$deadline" ]; then
+      echo "pipeline_bench: run with $workers workers timed out" >&2
+      break
+    fi
+    sleep 0.2
+  done
+  elapsed=$(($(now_ms) - started))
+  failed=$(metric 'cis_issues_processed_total{result="failed"}')
+
+  printf "%-8s %8s %10s %10s" "$workers" "$ISSUES" \
+    "$(echo "$elapsed" | awk '{ printf "%.1f", $1 / 1000 }')" \
+    "$(echo "$ISSUES $elapsed" | awk '{ printf "%.1f", $1 * 60000 / $2 }')"
+  for stage in clone analyze implement apply review push pull_request; do
+    total=$(metric "cis_stage_ms_total{stage=\"$stage\"}")
+    runs=$(metric "cis_stage_runs_total{stage=\"$stage\"}")
+    printf " %10sms" "$(echo "$total $runs" |
+      awk '{ printf "%.0f", $2 ? $1 / $2 : 0 }')"
+  done
+  printf " %10s\n" "$(awk '/^VmHWM:/ { print $2 }' /proc/$service/status)"
+  if [ "$failed" -gt 0 ]; then
+    echo "  $failed of $ISSUES issues failed"
+    KEEP=1
+  fi
+
+  kill -TERM "$service"
+  wait "$service" || true
+  offset=$((offset + ISSUES))
+done
+
+pushed=$(git -C "$REMOTES/bench/repo.git" branch --list 'issue_*' | wc -l)
+echo "branches pushed to the bench remote: $pushed"
@@ -0,0 +1,36 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+
+// Ingest admission control for /notify. Deliveries are admitted through a
+// global token bucket and one per repository, and refused outright while
+// the queue is deeper than max_queue_depth, so a noisy repository or a
+// misconfigured Action cannot bury everyone else's issues. Refusals carry
+// a Retry-After telling senders when to come back.
+
+enum admission_result {
+  ADMISSION_OK,
+  ADMISSION_QUEUE_FULL,
+  ADMISSION_GLOBAL_RATE,
+  ADMISSION_REPO_RATE
+};
+
+// Handle [Admission] config entries. Returns 1 if the entry was recognised.
+int admission_config_handler(const char *name, const char *value);
+
+// Largest request body accepted, in bytes
+size_t admission_max_body(void);
+
+// Admit a delivery before its body is read: checks the queue depth and the
+// global bucket. On refusal *retry_after is the wait in seconds.
+enum admission_result admission_check_global(int *retry_after);
+
+// Admit a delivery for a repository once its body has been parsed
+enum admission_result admission_check_repo(const char *repo_full_name,
+                                           int *retry_after);
+
+// Name of a result for logs and metric labels
+const char *admission_result_name(enum admission_result result);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef AI_CLIENT_H
+#define AI_CLIENT_H
+
+#include <stddef.h>
+
+#include <curl/curl.h>
+
+// Resilient HTTP POST for AI providers: per-stage deadlines, per-attempt
+// timeouts, jittered exponential retry on transport errors, 429 and 5xx
+// (honouring Retry-After), optional hedging once a request outlives the
+// provider's p95 latency, and a per-provider circuit breaker.
+
+// Handle [AI] resilience entries. Returns 1 if the entry was recognised.
+int ai_client_config_handler(const char *name, const char *value);
+
+// POST body to url for a pipeline stage. On success returns 0 and hands
+// over the NUL-terminated response body in *response (the caller frees
+// it); returns -1 once the stage deadline, retry budget or circuit breaker
+// gives up.
+int ai_post(const char *provider, const char *stage, const char *url,
+            const struct curl_slist *headers, const char *body,
+            size_t body_len, char **response, size_t *response_len);
+
+// Consumer of a streamed completion
+struct ai_stream {
+  // Completion text in the data of one server-sent event, or in a whole
+  // body when the server answers without streaming; the caller frees it
+  char *(*parse)(const char *data);
+  // Called before every attempt, so state from a failed one is dropped
+  void (*restart)(void *arg);
+  // Sees each piece of text as it arrives; non-zero aborts the request
+  int (*on_text)(const char *text, size_t len, void *arg);
+  void *arg;
+};
+
+// Like ai_post for a request that asked for server-sent events. The text of
+// each event is passed to stream->on_text as it arrives and *text receives
+// the whole completion. Streamed requests are not hedged, and one aborted
+// by on_text is not retried.
+int ai_post_stream(const char *provider, const char *stage, const char *url,
+                   const struct curl_slist *headers, const char *body,
+                   size_t body_len, const struct ai_stream *stream,
+                   char **text, size_t *text_len);
+
+#endif
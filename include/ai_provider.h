@@ -0,0 +1,50 @@
+#ifndef AI_PROVIDER_H
+#define AI_PROVIDER_H
+
+#include <stddef.h>
+
+#include <curl/curl.h>
+
+// AI provider backends. Each provider knows its endpoint, request format,
+// authentication headers and response format; [AI] base_url overrides the
+// endpoint so any provider can be pointed at a local server.
+
+struct ai_params {
+  const char *model;
+  const char *prompt;
+  int max_tokens;
+  double temperature;
+  int stream; // Ask for server-sent events
+};
+
+struct ai_usage {
+  long long prompt_tokens;
+  long long completion_tokens;
+};
+
+struct ai_provider {
+  const char *name;
+  const char *default_base_url;
+  const char *path; // Appended to the base URL
+
+  // Build the JSON request body; the caller frees it
+  char *(*build_request)(const struct ai_params *params, size_t *len);
+
+  // Append authentication headers
+  struct curl_slist *(*add_headers)(struct curl_slist *headers,
+                                    const char *api_key);
+
+  // Extract the completion text; the caller frees it. NULL if the
+  // response has none. Applied to the data of one event, it extracts the
+  // text that event adds to a streamed completion.
+  char *(*parse_response)(const char *body);
+
+  // Extract token usage. Returns 0 if the response reports it.
+  int (*parse_usage)(const char *body, struct ai_usage *usage);
+};
+
+// Look up a provider by its [AI] api_provider name: openai, anthropic or
+// mock (OpenAI format without authentication, on localhost:8090)
+const struct ai_provider *ai_provider_lookup(const char *name);
+
+#endif
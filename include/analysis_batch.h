@@ -0,0 +1,35 @@
+#ifndef ANALYSIS_BATCH_H
+#define ANALYSIS_BATCH_H
+
+#include <stddef.h>
+
+// Batched issue analysis. Workers analysing small issues of the same
+// repository at the same time share one AI request: the first to arrive
+// leads the batch, waits up to max_wait_ms for others to join, sends every
+// issue under its own "=== ISSUE <number> ===" delimiter and splits the
+// response back out. Batching only kicks in once issues wait in the queue,
+// so an idle service keeps answering each issue on its own.
+
+// Send the batched issues (delimited content for the batch prompt) and
+// return the response text, which the caller frees, or NULL on failure.
+// arg is the one the batch leader passed to analysis_batch_run.
+typedef char *(*batch_send_fn)(const char *content, void *arg);
+
+// Handle [Batching] config entries. Returns 1 if the entry was recognised.
+int batch_config_handler(const char *name, const char *value);
+
+// Analyse an issue as part of a batch; queue_wait_ms is how long it waited
+// in the queue, and send and arg make the request if it leads the batch.
+// Returns 0 with its analysis copied into response, 1 if the issue should
+// be analysed on its own (batching off, issue too large or not backlogged,
+// nobody joined, or its section missing from the response)
+// and -1 if the batch request failed.
+int analysis_batch_run(const char *repo_full_name, int issue_number,
+                       const char *issue_body, long long queue_wait_ms,
+                       batch_send_fn send, void *arg, char *response,
+                       size_t response_size);
+
+// Check splitting of batched responses. Returns 0 on success.
+int analysis_batch_self_test(void);
+
+#endif
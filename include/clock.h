@@ -0,0 +1,23 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <time.h>
+
+// Millisecond clocks shared by every module. now_ms is monotonic, for
+// timeouts and latencies within this process; wall_ms is the real time, for
+// timestamps that are stored or compared with other processes' (queue
+// records, rate limit resets).
+
+static inline long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline long long wall_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef FILE_APPLIER_H
+#define FILE_APPLIER_H
+
+#include <stddef.h>
+
+// Batched application of generated file contents to a workspace. Every
+// path is validated before anything is written: it must be relative, stay
+// inside the workspace without crossing symlinks, and not touch .git.
+// Missing directories are created, then all files are written at once,
+// each atomically through a temporary file, fsync and rename. The writes
+// go through io_uring when built with HAVE_LIBURING and the kernel allows
+// it, and through a pool of threads otherwise.
+
+struct file_change {
+  const char *path; // Relative to the workspace
+  const char *content;
+  size_t length;
+  int error; // Set by file_apply_batch: 0 or an errno value
+};
+
+// Normalise a relative path into buf the way it is written and staged:
+// empty and "." components are dropped. Absolute paths, "..", and anything
+// inside .git are rejected. Returns 0 if the path is acceptable.
+int file_path_normalise(const char *path, char *buf, size_t size);
+
+// Handle [Apply] config entries. Returns 1 if the entry was recognised.
+int applier_config_handler(const char *name, const char *value);
+
+// Apply every change under root. Returns 0 when all files were written and
+// -1 otherwise; if any path is invalid nothing is written. The error of
+// each change says what went wrong with it.
+int file_apply_batch(const char *root, struct file_change *changes,
+                     int count);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef GITHUB_CLIENT_H
+#define GITHUB_CLIENT_H
+
+#include <stddef.h>
+
+// Shared GitHub REST client. Requests reuse connections through a shared
+// curl handle and are paced against X-RateLimit-Remaining/Reset: once the
+// remaining budget runs low they are spread evenly over the time left until
+// the reset, and a rate-limited answer holds everyone back until the window
+// reopens. GET responses are cached with their ETag and revalidated with
+// If-None-Match, since a 304 does not count against the limit, and
+// identical GETs in flight at the same time are sent only once.
+
+// Handle [GitHub] config entries. Returns 1 if the entry was recognised.
+int github_config_handler(const char *name, const char *value);
+
+// Send a request for an API path such as "/repos/o/r/pulls". body may be
+// NULL. On return *status holds the HTTP status and *response the body (the
+// caller frees it). Returns 0 if an answer was received and -1 otherwise.
+int github_request(const char *method, const char *path, const char *body,
+                   size_t body_len, long *status, char **response);
+
+// GET an API path through the ETag cache, coalesced with identical GETs in
+// flight. Same contract as github_request.
+int github_get(const char *path, long *status, char **response);
+
+// Look up a repository's default branch. Returns 0 on success.
+int github_default_branch(const char *owner, const char *repo, char *branch,
+                          size_t size);
+
+// Build "<clone_url>/<owner>/<repo>.git" for cloning and pushing. The base
+// defaults to https://github.com and can point at a local directory of bare
+// repositories (file://...) for offline runs. Returns 0 on success.
+int github_clone_url(const char *owner, const char *repo, char *url,
+                     size_t size);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+// Listening-socket handover between an old and a new service process, for
+// restarts without a connection-refused window. The running process offers
+// its listen fd on a Unix socket. A new process started next to it takes a
+// copy with SCM_RIGHTS, starts serving on it and acknowledges; only then is
+// the old process told to drain. Both share one accept queue throughout, so
+// connections arriving during the switch wait in the kernel backlog.
+
+// Take the listen fd from a running process offering it at path. Returns
+// the fd, or -1 if nobody is offering one (a cold start). The old process
+// keeps serving until handover_acknowledge is called.
+int handover_receive(const char *path);
+
+// Tell the old process we are serving, so it stops accepting and drains
+void handover_acknowledge(void);
+
+// Offer listen_fd at path to the next process. on_handover runs on the
+// handover thread once a successor has acknowledged. Returns 0 on success.
+int handover_offer(const char *path, int listen_fd, void (*on_handover)(void));
+
+#endif
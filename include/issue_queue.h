@@ -0,0 +1,113 @@
+#ifndef ISSUE_QUEUE_H
+#define ISSUE_QUEUE_H
+
+#include <stdint.h>
+
+#include <hiredis/hiredis.h>
+
+// How long a webhook delivery id is remembered for deduplication
+extern int DELIVERY_TTL_SECONDS;
+
+// Handle [Queue] and [Priority] config entries. Returns 1 if the entry was
+// recognised, 0 otherwise.
+int queue_config_handler(const char *section, const char *name,
+                         const char *value);
+
+// Map issue labels to a priority class through the [Priority] label.* rules.
+// The highest-priority match wins; unmatched issues get the default class.
+const char *priority_class_for_labels(const char **labels, int label_count);
+
+// Record a webhook delivery id. Returns 1 if it has not been seen before,
+// 0 if it is a duplicate and -1 on Redis errors.
+int mark_delivery_seen(redisContext *redis_ctx, const char *delivery_id);
+
+// Drop a delivery id again, e.g. when the delivery could not be enqueued
+void forget_delivery(redisContext *redis_ctx, const char *delivery_id);
+
+// Enqueue an issue into a priority class (NULL for the default class).
+// Events for the same repository and issue that are still waiting in the
+// queue are coalesced so only the latest one is processed. Returns 0 when
+// queued in Redis, 1 when spooled to the local queue and -1 on failure.
+int enqueue_issue(redisContext *redis_ctx, const char *repo_full_name,
+                  int issue_number, const char *priority_class,
+                  const char *issue_title, const char *issue_body);
+
+// Fixed-layout record carried by the queue, followed by the issue title.
+// The body is stored out of line, in a blob of its own.
+struct issue_record {
+  uint32_t version;
+  uint32_t repo_id; // Index into the cis:repo_names hash
+  int32_t issue_number;
+  uint32_t body_length;
+  uint64_t body_hash; // Names the blob of version 1 records only
+  int64_t enqueued_ms;
+};
+
+// An issue taken off the queue. Release it with complete_issue once the
+// pipeline has finished with it.
+struct queued_issue {
+  struct issue_record record;
+  char repo_full_name[256];
+  char *issue_title;
+  char *issue_body; // Loaded on first use by queued_issue_body
+  redisContext *redis_ctx;
+  char queue_key[192];
+  char entry_id[64]; // Stream entry id, empty for the list backend
+};
+
+// Name this process's stream consumer <host>-<pid> unless consumer_name is
+// configured. Call once after loading the config, before any thread starts.
+void queue_name_consumer(void);
+
+// Join the consumer groups when the stream backend is configured
+int queue_init(redisContext *redis_ctx);
+
+// Dequeue the next issue, draining the priority classes by weighted round
+// robin with starvation protection. With the stream backend, entries
+// abandoned by other consumers are reclaimed first.
+struct queued_issue *dequeue_issue(redisContext *redis_ctx);
+
+// Fetch the body of a dequeued issue, on the worker that dequeued it.
+// Returns NULL if the blob has expired or Redis is unreachable.
+const char *queued_issue_body(struct queued_issue *item);
+
+// Acknowledge a dequeued issue and free it
+void complete_issue(redisContext *redis_ctx, struct queued_issue *item);
+
+// Return an issue the pipeline stopped working on, e.g. while draining for
+// shutdown, so it is processed again, and free it
+void release_issue(redisContext *redis_ctx, struct queued_issue *item);
+
+// Renew the claim on stream entries this process is still working on and
+// export pending counts. Call at least every claim_idle_seconds / 2.
+void queue_keepalive(redisContext *redis_ctx);
+
+// Move everything queued for a node that left the cluster to the current
+// owners of its repositories. Returns the number of entries moved or -1.
+int queue_reroute_node(redisContext *redis_ctx, const char *node_id);
+
+// Move issues left on the single queue list of earlier releases into the
+// default class. Call once at startup, before the workers. Returns the
+// number moved or -1, leaving the rest for the next start.
+int queue_migrate_legacy(redisContext *redis_ctx);
+
+// Open the local write-ahead queue if it is the backend or spill target
+int queue_open_local(void);
+
+// Replay spooled issues into Redis once it is reachable again; arg is a
+// dedicated redisContext
+void *local_queue_drainer_thread(void *arg);
+
+// Whether the configured backend needs Redis, and whether ingest can spill
+// to the local queue when Redis is down
+int queue_needs_redis(void);
+int queue_can_spill(void);
+
+// Issues waiting, without asking Redis: its depth at the last dequeue plus
+// what was enqueued since, and whatever is spooled locally
+long long queue_depth_estimate(void);
+
+int queue_uses_streams(void);
+int queue_claim_idle_seconds(void);
+
+#endif
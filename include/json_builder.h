@@ -0,0 +1,60 @@
+#ifndef JSON_BUILDER_H
+#define JSON_BUILDER_H
+
+#include <stddef.h>
+
+// Request-body builder writing JSON straight into a growable buffer. String
+// values are escaped with SSE2/AVX2 when the CPU has them and a table-driven
+// scalar loop otherwise. Allocation failures are sticky: the builder stops
+// writing and json_builder_finish returns NULL.
+
+struct json_builder {
+  char *data;
+  size_t len;
+  size_t cap;
+  int failed;
+  int need_comma;
+};
+
+enum json_escape_impl {
+  JSON_ESCAPE_AUTO,
+  JSON_ESCAPE_SCALAR,
+  JSON_ESCAPE_SSE2,
+  JSON_ESCAPE_AVX2
+};
+
+void json_builder_init(struct json_builder *jb);
+
+// Open an object or array; key is NULL at the top level and inside arrays
+void json_object_begin(struct json_builder *jb, const char *key);
+void json_object_end(struct json_builder *jb);
+void json_array_begin(struct json_builder *jb, const char *key);
+void json_array_end(struct json_builder *jb);
+
+void json_add_string(struct json_builder *jb, const char *key,
+                     const char *value);
+void json_add_string_len(struct json_builder *jb, const char *key,
+                         const char *value, size_t len);
+void json_add_int(struct json_builder *jb, const char *key, long long value);
+void json_add_double(struct json_builder *jb, const char *key, double value);
+void json_add_bool(struct json_builder *jb, const char *key, int value);
+
+// Append the escaped contents of a string, without quotes
+void json_append_escaped(struct json_builder *jb, const char *value,
+                         size_t len);
+
+// Hand over the NUL-terminated document (the caller frees it), or NULL if
+// an allocation failed along the way
+char *json_builder_finish(struct json_builder *jb);
+
+void json_builder_free(struct json_builder *jb);
+
+// Select the escaper, for tests and benchmarks. Returns -1 if the CPU does
+// not support it. Not thread-safe; call before starting workers.
+int json_set_escape_impl(enum json_escape_impl impl);
+
+// Check every available escaper against known vectors and each other.
+// Returns 0 on success.
+int json_builder_self_test(void);
+
+#endif
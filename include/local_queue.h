@@ -0,0 +1,49 @@
+#ifndef LOCAL_QUEUE_H
+#define LOCAL_QUEUE_H
+
+#include <stddef.h>
+
+// Durable local write-ahead queue: an mmap-backed ring segment file with
+// CRC-checked records and group-commit msync. Used to spill webhooks while
+// Redis is unreachable, and as a Redis-free queue for single-node setups.
+
+struct local_record {
+  char *priority_class;
+  char *repo_full_name;
+  int issue_number;
+  char *issue_title;
+  char *issue_body;
+  size_t size; // Bytes the record occupies in the segment
+  char *buffer;
+};
+
+// Open (or create) the segment file and start the group-commit thread
+int local_queue_open(const char *path, size_t size, int group_commit_ms);
+
+int local_queue_is_open(void);
+
+// Append a record. Returns once it has been synced to disk, or -1 if the
+// segment is full or the write failed.
+int local_queue_append(const char *priority_class, const char *repo_full_name,
+                       int issue_number, const char *issue_title,
+                       const char *issue_body);
+
+// Copy out the oldest record. Returns 1 if one was found, 0 if the queue is
+// empty and -1 on corruption.
+int local_queue_peek(struct local_record *record);
+
+// Remove the record returned by the last peek
+void local_queue_pop(const struct local_record *record);
+
+// Peek and pop in one step, for workers sharing the queue
+int local_queue_take(struct local_record *record);
+
+void local_record_free(struct local_record *record);
+
+// Records currently queued
+long long local_queue_depth(void);
+
+// Flush and unmap the segment
+void local_queue_close(void);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Minimal in-process metrics registry exported in Prometheus text format.
+// Metric names may carry labels, e.g. cis_queue_depth{class="high"}.
+
+void metrics_counter_add(const char *name, long long delta);
+void metrics_gauge_set(const char *name, long long value);
+void metrics_gauge_max(const char *name, long long value);
+
+// Render all metrics. The caller frees the returned string.
+char *metrics_render(void);
+
+#endif
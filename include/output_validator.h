@@ -0,0 +1,44 @@
+#ifndef OUTPUT_VALIDATOR_H
+#define OUTPUT_VALIDATOR_H
+
+#include <stddef.h>
+
+// Incremental validation of the implement stage's answer while it streams
+// in. The text must be one JSON object whose "changes" array holds at most
+// max_files objects, each with a "file" path that file_path_normalise
+// accepts and that starts with one of the allowed prefixes, and a string
+// "content" of at most max_file_bytes. The first byte that breaks any of
+// these rejects the answer, so the request can be aborted right there
+// instead of after the whole generation. Text after the object is ignored,
+// like cJSON_Parse does.
+
+struct output_validator;
+
+// Handle [Validate] config entries. Returns 1 if the entry was recognised.
+int validator_config_handler(const char *name, const char *value);
+
+// Whether implement answers are streamed through a validator
+int validator_enabled(void);
+
+// How many times a rejected answer is asked for again with a corrective
+// prompt
+int validator_retries(void);
+
+// Returns NULL if out of memory
+struct output_validator *validator_create(void);
+void validator_free(struct output_validator *v);
+
+// Forget everything fed so far, for a new answer
+void validator_reset(struct output_validator *v);
+
+// Feed the next piece of the answer. Returns 0 while it can still be valid
+// and -1 once it is not.
+int validator_feed(struct output_validator *v, const char *text, size_t len);
+
+// Check that the answer fed so far is complete. Returns 0 if it is valid.
+int validator_finish(struct output_validator *v);
+
+// Why the answer was rejected, or NULL if it was not
+const char *validator_error(const struct output_validator *v);
+
+#endif
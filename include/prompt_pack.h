@@ -0,0 +1,27 @@
+#ifndef PROMPT_PACK_H
+#define PROMPT_PACK_H
+
+// Token budgets for AI prompts. A model's context window is shared between
+// the prompt and the completion: each stage reserves its max_tokens, and
+// prompt content that does not fit in the rest is packed by eliding the
+// middle of its lowest-priority sections (fenced code and quoted text
+// before prose) until it does.
+
+// Handle [AI] token budget entries. Returns 1 if the entry was recognised.
+int prompt_config_handler(const char *name, const char *value);
+
+// Load the BPE ranks named by bpe_ranks, if any. Returns 0 on success.
+int prompt_init(void);
+
+// Render template (with a single %s) around content for a stage so the
+// prompt fits the model's context with room for the completion. Returns
+// the prompt (the caller frees it) and sets *max_tokens to the completion
+// budget left for the stage, or returns NULL on allocation failure.
+char *prompt_pack(const char *stage, const char *model, const char *template,
+                  const char *content, int *max_tokens);
+
+// Check that oversized content is packed into its budget. Returns 0 on
+// success.
+int prompt_pack_self_test(void);
+
+#endif
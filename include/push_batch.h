@@ -0,0 +1,22 @@
+#ifndef PUSH_BATCH_H
+#define PUSH_BATCH_H
+
+#include <git2.h>
+
+// Batched branch pushes. Issues of one repository finishing close together
+// share a single push: the first worker to push to a remote leads, waits up
+// to window_ms for others, and pushes every branch with one git_remote_push
+// over one connection. The other workspaces' objects are reachable from
+// the leader's repository as alternates. Each worker gets the status of
+// its own ref back.
+
+// Handle [Push] config entries. Returns 1 if the entry was recognised.
+int push_config_handler(const char *name, const char *value);
+
+// Push refs/heads/<branch_name>, which points at commit in repo, to origin
+// as part of a batch. Returns 0 once the remote accepted the ref and -1
+// otherwise, with the reason in error.
+int push_batch_run(git_repository *repo, const char *branch_name,
+                   const git_oid *commit, char *error, size_t error_size);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef REPO_DIGEST_H
+#define REPO_DIGEST_H
+
+// Per-repository project digest: build system, directory layout and a
+// one-line summary of key modules, for the analysis and implementation
+// prompts. A digest is built once from the HEAD tree and cached, in memory
+// and under cache_dir, against the HEAD commit. When HEAD moves, only the
+// paths changed between the two commits are refreshed.
+
+// Handle [Digest] config entries. Returns 1 if the entry was recognised.
+int digest_config_handler(const char *name, const char *value);
+
+// Return the digest of the repository checked out at local_path, which the
+// caller frees, or NULL if there is none (digests off, no repository).
+char *repo_digest_get(const char *repo_full_name, const char *local_path);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef REVIEW_FANOUT_H
+#define REVIEW_FANOUT_H
+
+// Review phase fan-out. Every configured reviewer (style, correctness,
+// final go/no-go, ...) reads the implementation and is asked in parallel,
+// so the phase takes as long as the slowest review. Each review ends in
+// "Approved" or "Not Approved"; the merged verdict is approved only if
+// every blocking reviewer approved, whatever order the answers arrive in.
+
+// Send one review prompt for a stage of an issue and return the response
+// text, which the caller frees, or NULL on failure
+typedef char *(*review_send_fn)(const char *stage, const char *template,
+                                const char *content, int issue_number);
+
+// Handle [Review] config entries. Returns 1 if the entry was recognised.
+int review_config_handler(const char *name, const char *value);
+
+// Handle [Prompts] <name>_review_prompt entries (review_changes_prompt is
+// the correctness review). Returns 1 if the entry was recognised.
+int review_prompt_config_handler(const char *name, const char *value);
+
+// Run every review of an issue's implementation in parallel and merge them
+// into *merged (the caller frees it). Returns 1 if approved, 0 if rejected
+// and -1 if a blocking review could not be obtained or none is configured.
+int review_run(const char *implementation, int issue_number,
+               review_send_fn send, char **merged);
+
+// Check the verdict rule. Returns 0 on success.
+int review_self_test(void);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+
+#include <hiredis/hiredis.h>
+
+// Optional repository sharding across service instances. Each instance
+// registers itself in Redis with a heartbeat; repositories are mapped to
+// instances on a consistent-hash ring with virtual nodes so ownership moves
+// with minimal churn when instances join or leave.
+
+// Handle [Cluster] config entries. Returns 1 if the entry was recognised.
+int shard_config_handler(const char *name, const char *value);
+
+int shard_enabled(void);
+
+// This instance's node id
+const char *shard_node_id(void);
+
+// Register this node and refresh cluster membership. Call once at startup
+// before accepting webhooks; the heartbeat thread keeps it up to date.
+int shard_refresh(redisContext *redis_ctx);
+
+// Heartbeat thread; arg is a dedicated redisContext
+void *shard_heartbeat_thread(void *arg);
+
+// Look up the node owning a repository ("owner/repo")
+void shard_owner(const char *repo_full_name, char *node_id, size_t size);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <pthread.h>
+
+// Parallel startup. Independent initialisation steps (loading BPE ranks,
+// connecting to Redis, global library setup, ...) run as tasks on their own
+// threads, so startup takes as long as the slowest step rather than the sum
+// of them. How long each took is logged and exported.
+
+struct startup_task {
+  const char *name;
+  int (*run)(void *arg); // Returns 0 on success
+  void *arg;
+  int result;
+  long long elapsed_ms;
+  pthread_t thread;
+  int threaded;
+};
+
+// Run the tasks in parallel and wait for all of them. Returns 0 if every
+// task succeeded and -1 otherwise; failed tasks are logged.
+int startup_run(struct startup_task *tasks, int count);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef SYSTEMD_SUPPORT_H
+#define SYSTEMD_SUPPORT_H
+
+// The parts of the systemd service protocol the service uses, without
+// linking libsystemd: socket activation ($LISTEN_FDS) and readiness and
+// status notifications ($NOTIFY_SOCKET, Type=notify). Both are no-ops when
+// the service is not started by systemd.
+
+// Return the listen socket passed by systemd socket activation and take it
+// out of the environment, or -1 if there is none
+int systemd_listen_fd(void);
+
+// Send a state string such as "READY=1" or "STOPPING=1" to the service
+// manager. Returns 0 if sent or there is no manager to send it to.
+int systemd_notify(const char *state);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <stddef.h>
+
+// Byte-pair encoding token counter. Merge ranks are loaded once from a
+// tiktoken ranks file (one "<base64 token> <rank>" line per token, e.g.
+// p50k_base.tiktoken for text-davinci-003) and are read-only afterwards, so
+// counting is thread-safe. Without a ranks file counts are estimated at four
+// bytes per token.
+
+// Load merge ranks. Returns 0 on success, -1 if the file cannot be read or
+// is malformed.
+int tokenizer_load(const char *path);
+
+// Whether counts come from loaded ranks rather than the estimate
+int tokenizer_loaded(void);
+
+// Number of tokens text encodes to
+size_t tokenizer_count(const char *text, size_t len);
+
+void tokenizer_free(void);
+
+#endif
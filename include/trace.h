@@ -0,0 +1,37 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Static tracepoints (USDT) in the hot paths, for bpftrace or perf to attach
+// to a running service; see tools/bpftrace. Built against <sys/sdt.h>
+// (systemtap-sdt-dev) each probe is a nop plus an ELF note until a tracer
+// enables it. Without the header, or with -DCIS_NO_TRACE, probes compile to
+// nothing. Arguments are evaluated in either case, so probes only take
+// values that are already at hand.
+//
+// Probes of provider "cis" (strings are passed as pointers):
+//   issue__enqueue(issue, body_bytes, class)
+//   issue__dequeue(issue, body_bytes)
+//   stage__start(issue, stage)           stage__done(issue, stage)
+//   ai__request__start(issue, stage, request_bytes)
+//   ai__request__done(issue, stage, reply_bytes, result)
+//   git__start(issue, operation)         git__done(issue, operation, result)
+//   log__flush(issue, bytes)
+
+#if defined(__has_include) && !defined(CIS_NO_TRACE)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CIS_HAVE_USDT 1
+#endif
+#endif
+
+#ifdef CIS_HAVE_USDT
+#define TRACE2(name, a, b) DTRACE_PROBE2(cis, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(cis, name, a, b, c)
+#define TRACE4(name, a, b, c, d) DTRACE_PROBE4(cis, name, a, b, c, d)
+#else
+#define TRACE2(name, a, b) ((void)(a), (void)(b))
+#define TRACE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#define TRACE4(name, a, b, c, d) ((void)(a), (void)(b), (void)(c), (void)(d))
+#endif
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef WORKSPACE_CLEANUP_H
+#define WORKSPACE_CLEANUP_H
+
+// In-process workspace removal. A finished workspace is renamed into the
+// trash directory, which is atomic and immediate, and deleted afterwards by
+// a pool of background threads walking the tree in parallel with
+// openat/unlinkat. The pool size caps concurrent deletions; freed bytes and
+// pending workspaces are exported as metrics.
+
+// Handle [Cleanup] config entries. Returns 1 if the entry was recognised.
+int cleanup_config_handler(const char *name, const char *value);
+
+// Create the trash directory, start the deletion threads and queue what a
+// previous run left in the trash. Returns 0 on success.
+int cleanup_init(void);
+
+// Move a workspace out of the way and queue it for deletion. Returns 0 once
+// path is gone (or did not exist) and -1 if it could not be moved.
+int workspace_discard(const char *path);
+
+#endif
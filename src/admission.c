@@ -0,0 +1,166 @@
+#include "admission.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clock.h"
+#include "issue_queue.h"
+#include "metrics.h"
+
+#define REPO_BUCKETS 1024 // Repositories tracked at once; must be 2^n
+#define MAX_PROBE 16
+
+// Tokens refill continuously at rate per second up to burst
+struct bucket {
+  double tokens;
+  long long refilled_ms;
+};
+
+struct repo_bucket {
+  uint64_t hash; // 0 for a free slot
+  char name[128];
+  struct bucket bucket;
+};
+
+static double global_rate = 50;
+static double global_burst = 200;
+static double repo_rate = 2;
+static double repo_burst = 20;
+static long long max_queue_depth = 10000;
+static size_t max_body_bytes = 1024 * 1024;
+static int queue_full_retry_seconds = 60;
+
+static struct bucket global_bucket = {-1, 0}; // Filled on first use
+static struct repo_bucket repo_buckets[REPO_BUCKETS];
+static pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *result_names[] = {"admitted", "queue_full", "global_rate",
+                                     "repo_rate"};
+
+// Function to handle admission config entries
+int admission_config_handler(const char *name, const char *value) {
+  if (strcmp(name, "global_rate") == 0) {
+    global_rate = atof(value);
+  } else if (strcmp(name, "global_burst") == 0) {
+    global_burst = atof(value);
+  } else if (strcmp(name, "repo_rate") == 0) {
+    repo_rate = atof(value);
+  } else if (strcmp(name, "repo_burst") == 0) {
+    repo_burst = atof(value);
+  } else if (strcmp(name, "max_queue_depth") == 0) {
+    max_queue_depth = atoll(value);
+  } else if (strcmp(name, "max_body_bytes") == 0) {
+    max_body_bytes = (size_t)atoll(value);
+  } else if (strcmp(name, "queue_full_retry_seconds") == 0) {
+    queue_full_retry_seconds = atoi(value);
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+size_t admission_max_body(void) { return max_body_bytes; }
+
+const char *admission_result_name(enum admission_result result) {
+  return result_names[result];
+}
+
+// Take a token if there is one. Otherwise returns the seconds until there
+// will be. A rate of zero or less means unlimited.
+static int take_token(struct bucket *b, double rate, double burst,
+                      long long now) {
+  if (rate <= 0) {
+    return 0;
+  }
+  if (b->tokens < 0) {
+    b->tokens = burst;
+  } else {
+    b->tokens += (double)(now - b->refilled_ms) * rate / 1000;
+    if (b->tokens > burst) {
+      b->tokens = burst;
+    }
+  }
+  b->refilled_ms = now;
+  if (b->tokens >= 1) {
+    b->tokens -= 1;
+    return 0;
+  }
+  int wait = (int)((1 - b->tokens) / rate) + 1;
+  return wait > 0 ? wait : 1;
+}
+
+static void count(enum admission_result result) {
+  char metric[80];
+  snprintf(metric, sizeof(metric), "cis_admission_total{result=\"%s\"}",
+           result_names[result]);
+  metrics_counter_add(metric, 1);
+}
+
+// Function to admit a delivery before reading its body
+enum admission_result admission_check_global(int *retry_after) {
+  long long depth = queue_depth_estimate();
+  metrics_gauge_set("cis_admission_queue_depth", depth);
+  if (max_queue_depth > 0 && depth >= max_queue_depth) {
+    *retry_after = queue_full_retry_seconds;
+    count(ADMISSION_QUEUE_FULL);
+    return ADMISSION_QUEUE_FULL;
+  }
+  pthread_mutex_lock(&admission_lock);
+  *retry_after = take_token(&global_bucket, global_rate, global_burst,
+                            now_ms());
+  pthread_mutex_unlock(&admission_lock);
+  if (*retry_after) {
+    count(ADMISSION_GLOBAL_RATE);
+    return ADMISSION_GLOBAL_RATE;
+  }
+  return ADMISSION_OK;
+}
+
+static uint64_t hash_name(const char *name) {
+  uint64_t hash = 1469598103934665603ULL; // FNV-1a
+  for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+    hash = (hash ^ *p) * 1099511628211ULL;
+  }
+  return hash ? hash : 1;
+}
+
+// Find a repository's bucket. When its probe run is full the idlest bucket
+// in it is reused; a bucket idle that long has refilled anyway.
+static struct repo_bucket *find_bucket(const char *name) {
+  uint64_t hash = hash_name(name);
+  struct repo_bucket *idlest = NULL;
+  for (int i = 0; i < MAX_PROBE; i++) {
+    struct repo_bucket *rb = &repo_buckets[(hash + i) & (REPO_BUCKETS - 1)];
+    if (rb->hash == hash && strncmp(rb->name, name, sizeof(rb->name)) == 0) {
+      return rb;
+    }
+    if (rb->hash == 0) {
+      idlest = rb;
+      break;
+    }
+    if (!idlest || rb->bucket.refilled_ms < idlest->bucket.refilled_ms) {
+      idlest = rb;
+    }
+  }
+  idlest->hash = hash;
+  snprintf(idlest->name, sizeof(idlest->name), "%s", name);
+  idlest->bucket.tokens = -1;
+  return idlest;
+}
+
+// Function to admit a delivery for a repository
+enum admission_result admission_check_repo(const char *repo_full_name,
+                                           int *retry_after) {
+  pthread_mutex_lock(&admission_lock);
+  struct repo_bucket *rb = find_bucket(repo_full_name);
+  *retry_after = take_token(&rb->bucket, repo_rate, repo_burst, now_ms());
+  pthread_mutex_unlock(&admission_lock);
+  enum admission_result result =
+      *retry_after ? ADMISSION_REPO_RATE : ADMISSION_OK;
+  count(result);
+  return result;
+}
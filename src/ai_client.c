@@ -0,0 +1,623 @@
+#define _GNU_SOURCE // strptime, timegm
+#include "ai_client.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "metrics.h"
+
+#define MAX_PROVIDERS 8
+#define MAX_STAGE_DEADLINES 16
+#define LATENCY_SAMPLES 128
+#define MIN_HEDGE_SAMPLES 20
+
+enum breaker_state { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN };
+
+// Circuit breaker and latency history for one provider
+struct provider_state {
+  char name[32];
+  enum breaker_state state;
+  int consecutive_failures;
+  time_t opened_at;
+  int probe_in_flight;
+  long long latency_ms[LATENCY_SAMPLES]; // Ring of successful requests
+  int latency_count;
+  int latency_next;
+};
+
+struct stage_deadline {
+  char stage[32];
+  long long deadline_ms;
+};
+
+// One HTTP transfer; a hedged attempt runs two of them side by side
+struct transfer {
+  CURL *easy;
+  char *data;
+  size_t len;
+  long long retry_after_ms;
+  long long started_ms;
+  int done;
+  CURLcode result;
+  long status;
+  const struct ai_stream *stream; // NULL unless the request streams
+  int event_stream;               // Answered with text/event-stream
+  int aborted;                    // Stopped by the stream's consumer
+  char *line;                     // Event line carried between writes
+  size_t line_len;
+  char *text; // Completion assembled from the events
+  size_t text_len;
+};
+
+static long connect_timeout_ms = 5000;
+static long request_timeout_ms = 120000;
+static long long default_deadline_ms = 300000;
+static int max_retries = 4;
+static long long retry_base_ms = 500;
+static long long retry_max_ms = 30000;
+static int hedging = 0;
+static long long hedge_min_ms = 2000;
+static int breaker_failures = 5;
+static int breaker_cooldown_seconds = 30;
+
+static struct stage_deadline stage_deadlines[MAX_STAGE_DEADLINES];
+static int stage_deadline_count = 0;
+
+static struct provider_state providers[MAX_PROVIDERS];
+static int provider_count = 0;
+static pthread_mutex_t provider_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to handle AI resilience config entries
+int ai_client_config_handler(const char *name, const char *value) {
+  if (strcmp(name, "connect_timeout_ms") == 0) {
+    connect_timeout_ms = atol(value);
+  } else if (strcmp(name, "request_timeout_ms") == 0) {
+    request_timeout_ms = atol(value);
+  } else if (strcmp(name, "stage_deadline_ms") == 0) {
+    default_deadline_ms = atoll(value);
+  } else if (strncmp(name, "stage_deadline_ms.", 18) == 0) {
+    if (stage_deadline_count == MAX_STAGE_DEADLINES) {
+      syslog(LOG_ERR, "Too many stage deadlines, ignoring %s", name);
+      return 0;
+    }
+    struct stage_deadline *d = &stage_deadlines[stage_deadline_count++];
+    snprintf(d->stage, sizeof(d->stage), "%s", name + 18);
+    d->deadline_ms = atoll(value);
+  } else if (strcmp(name, "max_retries") == 0) {
+    max_retries = atoi(value);
+  } else if (strcmp(name, "retry_base_ms") == 0) {
+    retry_base_ms = atoll(value) > 0 ? atoll(value) : 1;
+  } else if (strcmp(name, "retry_max_ms") == 0) {
+    retry_max_ms = atoll(value);
+  } else if (strcmp(name, "hedging") == 0) {
+    hedging = atoi(value);
+  } else if (strcmp(name, "hedge_min_ms") == 0) {
+    hedge_min_ms = atoll(value);
+  } else if (strcmp(name, "breaker_failures") == 0) {
+    breaker_failures = atoi(value) > 0 ? atoi(value) : 1;
+  } else if (strcmp(name, "breaker_cooldown_seconds") == 0) {
+    breaker_cooldown_seconds = atoi(value);
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static long long deadline_for_stage(const char *stage) {
+  for (int i = 0; i < stage_deadline_count; i++) {
+    if (strcmp(stage_deadlines[i].stage, stage) == 0) {
+      return stage_deadlines[i].deadline_ms;
+    }
+  }
+  return default_deadline_ms;
+}
+
+// Find or register a provider; the registry only ever grows
+static struct provider_state *provider_state(const char *name) {
+  pthread_mutex_lock(&provider_lock);
+  for (int i = 0; i < provider_count; i++) {
+    if (strcmp(providers[i].name, name) == 0) {
+      pthread_mutex_unlock(&provider_lock);
+      return &providers[i];
+    }
+  }
+  struct provider_state *ps = &providers[provider_count < MAX_PROVIDERS
+                                             ? provider_count++
+                                             : MAX_PROVIDERS - 1];
+  if (ps->name[0] == '\0') {
+    snprintf(ps->name, sizeof(ps->name), "%s", name);
+  }
+  pthread_mutex_unlock(&provider_lock);
+  return ps;
+}
+
+static void export_breaker(const struct provider_state *ps) {
+  char metric[96];
+  snprintf(metric, sizeof(metric), "cis_ai_circuit_open{provider=\"%s\"}",
+           ps->name);
+  metrics_gauge_set(metric, ps->state != BREAKER_CLOSED);
+}
+
+// Whether a request may go out. An open breaker admits a single probe once
+// its cooldown has passed.
+static int breaker_allow(struct provider_state *ps) {
+  pthread_mutex_lock(&provider_lock);
+  int allowed = 1;
+  if (ps->state == BREAKER_OPEN) {
+    if (time(NULL) - ps->opened_at >= breaker_cooldown_seconds) {
+      ps->state = BREAKER_HALF_OPEN;
+      ps->probe_in_flight = 1;
+      syslog(LOG_INFO, "Circuit for %s half-open, sending a probe",
+             ps->name);
+    } else {
+      allowed = 0;
+    }
+  } else if (ps->state == BREAKER_HALF_OPEN) {
+    allowed = !ps->probe_in_flight;
+    ps->probe_in_flight = 1;
+  }
+  pthread_mutex_unlock(&provider_lock);
+  return allowed;
+}
+
+static void breaker_record(struct provider_state *ps, int healthy) {
+  pthread_mutex_lock(&provider_lock);
+  ps->probe_in_flight = 0;
+  if (healthy) {
+    if (ps->state != BREAKER_CLOSED) {
+      syslog(LOG_INFO, "Circuit for %s closed", ps->name);
+    }
+    ps->state = BREAKER_CLOSED;
+    ps->consecutive_failures = 0;
+  } else if (ps->state == BREAKER_HALF_OPEN ||
+             ++ps->consecutive_failures >= breaker_failures) {
+    if (ps->state != BREAKER_OPEN) {
+      syslog(LOG_ERR, "Circuit for %s opened after %d failure(s)", ps->name,
+             ps->consecutive_failures);
+    }
+    ps->state = BREAKER_OPEN;
+    ps->opened_at = time(NULL);
+  }
+  export_breaker(ps);
+  pthread_mutex_unlock(&provider_lock);
+}
+
+static void record_latency(struct provider_state *ps, long long latency_ms) {
+  pthread_mutex_lock(&provider_lock);
+  ps->latency_ms[ps->latency_next] = latency_ms;
+  ps->latency_next = (ps->latency_next + 1) % LATENCY_SAMPLES;
+  if (ps->latency_count < LATENCY_SAMPLES) {
+    ps->latency_count++;
+  }
+  pthread_mutex_unlock(&provider_lock);
+
+  char metric[96];
+  snprintf(metric, sizeof(metric), "cis_ai_latency_ms_max{provider=\"%s\"}",
+           ps->name);
+  metrics_gauge_max(metric, latency_ms);
+}
+
+static int compare_latency(const void *a, const void *b) {
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+// Delay before hedging: the p95 of recent successful requests, or -1 while
+// there are too few samples to know what slow means
+static long long hedge_delay_ms(struct provider_state *ps) {
+  long long samples[LATENCY_SAMPLES];
+  pthread_mutex_lock(&provider_lock);
+  int count = ps->latency_count;
+  memcpy(samples, ps->latency_ms, sizeof(samples[0]) * count);
+  pthread_mutex_unlock(&provider_lock);
+  if (count < MIN_HEDGE_SAMPLES) {
+    return -1;
+  }
+  qsort(samples, count, sizeof(samples[0]), compare_latency);
+  long long p95 = samples[(count * 95) / 100];
+  return p95 > hedge_min_ms ? p95 : hedge_min_ms;
+}
+
+static void transfer_free(struct transfer *t) {
+  free(t->data);
+  free(t->line);
+  free(t->text);
+  t->data = t->line = t->text = NULL;
+}
+
+// Append a piece of streamed completion text and show it to the consumer
+static int stream_text(struct transfer *t, const char *piece) {
+  size_t len = strlen(piece);
+  char *text = realloc(t->text, t->text_len + len + 1);
+  if (!text) {
+    syslog(LOG_ERR, "Not enough memory for AI response");
+    return -1;
+  }
+  t->text = text;
+  memcpy(t->text + t->text_len, piece, len + 1);
+  t->text_len += len;
+  if (t->stream->on_text(piece, len, t->stream->arg) != 0) {
+    t->aborted = 1;
+    return -1;
+  }
+  return 0;
+}
+
+// Function to split server-sent events into lines and pass on the text of
+// each "data:" line. Returns -1 to abort the transfer.
+static int stream_events(struct transfer *t, const char *data, size_t size) {
+  while (size > 0) {
+    const char *newline = memchr(data, '\n', size);
+    size_t part = newline ? (size_t)(newline - data) : size;
+    char *line = realloc(t->line, t->line_len + part + 1);
+    if (!line) {
+      syslog(LOG_ERR, "Not enough memory for AI response");
+      return -1;
+    }
+    t->line = line;
+    memcpy(t->line + t->line_len, data, part);
+    t->line_len += part;
+    t->line[t->line_len] = '\0';
+    if (!newline) {
+      break;
+    }
+    data += part + 1;
+    size -= part + 1;
+
+    if (t->line_len > 0 && t->line[t->line_len - 1] == '\r') {
+      t->line[--t->line_len] = '\0';
+    }
+    t->line_len = 0;
+    if (strncmp(t->line, "data:", 5) != 0) {
+      continue; // Event names, ids, comments and blank separators
+    }
+    const char *payload = t->line + 5;
+    if (*payload == ' ') {
+      payload++;
+    }
+    if (strcmp(payload, "[DONE]") == 0) {
+      continue;
+    }
+    char *piece = t->stream->parse(payload);
+    int result = piece ? stream_text(t, piece) : 0;
+    free(piece);
+    if (result != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static size_t write_callback(void *contents, size_t size, size_t nmemb,
+                             void *userp) {
+  struct transfer *t = (struct transfer *)userp;
+  size_t realsize = size * nmemb;
+  if (t->event_stream) {
+    return stream_events(t, contents, realsize) == 0 ? realsize : 0;
+  }
+  char *data = realloc(t->data, t->len + realsize + 1);
+  if (!data) {
+    syslog(LOG_ERR, "Not enough memory for AI response");
+    return 0;
+  }
+  t->data = data;
+  memcpy(t->data + t->len, contents, realsize);
+  t->len += realsize;
+  t->data[t->len] = '\0';
+  return realsize;
+}
+
+// Pick up Retry-After, either delta-seconds or an HTTP date
+static size_t header_callback(char *buffer, size_t size, size_t nitems,
+                              void *userp) {
+  struct transfer *t = (struct transfer *)userp;
+  size_t len = size * nitems;
+  if (len > 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+    t->event_stream = 0; // Headers of a new response, e.g. after a redirect
+  } else if (t->stream && len > 13 &&
+             strncasecmp(buffer, "Content-Type:", 13) == 0) {
+    const char *p = buffer + 13;
+    while (*p == ' ') {
+      p++;
+    }
+    t->event_stream = (size_t)(p - buffer) + 17 <= len &&
+                      strncasecmp(p, "text/event-stream", 17) == 0;
+  }
+  if (len > 12 && strncasecmp(buffer, "Retry-After:", 12) == 0) {
+    char value[64];
+    size_t n = len - 12 < sizeof(value) - 1 ? len - 12 : sizeof(value) - 1;
+    memcpy(value, buffer + 12, n);
+    value[n] = '\0';
+    char *end = NULL;
+    long seconds = strtol(value, &end, 10);
+    if (end != value && seconds >= 0) {
+      t->retry_after_ms = (long long)seconds * 1000;
+    } else {
+      struct tm tm;
+      memset(&tm, 0, sizeof(tm));
+      const char *p = value;
+      while (*p == ' ') {
+        p++;
+      }
+      if (strptime(p, "%a, %d %b %Y %H:%M:%S", &tm)) {
+        long long delta = (long long)(timegm(&tm) - time(NULL));
+        t->retry_after_ms = delta > 0 ? delta * 1000 : 0;
+      }
+    }
+  }
+  return len;
+}
+
+static int start_transfer(CURLM *multi, struct transfer *t, const char *url,
+                          const struct curl_slist *headers, const char *body,
+                          size_t body_len, long timeout_ms,
+                          const struct ai_stream *stream) {
+  memset(t, 0, sizeof(*t));
+  t->retry_after_ms = -1;
+  t->stream = stream;
+  t->easy = curl_easy_init();
+  if (!t->easy) {
+    return -1;
+  }
+  curl_easy_setopt(t->easy, CURLOPT_URL, url);
+  curl_easy_setopt(t->easy, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt(t->easy, CURLOPT_POSTFIELDS, body);
+  curl_easy_setopt(t->easy, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)body_len);
+  curl_easy_setopt(t->easy, CURLOPT_WRITEFUNCTION, write_callback);
+  curl_easy_setopt(t->easy, CURLOPT_WRITEDATA, (void *)t);
+  curl_easy_setopt(t->easy, CURLOPT_HEADERFUNCTION, header_callback);
+  curl_easy_setopt(t->easy, CURLOPT_HEADERDATA, (void *)t);
+  curl_easy_setopt(t->easy, CURLOPT_CONNECTTIMEOUT_MS, connect_timeout_ms);
+  curl_easy_setopt(t->easy, CURLOPT_TIMEOUT_MS, timeout_ms);
+  curl_easy_setopt(t->easy, CURLOPT_NOSIGNAL, 1L); // Workers are threads
+  curl_easy_setopt(t->easy, CURLOPT_PRIVATE, (void *)t);
+  t->started_ms = now_ms();
+  curl_multi_add_handle(multi, t->easy);
+  return 0;
+}
+
+static int transfer_succeeded(const struct transfer *t) {
+  return t->done && t->result == CURLE_OK && t->status >= 200 &&
+         t->status < 300;
+}
+
+// Transport errors, 429 and 5xx are worth retrying; other answers are not
+static int transfer_retryable(const struct transfer *t) {
+  return t->result != CURLE_OK || t->status == 429 || t->status >= 500;
+}
+
+// Run one attempt, hedged with a second transfer if the first outlives
+// hedge_ms. Returns the index of the winning transfer, or of the most
+// informative failure.
+static int perform_attempt(struct transfer *transfers, int *started,
+                           const char *url, const struct curl_slist *headers,
+                           const char *body, size_t body_len,
+                           long long deadline_ms, long long hedge_ms,
+                           const struct ai_stream *stream) {
+  CURLM *multi = curl_multi_init();
+  if (!multi) {
+    return -1;
+  }
+  long long now = now_ms();
+  long timeout_ms = request_timeout_ms;
+  if (deadline_ms - now < timeout_ms) {
+    timeout_ms = deadline_ms - now > 0 ? (long)(deadline_ms - now) : 1;
+  }
+  *started = 0;
+  if (start_transfer(multi, &transfers[0], url, headers, body, body_len,
+                     timeout_ms, stream) != 0) {
+    curl_multi_cleanup(multi);
+    return -1;
+  }
+  *started = 1;
+  long long hedge_at = hedge_ms >= 0 ? now + hedge_ms : LLONG_MAX;
+
+  int winner = -1;
+  while (winner < 0) {
+    int running = 0;
+    curl_multi_perform(multi, &running);
+    int queued = 0;
+    CURLMsg *msg;
+    while ((msg = curl_multi_info_read(multi, &queued))) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      struct transfer *t = NULL;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&t);
+      t->done = 1;
+      t->result = msg->data.result;
+      curl_easy_getinfo(t->easy, CURLINFO_RESPONSE_CODE, &t->status);
+      if (transfer_succeeded(t)) {
+        winner = (int)(t - transfers);
+      }
+    }
+    if (winner >= 0) {
+      break;
+    }
+
+    int pending = 0;
+    for (int i = 0; i < *started; i++) {
+      pending += !transfers[i].done;
+    }
+    now = now_ms();
+    if (*started == 1 && now >= hedge_at && now < deadline_ms) {
+      // The first request is slower than nearly all recent ones; race it
+      long remaining = (long)(deadline_ms - now);
+      if (start_transfer(multi, &transfers[1], url, headers, body, body_len,
+                         remaining < request_timeout_ms ? remaining
+                                                        : request_timeout_ms,
+                         stream) == 0) {
+        *started = 2;
+        pending++;
+        metrics_counter_add("cis_ai_hedges_total", 1);
+      }
+    }
+    if (pending == 0) {
+      break;
+    }
+    long long wait = hedge_at > now ? hedge_at - now : 1000;
+    curl_multi_poll(multi, NULL, 0, wait < 1000 ? (int)wait : 1000, NULL);
+  }
+
+  if (winner < 0) {
+    // Both failed; report the one that asked for the longer back-off
+    winner = *started == 2 &&
+             transfers[1].retry_after_ms > transfers[0].retry_after_ms;
+  } else if (winner == 1) {
+    metrics_counter_add("cis_ai_hedge_wins_total", 1);
+  }
+  for (int i = 0; i < *started; i++) {
+    curl_multi_remove_handle(multi, transfers[i].easy);
+    curl_easy_cleanup(transfers[i].easy);
+  }
+  curl_multi_cleanup(multi);
+  return winner;
+}
+
+// Full-jitter exponential backoff
+static long long backoff_ms(int attempt) {
+  static __thread unsigned int seed = 0;
+  if (seed == 0) {
+    seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)&seed;
+  }
+  long long cap = retry_base_ms << (attempt < 20 ? attempt : 20);
+  if (cap > retry_max_ms) {
+    cap = retry_max_ms;
+  }
+  return cap > 0 ? rand_r(&seed) % (cap + 1) : 0;
+}
+
+static void count_outcome(const char *provider, const char *stage,
+                          const char *outcome) {
+  char metric[128];
+  snprintf(metric, sizeof(metric),
+           "cis_ai_requests_total{provider=\"%s\",stage=\"%s\","
+           "outcome=\"%s\"}",
+           provider, stage, outcome);
+  metrics_counter_add(metric, 1);
+}
+
+// Function to POST an AI request with retries, hedging and circuit breaking.
+// With a stream, *response receives the completion text instead of the
+// body.
+static int post(const char *provider, const char *stage, const char *url,
+                const struct curl_slist *headers, const char *body,
+                size_t body_len, const struct ai_stream *stream,
+                char **response, size_t *response_len) {
+  struct provider_state *ps = provider_state(provider);
+  long long deadline_ms = now_ms() + deadline_for_stage(stage);
+  *response = NULL;
+  *response_len = 0;
+
+  for (int attempt = 0;; attempt++) {
+    if (!breaker_allow(ps)) {
+      syslog(LOG_ERR, "Circuit for %s is open, failing %s request fast",
+             provider, stage);
+      count_outcome(provider, stage, "circuit_open");
+      return -1;
+    }
+
+    struct transfer transfers[2];
+    int started = 0;
+    // A hedged stream would pay for every token twice
+    long long hedge_ms = hedging && !stream ? hedge_delay_ms(ps) : -1;
+    if (stream) {
+      stream->restart(stream->arg);
+    }
+    int index = perform_attempt(transfers, &started, url, headers, body,
+                                body_len, deadline_ms, hedge_ms, stream);
+    if (index < 0) {
+      breaker_record(ps, 1); // Local failure, says nothing about the provider
+      syslog(LOG_ERR, "Failed to start %s request", stage);
+      return -1;
+    }
+    struct transfer *t = &transfers[index];
+    for (int i = 0; i < started; i++) {
+      if (i != index) {
+        transfer_free(&transfers[i]);
+      }
+    }
+
+    if (stream && transfer_succeeded(t) && !t->event_stream && t->data) {
+      // The server ignored "stream"; the consumer sees the answer at once
+      char *piece = stream->parse(t->data);
+      if (piece) {
+        stream_text(t, piece);
+        free(piece);
+      }
+    }
+    if (t->aborted) {
+      breaker_record(ps, 1); // The provider answered; the text was wrong
+      count_outcome(provider, stage, "aborted");
+      transfer_free(t);
+      return -1;
+    }
+
+    if (transfer_succeeded(t)) {
+      breaker_record(ps, 1);
+      record_latency(ps, now_ms() - t->started_ms);
+      count_outcome(provider, stage, "success");
+      if (stream) {
+        *response = t->text ? t->text : strdup("");
+        *response_len = t->text_len;
+        t->text = NULL;
+        transfer_free(t);
+      } else {
+        *response = t->data ? t->data : strdup("");
+        *response_len = t->len;
+      }
+      return *response ? 0 : -1;
+    }
+
+    int retryable = transfer_retryable(t);
+    breaker_record(ps, !retryable);
+    if (t->result != CURLE_OK) {
+      syslog(LOG_ERR, "%s request to %s failed: %s", stage, provider,
+             curl_easy_strerror(t->result));
+    } else {
+      syslog(LOG_ERR, "%s request to %s returned HTTP %ld", stage, provider,
+             t->status);
+    }
+    long long retry_after_ms = t->retry_after_ms;
+    transfer_free(t);
+
+    if (!retryable || attempt >= max_retries) {
+      count_outcome(provider, stage, retryable ? "exhausted" : "rejected");
+      return -1;
+    }
+    long long delay =
+        retry_after_ms >= 0 ? retry_after_ms : backoff_ms(attempt);
+    if (now_ms() + delay >= deadline_ms) {
+      syslog(LOG_ERR, "%s stage deadline leaves no time to retry", stage);
+      count_outcome(provider, stage, "deadline");
+      return -1;
+    }
+    metrics_counter_add("cis_ai_retries_total", 1);
+    usleep((useconds_t)delay * 1000);
+  }
+}
+
+int ai_post(const char *provider, const char *stage, const char *url,
+            const struct curl_slist *headers, const char *body,
+            size_t body_len, char **response, size_t *response_len) {
+  return post(provider, stage, url, headers, body, body_len, NULL, response,
+              response_len);
+}
+
+int ai_post_stream(const char *provider, const char *stage, const char *url,
+                   const struct curl_slist *headers, const char *body,
+                   size_t body_len, const struct ai_stream *stream,
+                   char **text, size_t *text_len) {
+  return post(provider, stage, url, headers, body, body_len, stream, text,
+              text_len);
+}
@@ -0,0 +1,132 @@
+#include "ai_provider.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cjson/cJSON.h>
+
+#include "json_builder.h"
+
+static char *finish_body(struct json_builder *jb, size_t *len) {
+  *len = jb->len;
+  return json_builder_finish(jb);
+}
+
+// Function to build an OpenAI completions request
+static char *openai_build_request(const struct ai_params *params,
+                                  size_t *len) {
+  struct json_builder jb;
+  json_builder_init(&jb);
+  json_object_begin(&jb, NULL);
+  json_add_string(&jb, "model", params->model);
+  json_add_string(&jb, "prompt", params->prompt);
+  json_add_int(&jb, "max_tokens", params->max_tokens);
+  json_add_double(&jb, "temperature", params->temperature);
+  if (params->stream) {
+    json_add_bool(&jb, "stream", 1);
+  }
+  json_object_end(&jb);
+  return finish_body(&jb, len);
+}
+
+static struct curl_slist *bearer_headers(struct curl_slist *headers,
+                                         const char *api_key) {
+  char auth_header[256];
+  snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s",
+           api_key);
+  return curl_slist_append(headers, auth_header);
+}
+
+static struct curl_slist *no_headers(struct curl_slist *headers,
+                                     const char *api_key) {
+  (void)api_key; // Suppress unused parameter warning
+  return headers;
+}
+
+// Completions answer with {"choices":[{"text":...}],"usage":{...}}, and
+// each streamed event carries the next piece in the same shape
+static char *openai_parse_response(const char *body) {
+  cJSON *json = cJSON_Parse(body);
+  cJSON *choice = cJSON_GetArrayItem(cJSON_GetObjectItem(json, "choices"), 0);
+  cJSON *text = cJSON_GetObjectItem(choice, "text");
+  char *result = cJSON_IsString(text) ? strdup(text->valuestring) : NULL;
+  cJSON_Delete(json);
+  return result;
+}
+
+static int openai_parse_usage(const char *body, struct ai_usage *usage) {
+  cJSON *json = cJSON_Parse(body);
+  cJSON *u = cJSON_GetObjectItem(json, "usage");
+  cJSON *prompt = cJSON_GetObjectItem(u, "prompt_tokens");
+  cJSON *completion = cJSON_GetObjectItem(u, "completion_tokens");
+  int found = cJSON_IsNumber(prompt) && cJSON_IsNumber(completion);
+  if (found) {
+    usage->prompt_tokens = (long long)prompt->valuedouble;
+    usage->completion_tokens = (long long)completion->valuedouble;
+  }
+  cJSON_Delete(json);
+  return found ? 0 : -1;
+}
+
+// Function to build an Anthropic text completion request
+static char *anthropic_build_request(const struct ai_params *params,
+                                     size_t *len) {
+  struct json_builder jb;
+  json_builder_init(&jb);
+  json_object_begin(&jb, NULL);
+  json_add_string(&jb, "prompt", params->prompt);
+  json_add_string(&jb, "model", params->model);
+  json_add_int(&jb, "max_tokens_to_sample", params->max_tokens);
+  json_add_double(&jb, "temperature", params->temperature);
+  if (params->stream) {
+    json_add_bool(&jb, "stream", 1);
+  }
+  json_object_end(&jb);
+  return finish_body(&jb, len);
+}
+
+static struct curl_slist *anthropic_headers(struct curl_slist *headers,
+                                            const char *api_key) {
+  char auth_header[256];
+  snprintf(auth_header, sizeof(auth_header), "x-api-key: %s", api_key);
+  headers = curl_slist_append(headers, auth_header);
+  return curl_slist_append(headers, "anthropic-version: 2023-06-01");
+}
+
+// Streamed completion events carry the next piece in "completion" too
+static char *anthropic_parse_response(const char *body) {
+  cJSON *json = cJSON_Parse(body);
+  cJSON *completion = cJSON_GetObjectItem(json, "completion");
+  char *result =
+      cJSON_IsString(completion) ? strdup(completion->valuestring) : NULL;
+  cJSON_Delete(json);
+  return result;
+}
+
+// Text completions do not report usage
+static int anthropic_parse_usage(const char *body, struct ai_usage *usage) {
+  (void)body;  // Suppress unused parameter warning
+  (void)usage; // Suppress unused parameter warning
+  return -1;
+}
+
+static const struct ai_provider providers[] = {
+    {"openai", "https://api.openai.com", "/v1/completions",
+     openai_build_request, bearer_headers, openai_parse_response,
+     openai_parse_usage},
+    {"anthropic", "https://api.anthropic.com", "/v1/complete",
+     anthropic_build_request, anthropic_headers, anthropic_parse_response,
+     anthropic_parse_usage},
+    {"mock", "http://127.0.0.1:8090", "/v1/completions", openai_build_request,
+     no_headers, openai_parse_response, openai_parse_usage},
+};
+
+const struct ai_provider *ai_provider_lookup(const char *name) {
+  for (size_t i = 0; i < sizeof(providers) / sizeof(providers[0]); i++) {
+    if (strcmp(providers[i].name, name) == 0) {
+      return &providers[i];
+    }
+  }
+  return NULL;
+}
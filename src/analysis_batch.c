@@ -0,0 +1,274 @@
+#include "analysis_batch.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "tokenizer.h"
+
+#define MAX_BATCH_SIZE 16
+#define DELIMITER_FORMAT "=== ISSUE %d ===\n"
+
+struct batch_member {
+  int issue_number;
+  const char *issue_body; // Owned by the waiting worker
+  char *analysis;         // Split out of the response by the leader
+};
+
+// Issues of one repository sharing a request. Followers block on changed
+// until the leader has sent the request and split the response.
+struct batch {
+  char repo_full_name[256];
+  struct batch_member members[MAX_BATCH_SIZE];
+  int count;
+  size_t tokens; // Of all issue bodies
+  int done;
+  int result;
+  int waiting; // Members yet to collect their analysis
+  pthread_cond_t changed;
+  struct batch *next;
+};
+
+static int batch_size = 4;
+static int max_wait_ms = 200;
+static int max_issue_tokens = 400;
+static int max_batch_tokens = 2000;
+static long long min_queue_wait_ms = 2000;
+
+static struct batch *open_batches = NULL;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to handle batching config entries
+int batch_config_handler(const char *name, const char *value) {
+  if (strcmp(name, "batch_size") == 0) {
+    batch_size = atoi(value);
+    if (batch_size > MAX_BATCH_SIZE) {
+      batch_size = MAX_BATCH_SIZE;
+    }
+  } else if (strcmp(name, "max_wait_ms") == 0) {
+    max_wait_ms = atoi(value);
+  } else if (strcmp(name, "max_issue_tokens") == 0) {
+    max_issue_tokens = atoi(value);
+  } else if (strcmp(name, "max_batch_tokens") == 0) {
+    max_batch_tokens = atoi(value);
+  } else if (strcmp(name, "min_queue_wait_ms") == 0) {
+    min_queue_wait_ms = atoll(value);
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+// Find the section of a batched response that answers issue_number: the
+// text after its delimiter up to the next delimiter. Returns a copy with
+// surrounding whitespace trimmed, or NULL if the issue was not answered.
+static char *split_section(const char *response, int issue_number) {
+  char delimiter[48];
+  int len = snprintf(delimiter, sizeof(delimiter), "=== ISSUE %d ===",
+                     issue_number);
+  const char *start = strstr(response, delimiter);
+  if (!start) {
+    return NULL;
+  }
+  start += len;
+  const char *end = strstr(start, "=== ISSUE ");
+  if (!end) {
+    end = start + strlen(start);
+  }
+  while (start < end && (*start == ' ' || *start == '\n' || *start == '\r')) {
+    start++;
+  }
+  while (end > start &&
+         (end[-1] == ' ' || end[-1] == '\n' || end[-1] == '\r')) {
+    end--;
+  }
+  if (start == end) {
+    return NULL;
+  }
+  return strndup(start, (size_t)(end - start));
+}
+
+// Build the delimited content of a sealed batch
+static char *batch_content(const struct batch *b) {
+  size_t size = 1;
+  for (int i = 0; i < b->count; i++) {
+    size += sizeof(DELIMITER_FORMAT) + 12 + strlen(b->members[i].issue_body) +
+            1;
+  }
+  char *content = malloc(size);
+  if (!content) {
+    return NULL;
+  }
+  size_t len = 0;
+  for (int i = 0; i < b->count; i++) {
+    len += (size_t)snprintf(content + len, size - len, DELIMITER_FORMAT "%s\n",
+                            b->members[i].issue_number,
+                            b->members[i].issue_body);
+  }
+  return content;
+}
+
+// Send a sealed batch and hand each member its part of the response
+static int send_batch(struct batch *b, batch_send_fn send, void *arg) {
+  char *content = batch_content(b);
+  char *response = content ? send(content, arg) : NULL;
+  free(content);
+  if (!response) {
+    syslog(LOG_ERR, "Batched analysis of %d issues in %s failed", b->count,
+           b->repo_full_name);
+    return -1;
+  }
+  int answered = 0;
+  for (int i = 0; i < b->count; i++) {
+    b->members[i].analysis =
+        split_section(response, b->members[i].issue_number);
+    answered += b->members[i].analysis != NULL;
+  }
+  free(response);
+
+  syslog(LOG_INFO, "Batched analysis of %d issues in %s answered %d",
+         b->count, b->repo_full_name, answered);
+  metrics_counter_add("cis_analysis_batches_total", 1);
+  metrics_counter_add("cis_analysis_batched_issues_total", answered);
+  if (answered < b->count) {
+    metrics_counter_add("cis_analysis_batch_misses_total",
+                        b->count - answered);
+  }
+  return 0;
+}
+
+// Copy a member's result out and release the batch with its last member.
+// Called with batch_lock held.
+static int collect(struct batch *b, int index, char *response,
+                   size_t response_size) {
+  struct batch_member *m = &b->members[index];
+  int result = b->result;
+  if (result == 0 && m->analysis) {
+    snprintf(response, response_size, "%s", m->analysis);
+  } else if (result == 0) {
+    result = 1; // Left unanswered, analyse it alone
+  }
+  free(m->analysis);
+  m->analysis = NULL;
+  if (--b->waiting == 0) {
+    pthread_cond_destroy(&b->changed);
+    free(b);
+  }
+  return result;
+}
+
+// Function to analyse an issue as part of a batch
+int analysis_batch_run(const char *repo_full_name, int issue_number,
+                       const char *issue_body, long long queue_wait_ms,
+                       batch_send_fn send, void *arg, char *response,
+                       size_t response_size) {
+  if (batch_size < 2 || queue_wait_ms < min_queue_wait_ms) {
+    return 1;
+  }
+  size_t tokens = tokenizer_count(issue_body, strlen(issue_body));
+  if (tokens > (size_t)max_issue_tokens) {
+    return 1;
+  }
+
+  pthread_mutex_lock(&batch_lock);
+  struct batch *b = open_batches;
+  while (b && (strcmp(b->repo_full_name, repo_full_name) != 0 ||
+               b->count == batch_size ||
+               b->tokens + tokens > (size_t)max_batch_tokens)) {
+    b = b->next;
+  }
+
+  if (b) {
+    // Join as a follower and wait for the leader to finish
+    int index = b->count++;
+    b->members[index] = (struct batch_member){issue_number, issue_body, NULL};
+    b->tokens += tokens;
+    b->waiting++;
+    if (b->count == batch_size) {
+      pthread_cond_broadcast(&b->changed);
+    }
+    while (!b->done) {
+      pthread_cond_wait(&b->changed, &batch_lock);
+    }
+    int result = collect(b, index, response, response_size);
+    pthread_mutex_unlock(&batch_lock);
+    return result;
+  }
+
+  // Lead a new batch
+  b = calloc(1, sizeof(*b));
+  if (!b) {
+    pthread_mutex_unlock(&batch_lock);
+    return 1;
+  }
+  snprintf(b->repo_full_name, sizeof(b->repo_full_name), "%s",
+           repo_full_name);
+  b->members[0] = (struct batch_member){issue_number, issue_body, NULL};
+  b->count = 1;
+  b->tokens = tokens;
+  b->waiting = 1;
+  pthread_cond_init(&b->changed, NULL);
+  b->next = open_batches;
+  open_batches = b;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += max_wait_ms / 1000;
+  deadline.tv_nsec += (long)(max_wait_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  while (b->count < batch_size &&
+         pthread_cond_timedwait(&b->changed, &batch_lock, &deadline) !=
+             ETIMEDOUT) {
+  }
+
+  // Seal the batch so nobody joins while the request is in flight
+  for (struct batch **p = &open_batches; *p; p = &(*p)->next) {
+    if (*p == b) {
+      *p = b->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&batch_lock);
+
+  int result = 1; // Alone after all
+  if (b->count > 1) {
+    result = send_batch(b, send, arg);
+  }
+
+  pthread_mutex_lock(&batch_lock);
+  b->result = result;
+  b->done = 1;
+  pthread_cond_broadcast(&b->changed);
+  result = collect(b, 0, response, response_size);
+  pthread_mutex_unlock(&batch_lock);
+  return result;
+}
+
+int analysis_batch_self_test(void) {
+  const char *response = "=== ISSUE 7 ===\nTypo in README.\n\n"
+                         "=== ISSUE 12 ===\n  Broken link in docs.  \n"
+                         "=== ISSUE 1 ===\n";
+  char *seven = split_section(response, 7);
+  char *twelve = split_section(response, 12);
+  char *one = split_section(response, 1);
+  char *missing = split_section(response, 3);
+  int ok = seven && strcmp(seven, "Typo in README.") == 0 && twelve &&
+           strcmp(twelve, "Broken link in docs.") == 0 && !one && !missing;
+  free(seven);
+  free(twelve);
+  free(one);
+  free(missing);
+  if (!ok) {
+    syslog(LOG_ERR, "Batched analysis response split incorrectly");
+    return -1;
+  }
+  return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // pthread_timedjoin_np
 #include <cjson/cJSON.h>
 #include <curl/curl.h>
 #include <errno.h>
@@ -17,6 +18,29 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "admission.h"
+#include "ai_client.h"
+#include "analysis_batch.h"
+#include "ai_provider.h"
+#include "clock.h"
+#include "file_applier.h"
+#include "github_client.h"
+#include "handover.h"
+#include "issue_queue.h"
+#include "json_builder.h"
+#include "local_queue.h"
+#include "metrics.h"
+#include "output_validator.h"
+#include "prompt_pack.h"
+#include "push_batch.h"
+#include "repo_digest.h"
+#include "review_fanout.h"
+#include "shard.h"
+#include "startup.h"
+#include "systemd_support.h"
+#include "trace.h"
+#include "workspace_cleanup.h"
+
 #define MAX_BUFFER_SIZE 8192
 
 // Configure logging
@@ -26,21 +50,21 @@ void configure_logging() {
 }
 
 // Function prototypes
-size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb,
-                           void *userp);
 int process_issue(const char *repo_owner, const char *repo_name,
                   int issue_number, const char *issue_title,
-                  const char *issue_body);
+                  struct queued_issue *issue);
 int analyze_issue(const char *repo_owner, const char *repo_name,
-                  int issue_number, const char *issue_body, char *response);
+                  int issue_number, const char *issue_body,
+                  const char *digest, long long queue_wait_ms,
+                  char *response);
 int implement_issue(const char *repo_owner, const char *repo_name,
-                    int issue_number, const char *branch_name, char *response);
-int review_changes(const char *repo_owner, const char *repo_name,
-                   int issue_number, const char *branch_name, char *response);
-int final_review(const char *repo_owner, const char *repo_name,
-                 int issue_number, const char *branch_name, char *response);
+                    int issue_number, const char *branch_name,
+                    const char *digest, const char *analysis,
+                    char **implementation);
+int review_implementation(int issue_number, const char *implementation);
 int create_pr(const char *repo_owner, const char *repo_name, int issue_number,
-              const char *branch_name, char *response);
+              const char *branch_name, const char *implementation,
+              char *response);
 enum MHD_Result answer_to_connection(void *cls,
                                      struct MHD_Connection *connection,
                                      const char *url, const char *method,
@@ -53,17 +77,37 @@ int SERVER_PORT = 8080;
 char LOG_DIRECTORY[256] = "./logs";
 char REDIS_HOST[256] = "127.0.0.1";
 int REDIS_PORT = 6379;
-char GITHUB_TOKEN[128] = "";
+int WORKER_THREADS = 1;
+// Empty disables
+char HANDOVER_SOCKET[256] = "/run/code_issue_service/handover.sock";
+int DRAIN_TIMEOUT_SECONDS = 60;
+int DRY_RUN = 1; // Log the git and pull request steps instead of running them
 char AI_PROVIDER[32] = "openai";
 char AI_API_KEY[128] = "";
 char AI_MODEL[64] = "text-davinci-003";
+char AI_BASE_URL[256] = ""; // Empty for the provider's own endpoint
+
+// Global variables for graceful shutdown
+volatile sig_atomic_t keep_running = 1;
+volatile sig_atomic_t shutdown_initiated = 0;
+static long long drain_deadline_ms = 0; // Set once draining starts
+struct MHD_Daemon *mhd_daemon = NULL;
+redisContext *redis_ctx = NULL;
+
+// process_issue result for an issue handed back to the queue unfinished
+#define ISSUE_RELEASED 1
+
+// Whether a shutdown is draining and its deadline has passed
+static int drain_expired(void) {
+  long long deadline = __atomic_load_n(&drain_deadline_ms, __ATOMIC_SEQ_CST);
+  return deadline != 0 && now_ms() >= deadline;
+}
 
 // Prompts
 char ANALYZE_PROMPT_TEMPLATE[MAX_BUFFER_SIZE];
 char IMPLEMENT_PROMPT_TEMPLATE[MAX_BUFFER_SIZE];
-char REVIEW_PROMPT_TEMPLATE[MAX_BUFFER_SIZE];
-char FINAL_REVIEW_PROMPT_TEMPLATE[MAX_BUFFER_SIZE];
 char PR_PROMPT_TEMPLATE[MAX_BUFFER_SIZE];
+char BATCH_ANALYZE_PROMPT_TEMPLATE[MAX_BUFFER_SIZE]; // Empty disables batching
 
 // Function to load config file
 int config_handler(void *user, const char *section, const char *name,
@@ -78,11 +122,38 @@ int config_handler(void *user, const char *section, const char *name,
       strcpy(REDIS_HOST, value);
     } else if (strcmp(name, "redis_port") == 0) {
       REDIS_PORT = atoi(value);
+    } else if (strcmp(name, "worker_threads") == 0) {
+      WORKER_THREADS = atoi(value) > 0 ? atoi(value) : 1;
+    } else if (strcmp(name, "handover_socket") == 0) {
+      snprintf(HANDOVER_SOCKET, sizeof(HANDOVER_SOCKET), "%s", value);
+    } else if (strcmp(name, "drain_timeout_seconds") == 0) {
+      DRAIN_TIMEOUT_SECONDS = atoi(value);
+    } else if (strcmp(name, "dry_run") == 0) {
+      DRY_RUN = atoi(value);
     }
+  } else if (strcmp(section, "Queue") == 0 ||
+             strcmp(section, "Priority") == 0) {
+    queue_config_handler(section, name, value);
+  } else if (strcmp(section, "Cluster") == 0) {
+    shard_config_handler(name, value);
+  } else if (strcmp(section, "Batching") == 0) {
+    batch_config_handler(name, value);
+  } else if (strcmp(section, "Review") == 0) {
+    review_config_handler(name, value);
+  } else if (strcmp(section, "Cleanup") == 0) {
+    cleanup_config_handler(name, value);
+  } else if (strcmp(section, "Apply") == 0) {
+    applier_config_handler(name, value);
+  } else if (strcmp(section, "Push") == 0) {
+    push_config_handler(name, value);
+  } else if (strcmp(section, "Digest") == 0) {
+    digest_config_handler(name, value);
+  } else if (strcmp(section, "Admission") == 0) {
+    admission_config_handler(name, value);
+  } else if (strcmp(section, "Validate") == 0) {
+    validator_config_handler(name, value);
   } else if (strcmp(section, "GitHub") == 0) {
-    if (strcmp(name, "personal_access_token") == 0) {
-      strcpy(GITHUB_TOKEN, value);
-    }
+    github_config_handler(name, value);
   } else if (strcmp(section, "AI") == 0) {
     if (strcmp(name, "api_provider") == 0) {
       strcpy(AI_PROVIDER, value);
@@ -90,18 +161,22 @@ int config_handler(void *user, const char *section, const char *name,
       strcpy(AI_API_KEY, value);
     } else if (strcmp(name, "model") == 0) {
       strcpy(AI_MODEL, value);
+    } else if (strcmp(name, "base_url") == 0) {
+      snprintf(AI_BASE_URL, sizeof(AI_BASE_URL), "%s", value);
+    } else if (!prompt_config_handler(name, value)) {
+      ai_client_config_handler(name, value);
     }
   } else if (strcmp(section, "Prompts") == 0) {
     if (strcmp(name, "analyze_issue_prompt") == 0) {
       strcpy(ANALYZE_PROMPT_TEMPLATE, value);
     } else if (strcmp(name, "implement_changes_prompt") == 0) {
       strcpy(IMPLEMENT_PROMPT_TEMPLATE, value);
-    } else if (strcmp(name, "review_changes_prompt") == 0) {
-      strcpy(REVIEW_PROMPT_TEMPLATE, value);
-    } else if (strcmp(name, "final_review_prompt") == 0) {
-      strcpy(FINAL_REVIEW_PROMPT_TEMPLATE, value);
     } else if (strcmp(name, "create_pr_prompt") == 0) {
       strcpy(PR_PROMPT_TEMPLATE, value);
+    } else if (strcmp(name, "batch_analyze_prompt") == 0) {
+      strcpy(BATCH_ANALYZE_PROMPT_TEMPLATE, value);
+    } else {
+      review_prompt_config_handler(name, value);
     }
   }
   return 1;
@@ -126,176 +201,149 @@ void log_message(int issue_number, const char *format, ...) {
   char time_str[64];
   strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&now));
 
-  fprintf(log_file, "[%s] ", time_str);
-  vfprintf(log_file, format, args);
-  fprintf(log_file, "\n");
+  int bytes = fprintf(log_file, "[%s] ", time_str);
+  bytes += vfprintf(log_file, format, args);
+  bytes += fprintf(log_file, "\n");
 
   va_end(args);
   fclose(log_file);
+  TRACE2(log__flush, issue_number, bytes);
 }
 
-// Structure to hold memory for curl callback
-struct MemoryStruct {
-  char *memory;
-  size_t size;
-};
+// Stream callbacks handing a completion to an output validator
+static void restart_validator(void *arg) { validator_reset(arg); }
 
-// Callback function for curl to write data
-size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb,
-                           void *userp) {
-  size_t realsize = size * nmemb;
-  struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+static int feed_validator(const char *text, size_t len, void *arg) {
+  return validator_feed(arg, text, len);
+}
 
-  mem->memory = realloc(mem->memory, mem->size + realsize + 1);
-  if (mem->memory == NULL) {
-    syslog(LOG_ERR, "Not enough memory (realloc returned NULL)");
-    return 0;
+// Function to request a completion from the AI provider. stage names the
+// pipeline step for deadlines and metrics. With a validator the completion
+// is streamed through it, and the request is aborted as soon as the
+// validator rejects the text. issue_number only tags the tracepoints.
+// Returns the completion text, which the caller frees, or NULL on failure.
+char *request_completion(const char *stage, const char *prompt,
+                         int max_tokens, struct output_validator *validator,
+                         int issue_number) {
+  const struct ai_provider *provider = ai_provider_lookup(AI_PROVIDER);
+  if (!provider) {
+    syslog(LOG_ERR, "Unknown AI provider %s", AI_PROVIDER);
+    return NULL;
   }
 
-  memcpy(&(mem->memory[mem->size]), contents, realsize);
-  mem->size += realsize;
-  mem->memory[mem->size] = 0;
-
-  return realsize;
-}
+  char url[512];
+  snprintf(url, sizeof(url), "%s%s",
+           AI_BASE_URL[0] ? AI_BASE_URL : provider->default_base_url,
+           provider->path);
+  struct ai_params params = {AI_MODEL, prompt, max_tokens, 0.7,
+                            validator != NULL};
+  size_t buffer_len = 0;
+  char *buffer = provider->build_request(&params, &buffer_len);
+  if (!buffer) {
+    syslog(LOG_ERR, "Failed to build AI request body");
+    return NULL;
+  }
 
-// Function to send a POST request to AI API for code analysis or generation
-int send_ai_request(const char *prompt, char *response) {
-  CURL *curl;
-  CURLcode res;
   struct curl_slist *headers = NULL;
-  char buffer[MAX_BUFFER_SIZE];
-  struct MemoryStruct chunk;
-
-  chunk.memory = malloc(1); // Will be grown as needed by realloc
-  chunk.size = 0;           // No data at this point
-
-  curl_global_init(CURL_GLOBAL_DEFAULT);
-  curl = curl_easy_init();
-  if (curl) {
-    // Prepare the API request depending on the provider
-    if (strcmp(AI_PROVIDER, "openai") == 0) {
-      snprintf(buffer, sizeof(buffer),
-               "{\"model\":\"%s\",\"prompt\":\"%s\",\"max_tokens\":1000,"
-               "\"temperature\":0.7}",
-               AI_MODEL, prompt);
-      curl_easy_setopt(curl, CURLOPT_URL,
-                       "https://api.openai.com/v1/completions");
-    } else if (strcmp(AI_PROVIDER, "anthropic") == 0) {
-      snprintf(buffer, sizeof(buffer),
-               "{\"prompt\":\"%s\", \"model\":\"%s\", "
-               "\"max_tokens_to_sample\":1000, \"temperature\":0.7}",
-               prompt, AI_MODEL);
-      curl_easy_setopt(curl, CURLOPT_URL,
-                       "https://api.anthropic.com/v1/complete");
-    }
-
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    char auth_header[256];
-    snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s",
-             AI_API_KEY);
-    headers = curl_slist_append(headers, auth_header);
-
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, buffer);
-
-    // Set up response handling
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-
-    res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-      syslog(LOG_ERR, "Curl failed: %s", curl_easy_strerror(res));
-      free(chunk.memory);
-      curl_easy_cleanup(curl);
-      curl_global_cleanup();
-      return -1;
-    }
-
-    // Copy response
-    strncpy(response, chunk.memory, MAX_BUFFER_SIZE - 1);
-    response[MAX_BUFFER_SIZE - 1] = '\0';
+  headers = curl_slist_append(headers, "Content-Type: application/json");
+  headers = provider->add_headers(headers, AI_API_KEY);
+
+  // Retries, hedging and circuit breaking happen in ai_post
+  char *reply = NULL;
+  size_t reply_len = 0;
+  TRACE3(ai__request__start, issue_number, stage, buffer_len);
+  int result;
+  if (validator) {
+    struct ai_stream stream = {provider->parse_response, restart_validator,
+                               feed_validator, validator};
+    result = ai_post_stream(AI_PROVIDER, stage, url, headers, buffer,
+                            buffer_len, &stream, &reply, &reply_len);
+  } else {
+    result = ai_post(AI_PROVIDER, stage, url, headers, buffer, buffer_len,
+                     &reply, &reply_len);
+  }
+  TRACE4(ai__request__done, issue_number, stage, reply_len, result);
+  curl_slist_free_all(headers);
+  free(buffer);
+  if (result != 0) {
+    return NULL;
+  }
+  if (validator) {
+    return reply; // Already the completion text; streams report no usage
+  }
 
-    free(chunk.memory);
-    curl_easy_cleanup(curl);
+  struct ai_usage usage;
+  if (provider->parse_usage(reply, &usage) == 0) {
+    char metric[128];
+    snprintf(metric, sizeof(metric),
+             "cis_ai_prompt_tokens_total{provider=\"%s\"}", AI_PROVIDER);
+    metrics_counter_add(metric, usage.prompt_tokens);
+    snprintf(metric, sizeof(metric),
+             "cis_ai_completion_tokens_total{provider=\"%s\"}", AI_PROVIDER);
+    metrics_counter_add(metric, usage.completion_tokens);
   }
-  curl_global_cleanup();
-  return 0;
+  char *text = provider->parse_response(reply);
+  free(reply);
+  if (!text) {
+    syslog(LOG_ERR, "No completion in %s response for %s", AI_PROVIDER,
+           stage);
+  }
+  return text;
 }
 
-// Function to enqueue issue in Redis
-int enqueue_issue(redisContext *redis_ctx, const char *issue_data) {
-  redisReply *reply =
-      redisCommand(redis_ctx, "RPUSH issue_queue %s", issue_data);
-  if (!reply) {
-    syslog(LOG_ERR, "Failed to enqueue issue in Redis");
-    return -1;
-  }
-  freeReplyObject(reply);
-  return 0;
+// Function to name the workspace an issue is checked out in
+static void workspace_path(char *path, size_t size, const char *repo_owner,
+                           const char *repo_name, int issue_number) {
+  snprintf(path, size, "/tmp/%s_%s_%d", repo_owner, repo_name, issue_number);
 }
 
-// Function to dequeue issue from Redis
-char *dequeue_issue(redisContext *redis_ctx) {
-  redisReply *reply = redisCommand(redis_ctx, "LPOP issue_queue");
-  if (!reply) {
-    syslog(LOG_ERR, "Failed to dequeue issue from Redis");
-    return NULL;
-  }
-  if (reply->type == REDIS_REPLY_NIL) {
-    freeReplyObject(reply);
-    return NULL; // No issues in queue
-  }
-  char *issue_data = NULL;
-  if (reply->str) {
-    issue_data = strdup(reply->str);
-    if (!issue_data) {
-      syslog(LOG_ERR, "Failed to duplicate issue data");
-    }
+// What a worker cancelled by drain in the middle of an issue leaves behind
+struct cancelled_issue {
+  struct queued_issue *item;
+  char workspace[256];
+};
+
+// Function to return the issue of a cancelled worker to the queue, so a list
+// entry already popped off Redis is not lost
+static void release_cancelled_issue(void *arg) {
+  struct cancelled_issue *cancelled = arg;
+  struct queued_issue *item = cancelled->item;
+  syslog(LOG_WARNING, "Worker cancelled, returning %s#%d to the queue",
+         item->repo_full_name, item->record.issue_number);
+  workspace_discard(cancelled->workspace);
+  // The worker's connection may be stuck mid-command; use a fresh one
+  redisContext *ctx = redisConnect(REDIS_HOST, REDIS_PORT);
+  if (!ctx || ctx->err) {
+    syslog(LOG_ERR, "Failed to connect to Redis to requeue %s#%d",
+           item->repo_full_name, item->record.issue_number);
   } else {
-    syslog(LOG_ERR, "Received NULL string from Redis");
+    item->redis_ctx = ctx;
+  }
+  release_issue(item->redis_ctx, item);
+  if (ctx) {
+    redisFree(ctx);
   }
-  freeReplyObject(reply);
-  return issue_data;
 }
 
 // Function to process an issue (to be run in a separate thread)
 void *process_issue_thread(void *arg) {
   redisContext *redis_ctx = (redisContext *)arg;
   syslog(LOG_INFO, "Issue processing thread started");
-  while (1) {
-    char *issue_data = dequeue_issue(redis_ctx);
-    if (!issue_data) {
+  if (queue_init(redis_ctx) != 0) {
+    syslog(LOG_ERR, "Failed to initialise issue queue");
+    return NULL;
+  }
+  while (keep_running) {
+    struct queued_issue *item = dequeue_issue(redis_ctx);
+    if (!item) {
       sleep(1); // Wait before checking the queue again
       continue;
     }
-    syslog(LOG_INFO, "Dequeued new issue for processing: %s", issue_data);
-
-    // Parse issue data
-    cJSON *issue_json = cJSON_Parse(issue_data);
-    if (!issue_json) {
-      syslog(LOG_ERR, "Failed to parse issue data: %s", issue_data);
-      free(issue_data);
-      continue;
-    }
-
-    cJSON *repo_item = cJSON_GetObjectItem(issue_json, "repository");
-    cJSON *issue_number_item = cJSON_GetObjectItem(issue_json, "issue_number");
-    cJSON *issue_title_item = cJSON_GetObjectItem(issue_json, "issue_title");
-    cJSON *issue_body_item = cJSON_GetObjectItem(issue_json, "issue_body");
-
-    if (!repo_item || !issue_number_item || !issue_title_item ||
-        !issue_body_item) {
-      syslog(LOG_ERR, "Invalid issue data");
-      cJSON_Delete(issue_json);
-      free(issue_data);
-      continue;
-    }
-
-    const char *repo_full_name = repo_item->valuestring;
-    int issue_number = issue_number_item->valueint;
-    const char *issue_title = issue_title_item->valuestring;
-    const char *issue_body = issue_body_item->valuestring;
+    const char *repo_full_name = item->repo_full_name;
+    int issue_number = item->record.issue_number;
+    TRACE2(issue__dequeue, issue_number, item->record.body_length);
+    syslog(LOG_INFO, "Dequeued new issue for processing: %s#%d (%u byte body)",
+           repo_full_name, issue_number, item->record.body_length);
 
     // Split repo_full_name into owner and repo
     char repo_owner[128], repo_name[128];
@@ -304,18 +352,46 @@ void *process_issue_thread(void *arg) {
     log_message(issue_number, "Processing issue #%d in repository %s/%s",
                 issue_number, repo_owner, repo_name);
 
-    // Process the issue
-    int result = process_issue(repo_owner, repo_name, issue_number, issue_title,
-                               issue_body);
+    // Process the issue. drain cancels a worker stuck past its deadline;
+    // the issue then goes back to the queue.
+    struct cancelled_issue cancelled = {item, ""};
+    workspace_path(cancelled.workspace, sizeof(cancelled.workspace),
+                   repo_owner, repo_name, issue_number);
+    int result;
+    pthread_cleanup_push(release_cancelled_issue, &cancelled);
+    result = process_issue(repo_owner, repo_name, issue_number,
+                           item->issue_title, item);
+    pthread_cleanup_pop(0);
+    if (result == ISSUE_RELEASED) {
+      log_message(issue_number, "Returned issue #%d to the queue",
+                  issue_number);
+      release_issue(redis_ctx, item);
+      continue;
+    }
     if (result == 0) {
       log_message(issue_number, "Successfully processed issue #%d",
                   issue_number);
+      metrics_counter_add("cis_issues_processed_total{result=\"ok\"}", 1);
     } else {
       log_message(issue_number, "Failed to process issue #%d", issue_number);
+      metrics_counter_add("cis_issues_processed_total{result=\"failed\"}", 1);
     }
 
-    cJSON_Delete(issue_json);
-    free(issue_data); // Free issue_data after we're done using it
+    complete_issue(redis_ctx, item); // Acknowledge once we're done with it
+  }
+  return NULL;
+}
+
+// Function to keep stream entries claimed while workers process them
+void *queue_keepalive_thread(void *arg) {
+  redisContext *redis_ctx = (redisContext *)arg;
+  int interval = queue_claim_idle_seconds() / 3;
+  if (interval < 1) {
+    interval = 1;
+  }
+  while (1) {
+    sleep(interval);
+    queue_keepalive(redis_ctx);
   }
   return NULL;
 }
@@ -323,11 +399,18 @@ void *process_issue_thread(void *arg) {
 // Function to clone the repository
 int clone_repository(const char *repo_owner, const char *repo_name,
                      const char *local_path, int issue_number) {
+  TRACE2(git__start, issue_number, "clone");
   git_libgit2_init();
 
-  char repo_url[256];
-  snprintf(repo_url, sizeof(repo_url), "https://github.com/%s/%s.git",
-           repo_owner, repo_name);
+  char repo_url[512];
+  if (github_clone_url(repo_owner, repo_name, repo_url, sizeof(repo_url)) !=
+      0) {
+    log_message(issue_number, "Clone URL too long for %s/%s", repo_owner,
+                repo_name);
+    git_libgit2_shutdown();
+    TRACE3(git__done, issue_number, "clone", -1);
+    return -1;
+  }
 
   git_repository *repo = NULL;
   int error = git_clone(&repo, repo_url, local_path, NULL);
@@ -335,17 +418,20 @@ int clone_repository(const char *repo_owner, const char *repo_name,
     const git_error *e = git_error_last();
     log_message(issue_number, "Error cloning repository: %s", e->message);
     git_libgit2_shutdown();
+    TRACE3(git__done, issue_number, "clone", -1);
     return -1;
   }
 
   git_repository_free(repo);
   git_libgit2_shutdown();
+  TRACE3(git__done, issue_number, "clone", 0);
   return 0;
 }
 
 // Function to create and checkout a new branch
 int create_and_checkout_branch(const char *branch_name, const char *local_path,
                                int issue_number) {
+  TRACE2(git__start, issue_number, "branch");
   git_libgit2_init();
 
   git_repository *repo = NULL;
@@ -406,6 +492,7 @@ cleanup:
   if (repo)
     git_repository_free(repo);
   git_libgit2_shutdown();
+  TRACE3(git__done, issue_number, "branch", error);
 
   if (error != 0) {
     return -1;
@@ -414,8 +501,22 @@ cleanup:
   return 0;
 }
 
+// Free the path list filled in by apply_code_changes
+static void free_touched_paths(git_strarray *paths) {
+  for (size_t i = 0; i < paths->count; i++) {
+    free(paths->strings[i]);
+  }
+  free(paths->strings);
+  paths->strings = NULL;
+  paths->count = 0;
+}
+
+// Function to apply the AI's changes. The paths written, relative to the
+// workspace, are returned in touched for the commit step to stage.
 int apply_code_changes(const char *local_path, const char *ai_response,
-                       int issue_number) {
+                       git_strarray *touched, int issue_number) {
+  touched->strings = NULL;
+  touched->count = 0;
   // Parse AI response and apply changes
   cJSON *json = cJSON_Parse(ai_response);
   if (!json) {
@@ -431,6 +532,14 @@ int apply_code_changes(const char *local_path, const char *ai_response,
     return -1;
   }
 
+  // Collect the changes, then validate and write them as one batch
+  int count = cJSON_GetArraySize(changes);
+  struct file_change *batch = calloc((size_t)count + 1, sizeof(*batch));
+  if (!batch) {
+    cJSON_Delete(json);
+    return -1;
+  }
+  int batched = 0;
   cJSON *change = NULL;
   cJSON_ArrayForEach(change, changes) {
     cJSON *file_item = cJSON_GetObjectItem(change, "file");
@@ -440,70 +549,61 @@ int apply_code_changes(const char *local_path, const char *ai_response,
       log_message(issue_number, "Invalid change format in AI response");
       continue;
     }
+    batch[batched].path = file_item->valuestring;
+    batch[batched].content = content_item->valuestring;
+    batch[batched].length = strlen(content_item->valuestring);
+    batched++;
+  }
 
-    const char *file_path = file_item->valuestring;
-    const char *file_content = content_item->valuestring;
-
-    // Construct the full path to the file
-    char full_file_path[512];
-    snprintf(full_file_path, sizeof(full_file_path), "%s/%s", local_path,
-             file_path);
-
-    // Ensure the file path is within the local_path directory to prevent
-    // directory traversal attacks
-    char resolved_local_path[PATH_MAX];
-    char resolved_full_file_path[PATH_MAX];
-    realpath(local_path, resolved_local_path);
-    realpath(full_file_path, resolved_full_file_path);
-
-    if (strstr(resolved_full_file_path, resolved_local_path) !=
-        resolved_full_file_path) {
+  int result = file_apply_batch(local_path, batch, batched);
+  for (int i = 0; i < batched; i++) {
+    if (batch[i].error == 0 && result == 0) {
+      log_message(issue_number, "Applied changes to file: %s", batch[i].path);
+    } else if (batch[i].error == EINVAL) {
       log_message(issue_number, "Invalid file path in AI response: %s",
-                  full_file_path);
-      continue;
+                  batch[i].path);
+    } else if (batch[i].error != 0) {
+      log_message(issue_number, "Failed to write %s: %s", batch[i].path,
+                  strerror(batch[i].error));
     }
-
-    // Create directories if necessary
-    char dir_path[512];
-    strncpy(dir_path, full_file_path, sizeof(dir_path));
-    dir_path[sizeof(dir_path) - 1] = '\0';
-    char *last_slash = strrchr(dir_path, '/');
-    if (last_slash) {
-      *last_slash = '\0';
-      struct stat st = {0};
-      if (stat(dir_path, &st) == -1) {
-        if (mkdir(dir_path, 0755) != 0 && errno != EEXIST) {
-          log_message(issue_number, "Failed to create directory: %s", dir_path);
-          continue;
-        }
+  }
+  if (result != 0) {
+    log_message(issue_number, "Failed to apply changes to %s", local_path);
+  } else if (batched > 0) {
+    touched->strings = calloc((size_t)batched, sizeof(char *));
+    for (int i = 0; touched->strings && i < batched; i++) {
+      char path[PATH_MAX];
+      file_path_normalise(batch[i].path, path, sizeof(path));
+      touched->strings[i] = strdup(path);
+      if (!touched->strings[i]) {
+        result = -1;
+        break;
       }
+      touched->count++;
     }
-
-    // Write content to the file
-    FILE *file = fopen(full_file_path, "w");
-    if (!file) {
-      log_message(issue_number, "Failed to open file for writing: %s",
-                  full_file_path);
-      continue;
+    if (!touched->strings || result != 0) {
+      log_message(issue_number, "Out of memory listing applied changes");
+      free_touched_paths(touched);
+      result = -1;
     }
-
-    if (fprintf(file, "%s", file_content) < 0) {
-      log_message(issue_number, "Failed to write content to file: %s",
-                  full_file_path);
-      fclose(file);
-      continue;
-    }
-
-    fclose(file);
-    log_message(issue_number, "Applied changes to file: %s", full_file_path);
   }
 
+  free(batch);
   cJSON_Delete(json);
-  return 0;
+  return result;
 }
-// Function to commit and push changes to GitHub
+
+// Function to commit and push changes to GitHub. Only the given paths are
+// staged, so the working tree is never scanned.
 int commit_and_push_changes(const char *local_path, const char *branch_name,
-                            const char *commit_message, int issue_number) {
+                            const char *commit_message,
+                            const git_strarray *paths, int issue_number) {
+  if (paths->count == 0) {
+    log_message(issue_number, "No changes to commit");
+    return -1;
+  }
+
+  TRACE2(git__start, issue_number, "commit");
   git_libgit2_init();
 
   git_repository *repo = NULL;
@@ -512,7 +612,7 @@ int commit_and_push_changes(const char *local_path, const char *branch_name,
   git_tree *tree = NULL;
   git_signature *signature = NULL;
   git_commit *parent_commit = NULL;
-  git_remote *remote = NULL;
+  int committed = 0;
 
   int error = git_repository_open(&repo, local_path);
   if (error != 0) {
@@ -535,11 +635,13 @@ int commit_and_push_changes(const char *local_path, const char *branch_name,
     goto cleanup;
   }
 
-  error = git_index_add_all(index, NULL, GIT_INDEX_ADD_DEFAULT, NULL, NULL);
-  if (error != 0) {
-    log_message(issue_number, "Error adding files to index: %s",
-                git_error_last()->message);
-    goto cleanup;
+  for (size_t i = 0; i < paths->count; i++) {
+    error = git_index_add_bypath(index, paths->strings[i]);
+    if (error != 0) {
+      log_message(issue_number, "Error adding %s to index: %s",
+                  paths->strings[i], git_error_last()->message);
+      goto cleanup;
+    }
   }
 
   error = git_index_write(index);
@@ -589,39 +691,25 @@ int commit_and_push_changes(const char *local_path, const char *branch_name,
     goto cleanup;
   }
 
-  // Set up remote
-  error = git_remote_lookup(&remote, repo, "origin");
-  if (error != 0) {
-    log_message(issue_number, "Error looking up remote: %s",
-                git_error_last()->message);
-    goto cleanup;
-  }
-
-  // Set up push options
-  git_push_options push_opts;
-  git_push_options_init(&push_opts, GIT_PUSH_OPTIONS_VERSION);
-
-  // Push the branch
-  git_strarray refspecs = {0};
-  char *refspec = NULL;
-  refspec = malloc(256 * sizeof(char));
-  if (refspec == NULL) {
-    log_message(issue_number, "Failed to allocate memory for refspec");
-    goto cleanup;
-  }
-  snprintf(refspec, 256, "refs/heads/%s", branch_name);
-  refspecs.strings = &refspec;
-  refspecs.count = 1;
+  committed = 1;
+  TRACE3(git__done, issue_number, "commit", 0);
 
-  error = git_remote_push(remote, &refspecs, &push_opts);
-  free(refspec);
+  // Push the branch, together with any other branches of this repository
+  // finishing at the same time
+  char push_error[256];
+  TRACE2(git__start, issue_number, "push");
+  error = push_batch_run(repo, branch_name, &commit_oid, push_error,
+                         sizeof(push_error));
+  TRACE3(git__done, issue_number, "push", error);
   if (error != 0) {
-    log_message(issue_number, "Error pushing to remote: %s",
-                git_error_last()->message);
+    log_message(issue_number, "Error pushing to remote: %s", push_error);
     goto cleanup;
   }
 
 cleanup:
+  if (!committed) {
+    TRACE3(git__done, issue_number, "commit", error);
+  }
   if (index)
     git_index_free(index);
   if (tree)
@@ -632,8 +720,6 @@ cleanup:
     git_commit_free(parent_commit);
   if (head_ref)
     git_reference_free(head_ref);
-  if (remote)
-    git_remote_free(remote);
   if (repo)
     git_repository_free(repo);
   git_libgit2_shutdown();
@@ -649,146 +735,266 @@ cleanup:
 int create_pull_request(const char *repo_owner, const char *repo_name,
                         int issue_number, const char *branch_name,
                         const char *pr_title, const char *pr_body) {
-  CURL *curl;
-  CURLcode res;
-  struct curl_slist *headers = NULL;
-  char url[256];
-  char data[MAX_BUFFER_SIZE];
-  struct MemoryStruct chunk;
-
-  snprintf(url, sizeof(url), "https://api.github.com/repos/%s/%s/pulls",
-           repo_owner, repo_name);
-
-  snprintf(data, sizeof(data),
-           "{\"title\": \"%s\", \"head\": \"%s\", \"base\": \"master\", "
-           "\"body\": \"%s\"}",
-           pr_title, branch_name, pr_body);
-
-  chunk.memory = malloc(1); // Will be grown as needed by realloc
-  chunk.size = 0;           // No data at this point
-
-  curl_global_init(CURL_GLOBAL_DEFAULT);
-  curl = curl_easy_init();
-  if (curl) {
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    char auth_header[256];
-    snprintf(auth_header, sizeof(auth_header), "Authorization: token %s",
-             GITHUB_TOKEN);
-    headers = curl_slist_append(headers, auth_header);
-    headers = curl_slist_append(headers, "User-Agent: Automated Bot");
-
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
-
-    // Set up response handling
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-
-    res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-      log_message(issue_number, "Error creating PR: %s",
-                  curl_easy_strerror(res));
-      free(chunk.memory);
-      curl_easy_cleanup(curl);
-      curl_global_cleanup();
-      return -1;
-    }
+  char base[256];
+  if (github_default_branch(repo_owner, repo_name, base, sizeof(base)) != 0) {
+    log_message(issue_number, "Failed to look up the default branch");
+    return -1;
+  }
 
-    // Optionally, parse the response and log PR URL
-    cJSON *json = cJSON_Parse(chunk.memory);
-    if (json) {
-      cJSON *html_url = cJSON_GetObjectItem(json, "html_url");
-      if (html_url && cJSON_IsString(html_url)) {
-        log_message(issue_number, "Pull Request created: %s",
-                    html_url->valuestring);
-      }
-      cJSON_Delete(json);
-    }
+  struct json_builder body;
+  json_builder_init(&body);
+  json_object_begin(&body, NULL);
+  json_add_string(&body, "title", pr_title);
+  json_add_string(&body, "head", branch_name);
+  json_add_string(&body, "base", base);
+  json_add_string(&body, "body", pr_body);
+  json_object_end(&body);
+  size_t data_len = body.len;
+  char *data = json_builder_finish(&body);
+  if (!data) {
+    log_message(issue_number, "Failed to build pull request body");
+    return -1;
+  }
 
-    free(chunk.memory);
-    curl_easy_cleanup(curl);
+  char path[256];
+  snprintf(path, sizeof(path), "/repos/%s/%s/pulls", repo_owner, repo_name);
+  long status = 0;
+  char *response = NULL;
+  int result = github_request("POST", path, data, data_len, &status, &response);
+  free(data);
+  if (result != 0) {
+    log_message(issue_number, "Error creating PR: request failed");
+    return -1;
   }
-  curl_global_cleanup();
 
+  cJSON *json = cJSON_Parse(response);
+  free(response);
+  cJSON *item = json ? cJSON_GetObjectItem(json, "html_url") : NULL;
+  if (status == 201 && cJSON_IsString(item)) {
+    log_message(issue_number, "Pull Request created: %s", item->valuestring);
+  } else {
+    item = json ? cJSON_GetObjectItem(json, "message") : NULL;
+    log_message(issue_number, "Error creating PR: HTTP %ld %s", status,
+                cJSON_IsString(item) ? item->valuestring : "");
+    result = -1;
+  }
+  cJSON_Delete(json);
+  return result;
+}
+
+// Function to pack a stage prompt into the model's token budget and send it,
+// through a validator if one is given. Returns the completion text, which
+// the caller frees, or NULL on failure.
+static char *checked_stage_completion(const char *stage, const char *template,
+                                      const char *content,
+                                      struct output_validator *validator,
+                                      int issue_number) {
+  int max_tokens = 0;
+  char *prompt = prompt_pack(stage, AI_MODEL, template, content, &max_tokens);
+  if (!prompt) {
+    return NULL;
+  }
+  char *text =
+      request_completion(stage, prompt, max_tokens, validator, issue_number);
+  free(prompt);
+  return text;
+}
+
+char *stage_completion(const char *stage, const char *template,
+                       const char *content, int issue_number) {
+  return checked_stage_completion(stage, template, content, NULL,
+                                  issue_number);
+}
+
+// Function to send a stage prompt and copy the completion into response
+int send_stage_prompt(const char *stage, const char *template,
+                      const char *content, char *response, int issue_number) {
+  char *text = stage_completion(stage, template, content, issue_number);
+  if (!text) {
+    return -1;
+  }
+  strncpy(response, text, MAX_BUFFER_SIZE - 1);
+  response[MAX_BUFFER_SIZE - 1] = '\0';
+  free(text);
   return 0;
 }
 
+// Put the repository digest, if there is one, ahead of a stage's content.
+// Returns a copy the caller frees, or NULL if out of memory.
+static char *with_digest(const char *digest, const char *content) {
+  if (!digest || digest[0] == '\0') {
+    return strdup(content);
+  }
+  size_t size = strlen(digest) + strlen(content) + 32;
+  char *combined = malloc(size);
+  if (combined) {
+    snprintf(combined, size, "Repository digest:\n%s\n%s", digest, content);
+  }
+  return combined;
+}
+
+// What the leader of an analysis batch passes to send_batch_analysis
+struct batch_leader {
+  const char *digest;
+  int issue_number;
+};
+
+// Function to send issues batched by analysis_batch_run in one request.
+// Every issue of a batch is in the same repository, so the leader's digest
+// goes ahead of them once. The request is traced as the leader's.
+char *send_batch_analysis(const char *content, void *arg) {
+  const struct batch_leader *leader = arg;
+  char *combined = with_digest(leader->digest, content);
+  if (!combined) {
+    return NULL;
+  }
+  char *text = stage_completion("analyze_batch", BATCH_ANALYZE_PROMPT_TEMPLATE,
+                                combined, leader->issue_number);
+  free(combined);
+  return text;
+}
+
 // Implement the AI interaction functions
 int analyze_issue(const char *repo_owner, const char *repo_name,
-                  int issue_number, const char *issue_body, char *response) {
-  (void)repo_owner; // Suppress unused parameter warning
-  (void)repo_name;  // Suppress unused parameter warning
-  char prompt[MAX_BUFFER_SIZE];
-  snprintf(prompt, sizeof(prompt), ANALYZE_PROMPT_TEMPLATE, issue_body);
+                  int issue_number, const char *issue_body,
+                  const char *digest, long long queue_wait_ms,
+                  char *response) {
+  // Small issues that waited in a backlog share a request with others of
+  // the same repository
+  if (BATCH_ANALYZE_PROMPT_TEMPLATE[0] != '\0') {
+    char repo_full_name[256];
+    snprintf(repo_full_name, sizeof(repo_full_name), "%s/%s", repo_owner,
+             repo_name);
+    struct batch_leader leader = {digest, issue_number};
+    int batched = analysis_batch_run(repo_full_name, issue_number, issue_body,
+                                     queue_wait_ms, send_batch_analysis,
+                                     &leader, response, MAX_BUFFER_SIZE);
+    if (batched == 0) {
+      log_message(issue_number, "Received batched AI issue analysis.");
+      return 0;
+    } else if (batched < 0) {
+      log_message(issue_number, "Failed to send batched AI issue analysis.");
+      return -1;
+    }
+  }
 
-  if (send_ai_request(prompt, response) != 0) {
+  char *content = with_digest(digest, issue_body);
+  if (!content || send_stage_prompt("analyze", ANALYZE_PROMPT_TEMPLATE,
+                                    content, response, issue_number) != 0) {
     log_message(issue_number, "Failed to send AI request for issue analysis.");
+    free(content);
     return -1;
   }
+  free(content);
 
   log_message(issue_number, "Received AI response for issue analysis.");
   return 0;
 }
 
+// The later stages fill their template with the previous stage's response.
+// The implementation holds whole files, more than a response buffer, so it
+// is handed back in *implementation for the caller to free.
 int implement_issue(const char *repo_owner, const char *repo_name,
-                    int issue_number, const char *branch_name, char *response) {
-  char prompt[MAX_BUFFER_SIZE];
-  snprintf(prompt, sizeof(prompt), IMPLEMENT_PROMPT_TEMPLATE, repo_owner,
-           repo_name, branch_name);
-
-  if (send_ai_request(prompt, response) != 0) {
+                    int issue_number, const char *branch_name,
+                    const char *digest, const char *analysis,
+                    char **implementation) {
+  (void)repo_owner;  // Suppress unused parameter warning
+  (void)repo_name;   // Suppress unused parameter warning
+  (void)branch_name; // Suppress unused parameter warning
+  *implementation = NULL;
+  char *content = with_digest(digest, analysis);
+  if (!content) {
     log_message(issue_number, "Failed to send AI request for implementation.");
     return -1;
   }
 
-  log_message(issue_number, "Received AI response for implementation.");
-  return 0;
-}
-
-int review_changes(const char *repo_owner, const char *repo_name,
-                   int issue_number, const char *branch_name, char *response) {
-  char prompt[MAX_BUFFER_SIZE];
-  snprintf(prompt, sizeof(prompt), REVIEW_PROMPT_TEMPLATE, repo_owner,
-           repo_name, branch_name);
-
-  if (send_ai_request(prompt, response) != 0) {
-    log_message(issue_number, "Failed to send AI request for review.");
+  // The answer is checked while it streams in. A rejected one is cut off
+  // and asked for again, with the reason added to the prompt.
+  struct output_validator *validator =
+      validator_enabled() ? validator_create() : NULL;
+  char *corrected = NULL;
+  char *text = NULL;
+  for (int attempt = 0;; attempt++) {
+    text = checked_stage_completion("implement", IMPLEMENT_PROMPT_TEMPLATE,
+                                    corrected ? corrected : content,
+                                    validator, issue_number);
+    if (!validator || (text && validator_finish(validator) == 0)) {
+      break;
+    }
+    free(text);
+    text = NULL;
+    const char *error = validator_error(validator);
+    if (!error) {
+      break; // The request failed, not the answer
+    }
+    log_message(issue_number, "Implementation rejected: %s", error);
+    metrics_counter_add("cis_implement_rejected_total", 1);
+    if (attempt >= validator_retries()) {
+      break;
+    }
+    size_t size = strlen(content) + strlen(error) + 256;
+    free(corrected);
+    corrected = malloc(size);
+    if (!corrected) {
+      break;
+    }
+    snprintf(corrected, size,
+             "%s\n\nA previous answer was rejected: %s. Answer with only "
+             "the JSON object, a \"changes\" array of objects with \"file\" "
+             "and \"content\".",
+             content, error);
+    metrics_counter_add("cis_implement_corrective_retries_total", 1);
+  }
+  validator_free(validator);
+  free(corrected);
+  free(content);
+  if (!text) {
+    log_message(issue_number, "Failed to send AI request for implementation.");
     return -1;
   }
+  *implementation = text;
 
-  log_message(issue_number, "Received AI response for review.");
+  log_message(issue_number, "Received AI response for implementation.");
   return 0;
 }
 
-int final_review(const char *repo_owner, const char *repo_name,
-                 int issue_number, const char *branch_name, char *response) {
-  char prompt[MAX_BUFFER_SIZE];
-  snprintf(prompt, sizeof(prompt), FINAL_REVIEW_PROMPT_TEMPLATE, repo_owner,
-           repo_name, branch_name);
-
-  if (send_ai_request(prompt, response) != 0) {
-    log_message(issue_number, "Failed to send AI request for final review.");
+// Reviews all read the implementation and run in parallel; the phase fails
+// unless the merged verdict approves the changes
+int review_implementation(int issue_number, const char *implementation) {
+  char *merged = NULL;
+  int verdict =
+      review_run(implementation, issue_number, stage_completion, &merged);
+  log_message(issue_number, "Review Response: %s",
+              merged ? merged : "(no review text)");
+  free(merged);
+  if (verdict < 0) {
+    log_message(issue_number, "Failed to send AI requests for review.");
+    return -1;
+  } else if (verdict == 0) {
+    log_message(issue_number, "Changes were not approved by review.");
     return -1;
   }
 
-  log_message(issue_number, "Received AI response for final review.");
+  log_message(issue_number, "Changes approved by review.");
   return 0;
 }
 
 int create_pr(const char *repo_owner, const char *repo_name, int issue_number,
-              const char *branch_name, char *response) {
+              const char *branch_name, const char *implementation,
+              char *response) {
+  (void)repo_owner;  // Suppress unused parameter warning
+  (void)repo_name;   // Suppress unused parameter warning
+  (void)branch_name; // Suppress unused parameter warning
   char pr_title[256];
   char pr_body[1024];
   // Extract pr_title and pr_body from the AI response
   // This is a placeholder, you should implement proper parsing of the AI
   // response
-  sscanf(response, "Title: %255[^\n]\nBody: %1023[^\n]", pr_title, pr_body);
-  char prompt[MAX_BUFFER_SIZE];
-  snprintf(prompt, sizeof(prompt), PR_PROMPT_TEMPLATE, repo_owner, repo_name,
-           branch_name);
+  sscanf(implementation, "Title: %255[^\n]\nBody: %1023[^\n]", pr_title,
+         pr_body);
 
-  if (send_ai_request(prompt, response) != 0) {
+  if (send_stage_prompt("create_pr", PR_PROMPT_TEMPLATE, implementation,
+                        response, issue_number) != 0) {
     log_message(issue_number, "Failed to send AI request for PR creation.");
     return -1;
   }
@@ -815,8 +1021,10 @@ int mock_create_and_checkout_branch(const char *branch_name,
 
 // Mock function to simulate applying code changes
 int mock_apply_code_changes(const char *local_path, const char *ai_response,
-                            int issue_number) {
+                            git_strarray *touched, int issue_number) {
   (void)ai_response; // Suppress unused parameter warning
+  touched->strings = NULL;
+  touched->count = 0;
   log_message(issue_number,
               "Mocking: Applied code changes based on AI response in %s",
               local_path);
@@ -826,12 +1034,13 @@ int mock_apply_code_changes(const char *local_path, const char *ai_response,
 // Mock function to simulate committing and pushing changes
 int mock_commit_and_push_changes(const char *local_path,
                                  const char *branch_name,
-                                 const char *commit_message, int issue_number) {
+                                 const char *commit_message,
+                                 const git_strarray *paths, int issue_number) {
   (void)local_path; // Suppress unused parameter warning
-  log_message(
-      issue_number,
-      "Mocking: Committed and pushed changes to branch %s with message: %s",
-      branch_name, commit_message);
+  log_message(issue_number,
+              "Mocking: Committed and pushed %zu changed files to branch %s "
+              "with message: %s",
+              paths->count, branch_name, commit_message);
   return 0;
 }
 
@@ -847,10 +1056,41 @@ int mock_create_pull_request(const char *repo_owner, const char *repo_name,
   return 0;
 }
 
+// Function to stop an issue between pipeline steps once the drain deadline
+// has passed. Nothing has been pushed yet, so the issue starts over from
+// the queue and its workspace is dropped.
+static int checkpoint(const char *local_repo_path, int issue_number) {
+  if (!drain_expired()) {
+    return 0;
+  }
+  log_message(issue_number, "Shutting down, stopping before the next step.");
+  workspace_discard(local_repo_path);
+  return 1;
+}
+
+// Function to mark the start of a pipeline stage
+static long long stage_start(const char *stage, int issue_number) {
+  TRACE2(stage__start, issue_number, stage);
+  return now_ms();
+}
+
+// Function to record how long a pipeline stage took
+static void stage_done(const char *stage, int issue_number,
+                       long long started_ms) {
+  TRACE2(stage__done, issue_number, stage);
+  char metric[96];
+  snprintf(metric, sizeof(metric), "cis_stage_ms_total{stage=\"%s\"}",
+           stage);
+  metrics_counter_add(metric, now_ms() - started_ms);
+  snprintf(metric, sizeof(metric), "cis_stage_runs_total{stage=\"%s\"}",
+           stage);
+  metrics_counter_add(metric, 1);
+}
+
 // Main processing function
 int process_issue(const char *repo_owner, const char *repo_name,
                   int issue_number, const char *issue_title,
-                  const char *issue_body) {
+                  struct queued_issue *issue) {
   char response[MAX_BUFFER_SIZE];
   char local_repo_path[256];
   char branch_name[64];
@@ -858,90 +1098,156 @@ int process_issue(const char *repo_owner, const char *repo_name,
   syslog(LOG_INFO, "Processing issue #%d for %s/%s", issue_number, repo_owner,
          repo_name);
 
-  snprintf(local_repo_path, sizeof(local_repo_path), "/tmp/%s_%s_%d",
-           repo_owner, repo_name, issue_number);
+  workspace_path(local_repo_path, sizeof(local_repo_path), repo_owner,
+                 repo_name, issue_number);
   snprintf(branch_name, sizeof(branch_name), "issue_%d_fix", issue_number);
 
-  // Mock: Clone the repository
-  if (mock_clone_repository(repo_owner, repo_name, local_repo_path,
-                            issue_number) != 0) {
-    log_message(issue_number, "Failed to mock clone repository.");
+  // Clone the repository
+  long long started = stage_start("clone", issue_number);
+  if ((DRY_RUN ? mock_clone_repository(repo_owner, repo_name,
+                                       local_repo_path, issue_number)
+               : clone_repository(repo_owner, repo_name, local_repo_path,
+                                  issue_number)) != 0) {
+    log_message(issue_number, "Failed to clone repository.");
     return -1;
   }
 
-  // Mock: Create and checkout a new branch
-  if (mock_create_and_checkout_branch(branch_name, local_repo_path,
-                                      issue_number) != 0) {
-    log_message(issue_number, "Failed to mock create and checkout branch.");
+  // Create and checkout a new branch
+  if ((DRY_RUN ? mock_create_and_checkout_branch(branch_name, local_repo_path,
+                                                 issue_number)
+               : create_and_checkout_branch(branch_name, local_repo_path,
+                                            issue_number)) != 0) {
+    log_message(issue_number, "Failed to create and checkout branch.");
+    workspace_discard(local_repo_path);
     return -1;
   }
+  stage_done("clone", issue_number, started);
+
+  if (checkpoint(local_repo_path, issue_number)) {
+    return ISSUE_RELEASED;
+  }
 
-  // Step 1: Analyze issue
-  if (analyze_issue(repo_owner, repo_name, issue_number, issue_body,
-                    response) != 0) {
+  // Step 1: Analyze issue. The body is only fetched now that it is needed.
+  const char *issue_body = queued_issue_body(issue);
+  if (!issue_body) {
+    log_message(issue_number, "Failed to load issue body.");
+    workspace_discard(local_repo_path);
+    return -1;
+  }
+  long long queue_wait_ms = wall_ms() - issue->record.enqueued_ms;
+  // What the model is told about the repository, cached by HEAD commit
+  char repo_full_name[256];
+  snprintf(repo_full_name, sizeof(repo_full_name), "%s/%s", repo_owner,
+           repo_name);
+  started = stage_start("analyze", issue_number);
+  char *digest = repo_digest_get(repo_full_name, local_repo_path);
+  if (analyze_issue(repo_owner, repo_name, issue_number, issue_body, digest,
+                    queue_wait_ms, response) != 0) {
     log_message(issue_number, "Failed to analyze issue.");
+    free(digest);
+    workspace_discard(local_repo_path);
     return -1;
   }
+  stage_done("analyze", issue_number, started);
   log_message(issue_number, "Issue Analysis Response: %s", response);
-
-  // Step 2: Implement changes
-  if (implement_issue(repo_owner, repo_name, issue_number, branch_name,
-                      response) != 0) {
+  if (checkpoint(local_repo_path, issue_number)) {
+    free(digest);
+    return ISSUE_RELEASED;
+  }
+
+  // Step 2: Implement changes. The implementation is carried on the heap
+  // through apply, review and the PR prompt.
+  started = stage_start("implement", issue_number);
+  char *implementation = NULL;
+  int implemented = implement_issue(repo_owner, repo_name, issue_number,
+                                    branch_name, digest, response,
+                                    &implementation);
+  free(digest);
+  if (implemented != 0) {
     log_message(issue_number, "Failed to implement changes.");
+    workspace_discard(local_repo_path);
     return -1;
   }
-  log_message(issue_number, "Implementation Response: %s", response);
-
-  // Mock: Apply code changes based on AI response
-  if (mock_apply_code_changes(local_repo_path, response, issue_number) != 0) {
-    log_message(issue_number, "Failed to mock apply code changes.");
+  stage_done("implement", issue_number, started);
+  log_message(issue_number, "Implementation Response: %s", implementation);
+
+  // Apply code changes based on AI response
+  started = stage_start("apply", issue_number);
+  git_strarray touched;
+  if ((DRY_RUN ? mock_apply_code_changes(local_repo_path, implementation,
+                                         &touched, issue_number)
+               : apply_code_changes(local_repo_path, implementation, &touched,
+                                    issue_number)) != 0) {
+    log_message(issue_number, "Failed to apply code changes.");
+    free(implementation);
+    workspace_discard(local_repo_path);
     return -1;
   }
+  stage_done("apply", issue_number, started);
 
-  // Step 3: Review changes
-  if (review_changes(repo_owner, repo_name, issue_number, branch_name,
-                     response) != 0) {
+  // Step 3: Review changes. Style, correctness and the final go/no-go are
+  // asked in parallel.
+  started = stage_start("review", issue_number);
+  if (review_implementation(issue_number, implementation) != 0) {
     log_message(issue_number, "Failed to review changes.");
+    free(implementation);
+    free_touched_paths(&touched);
+    workspace_discard(local_repo_path);
     return -1;
   }
-  log_message(issue_number, "Review Response: %s", response);
-
-  // Step 4: Final review
-  if (final_review(repo_owner, repo_name, issue_number, branch_name,
-                   response) != 0) {
-    log_message(issue_number, "Failed to perform final review.");
-    return -1;
-  }
-  log_message(issue_number, "Final Review Response: %s", response);
-
-  // Mock: Commit and push changes
-  if (mock_commit_and_push_changes(local_repo_path, branch_name,
-                                   "Automated fix for issue",
-                                   issue_number) != 0) {
-    log_message(issue_number, "Failed to mock commit and push changes.");
+  stage_done("review", issue_number, started);
+  if (checkpoint(local_repo_path, issue_number)) {
+    free(implementation);
+    free_touched_paths(&touched);
+    return ISSUE_RELEASED;
+  }
+
+  // Commit and push changes; only the applied paths are staged
+  started = stage_start("push", issue_number);
+  int committed =
+      DRY_RUN ? mock_commit_and_push_changes(local_repo_path, branch_name,
+                                             "Automated fix for issue",
+                                             &touched, issue_number)
+              : commit_and_push_changes(local_repo_path, branch_name,
+                                        "Automated fix for issue", &touched,
+                                        issue_number);
+  free_touched_paths(&touched);
+  if (committed != 0) {
+    log_message(issue_number, "Failed to commit and push changes.");
+    free(implementation);
+    workspace_discard(local_repo_path);
     return -1;
   }
+  stage_done("push", issue_number, started);
 
-  // Step 5: Create PR
-  if (create_pr(repo_owner, repo_name, issue_number, branch_name, response) !=
-      0) {
+  // Step 4: Create PR
+  started = stage_start("pull_request", issue_number);
+  int prepared = create_pr(repo_owner, repo_name, issue_number, branch_name,
+                           implementation, response);
+  free(implementation);
+  if (prepared != 0) {
     log_message(issue_number, "Failed to create PR.");
+    workspace_discard(local_repo_path);
     return -1;
   }
   log_message(issue_number, "PR Creation Response: %s", response);
 
-  // Mock: Create PR via GitHub API
-  if (mock_create_pull_request(repo_owner, repo_name, issue_number, branch_name,
-                               issue_title,
-                               "Automated PR for issue fix") != 0) {
-    log_message(issue_number, "Failed to mock create pull request.");
+  // Create PR via GitHub API
+  if ((DRY_RUN ? mock_create_pull_request(repo_owner, repo_name, issue_number,
+                                          branch_name, issue_title,
+                                          "Automated PR for issue fix")
+               : create_pull_request(repo_owner, repo_name, issue_number,
+                                     branch_name, issue_title,
+                                     "Automated PR for issue fix")) != 0) {
+    log_message(issue_number, "Failed to create pull request.");
+    workspace_discard(local_repo_path);
     return -1;
   }
+  stage_done("pull_request", issue_number, started);
 
-  // Clean up local repository
-  char remove_cmd[512];
-  snprintf(remove_cmd, sizeof(remove_cmd), "rm -rf %s", local_repo_path);
-  if (system(remove_cmd) != 0) {
+  // Clean up local repository; it is moved to the trash at once and
+  // deleted in the background
+  if (workspace_discard(local_repo_path) != 0) {
     log_message(issue_number, "Failed to clean up local repository.");
     return -1;
   }
@@ -950,6 +1256,132 @@ int process_issue(const char *repo_owner, const char *repo_name,
   return 0;
 }
 
+// Per-request state kept in *con_cls while a webhook body arrives
+struct upload {
+  char *data;
+  size_t length;
+  int too_large;
+};
+
+// Function to queue a plain-text response, with a Retry-After header when
+// retry_after is non-zero
+static enum MHD_Result send_text(struct MHD_Connection *connection,
+                                 unsigned int status, const char *text,
+                                 int retry_after) {
+  struct MHD_Response *mhd_response = MHD_create_response_from_buffer(
+      strlen(text), (void *)text, MHD_RESPMEM_PERSISTENT);
+  if (retry_after > 0) {
+    char seconds[16];
+    snprintf(seconds, sizeof(seconds), "%d", retry_after);
+    MHD_add_response_header(mhd_response, MHD_HTTP_HEADER_RETRY_AFTER,
+                            seconds);
+  }
+  enum MHD_Result ret = MHD_queue_response(connection, status, mhd_response);
+  MHD_destroy_response(mhd_response);
+  return ret;
+}
+
+// Function to free a request's upload state once MHD is done with it
+static void request_completed(void *cls, struct MHD_Connection *connection,
+                              void **con_cls,
+                              enum MHD_RequestTerminationCode toe) {
+  (void)cls;
+  (void)connection;
+  (void)toe;
+  struct upload *upload = *con_cls;
+  if (upload) {
+    free(upload->data);
+    free(upload);
+    *con_cls = NULL;
+  }
+}
+
+// Function to enqueue a fully received webhook payload
+static enum MHD_Result handle_webhook(struct MHD_Connection *connection,
+                                      redisContext *redis_ctx,
+                                      const char *payload) {
+  cJSON *json = cJSON_Parse(payload);
+  if (!json) {
+    syslog(LOG_ERR, "Failed to parse webhook payload");
+    return send_text(connection, MHD_HTTP_BAD_REQUEST, "Invalid JSON", 0);
+  }
+
+  // Extract necessary data from the webhook payload
+  cJSON *issue = cJSON_GetObjectItem(json, "issue");
+  cJSON *repository = cJSON_GetObjectItem(json, "repository");
+
+  if (!issue || !repository) {
+    syslog(LOG_ERR, "Invalid webhook payload");
+    cJSON_Delete(json);
+    return send_text(connection, MHD_HTTP_BAD_REQUEST, "Invalid payload", 0);
+  }
+
+  cJSON *issue_number_item = cJSON_GetObjectItem(issue, "number");
+  cJSON *issue_title_item = cJSON_GetObjectItem(issue, "title");
+  cJSON *issue_body_item = cJSON_GetObjectItem(issue, "body");
+  cJSON *repo_full_name_item = cJSON_GetObjectItem(repository, "full_name");
+
+  if (!issue_number_item || !issue_title_item || !issue_body_item ||
+      !repo_full_name_item) {
+    syslog(LOG_ERR, "Incomplete webhook data");
+    cJSON_Delete(json);
+    return send_text(connection, MHD_HTTP_BAD_REQUEST, "Incomplete data", 0);
+  }
+
+  // Throttle per repository before the delivery is marked as seen, so the
+  // sender's retry is not dropped as a duplicate
+  int retry_after = 0;
+  if (admission_check_repo(repo_full_name_item->valuestring, &retry_after) !=
+      ADMISSION_OK) {
+    syslog(LOG_WARNING, "Throttling deliveries for %s",
+           repo_full_name_item->valuestring);
+    cJSON_Delete(json);
+    return send_text(connection, MHD_HTTP_TOO_MANY_REQUESTS,
+                     "Too many requests for this repository", retry_after);
+  }
+
+  // Route the issue to a priority class based on its labels
+  const char *labels[32];
+  int label_count = 0;
+  cJSON *label = NULL;
+  cJSON_ArrayForEach(label, cJSON_GetObjectItem(issue, "labels")) {
+    cJSON *label_name = cJSON_GetObjectItem(label, "name");
+    if (cJSON_IsString(label_name) && label_count < 32) {
+      labels[label_count++] = label_name->valuestring;
+    }
+  }
+  const char *priority_class = priority_class_for_labels(labels, label_count);
+
+  // GitHub sends a null body for issues opened without a description
+  const char *issue_body =
+      cJSON_IsString(issue_body_item) ? issue_body_item->valuestring : "";
+
+  // GitHub retries deliveries; only enqueue each delivery id once
+  const char *delivery_id = MHD_lookup_connection_value(
+      connection, MHD_HEADER_KIND, "X-GitHub-Delivery");
+  if (mark_delivery_seen(redis_ctx, delivery_id) == 0) {
+    syslog(LOG_INFO, "Ignoring duplicate delivery %s", delivery_id);
+    cJSON_Delete(json);
+    return send_text(connection, MHD_HTTP_OK, "Duplicate delivery", 0);
+  }
+
+  // Enqueue the issue in Redis
+  int queued = enqueue_issue(redis_ctx, repo_full_name_item->valuestring,
+                             issue_number_item->valueint, priority_class,
+                             issue_title_item->valuestring, issue_body);
+  cJSON_Delete(json);
+  if (queued < 0) {
+    syslog(LOG_ERR, "Failed to enqueue issue");
+    forget_delivery(redis_ctx, delivery_id);
+    return send_text(connection, MHD_HTTP_INTERNAL_SERVER_ERROR,
+                     "Failed to enqueue issue", 0);
+  }
+
+  // Respond with 200 OK, or 202 if the issue was spooled locally
+  return send_text(connection, queued == 0 ? MHD_HTTP_OK : MHD_HTTP_ACCEPTED,
+                   queued == 0 ? "OK" : "Accepted", 0);
+}
+
 // HTTP server callback
 enum MHD_Result answer_to_connection(void *cls,
                                      struct MHD_Connection *connection,
@@ -957,145 +1389,143 @@ enum MHD_Result answer_to_connection(void *cls,
                                      const char *version,
                                      const char *upload_data,
                                      size_t *upload_data_size, void **con_cls) {
-  (void)cls;
-  (void)url;
   (void)version;
-  (void)con_cls;
 
   syslog(LOG_INFO, "Received new connection");
 
-  static int aptr;
+  if (0 == strcmp(method, "GET") && 0 == strcmp(url, "/metrics")) {
+    char *body = metrics_render();
+    if (!body) {
+      return MHD_NO;
+    }
+    struct MHD_Response *mhd_response = MHD_create_response_from_buffer(
+        strlen(body), body, MHD_RESPMEM_MUST_FREE);
+    MHD_add_response_header(mhd_response, "Content-Type",
+                            "text/plain; version=0.0.4");
+    enum MHD_Result ret =
+        MHD_queue_response(connection, MHD_HTTP_OK, mhd_response);
+    MHD_destroy_response(mhd_response);
+    return ret;
+  }
+
   if (0 != strcmp(method, "POST")) {
     syslog(LOG_INFO, "Rejected non-POST request");
     return MHD_NO; // We only support POST
   }
 
-  if (&aptr != *con_cls) {
-    // The first time only the headers are valid, do not respond in the first
-    // call
-    *con_cls = &aptr;
+  struct upload *upload = *con_cls;
+  if (!upload) {
+    // The first time only the headers are valid. Refuse what we will not
+    // take here, before any of the body is read.
+    int retry_after = 0;
+    enum admission_result admitted = admission_check_global(&retry_after);
+    if (admitted != ADMISSION_OK) {
+      syslog(LOG_WARNING, "Refusing delivery: %s",
+             admission_result_name(admitted));
+      return send_text(connection, MHD_HTTP_TOO_MANY_REQUESTS,
+                       admitted == ADMISSION_QUEUE_FULL ? "Queue full"
+                                                        : "Too many requests",
+                       retry_after);
+    }
+    const char *content_length = MHD_lookup_connection_value(
+        connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_LENGTH);
+    if (content_length &&
+        strtoull(content_length, NULL, 10) > admission_max_body()) {
+      syslog(LOG_WARNING, "Refusing %s byte delivery", content_length);
+      metrics_counter_add("cis_admission_total{result=\"too_large\"}", 1);
+      return send_text(connection, MHD_HTTP_PAYLOAD_TOO_LARGE,
+                       "Payload too large", 0);
+    }
+    upload = calloc(1, sizeof(*upload));
+    if (!upload) {
+      return MHD_NO;
+    }
+    *con_cls = upload;
     return MHD_YES;
   }
 
   if (*upload_data_size != 0) {
-    // Process the upload data (webhook payload)
-    cJSON *json = cJSON_Parse(upload_data);
-    if (!json) {
-      syslog(LOG_ERR, "Failed to parse webhook payload");
-      const char *response = "Invalid JSON";
-      struct MHD_Response *mhd_response = MHD_create_response_from_buffer(
-          strlen(response), (void *)response, MHD_RESPMEM_PERSISTENT);
-      MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, mhd_response);
-      MHD_destroy_response(mhd_response);
-      return MHD_YES;
-    }
-
-    // Extract necessary data from the webhook payload
-    cJSON *issue = cJSON_GetObjectItem(json, "issue");
-    cJSON *repository = cJSON_GetObjectItem(json, "repository");
-
-    if (!issue || !repository) {
-      syslog(LOG_ERR, "Invalid webhook payload");
-      const char *response = "Invalid payload";
-      struct MHD_Response *mhd_response = MHD_create_response_from_buffer(
-          strlen(response), (void *)response, MHD_RESPMEM_PERSISTENT);
-      MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, mhd_response);
-      MHD_destroy_response(mhd_response);
-      cJSON_Delete(json);
+    // Chunked bodies carry no Content-Length, so cap them as they arrive
+    size_t size = *upload_data_size;
+    *upload_data_size = 0;
+    if (upload->too_large) {
       return MHD_YES;
     }
-
-    cJSON *issue_number_item = cJSON_GetObjectItem(issue, "number");
-    cJSON *issue_title_item = cJSON_GetObjectItem(issue, "title");
-    cJSON *issue_body_item = cJSON_GetObjectItem(issue, "body");
-    cJSON *repo_full_name_item = cJSON_GetObjectItem(repository, "full_name");
-
-    if (!issue_number_item || !issue_title_item || !issue_body_item ||
-        !repo_full_name_item) {
-      syslog(LOG_ERR, "Incomplete webhook data");
-      const char *response = "Incomplete data";
-      struct MHD_Response *mhd_response = MHD_create_response_from_buffer(
-          strlen(response), (void *)response, MHD_RESPMEM_PERSISTENT);
-      MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, mhd_response);
-      MHD_destroy_response(mhd_response);
-      cJSON_Delete(json);
+    if (upload->length + size > admission_max_body()) {
+      upload->too_large = 1;
+      metrics_counter_add("cis_admission_total{result=\"too_large\"}", 1);
       return MHD_YES;
     }
-
-    // Prepare issue data to enqueue
-    cJSON *issue_data_json = cJSON_CreateObject();
-    cJSON_AddStringToObject(issue_data_json, "repository",
-                            repo_full_name_item->valuestring);
-    cJSON_AddNumberToObject(issue_data_json, "issue_number",
-                            issue_number_item->valueint);
-    cJSON_AddStringToObject(issue_data_json, "issue_title",
-                            issue_title_item->valuestring);
-    cJSON_AddStringToObject(issue_data_json, "issue_body",
-                            issue_body_item->valuestring);
-
-    char *issue_data = cJSON_PrintUnformatted(issue_data_json);
-
-    // Enqueue issue data in Redis
-    redisContext *redis_ctx = (redisContext *)cls;
-    if (enqueue_issue(redis_ctx, issue_data) != 0) {
-      syslog(LOG_ERR, "Failed to enqueue issue");
-      const char *response = "Failed to enqueue issue";
-      struct MHD_Response *mhd_response = MHD_create_response_from_buffer(
-          strlen(response), (void *)response, MHD_RESPMEM_PERSISTENT);
-      MHD_queue_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR,
-                         mhd_response);
-      MHD_destroy_response(mhd_response);
-      cJSON_Delete(json);
-      cJSON_free(issue_data);
-      cJSON_Delete(issue_data_json);
-      return MHD_YES;
+    char *data = realloc(upload->data, upload->length + size + 1);
+    if (!data) {
+      return MHD_NO;
     }
-
-    cJSON_Delete(json);
-    cJSON_free(issue_data);
-    cJSON_Delete(issue_data_json);
-
-    // Respond with 200 OK
-    const char *response = "OK";
-    struct MHD_Response *mhd_response = MHD_create_response_from_buffer(
-        strlen(response), (void *)response, MHD_RESPMEM_PERSISTENT);
-    MHD_queue_response(connection, MHD_HTTP_OK, mhd_response);
-    MHD_destroy_response(mhd_response);
-
-    *upload_data_size = 0;
+    memcpy(data + upload->length, upload_data, size);
+    upload->length += size;
+    data[upload->length] = '\0';
+    upload->data = data;
     return MHD_YES;
   }
 
   // POST data fully received
-  return MHD_YES;
+  if (upload->too_large) {
+    return send_text(connection, MHD_HTTP_PAYLOAD_TOO_LARGE,
+                     "Payload too large", 0);
+  }
+  return handle_webhook(connection, (redisContext *)cls,
+                        upload->data ? upload->data : "");
 }
 
-// Global variables for graceful shutdown
-volatile sig_atomic_t keep_running = 1;
-volatile sig_atomic_t shutdown_initiated = 0;
-struct MHD_Daemon *mhd_daemon = NULL;
-redisContext *redis_ctx = NULL;
-
+// Signal handler. It only flags the main loop, which drains and shuts down
+// outside signal context; a second signal exits at once.
 void signal_handler(int signum) {
-  if (__atomic_test_and_set(&shutdown_initiated, __ATOMIC_SEQ_CST)) {
-    syslog(LOG_INFO, "Shutdown already in progress, ignoring signal %d",
-           signum);
-    return;
+  (void)signum;
+  if (shutdown_initiated) {
+    _exit(1);
   }
-
-  syslog(LOG_INFO, "Received signal %d, shutting down...", signum);
+  shutdown_initiated = 1;
   keep_running = 0;
-  if (mhd_daemon) {
-    syslog(LOG_INFO, "Stopping MHD daemon");
-    MHD_stop_daemon(mhd_daemon);
-    mhd_daemon = NULL;
-  }
-  if (redis_ctx) {
-    syslog(LOG_INFO, "Closing Redis connection");
-    redisFree(redis_ctx);
-    redis_ctx = NULL;
+}
+
+// Called once a successor serves on our listen socket
+static void handover_done(void) { keep_running = 0; }
+
+// Function to stop taking deliveries and let workers finish. Issues still
+// in progress at the deadline are handed back to the queue at their next
+// step boundary; a worker stuck in one step gets the same time again.
+static void drain(pthread_t *workers, int count) {
+  struct timespec limit; // For the workers, on the clock joins use
+  clock_gettime(CLOCK_REALTIME, &limit);
+  limit.tv_sec += 2 * DRAIN_TIMEOUT_SECONDS;
+  long long deadline = now_ms() + DRAIN_TIMEOUT_SECONDS * 1000LL;
+  __atomic_store_n(&drain_deadline_ms, deadline, __ATOMIC_SEQ_CST);
+  syslog(LOG_INFO, "Draining for up to %d s", DRAIN_TIMEOUT_SECONDS);
+
+  // Stop accepting. A successor has its own copy of the listen socket, so
+  // closing ours refuses nothing.
+  MHD_socket listen_fd = MHD_quiesce_daemon(mhd_daemon);
+  if (listen_fd != MHD_INVALID_SOCKET) {
+    close(listen_fd);
+  }
+  const union MHD_DaemonInfo *info;
+  while (now_ms() < deadline &&
+         (info = MHD_get_daemon_info(mhd_daemon,
+                                     MHD_DAEMON_INFO_CURRENT_CONNECTIONS)) &&
+         info->num_connections > 0) {
+    usleep(50000); // Deliveries being received are still answered
+  }
+  MHD_stop_daemon(mhd_daemon);
+  mhd_daemon = NULL;
+
+  for (int i = 0; i < count; i++) {
+    if (pthread_timedjoin_np(workers[i], NULL, &limit) != 0) {
+      syslog(LOG_ERR, "Worker %d did not stop, cancelling it and "
+             "returning its issue to the queue", i);
+      pthread_cancel(workers[i]);
+      pthread_join(workers[i], NULL);
+    }
   }
-  syslog(LOG_INFO, "Shutdown complete");
+  syslog(LOG_INFO, "Drained");
 }
 
 // Function to simulate a webhook payload
@@ -1121,6 +1551,49 @@ char *simulate_webhook_payload() {
 void run_tests() {
   syslog(LOG_INFO, "Running tests...");
   // Add your test code here
+  if (json_builder_self_test() == 0) {
+    syslog(LOG_INFO, "JSON escaper self test passed");
+  } else {
+    syslog(LOG_ERR, "JSON escaper self test failed");
+  }
+
+  if (review_self_test() == 0) {
+    syslog(LOG_INFO, "Review verdict self test passed");
+  } else {
+    syslog(LOG_ERR, "Review verdict self test failed");
+  }
+
+  if (analysis_batch_self_test() == 0) {
+    syslog(LOG_INFO, "Batched analysis self test passed");
+  } else {
+    syslog(LOG_ERR, "Batched analysis self test failed");
+  }
+
+  if (prompt_pack_self_test() == 0) {
+    syslog(LOG_INFO, "Prompt packing self test passed");
+  } else {
+    syslog(LOG_ERR, "Prompt packing self test failed");
+  }
+
+  // A request body built from awkward input must parse back unchanged
+  const char *awkward = "Line 1\n\t\"quoted\" C:\\path \x01 caf\xc3\xa9";
+  struct json_builder body;
+  json_builder_init(&body);
+  json_object_begin(&body, NULL);
+  json_add_string(&body, "prompt", awkward);
+  json_object_end(&body);
+  char *request = json_builder_finish(&body);
+  cJSON *parsed = request ? cJSON_Parse(request) : NULL;
+  cJSON *prompt_item = cJSON_GetObjectItem(parsed, "prompt");
+  if (cJSON_IsString(prompt_item) &&
+      strcmp(prompt_item->valuestring, awkward) == 0) {
+    syslog(LOG_INFO, "JSON request body round trip passed");
+  } else {
+    syslog(LOG_ERR, "JSON request body round trip failed");
+  }
+  cJSON_Delete(parsed);
+  free(request);
+
   char *payload = simulate_webhook_payload();
   syslog(LOG_INFO, "Simulated webhook payload: %s", payload);
 
@@ -1138,28 +1611,14 @@ void run_tests() {
 
       if (issue_number_item && issue_title_item && issue_body_item &&
           repo_full_name_item) {
-        cJSON *issue_data_json = cJSON_CreateObject();
-        cJSON_AddStringToObject(issue_data_json, "repository",
-                                repo_full_name_item->valuestring);
-        cJSON_AddNumberToObject(issue_data_json, "issue_number",
-                                issue_number_item->valueint);
-        cJSON_AddStringToObject(issue_data_json, "issue_title",
-                                issue_title_item->valuestring);
-        cJSON_AddStringToObject(issue_data_json, "issue_body",
-                                issue_body_item->valuestring);
-
-        char *issue_data = cJSON_PrintUnformatted(issue_data_json);
-        if (issue_data == NULL) {
-          syslog(LOG_ERR, "Failed to print JSON data");
+        if (enqueue_issue(redis_ctx, repo_full_name_item->valuestring,
+                          issue_number_item->valueint, NULL,
+                          issue_title_item->valuestring,
+                          issue_body_item->valuestring) >= 0) {
+          syslog(LOG_INFO, "Successfully enqueued simulated issue");
         } else {
-          if (enqueue_issue(redis_ctx, issue_data) == 0) {
-            syslog(LOG_INFO, "Successfully enqueued simulated issue");
-          } else {
-            syslog(LOG_ERR, "Failed to enqueue simulated issue");
-          }
-          cJSON_free(issue_data);
+          syslog(LOG_ERR, "Failed to enqueue simulated issue");
         }
-        cJSON_Delete(issue_data_json);
       }
     }
     cJSON_Delete(json);
@@ -1169,12 +1628,75 @@ void run_tests() {
   syslog(LOG_INFO, "Tests completed.");
 }
 
+// Function to connect to Redis. A failed connection is only fatal when
+// the queue cannot do without Redis; otherwise the context reconnects later.
+int connect_redis(redisContext **ctx) {
+  *ctx = NULL;
+  if (!queue_needs_redis()) {
+    return 0; // Local queue backend, Redis is not used
+  }
+  *ctx = redisConnect(REDIS_HOST, REDIS_PORT);
+  if (*ctx == NULL) {
+    syslog(LOG_ERR, "Failed to allocate Redis context");
+    return -1;
+  }
+  if ((*ctx)->err) {
+    syslog(LOG_ERR, "Failed to connect to Redis: %s", (*ctx)->errstr);
+    if (queue_can_spill()) {
+      syslog(LOG_INFO, "Spooling issues to the local queue until Redis is up");
+      return 0;
+    }
+    redisFree(*ctx);
+    *ctx = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+// Startup tasks, run in parallel by startup_run
+static int start_prompts(void *arg) {
+  (void)arg;
+  return prompt_init(); // BPE ranks, loaded once for all workers
+}
+
+static int start_cleanup(void *arg) {
+  (void)arg;
+  return cleanup_init(); // Workspaces are deleted by background threads
+}
+
+static int start_curl(void *arg) {
+  (void)arg;
+  return curl_global_init(CURL_GLOBAL_DEFAULT) == CURLE_OK ? 0 : -1;
+}
+
+static int start_libgit2(void *arg) {
+  (void)arg;
+  return git_libgit2_init() > 0 ? 0 : -1;
+}
+
+static int start_redis(void *arg) { return connect_redis(arg); }
+
+// Connect a context that is useless without Redis
+static int start_redis_required(void *arg) {
+  redisContext **ctx = arg;
+  *ctx = redisConnect(REDIS_HOST, REDIS_PORT);
+  return *ctx && !(*ctx)->err ? 0 : -1;
+}
+
+static int start_cluster(void *arg) {
+  redisContext **ctx = arg;
+  return start_redis_required(ctx) == 0 && shard_refresh(*ctx) == 0 ? 0 : -1;
+}
+
 // Main function
 int main(int argc, char *argv[]) {
   // Set up signal handler
   signal(SIGINT, signal_handler);
   signal(SIGTERM, signal_handler);
 
+  // Taken before any thread starts, as it edits the environment
+  int activated_fd = systemd_listen_fd();
+
   configure_logging();
   syslog(LOG_INFO, "Starting code_issue_service");
 
@@ -1206,70 +1728,60 @@ int main(int argc, char *argv[]) {
     syslog(LOG_ERR, "Cannot load config file: %s", config_file);
     return 1;
   }
+  queue_name_consumer();
 
-  // Initialize Redis
-  redis_ctx = redisConnect(REDIS_HOST, REDIS_PORT);
-  if (redis_ctx == NULL || redis_ctx->err) {
-    if (redis_ctx) {
-      syslog(LOG_ERR, "Failed to connect to Redis: %s", redis_ctx->errstr);
-      redisFree(redis_ctx);
-    } else {
-      syslog(LOG_ERR, "Failed to allocate Redis context");
-    }
-    return 1;
-  }
-
-  // Start the worker thread
-  pthread_t worker_thread;
-  if (pthread_create(&worker_thread, NULL, process_issue_thread, redis_ctx) !=
-      0) {
-    syslog(LOG_ERR, "Failed to create worker thread");
+  // Open the local queue used as backend or while Redis is unreachable.
+  // Redis connections fall back to it, so it is opened first.
+  if (queue_open_local() != 0) {
+    syslog(LOG_ERR, "Failed to open local queue");
     return 1;
   }
 
-  // Simulate webhook payload
-  char *payload = simulate_webhook_payload();
-  syslog(LOG_INFO, "Simulated webhook payload: %s", payload);
-
-  // Process the simulated payload
-  cJSON *json = cJSON_Parse(payload);
-  if (json) {
-    cJSON *issue = cJSON_GetObjectItem(json, "issue");
-    cJSON *repository = cJSON_GetObjectItem(json, "repository");
-
-    if (issue && repository) {
-      cJSON *issue_number_item = cJSON_GetObjectItem(issue, "number");
-      cJSON *issue_title_item = cJSON_GetObjectItem(issue, "title");
-      cJSON *issue_body_item = cJSON_GetObjectItem(issue, "body");
-      cJSON *repo_full_name_item = cJSON_GetObjectItem(repository, "full_name");
-
-      if (issue_number_item && issue_title_item && issue_body_item &&
-          repo_full_name_item) {
-        cJSON *issue_data_json = cJSON_CreateObject();
-        cJSON_AddStringToObject(issue_data_json, "repository",
-                                repo_full_name_item->valuestring);
-        cJSON_AddNumberToObject(issue_data_json, "issue_number",
-                                issue_number_item->valueint);
-        cJSON_AddStringToObject(issue_data_json, "issue_title",
-                                issue_title_item->valuestring);
-        cJSON_AddStringToObject(issue_data_json, "issue_body",
-                                issue_body_item->valuestring);
-
-        char *issue_data = cJSON_PrintUnformatted(issue_data_json);
-
-        if (enqueue_issue(redis_ctx, issue_data) == 0) {
-          syslog(LOG_INFO, "Successfully enqueued simulated issue");
-        } else {
-          syslog(LOG_ERR, "Failed to enqueue simulated issue");
-        }
-
-        cJSON_free(issue_data);
-        cJSON_Delete(issue_data_json);
-      }
+  // Slow initialisation runs in parallel. Under socket activation,
+  // deliveries arriving meanwhile wait in the kernel's accept queue.
+  // libcurl's global setup is not thread-safe against other curl calls,
+  // and nothing uses curl until these tasks are done.
+  struct startup_task tasks[8 + WORKER_THREADS];
+  redisContext *worker_ctxs[WORKER_THREADS];
+  redisContext *cluster_ctx = NULL;
+  redisContext *keepalive_ctx = NULL;
+  redisContext *drainer_ctx = NULL;
+  int task_count = 0;
+  memset(worker_ctxs, 0, sizeof(worker_ctxs));
+  tasks[task_count++] =
+      (struct startup_task){.name = "bpe_ranks", .run = start_prompts};
+  tasks[task_count++] =
+      (struct startup_task){.name = "cleanup", .run = start_cleanup};
+  tasks[task_count++] =
+      (struct startup_task){.name = "curl", .run = start_curl};
+  tasks[task_count++] =
+      (struct startup_task){.name = "libgit2", .run = start_libgit2};
+  tasks[task_count++] = (struct startup_task){
+      .name = "redis", .run = start_redis, .arg = &redis_ctx};
+  if (!test_mode) {
+    // Each worker has its own Redis connection
+    for (int i = 0; i < WORKER_THREADS; i++) {
+      tasks[task_count++] = (struct startup_task){
+          .name = "redis_worker", .run = start_redis, .arg = &worker_ctxs[i]};
+    }
+    // Join the cluster before taking work so repositories route to us
+    if (shard_enabled()) {
+      tasks[task_count++] = (struct startup_task){
+          .name = "cluster", .run = start_cluster, .arg = &cluster_ctx};
+    }
+    if (queue_uses_streams()) {
+      tasks[task_count++] = (struct startup_task){.name = "redis_keepalive",
+                                                  .run = start_redis_required,
+                                                  .arg = &keepalive_ctx};
+    }
+    if (queue_needs_redis() && queue_can_spill()) {
+      tasks[task_count++] = (struct startup_task){
+          .name = "redis_drainer", .run = start_redis, .arg = &drainer_ctx};
     }
-    cJSON_Delete(json);
   }
-  free(payload);
+  if (startup_run(tasks, task_count) != 0) {
+    return 1;
+  }
 
   // Ensure log directory exists
   struct stat st = {0};
@@ -1277,53 +1789,101 @@ int main(int argc, char *argv[]) {
     mkdir(LOG_DIRECTORY, 0700);
   }
 
-  // Initialize Redis
-  redis_ctx = redisConnect(REDIS_HOST, REDIS_PORT);
-  if (redis_ctx == NULL || redis_ctx->err) {
-    if (redis_ctx) {
-      syslog(LOG_ERR, "Failed to connect to Redis: %s", redis_ctx->errstr);
-      redisFree(redis_ctx);
-    } else {
-      syslog(LOG_ERR, "Failed to allocate Redis context");
-    }
-    return 1;
-  }
-
   if (test_mode) {
     run_tests();
   } else {
-    // Start the worker thread
-    pthread_t worker_thread;
-    if (pthread_create(&worker_thread, NULL, process_issue_thread, redis_ctx) !=
-        0) {
-      syslog(LOG_ERR, "Failed to create worker thread");
-      return 1;
+    if (shard_enabled()) {
+      pthread_t heartbeat_thread;
+      if (pthread_create(&heartbeat_thread, NULL, shard_heartbeat_thread,
+                         cluster_ctx) != 0) {
+        syslog(LOG_ERR, "Failed to join the cluster");
+        return 1;
+      }
+      pthread_detach(heartbeat_thread);
     }
 
-    // Start the HTTP server
-    mhd_daemon =
-        MHD_start_daemon(MHD_USE_SELECT_INTERNALLY, SERVER_PORT, NULL, NULL,
-                         &answer_to_connection, redis_ctx, MHD_OPTION_END);
+    // Issues queued before an upgrade would otherwise never be read
+    if (redis_ctx && queue_migrate_legacy(redis_ctx) < 0) {
+      syslog(LOG_WARNING, "Legacy queue entries are left for the next start");
+    }
+
+    // Start the worker threads
+    pthread_t worker_threads[WORKER_THREADS];
+    for (int i = 0; i < WORKER_THREADS; i++) {
+      if (pthread_create(&worker_threads[i], NULL, process_issue_thread,
+                         worker_ctxs[i]) != 0) {
+        syslog(LOG_ERR, "Failed to create worker thread");
+        return 1;
+      }
+    }
+
+    // Stream entries are reclaimed by other nodes unless we renew them
+    if (queue_uses_streams()) {
+      pthread_t keepalive_thread;
+      if (pthread_create(&keepalive_thread, NULL, queue_keepalive_thread,
+                         keepalive_ctx) != 0) {
+        syslog(LOG_ERR, "Failed to start stream keepalive thread");
+        return 1;
+      }
+      pthread_detach(keepalive_thread);
+    }
+
+    // Replay issues spooled while Redis was down
+    if (queue_needs_redis() && queue_can_spill()) {
+      pthread_t drainer_thread;
+      if (pthread_create(&drainer_thread, NULL, local_queue_drainer_thread,
+                         drainer_ctx) != 0) {
+        syslog(LOG_ERR, "Failed to start local queue drainer");
+        return 1;
+      }
+      pthread_detach(drainer_thread);
+    }
+
+    // Start the HTTP server on the socket systemd passed us, else on the
+    // listen socket of the instance we are replacing, else on our own (MHD
+    // binds one when given -1). ITC lets the server be quiesced when
+    // draining.
+    MHD_socket listen_fd =
+        activated_fd >= 0 ? activated_fd : handover_receive(HANDOVER_SOCKET);
+    mhd_daemon = MHD_start_daemon(
+        MHD_USE_SELECT_INTERNALLY | MHD_USE_ITC, SERVER_PORT, NULL, NULL,
+        &answer_to_connection, redis_ctx, MHD_OPTION_LISTEN_SOCKET, listen_fd,
+        MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
+        MHD_OPTION_END);
     if (mhd_daemon == NULL) {
       syslog(LOG_ERR, "Failed to start server");
       return 1;
     }
 
     syslog(LOG_INFO, "Server started on port %d", SERVER_PORT);
+    systemd_notify("READY=1");
+
+    // The previous instance drains once we serve; the next one takes over
+    // from us the same way. systemd keeps an activated socket open across
+    // restarts itself.
+    handover_acknowledge();
+    const union MHD_DaemonInfo *info =
+        MHD_get_daemon_info(mhd_daemon, MHD_DAEMON_INFO_LISTEN_FD);
+    if (activated_fd < 0 &&
+        (!info || handover_offer(HANDOVER_SOCKET, info->listen_fd,
+                                 handover_done) != 0)) {
+      syslog(LOG_WARNING, "Restarts will not hand over the listen socket");
+    }
 
     // Keep the main thread running
     while (keep_running) {
       sleep(1);
     }
 
-    // Clean up
-    pthread_cancel(worker_thread);
-    pthread_join(worker_thread, NULL);
+    systemd_notify("STOPPING=1");
+    drain(worker_threads, WORKER_THREADS);
   }
 
   if (redis_ctx) {
     redisFree(redis_ctx);
   }
+  local_queue_close();
+  curl_global_cleanup();
 
   syslog(LOG_INFO, "Server shutting down");
   closelog();
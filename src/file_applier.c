@@ -0,0 +1,474 @@
+#include "file_applier.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "metrics.h"
+
+#define MAX_APPLY_THREADS 32
+#define URING_MAX_FILES 256 // Files submitted per io_uring round
+#define URING_OPS_PER_FILE 5
+
+// A file to write: the directory it goes in, its name there and the
+// temporary name it is written under first
+struct pending_write {
+  int dir_fd;
+  const char *name;
+  char tmp_name[64];
+  const char *content;
+  size_t length;
+  mode_t mode;
+  int *error;
+};
+
+// Directories opened so far, by path relative to the workspace
+struct dir_entry {
+  char *path;
+  int fd;
+};
+
+struct dir_cache {
+  int root_fd;
+  struct dir_entry *entries;
+  int count;
+  int capacity;
+};
+
+struct write_pool {
+  struct pending_write *writes;
+  int count;
+  int next;
+};
+
+static int apply_threads = 8;
+static unsigned long apply_seq = 0;
+
+// Function to handle applier config entries
+int applier_config_handler(const char *name, const char *value) {
+  if (strcmp(name, "threads") == 0) {
+    apply_threads = atoi(value);
+    if (apply_threads < 1) {
+      apply_threads = 1;
+    } else if (apply_threads > MAX_APPLY_THREADS) {
+      apply_threads = MAX_APPLY_THREADS;
+    }
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+// Function to normalise a relative path
+int file_path_normalise(const char *path, char *buf, size_t size) {
+  if (!path || path[0] == '/' || strlen(path) >= size) {
+    return -1;
+  }
+  size_t len = 0;
+  for (const char *p = path; *p;) {
+    size_t part = strcspn(p, "/");
+    if (part == 2 && strncmp(p, "..", 2) == 0) {
+      return -1;
+    }
+    if (part == 4 && strncmp(p, ".git", 4) == 0) {
+      return -1;
+    }
+    if (part > NAME_MAX) {
+      return -1;
+    }
+    if (part > 0 && !(part == 1 && p[0] == '.')) {
+      if (len > 0) {
+        buf[len++] = '/';
+      }
+      memcpy(buf + len, p, part);
+      len += part;
+    }
+    p += part;
+    while (*p == '/') {
+      p++;
+    }
+  }
+  buf[len] = '\0';
+  return len > 0 ? 0 : -1;
+}
+
+static int cached_dir(const struct dir_cache *cache, const char *path,
+                      size_t len) {
+  for (int i = 0; i < cache->count; i++) {
+    if (strlen(cache->entries[i].path) == len &&
+        strncmp(cache->entries[i].path, path, len) == 0) {
+      return cache->entries[i].fd;
+    }
+  }
+  return -1;
+}
+
+static int cache_dir(struct dir_cache *cache, const char *path, size_t len,
+                     int fd) {
+  if (cache->count == cache->capacity) {
+    int capacity = cache->capacity ? cache->capacity * 2 : 16;
+    struct dir_entry *entries =
+        realloc(cache->entries, (size_t)capacity * sizeof(*entries));
+    if (!entries) {
+      return -1;
+    }
+    cache->entries = entries;
+    cache->capacity = capacity;
+  }
+  char *copy = strndup(path, len);
+  if (!copy) {
+    return -1;
+  }
+  cache->entries[cache->count].path = copy;
+  cache->entries[cache->count].fd = fd;
+  cache->count++;
+  return 0;
+}
+
+// Open the directory a normalised path goes in, creating what is missing.
+// Each level is opened relative to the one above with O_NOFOLLOW, so a
+// symlink anywhere on the way is refused instead of followed out of the
+// workspace. Returns the directory fd (owned by the cache) or -1 with errno
+// set.
+static int open_parent(struct dir_cache *cache, const char *path) {
+  const char *slash = strrchr(path, '/');
+  if (!slash) {
+    return cache->root_fd;
+  }
+  size_t dir_len = (size_t)(slash - path);
+  int fd = cached_dir(cache, path, dir_len);
+  if (fd >= 0) {
+    return fd;
+  }
+
+  // Start from the deepest directory already open
+  size_t done = 0;
+  int parent = cache->root_fd;
+  for (const char *p = strchr(path, '/'); p && p < slash + 1;
+       p = strchr(p + 1, '/')) {
+    int cached = cached_dir(cache, path, (size_t)(p - path));
+    if (cached >= 0) {
+      parent = cached;
+      done = (size_t)(p - path) + 1;
+    }
+  }
+  while (done < dir_len) {
+    size_t part = strcspn(path + done, "/");
+    char name[NAME_MAX + 1];
+    memcpy(name, path + done, part);
+    name[part] = '\0';
+    int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    fd = openat(parent, name, flags);
+    if (fd < 0 && errno == ENOENT) {
+      if (mkdirat(parent, name, 0755) != 0 && errno != EEXIST) {
+        return -1;
+      }
+      fd = openat(parent, name, flags);
+    }
+    if (fd < 0) {
+      return -1;
+    }
+    if (cache_dir(cache, path, done + part, fd) != 0) {
+      close(fd);
+      errno = ENOMEM;
+      return -1;
+    }
+    parent = fd;
+    done += part + 1;
+  }
+  return parent;
+}
+
+static void free_cache(struct dir_cache *cache) {
+  for (int i = 0; i < cache->count; i++) {
+    close(cache->entries[i].fd);
+    free(cache->entries[i].path);
+  }
+  free(cache->entries);
+  if (cache->root_fd >= 0) {
+    close(cache->root_fd);
+  }
+}
+
+// Write one file under its temporary name, flush it and move it into place
+static void write_file(struct pending_write *w) {
+  int fd = openat(w->dir_fd, w->tmp_name,
+                  O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, w->mode);
+  if (fd < 0) {
+    *w->error = errno;
+    return;
+  }
+  size_t done = 0;
+  while (done < w->length) {
+    ssize_t n = pwrite(fd, w->content + done, w->length - done, (off_t)done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      *w->error = n < 0 ? errno : EIO;
+      break;
+    }
+    done += (size_t)n;
+  }
+  if (*w->error == 0 && fsync(fd) != 0) {
+    *w->error = errno;
+  }
+  if (close(fd) != 0 && *w->error == 0) {
+    *w->error = errno;
+  }
+  if (*w->error == 0 &&
+      renameat(w->dir_fd, w->tmp_name, w->dir_fd, w->name) != 0) {
+    *w->error = errno;
+  }
+  if (*w->error != 0) {
+    unlinkat(w->dir_fd, w->tmp_name, 0);
+  }
+}
+
+static void *write_thread(void *arg) {
+  struct write_pool *pool = arg;
+  int i;
+  while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) <
+         pool->count) {
+    write_file(&pool->writes[i]);
+  }
+  return NULL;
+}
+
+// Write everything with a pool of threads, each taking the next file
+static void write_batch_threads(struct pending_write *writes, int count) {
+  struct write_pool pool = {writes, count, 0};
+  pthread_t threads[MAX_APPLY_THREADS];
+  int started = 0;
+  int wanted = count < apply_threads ? count : apply_threads;
+  // The calling thread is one of the workers
+  while (started < wanted - 1 &&
+         pthread_create(&threads[started], NULL, write_thread, &pool) == 0) {
+    started++;
+  }
+  write_thread(&pool);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+#ifdef HAVE_LIBURING
+// Write everything through io_uring. Each file is one linked chain: open
+// into a registered file slot, write, fsync, close and rename, so a failing
+// step cancels the rest of its chain and nothing else. Returns -1 if the
+// ring could not be set up, leaving the work to the thread pool.
+static int write_batch_uring(struct pending_write *writes, int count) {
+  int per_round = count < URING_MAX_FILES ? count : URING_MAX_FILES;
+  struct io_uring ring;
+  if (io_uring_queue_init((unsigned)(per_round * URING_OPS_PER_FILE), &ring,
+                          0) < 0) {
+    return -1;
+  }
+  if (io_uring_register_files_sparse(&ring, (unsigned)per_round) < 0) {
+    io_uring_queue_exit(&ring);
+    return -1;
+  }
+
+  for (int start = 0; start < count; start += per_round) {
+    int n = count - start < per_round ? count - start : per_round;
+    int submitted = 0;
+    for (int i = 0; i < n; i++) {
+      struct pending_write *w = &writes[start + i];
+      if (w->length > INT_MAX) {
+        write_file(w); // Too big for a single write request
+        continue;
+      }
+      unsigned slot = (unsigned)i;
+      __u64 tag = (__u64)(start + i) * URING_OPS_PER_FILE;
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+      io_uring_prep_openat_direct(sqe, w->dir_fd, w->tmp_name,
+                                  O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                                  w->mode, slot);
+      sqe->flags |= IOSQE_IO_LINK;
+      io_uring_sqe_set_data64(sqe, tag);
+      sqe = io_uring_get_sqe(&ring);
+      io_uring_prep_write(sqe, (int)slot, w->content, (unsigned)w->length, 0);
+      sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+      io_uring_sqe_set_data64(sqe, tag + 1);
+      sqe = io_uring_get_sqe(&ring);
+      io_uring_prep_fsync(sqe, (int)slot, 0);
+      sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+      io_uring_sqe_set_data64(sqe, tag + 2);
+      sqe = io_uring_get_sqe(&ring);
+      io_uring_prep_close_direct(sqe, slot);
+      sqe->flags |= IOSQE_IO_LINK;
+      io_uring_sqe_set_data64(sqe, tag + 3);
+      sqe = io_uring_get_sqe(&ring);
+      io_uring_prep_renameat(sqe, w->dir_fd, w->tmp_name, w->dir_fd, w->name,
+                             0);
+      io_uring_sqe_set_data64(sqe, tag + 4);
+      submitted += URING_OPS_PER_FILE;
+    }
+    if (submitted == 0) {
+      continue;
+    }
+    int ret = io_uring_submit_and_wait(&ring, (unsigned)submitted);
+    if (ret < 0) {
+      // Nothing from here on was written
+      for (int i = start; i < count; i++) {
+        if (*writes[i].error == 0) {
+          *writes[i].error = -ret;
+        }
+      }
+      break;
+    }
+
+    for (int reaped = 0; reaped < submitted; reaped++) {
+      struct io_uring_cqe *cqe;
+      if (io_uring_wait_cqe(&ring, &cqe) < 0) {
+        break;
+      }
+      __u64 tag = io_uring_cqe_get_data64(cqe);
+      struct pending_write *w = &writes[tag / URING_OPS_PER_FILE];
+      int op = (int)(tag % URING_OPS_PER_FILE);
+      // The first failure in a chain is the one worth reporting
+      if (*w->error == 0 && cqe->res < 0 && cqe->res != -ECANCELED) {
+        *w->error = -cqe->res;
+      } else if (*w->error == 0 && op == 1 &&
+                 (size_t)cqe->res != w->length) {
+        *w->error = EIO; // Short write; the chain was cut after it
+      }
+      io_uring_cqe_seen(&ring, cqe);
+    }
+    for (int i = 0; i < n; i++) {
+      struct pending_write *w = &writes[start + i];
+      if (*w->error != 0) {
+        unlinkat(w->dir_fd, w->tmp_name, 0);
+      }
+    }
+  }
+  io_uring_queue_exit(&ring);
+  return 0;
+}
+#endif
+
+// Function to apply a batch of file changes
+int file_apply_batch(const char *root, struct file_change *changes,
+                     int count) {
+  struct dir_cache cache = {-1, NULL, 0, 0};
+  struct pending_write *writes = calloc((size_t)count + 1, sizeof(*writes));
+  char **paths = calloc((size_t)count + 1, sizeof(*paths));
+  int invalid = 0;
+  if (!writes || !paths) {
+    free(writes);
+    free(paths);
+    return -1;
+  }
+
+  // Every path is checked before any directory is created
+  for (int i = 0; i < count; i++) {
+    char buf[PATH_MAX];
+    changes[i].error = 0;
+    if (file_path_normalise(changes[i].path, buf, sizeof(buf)) != 0) {
+      changes[i].error = EINVAL;
+      invalid++;
+      continue;
+    }
+    paths[i] = strdup(buf);
+    if (!paths[i]) {
+      changes[i].error = ENOMEM;
+      invalid++;
+      continue;
+    }
+    for (int j = 0; j < i; j++) {
+      if (paths[j] && strcmp(paths[i], paths[j]) == 0) {
+        changes[i].error = EEXIST; // Written twice in one batch
+        invalid++;
+        break;
+      }
+    }
+  }
+
+  if (!invalid) {
+    cache.root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cache.root_fd < 0) {
+      int saved = errno;
+      syslog(LOG_ERR, "Failed to open workspace %s: %s", root,
+             strerror(saved));
+      for (int i = 0; i < count; i++) {
+        changes[i].error = saved;
+      }
+      invalid = count;
+    }
+  }
+
+  // Then directories are created and the existing files' modes kept
+  unsigned long seq = __atomic_add_fetch(&apply_seq, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < count && !invalid; i++) {
+    struct pending_write *w = &writes[i];
+    w->dir_fd = open_parent(&cache, paths[i]);
+    if (w->dir_fd < 0) {
+      changes[i].error = errno;
+      invalid++;
+      break;
+    }
+    const char *slash = strrchr(paths[i], '/');
+    w->name = slash ? slash + 1 : paths[i];
+    snprintf(w->tmp_name, sizeof(w->tmp_name), ".cis-apply.%d.%lu.%d",
+             (int)getpid(), seq, i);
+    w->content = changes[i].content;
+    w->length = changes[i].length;
+    w->error = &changes[i].error;
+    w->mode = 0644;
+    struct stat st;
+    if (fstatat(w->dir_fd, w->name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+      if (S_ISDIR(st.st_mode)) {
+        changes[i].error = EISDIR;
+        invalid++;
+        break;
+      }
+      if (S_ISREG(st.st_mode)) {
+        w->mode = st.st_mode & 07777;
+      }
+    }
+  }
+
+  int failed = invalid;
+  if (!invalid) {
+#ifdef HAVE_LIBURING
+    if (write_batch_uring(writes, count) != 0) {
+      write_batch_threads(writes, count);
+    }
+#else
+    write_batch_threads(writes, count);
+#endif
+    // Make the renames durable, once per directory
+    if (fsync(cache.root_fd) != 0) {
+      syslog(LOG_ERR, "Failed to sync %s: %s", root, strerror(errno));
+    }
+    for (int i = 0; i < cache.count; i++) {
+      fsync(cache.entries[i].fd);
+    }
+    for (int i = 0; i < count; i++) {
+      failed += changes[i].error != 0;
+    }
+    metrics_counter_add("cis_apply_files_total", count - failed);
+  }
+  if (failed) {
+    metrics_counter_add("cis_apply_failures_total", failed);
+  }
+
+  free_cache(&cache);
+  for (int i = 0; i < count; i++) {
+    free(paths[i]);
+  }
+  free(paths);
+  free(writes);
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,495 @@
+#include "github_client.h"
+
+#include <cjson/cJSON.h>
+#include <curl/curl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "metrics.h"
+
+#define MAX_CACHE_ENTRIES 256
+
+// One answer from GitHub, with the headers the client cares about
+struct github_response {
+  char *data;
+  size_t len;
+  char etag[128];
+  long remaining; // -1 when the header was missing
+  long long reset_ms;
+  long long retry_after_ms;
+};
+
+// A cached GET response and the ETag it can be revalidated with
+struct cache_entry {
+  char *path;
+  char etag[128];
+  char *body;
+  unsigned long long used;
+};
+
+// A GET on its way; identical GETs wait for it instead of sending their own
+struct inflight {
+  char *path;
+  int done;
+  int result;
+  long status;
+  char *body;
+  int refs;
+  struct inflight *next;
+};
+
+static char github_token[128] = "";
+static char api_url[256] = "https://api.github.com";
+static char clone_url[256] = "https://github.com";
+static long rate_reserve = 50;  // Requests kept back for the next window
+static long pace_below = 1000;  // Pacing starts under this many remaining
+static int max_retries = 2;     // After rate-limited answers
+static long request_timeout_ms = 30000;
+static int cache_limit = MAX_CACHE_ENTRIES;
+
+// Rate limit state, in wall clock milliseconds like X-RateLimit-Reset
+static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+static long rate_remaining = -1; // Unknown until the first answer
+static long long rate_reset_ms = 0;
+static long long next_slot_ms = 0;
+static long long blocked_until_ms = 0;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inflight_done = PTHREAD_COND_INITIALIZER;
+static struct cache_entry cache[MAX_CACHE_ENTRIES];
+static unsigned long long cache_clock = 0;
+static struct inflight *inflight_list = NULL;
+
+// Connections, TLS sessions and DNS are shared by all workers
+static CURLSH *share = NULL;
+static pthread_once_t share_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+// Function to handle GitHub config entries
+int github_config_handler(const char *name, const char *value) {
+  if (strcmp(name, "personal_access_token") == 0) {
+    snprintf(github_token, sizeof(github_token), "%s", value);
+  } else if (strcmp(name, "api_url") == 0) {
+    snprintf(api_url, sizeof(api_url), "%s", value);
+  } else if (strcmp(name, "clone_url") == 0) {
+    snprintf(clone_url, sizeof(clone_url), "%s", value);
+  } else if (strcmp(name, "rate_limit_reserve") == 0) {
+    rate_reserve = atol(value);
+  } else if (strcmp(name, "pace_below") == 0) {
+    pace_below = atol(value);
+  } else if (strcmp(name, "max_retries") == 0) {
+    max_retries = atoi(value);
+  } else if (strcmp(name, "request_timeout_ms") == 0) {
+    request_timeout_ms = atol(value);
+  } else if (strcmp(name, "cache_entries") == 0) {
+    cache_limit = atoi(value);
+    if (cache_limit < 0) {
+      cache_limit = 0;
+    } else if (cache_limit > MAX_CACHE_ENTRIES) {
+      cache_limit = MAX_CACHE_ENTRIES;
+    }
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static void share_lock(CURL *handle, curl_lock_data data,
+                       curl_lock_access access, void *userp) {
+  (void)handle; // Suppress unused parameter warnings
+  (void)access;
+  (void)userp;
+  pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userp) {
+  (void)handle; // Suppress unused parameter warnings
+  (void)userp;
+  pthread_mutex_unlock(&share_locks[data]);
+}
+
+static void init_share(void) {
+  for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+    pthread_mutex_init(&share_locks[i], NULL);
+  }
+  share = curl_share_init();
+  if (!share) {
+    return;
+  }
+  curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+  curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+}
+
+static size_t write_callback(void *contents, size_t size, size_t nmemb,
+                             void *userp) {
+  struct github_response *r = userp;
+  size_t realsize = size * nmemb;
+  char *data = realloc(r->data, r->len + realsize + 1);
+  if (!data) {
+    syslog(LOG_ERR, "Not enough memory for GitHub response");
+    return 0;
+  }
+  r->data = data;
+  memcpy(r->data + r->len, contents, realsize);
+  r->len += realsize;
+  r->data[r->len] = '\0';
+  return realsize;
+}
+
+// Copy a header's value, trimmed, if the line is that header
+static int header_value(const char *line, size_t len, const char *name,
+                        char *value, size_t size) {
+  size_t name_len = strlen(name);
+  if (len <= name_len || strncasecmp(line, name, name_len) != 0 ||
+      line[name_len] != ':') {
+    return 0;
+  }
+  const char *p = line + name_len + 1;
+  const char *end = line + len;
+  while (p < end && *p == ' ') {
+    p++;
+  }
+  while (end > p && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' ')) {
+    end--;
+  }
+  size_t n = (size_t)(end - p) < size - 1 ? (size_t)(end - p) : size - 1;
+  memcpy(value, p, n);
+  value[n] = '\0';
+  return 1;
+}
+
+static size_t header_callback(char *buffer, size_t size, size_t nitems,
+                              void *userp) {
+  struct github_response *r = userp;
+  size_t len = size * nitems;
+  char value[128];
+  if (header_value(buffer, len, "ETag", r->etag, sizeof(r->etag))) {
+    return len;
+  }
+  if (header_value(buffer, len, "X-RateLimit-Remaining", value,
+                   sizeof(value))) {
+    r->remaining = atol(value);
+  } else if (header_value(buffer, len, "X-RateLimit-Reset", value,
+                          sizeof(value))) {
+    r->reset_ms = atoll(value) * 1000;
+  } else if (header_value(buffer, len, "Retry-After", value, sizeof(value))) {
+    r->retry_after_ms = atoll(value) * 1000;
+  }
+  return len;
+}
+
+// Wait for this request's turn. Plenty of budget means no wait at all;
+// under pace_below the rest of the window is shared out evenly, and with
+// only the reserve left requests wait for the reset.
+static void pace_request(void) {
+  pthread_mutex_lock(&rate_lock);
+  long long now = wall_ms();
+  long long slot = blocked_until_ms > now ? blocked_until_ms : now;
+  if (rate_remaining >= 0 && rate_reset_ms > now) {
+    long spare = rate_remaining - rate_reserve;
+    if (spare <= 0) {
+      slot = rate_reset_ms > slot ? rate_reset_ms : slot;
+    } else if (rate_remaining < pace_below) {
+      slot = next_slot_ms > slot ? next_slot_ms : slot;
+      next_slot_ms = slot + (rate_reset_ms - now) / spare;
+    }
+    if (rate_remaining > 0) {
+      rate_remaining--; // Until the answer says otherwise
+    }
+  }
+  pthread_mutex_unlock(&rate_lock);
+
+  long long wait = slot - now;
+  if (wait <= 0) {
+    return;
+  }
+  if (wait > 1000) {
+    syslog(LOG_WARNING, "GitHub rate limit: waiting %lld ms", wait);
+  }
+  metrics_counter_add("cis_github_paced_ms_total", wait);
+  struct timespec ts = {wait / 1000, (wait % 1000) * 1000000};
+  nanosleep(&ts, NULL);
+}
+
+// Take in the rate limit headers. Returns 1 if the answer was a rate limit.
+static int record_rate(const struct github_response *r, long status) {
+  pthread_mutex_lock(&rate_lock);
+  if (r->remaining >= 0) {
+    rate_remaining = r->remaining;
+    rate_reset_ms = r->reset_ms;
+    metrics_gauge_set("cis_github_rate_limit_remaining", r->remaining);
+  }
+  int limited = status == 429 || (status == 403 && (r->remaining == 0 ||
+                                                    r->retry_after_ms > 0));
+  if (limited) {
+    // Secondary limits say how long to back off; primary ones reset
+    long long until = r->retry_after_ms > 0 ? wall_ms() + r->retry_after_ms
+                                            : r->reset_ms;
+    if (until > blocked_until_ms) {
+      blocked_until_ms = until;
+    }
+    metrics_counter_add("cis_github_rate_limited_total", 1);
+  }
+  pthread_mutex_unlock(&rate_lock);
+  return limited;
+}
+
+static int perform(const char *method, const char *path, const char *body,
+                   size_t body_len, const char *etag,
+                   struct github_response *r, long *status) {
+  pthread_once(&share_once, init_share);
+  memset(r, 0, sizeof(*r));
+  r->remaining = -1;
+  CURL *curl = curl_easy_init();
+  if (!curl) {
+    return -1;
+  }
+
+  char url[512];
+  snprintf(url, sizeof(url), "%s%s", api_url, path);
+  char header[256];
+  struct curl_slist *headers = NULL;
+  headers = curl_slist_append(headers, "Accept: application/vnd.github+json");
+  headers = curl_slist_append(headers, "User-Agent: Automated Bot");
+  snprintf(header, sizeof(header), "Authorization: token %s", github_token);
+  headers = curl_slist_append(headers, header);
+  if (body) {
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+  }
+  if (etag && etag[0]) {
+    snprintf(header, sizeof(header), "If-None-Match: %s", etag);
+    headers = curl_slist_append(headers, header);
+  }
+
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
+  if (body) {
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)body_len);
+  }
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)r);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)r);
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, request_timeout_ms);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // Workers are threads
+  if (share) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
+  }
+
+  CURLcode res = curl_easy_perform(curl);
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, status);
+  curl_slist_free_all(headers);
+  curl_easy_cleanup(curl);
+  metrics_counter_add("cis_github_requests_total", 1);
+  if (res != CURLE_OK) {
+    syslog(LOG_ERR, "GitHub %s %s failed: %s", method, path,
+           curl_easy_strerror(res));
+    free(r->data);
+    r->data = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static int request_with_etag(const char *method, const char *path,
+                             const char *body, size_t body_len,
+                             const char *etag, struct github_response *r,
+                             long *status) {
+  for (int attempt = 0;; attempt++) {
+    pace_request();
+    if (perform(method, path, body, body_len, etag, r, status) != 0) {
+      return -1;
+    }
+    if (!record_rate(r, *status) || attempt >= max_retries) {
+      return 0;
+    }
+    free(r->data); // Try again once the window reopens
+  }
+}
+
+// Function to send a GitHub API request
+int github_request(const char *method, const char *path, const char *body,
+                   size_t body_len, long *status, char **response) {
+  struct github_response r;
+  *status = 0;
+  *response = NULL;
+  if (request_with_etag(method, path, body, body_len, NULL, &r, status) !=
+      0) {
+    return -1;
+  }
+  *response = r.data ? r.data : strdup("");
+  return 0;
+}
+
+static struct cache_entry *cache_find(const char *path) {
+  for (int i = 0; i < cache_limit; i++) {
+    if (cache[i].path && strcmp(cache[i].path, path) == 0) {
+      cache[i].used = ++cache_clock;
+      return &cache[i];
+    }
+  }
+  return NULL;
+}
+
+// Remember a response, replacing the least recently used entry if full
+static void cache_store(const char *path, const char *etag, const char *body) {
+  if (cache_limit == 0) {
+    return;
+  }
+  struct cache_entry *e = cache_find(path);
+  if (!e) {
+    e = &cache[0];
+    for (int i = 0; i < cache_limit; i++) {
+      if (!cache[i].path) {
+        e = &cache[i];
+        break;
+      }
+      if (cache[i].used < e->used) {
+        e = &cache[i];
+      }
+    }
+    free(e->path);
+    e->path = strdup(path);
+  }
+  free(e->body);
+  e->body = strdup(body);
+  snprintf(e->etag, sizeof(e->etag), "%s", etag);
+  e->used = ++cache_clock;
+  if (!e->path || !e->body) {
+    free(e->path);
+    free(e->body);
+    memset(e, 0, sizeof(*e));
+  }
+}
+
+static void release_inflight(struct inflight *f) {
+  if (--f->refs == 0) {
+    free(f->path);
+    free(f->body);
+    free(f);
+  }
+}
+
+// Function to GET through the ETag cache
+int github_get(const char *path, long *status, char **response) {
+  *status = 0;
+  *response = NULL;
+  pthread_mutex_lock(&cache_lock);
+  for (struct inflight *f = inflight_list; f; f = f->next) {
+    if (strcmp(f->path, path) != 0) {
+      continue;
+    }
+    // Someone is already asking; share their answer
+    f->refs++;
+    while (!f->done) {
+      pthread_cond_wait(&inflight_done, &cache_lock);
+    }
+    int result = f->result;
+    *status = f->status;
+    *response = f->body ? strdup(f->body) : NULL;
+    release_inflight(f);
+    pthread_mutex_unlock(&cache_lock);
+    metrics_counter_add("cis_github_coalesced_total", 1);
+    return *response || result != 0 ? result : -1;
+  }
+
+  struct inflight *f = calloc(1, sizeof(*f));
+  if (!f || !(f->path = strdup(path))) {
+    free(f);
+    pthread_mutex_unlock(&cache_lock);
+    return -1;
+  }
+  f->refs = 1;
+  f->next = inflight_list;
+  inflight_list = f;
+  char etag[128] = "";
+  struct cache_entry *cached = cache_find(path);
+  if (cached) {
+    snprintf(etag, sizeof(etag), "%s", cached->etag);
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  struct github_response r;
+  int result = request_with_etag("GET", path, NULL, 0, etag, &r, status);
+
+  pthread_mutex_lock(&cache_lock);
+  if (result == 0 && *status == 304 && !cache_find(path)) {
+    // Evicted while we asked, so the 304 stands for nothing: ask once more
+    // without the ETag to get the body
+    pthread_mutex_unlock(&cache_lock);
+    free(r.data);
+    result = request_with_etag("GET", path, NULL, 0, NULL, &r, status);
+    pthread_mutex_lock(&cache_lock);
+  }
+  if (result == 0 && *status == 304 && (cached = cache_find(path)) != NULL) {
+    // Unchanged, and free as far as the rate limit is concerned
+    free(r.data);
+    r.data = strdup(cached->body);
+    *status = 200;
+    metrics_counter_add("cis_github_cache_hits_total", 1);
+  } else if (result == 0 && *status == 200 && r.etag[0] && r.data) {
+    cache_store(path, r.etag, r.data);
+  }
+  if (result == 0 && !r.data) {
+    r.data = strdup("");
+  }
+  f->result = r.data ? result : -1;
+  f->status = *status;
+  f->body = r.data;
+  f->done = 1;
+  for (struct inflight **p = &inflight_list; *p; p = &(*p)->next) {
+    if (*p == f) {
+      *p = f->next;
+      break;
+    }
+  }
+  pthread_cond_broadcast(&inflight_done);
+  result = f->result;
+  *response = r.data ? strdup(r.data) : NULL;
+  release_inflight(f);
+  pthread_mutex_unlock(&cache_lock);
+  return *response || result != 0 ? result : -1;
+}
+
+// Function to look up a repository's default branch
+int github_default_branch(const char *owner, const char *repo, char *branch,
+                          size_t size) {
+  char path[256];
+  snprintf(path, sizeof(path), "/repos/%s/%s", owner, repo);
+  long status = 0;
+  char *body = NULL;
+  if (github_get(path, &status, &body) != 0 || status != 200) {
+    syslog(LOG_ERR, "Failed to look up %s/%s (HTTP %ld)", owner, repo, status);
+    free(body);
+    return -1;
+  }
+  cJSON *json = cJSON_Parse(body);
+  free(body);
+  cJSON *item = json ? cJSON_GetObjectItem(json, "default_branch") : NULL;
+  int result = -1;
+  if (cJSON_IsString(item) && strlen(item->valuestring) < size) {
+    strcpy(branch, item->valuestring);
+    result = 0;
+  }
+  cJSON_Delete(json);
+  return result;
+}
+
+// Function to build the clone URL of a repository
+int github_clone_url(const char *owner, const char *repo, char *url,
+                     size_t size) {
+  int length = snprintf(url, size, "%s/%s/%s.git", clone_url, owner, repo);
+  return length < 0 || (size_t)length >= size ? -1 : 0;
+}
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE // accept4, struct ucred
+#include "handover.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define RECEIVE_TIMEOUT_SECONDS 10
+// How long a successor may take to start serving before we give up on it
+#define ACK_TIMEOUT_SECONDS 120
+
+struct offer {
+  int server_fd;
+  int listen_fd;
+  void (*on_handover)(void);
+};
+
+static int predecessor_fd = -1; // Connection to the process we took over
+static struct offer offer;
+
+static int unix_address(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    syslog(LOG_ERR, "Handover socket path too long: %s", path);
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+static void set_timeout(int fd, int seconds) {
+  struct timeval tv = {seconds, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+// Function to check that the other end runs as our user. Anyone else could
+// hand us a socket of their choosing, or take ours.
+static int peer_is_us(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+    syslog(LOG_ERR, "Failed to identify handover peer: %s", strerror(errno));
+    return 0;
+  }
+  if (cred.uid != geteuid()) {
+    syslog(LOG_WARNING, "Refusing handover with pid %d of uid %d",
+           (int)cred.pid, (int)cred.uid);
+    metrics_counter_add("cis_handover_refused_total", 1);
+    return 0;
+  }
+  return 1;
+}
+
+// Function to take the listen fd from the running process
+int handover_receive(const char *path) {
+  struct sockaddr_un addr;
+  if (!path || path[0] == '\0' || unix_address(path, &addr) != 0) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    if (errno != ENOENT && errno != ECONNREFUSED) {
+      syslog(LOG_WARNING, "Cannot reach %s for handover: %s", path,
+             strerror(errno));
+    }
+    close(fd);
+    return -1; // Nobody to take over from
+  }
+  if (!peer_is_us(fd)) {
+    close(fd);
+    return -1;
+  }
+  set_timeout(fd, RECEIVE_TIMEOUT_SECONDS);
+
+  char byte;
+  struct iovec iov = {&byte, 1};
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  int listen_fd = -1;
+  if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) == 1) {
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+      memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+  if (listen_fd < 0) {
+    syslog(LOG_ERR, "No listen socket received from %s", path);
+    close(fd);
+    return -1;
+  }
+  syslog(LOG_INFO, "Took over listen socket from the running process");
+  predecessor_fd = fd;
+  return listen_fd;
+}
+
+// Function to let the previous process start draining
+void handover_acknowledge(void) {
+  if (predecessor_fd < 0) {
+    return;
+  }
+  if (write(predecessor_fd, "A", 1) != 1) {
+    syslog(LOG_ERR, "Failed to acknowledge handover: %s", strerror(errno));
+  }
+  close(predecessor_fd);
+  predecessor_fd = -1;
+}
+
+// Serve successors until one acknowledges. A successor that dies before
+// acknowledging changes nothing; we keep serving and wait for the next.
+static void *offer_thread(void *arg) {
+  (void)arg;
+  while (1) {
+    int conn = accept4(offer.server_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      syslog(LOG_ERR, "Handover socket failed: %s", strerror(errno));
+      break;
+    }
+    if (!peer_is_us(conn)) {
+      close(conn);
+      continue;
+    }
+
+    char byte = 'L';
+    struct iovec iov = {&byte, 1};
+    union {
+      char buf[CMSG_SPACE(sizeof(int))];
+      struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &offer.listen_fd, sizeof(int));
+
+    set_timeout(conn, ACK_TIMEOUT_SECONDS);
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != 1 || read(conn, &byte, 1) != 1 ||
+        byte != 'A') {
+      syslog(LOG_WARNING, "Successor did not take over, still serving");
+      metrics_counter_add("cis_handover_failures_total", 1);
+      close(conn);
+      continue;
+    }
+    close(conn);
+    syslog(LOG_INFO, "Successor is serving, handing over");
+    metrics_counter_add("cis_handover_total", 1);
+    offer.on_handover();
+    break;
+  }
+  // The path now belongs to the successor, so it is not unlinked
+  close(offer.server_fd);
+  return NULL;
+}
+
+// Function to offer our listen fd to the next process
+int handover_offer(const char *path, int listen_fd,
+                   void (*on_handover)(void)) {
+  struct sockaddr_un addr;
+  if (!path || path[0] == '\0') {
+    return 0; // Handover disabled
+  }
+  if (unix_address(path, &addr) != 0) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    syslog(LOG_ERR, "Failed to create handover socket: %s", strerror(errno));
+    return -1;
+  }
+  // Whatever is there is stale or belongs to the process we took over from,
+  // which no longer needs it
+  unlink(path);
+  // Only our user may connect; the mode is set before anyone can, and the
+  // peer is still checked in case the directory lets others swap the path
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      chmod(path, 0600) != 0 || listen(fd, 1) != 0) {
+    syslog(LOG_ERR, "Failed to listen on %s: %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  offer.server_fd = fd;
+  offer.listen_fd = listen_fd;
+  offer.on_handover = on_handover;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, offer_thread, NULL) != 0) {
+    syslog(LOG_ERR, "Failed to start handover thread");
+    close(fd);
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
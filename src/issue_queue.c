@@ -0,0 +1,1528 @@
+#include "issue_queue.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cjson/cJSON.h>
+
+#include "clock.h"
+#include "local_queue.h"
+#include "metrics.h"
+#include "shard.h"
+#include "trace.h"
+
+#define MAX_PRIORITY_CLASSES 8
+#define MAX_LABEL_ROUTES 64
+#define MAX_INFLIGHT 64
+#define MAX_KEY 192
+#define BLOOM_BITS (1 << 20)
+#define BLOOM_HASHES 7
+#define REPO_ID_CACHE 256
+#define RECORD_VERSION 2
+
+int DELIVERY_TTL_SECONDS = 86400;
+
+// Each priority class has its own list, issue_queue:<class>, or
+// issue_queue:<node>:<class> when repositories are sharded. Entries are
+// "<enqueue_ms> <owner/repo#number>"; the latest record for each key lives
+// in the issue_pending hash until it is dequeued.
+#define QUEUE_KEY_PREFIX "issue_queue"
+#define PENDING_KEY "issue_pending"
+
+// Releases before priority classes queued on a single list, issue_queue,
+// either the JSON payload itself or its coalescing key with the payload in
+// issue_pending. queue_migrate_legacy moves them into the default class;
+// JSON payloads still waiting in issue_pending are read as they are.
+#define LEGACY_QUEUE_KEY "issue_queue"
+
+// Records name repositories by a small id and carry the body out of line,
+// in cis:blob:<repo id>:<issue>:<enqueue ms>:<length>, which is deleted
+// once the issue completes and otherwise expires after body_ttl_seconds.
+// Blobs are private to one enqueue: bodies come from issue authors, so a
+// key derived from the content would let one issue plant another's text.
+// Version 1 records name a blob by a hash of the body instead.
+#define BLOB_KEY_PREFIX "cis:blob"
+#define REPO_IDS_KEY "cis:repo_ids"
+#define REPO_NAMES_KEY "cis:repo_names"
+#define REPO_SEQ_KEY "cis:repo_id_seq"
+
+// With backend=stream each class is a stream, issue_stream:<class>, read
+// through a consumer group. Entries carry the coalescing key; on delivery
+// the payload moves to issue_inflight (keyed by entry id) until it is acked.
+#define STREAM_KEY_PREFIX "issue_stream"
+#define INFLIGHT_KEY "issue_inflight"
+#define PROGRESS_KEY "cis:consumer_progress"
+
+struct priority_class {
+  char name[32];
+  int weight;
+  int current_weight; // Smooth weighted round robin state
+};
+
+struct label_route {
+  char label[64];
+  char class_name[32];
+};
+
+// Classes are listed from highest to lowest priority
+static struct priority_class classes[MAX_PRIORITY_CLASSES] = {
+    {"critical", 8, 0}, {"high", 4, 0}, {"normal", 2, 0}, {"low", 1, 0}};
+static int class_count = 4;
+static char default_class[32] = "normal";
+static int starvation_seconds = 900;
+static struct label_route label_routes[MAX_LABEL_ROUTES];
+static int label_route_count = 0;
+static pthread_mutex_t scheduler_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int use_streams = 0;
+static int use_local = 0;
+static int spill_to_local = 1;
+static char local_queue_path[256] = "/var/lib/cis/queue.wal";
+static int local_queue_size_mb = 64;
+static int group_commit_ms = 5;
+static char consumer_group[64] = "cis";
+static char consumer_name[128] = "";
+static int claim_idle_seconds = 300;
+static int body_ttl_seconds = 14 * 86400;
+
+// Redis depth as last sampled by a dequeue, plus what was enqueued since,
+// so ingest can see the backlog without a round trip per request
+static long long sampled_depth = 0;
+static long long enqueued_since_sample = 0;
+
+// Repository ids rarely change, so both directions are cached
+struct repo_id_entry {
+  uint32_t id;
+  char name[256];
+};
+static struct repo_id_entry repo_ids[REPO_ID_CACHE];
+static int repo_id_next = 0;
+static pthread_mutex_t repo_id_lock = PTHREAD_MUTEX_INITIALIZER;
+
+_Static_assert(sizeof(struct issue_record) == 32,
+               "issue_record must keep its fixed layout");
+
+// Delivery ids seen while Redis is not in use, in two rotating generations
+// so ids are forgotten after one to two delivery TTLs
+static unsigned char bloom[2][BLOOM_BITS / 8];
+static int bloom_current = 0;
+static time_t bloom_rotated = 0;
+static pthread_mutex_t bloom_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Stream entries this process is working on, renewed by queue_keepalive
+struct inflight_entry {
+  char stream_key[MAX_KEY];
+  char entry_id[64];
+};
+static struct inflight_entry inflight[MAX_INFLIGHT];
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Store the body blob, store the record and only
+// push the entry if the key was not already waiting. A waiting key keeps
+// its class and position; only its record is replaced.
+static const char *ENQUEUE_SCRIPT =
+    "redis.call('SET', KEYS[3], ARGV[4], 'EX', ARGV[5]) "
+    "if redis.call('HSET', KEYS[2], ARGV[1], ARGV[2]) == 1 then "
+    "redis.call('RPUSH', KEYS[1], ARGV[3]) return 1 end "
+    "return 0";
+
+static const char *STREAM_ENQUEUE_SCRIPT =
+    "redis.call('SET', KEYS[3], ARGV[4], 'EX', ARGV[5]) "
+    "if redis.call('HSET', KEYS[2], ARGV[1], ARGV[2]) == 1 then "
+    "redis.call('XADD', KEYS[1], '*', 'key', ARGV[1]) return 1 end "
+    "return 0";
+
+// Look up or allocate the id of a repository
+static const char *REPO_ID_SCRIPT =
+    "local id = redis.call('HGET', KEYS[1], ARGV[1]) "
+    "if id then return tonumber(id) end "
+    "id = redis.call('INCR', KEYS[3]) "
+    "redis.call('HSET', KEYS[1], ARGV[1], id) "
+    "redis.call('HSET', KEYS[2], id, ARGV[1]) "
+    "return id";
+
+// Pop an entry and hand back {entry, latest record}
+static const char *DEQUEUE_SCRIPT =
+    "local e = redis.call('LPOP', KEYS[1]) "
+    "if not e then return false end "
+    "local k = string.match(e, '^%d+ (.*)$') or e "
+    "local v = redis.call('HGET', KEYS[2], k) "
+    "if not v then return {e} end "
+    "redis.call('HDEL', KEYS[2], k) "
+    "return {e, v}";
+
+// Move the latest record of a delivered stream entry into issue_inflight.
+// A reclaimed entry finds its record there already.
+static const char *CLAIM_SCRIPT =
+    "local v = redis.call('HGET', KEYS[2], ARGV[2]) "
+    "if v then return v end "
+    "v = redis.call('HGET', KEYS[1], ARGV[1]) "
+    "if not v then return false end "
+    "redis.call('HDEL', KEYS[1], ARGV[1]) "
+    "redis.call('HSET', KEYS[2], ARGV[2], v) "
+    "return v";
+
+// Move the head of a dead node's list to its new owner if it is unchanged
+static const char *MOVE_HEAD_SCRIPT =
+    "if redis.call('LINDEX', KEYS[1], 0) ~= ARGV[1] then return 0 end "
+    "redis.call('LPOP', KEYS[1]) "
+    "redis.call('RPUSH', KEYS[2], ARGV[1]) "
+    "return 1";
+
+// Re-add a dead node's stream entry on the new owner's stream. Records the
+// dead node had already claimed go back to issue_pending.
+static const char *MOVE_STREAM_ENTRY_SCRIPT =
+    "local v = redis.call('HGET', KEYS[4], ARGV[1]) "
+    "if v then redis.call('HSETNX', KEYS[3], ARGV[2], v) "
+    "redis.call('HDEL', KEYS[4], ARGV[1]) end "
+    "redis.call('XADD', KEYS[2], '*', 'key', ARGV[2]) "
+    "redis.call('XDEL', KEYS[1], ARGV[1]) "
+    "return 1";
+
+static int find_class(const char *name) {
+  for (int i = 0; i < class_count; i++) {
+    if (strcmp(classes[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Build the key of a class queue, scoped to a node when sharding
+static void class_key(char *buf, size_t size, const char *node,
+                      int class_index) {
+  const char *prefix = use_streams ? STREAM_KEY_PREFIX : QUEUE_KEY_PREFIX;
+  if (node) {
+    snprintf(buf, size, "%s:%s:%s", prefix, node, classes[class_index].name);
+  } else {
+    snprintf(buf, size, "%s:%s", prefix, classes[class_index].name);
+  }
+}
+
+// The node whose queues this process serves, NULL when not sharding
+static const char *local_node(void) {
+  return shard_enabled() ? shard_node_id() : NULL;
+}
+
+// Resolve a class name, falling back to the default and then lowest class
+static int resolve_class(const char *name) {
+  int index = name ? find_class(name) : -1;
+  if (index < 0) {
+    index = find_class(default_class);
+  }
+  return index >= 0 ? index : class_count - 1;
+}
+
+// Parse "critical:8,high:4,normal:2,low:1"
+static int parse_classes(const char *value) {
+  char spec[512];
+  snprintf(spec, sizeof(spec), "%s", value);
+
+  int count = 0;
+  char *saveptr = NULL;
+  for (char *tok = strtok_r(spec, ",", &saveptr); tok;
+       tok = strtok_r(NULL, ",", &saveptr)) {
+    if (count == MAX_PRIORITY_CLASSES) {
+      syslog(LOG_ERR, "Too many priority classes, ignoring %s", tok);
+      break;
+    }
+    while (*tok == ' ') {
+      tok++;
+    }
+    char *colon = strchr(tok, ':');
+    int weight = colon ? atoi(colon + 1) : 1;
+    if (colon) {
+      *colon = '\0';
+    }
+    snprintf(classes[count].name, sizeof(classes[count].name), "%s", tok);
+    classes[count].weight = weight > 0 ? weight : 1;
+    classes[count].current_weight = 0;
+    count++;
+  }
+  if (count == 0) {
+    syslog(LOG_ERR, "No priority classes in '%s'", value);
+    return 0;
+  }
+  class_count = count;
+  return 1;
+}
+
+// Function to handle queue related config entries
+int queue_config_handler(const char *section, const char *name,
+                         const char *value) {
+  if (strcmp(section, "Queue") == 0) {
+    if (strcmp(name, "delivery_ttl_seconds") == 0) {
+      DELIVERY_TTL_SECONDS = atoi(value);
+      return 1;
+    } else if (strcmp(name, "backend") == 0) {
+      use_streams = strcmp(value, "stream") == 0;
+      use_local = strcmp(value, "local") == 0;
+      if (!use_streams && !use_local && strcmp(value, "list") != 0) {
+        syslog(LOG_ERR, "Unknown queue backend '%s'", value);
+        return 0;
+      }
+      return 1;
+    } else if (strcmp(name, "consumer_group") == 0) {
+      snprintf(consumer_group, sizeof(consumer_group), "%s", value);
+      return 1;
+    } else if (strcmp(name, "consumer_name") == 0) {
+      snprintf(consumer_name, sizeof(consumer_name), "%s", value);
+      return 1;
+    } else if (strcmp(name, "claim_idle_seconds") == 0) {
+      claim_idle_seconds = atoi(value) > 0 ? atoi(value) : 1;
+      return 1;
+    } else if (strcmp(name, "spill_to_local") == 0) {
+      spill_to_local = atoi(value);
+      return 1;
+    } else if (strcmp(name, "local_queue_path") == 0) {
+      snprintf(local_queue_path, sizeof(local_queue_path), "%s", value);
+      return 1;
+    } else if (strcmp(name, "local_queue_size_mb") == 0) {
+      local_queue_size_mb = atoi(value) > 0 ? atoi(value) : 1;
+      return 1;
+    } else if (strcmp(name, "group_commit_ms") == 0) {
+      group_commit_ms = atoi(value);
+      return 1;
+    } else if (strcmp(name, "body_ttl_seconds") == 0) {
+      body_ttl_seconds = atoi(value) > 0 ? atoi(value) : 1;
+      return 1;
+    }
+  } else if (strcmp(section, "Priority") == 0) {
+    if (strcmp(name, "classes") == 0) {
+      return parse_classes(value);
+    } else if (strcmp(name, "default_class") == 0) {
+      snprintf(default_class, sizeof(default_class), "%s", value);
+      return 1;
+    } else if (strcmp(name, "starvation_seconds") == 0) {
+      starvation_seconds = atoi(value);
+      return 1;
+    } else if (strncmp(name, "label.", 6) == 0) {
+      if (label_route_count == MAX_LABEL_ROUTES) {
+        syslog(LOG_ERR, "Too many label routes, ignoring %s", name);
+        return 0;
+      }
+      struct label_route *route = &label_routes[label_route_count++];
+      snprintf(route->label, sizeof(route->label), "%s", name + 6);
+      snprintf(route->class_name, sizeof(route->class_name), "%s", value);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Function to pick the priority class for a set of issue labels
+const char *priority_class_for_labels(const char **labels, int label_count) {
+  int best = -1;
+  for (int i = 0; i < label_count; i++) {
+    for (int r = 0; r < label_route_count; r++) {
+      if (strcasecmp(labels[i], label_routes[r].label) != 0) {
+        continue;
+      }
+      int class_index = find_class(label_routes[r].class_name);
+      if (class_index >= 0 && (best < 0 || class_index < best)) {
+        best = class_index;
+      }
+    }
+  }
+  return best >= 0 ? classes[best].name : default_class;
+}
+
+// Re-establish a dropped Redis connection, at most once a second per thread
+static int ensure_connected(redisContext *redis_ctx) {
+  static __thread time_t last_attempt = 0;
+  if (!redis_ctx) {
+    return -1;
+  }
+  if (!redis_ctx->err) {
+    return 0;
+  }
+  time_t now = time(NULL);
+  if (now == last_attempt) {
+    return -1;
+  }
+  last_attempt = now;
+  if (redisReconnect(redis_ctx) != REDIS_OK) {
+    return -1;
+  }
+  syslog(LOG_INFO, "Reconnected to Redis");
+  return 0;
+}
+
+// Check a delivery id against the local Bloom filter and add it. Returns 1
+// if it was (probably) seen before.
+static int bloom_check_and_add(const char *delivery_id) {
+  uint64_t h1 = 1469598103934665603ULL;
+  for (const unsigned char *p = (const unsigned char *)delivery_id; *p; p++) {
+    h1 = (h1 ^ *p) * 1099511628211ULL;
+  }
+  uint64_t h2 = (h1 >> 33) | 1;
+
+  pthread_mutex_lock(&bloom_lock);
+  time_t now = time(NULL);
+  if (now - bloom_rotated >= DELIVERY_TTL_SECONDS) {
+    bloom_current ^= 1;
+    memset(bloom[bloom_current], 0, sizeof(bloom[bloom_current]));
+    bloom_rotated = now;
+  }
+  int seen[2] = {1, 1};
+  for (int i = 0; i < BLOOM_HASHES; i++) {
+    uint64_t bit = (h1 + (uint64_t)i * h2) % BLOOM_BITS;
+    for (int g = 0; g < 2; g++) {
+      if (!(bloom[g][bit / 8] & (1 << (bit % 8)))) {
+        seen[g] = 0;
+      }
+    }
+    bloom[bloom_current][bit / 8] |= 1 << (bit % 8);
+  }
+  pthread_mutex_unlock(&bloom_lock);
+  return seen[0] || seen[1];
+}
+
+// Function to record a webhook delivery id
+int mark_delivery_seen(redisContext *redis_ctx, const char *delivery_id) {
+  if (!delivery_id || delivery_id[0] == '\0') {
+    return 1; // Nothing to deduplicate on
+  }
+  if (use_local || ensure_connected(redis_ctx) != 0) {
+    return bloom_check_and_add(delivery_id) ? 0 : 1;
+  }
+
+  redisReply *reply =
+      redisCommand(redis_ctx, "SET cis:delivery:%s 1 NX EX %d", delivery_id,
+                   DELIVERY_TTL_SECONDS);
+  if (!reply) {
+    syslog(LOG_ERR, "Failed to record delivery %s in Redis", delivery_id);
+    return bloom_check_and_add(delivery_id) ? 0 : -1;
+  }
+
+  int result;
+  if (reply->type == REDIS_REPLY_NIL) {
+    result = 0;
+  } else if (reply->type == REDIS_REPLY_ERROR) {
+    syslog(LOG_ERR, "Redis error recording delivery %s: %s", delivery_id,
+           reply->str);
+    result = -1;
+  } else {
+    result = 1;
+  }
+  freeReplyObject(reply);
+  return result;
+}
+
+// Function to forget a webhook delivery id
+void forget_delivery(redisContext *redis_ctx, const char *delivery_id) {
+  if (!delivery_id || delivery_id[0] == '\0' || use_local ||
+      ensure_connected(redis_ctx) != 0) {
+    return;
+  }
+  redisReply *reply =
+      redisCommand(redis_ctx, "DEL cis:delivery:%s", delivery_id);
+  if (reply) {
+    freeReplyObject(reply);
+  }
+}
+
+static void blob_key(char *buf, size_t size, const struct issue_record *rec) {
+  if (rec->version == 1) {
+    snprintf(buf, size, "%s:%016llx:%u", BLOB_KEY_PREFIX,
+             (unsigned long long)rec->body_hash, rec->body_length);
+    return;
+  }
+  snprintf(buf, size, "%s:%u:%d:%lld:%u", BLOB_KEY_PREFIX, rec->repo_id,
+           rec->issue_number, (long long)rec->enqueued_ms, rec->body_length);
+}
+
+static void repo_id_remember(uint32_t id, const char *name) {
+  pthread_mutex_lock(&repo_id_lock);
+  struct repo_id_entry *entry = &repo_ids[repo_id_next];
+  repo_id_next = (repo_id_next + 1) % REPO_ID_CACHE;
+  entry->id = id;
+  snprintf(entry->name, sizeof(entry->name), "%s", name);
+  pthread_mutex_unlock(&repo_id_lock);
+}
+
+// Look up the id of a repository, allocating one on first use. Returns 0
+// on failure; ids start at 1.
+static uint32_t repo_id_for(redisContext *redis_ctx, const char *name) {
+  pthread_mutex_lock(&repo_id_lock);
+  for (int i = 0; i < REPO_ID_CACHE; i++) {
+    if (repo_ids[i].id != 0 && strcmp(repo_ids[i].name, name) == 0) {
+      uint32_t id = repo_ids[i].id;
+      pthread_mutex_unlock(&repo_id_lock);
+      return id;
+    }
+  }
+  pthread_mutex_unlock(&repo_id_lock);
+
+  redisReply *reply =
+      redisCommand(redis_ctx, "EVAL %s 3 %s %s %s %s", REPO_ID_SCRIPT,
+                   REPO_IDS_KEY, REPO_NAMES_KEY, REPO_SEQ_KEY, name);
+  uint32_t id = 0;
+  if (reply && reply->type == REDIS_REPLY_INTEGER) {
+    id = (uint32_t)reply->integer;
+    repo_id_remember(id, name);
+  } else {
+    syslog(LOG_ERR, "Failed to look up repository id for %s", name);
+  }
+  freeReplyObject(reply);
+  return id;
+}
+
+// Function to resolve a repository id back to its name
+static int repo_name_for(redisContext *redis_ctx, uint32_t id, char *name,
+                         size_t size) {
+  pthread_mutex_lock(&repo_id_lock);
+  for (int i = 0; i < REPO_ID_CACHE; i++) {
+    if (repo_ids[i].id == id) {
+      snprintf(name, size, "%s", repo_ids[i].name);
+      pthread_mutex_unlock(&repo_id_lock);
+      return 0;
+    }
+  }
+  pthread_mutex_unlock(&repo_id_lock);
+
+  redisReply *reply =
+      redisCommand(redis_ctx, "HGET %s %u", REPO_NAMES_KEY, id);
+  int result = -1;
+  if (reply && reply->type == REDIS_REPLY_STRING) {
+    snprintf(name, size, "%s", reply->str);
+    repo_id_remember(id, reply->str);
+    result = 0;
+  } else {
+    syslog(LOG_ERR, "Unknown repository id %u", id);
+  }
+  freeReplyObject(reply);
+  return result;
+}
+
+static int enqueue_redis(redisContext *redis_ctx, const char *repo_full_name,
+                         int issue_number, const char *priority_class,
+                         const char *issue_title, const char *issue_body) {
+  if (ensure_connected(redis_ctx) != 0) {
+    return -1;
+  }
+  struct issue_record rec = {0};
+  rec.version = RECORD_VERSION;
+  rec.repo_id = repo_id_for(redis_ctx, repo_full_name);
+  if (rec.repo_id == 0) {
+    return -1;
+  }
+  rec.issue_number = issue_number;
+  rec.body_length = (uint32_t)strlen(issue_body);
+  rec.enqueued_ms = wall_ms();
+
+  // The record is followed by the title, which every stage needs
+  size_t title_length = strlen(issue_title);
+  char *value = malloc(sizeof(rec) + title_length);
+  if (!value) {
+    syslog(LOG_ERR, "Failed to allocate queue record");
+    return -1;
+  }
+  memcpy(value, &rec, sizeof(rec));
+  memcpy(value + sizeof(rec), issue_title, title_length);
+  char body_key[MAX_KEY];
+  blob_key(body_key, sizeof(body_key), &rec);
+
+  int class_index = resolve_class(priority_class);
+  priority_class = classes[class_index].name;
+
+  char coalesce_key[320];
+  char entry[352];
+  char queue_key[MAX_KEY];
+  snprintf(coalesce_key, sizeof(coalesce_key), "%s#%d", repo_full_name,
+           issue_number);
+  snprintf(entry, sizeof(entry), "%lld %s", (long long)rec.enqueued_ms,
+           coalesce_key);
+  if (shard_enabled()) {
+    // Route to the node owning the repository so its caches stay warm
+    char owner[64];
+    shard_owner(repo_full_name, owner, sizeof(owner));
+    class_key(queue_key, sizeof(queue_key), owner, class_index);
+  } else {
+    class_key(queue_key, sizeof(queue_key), NULL, class_index);
+  }
+
+  redisReply *reply = redisCommand(
+      redis_ctx, "EVAL %s 3 %s %s %s %s %b %s %b %d",
+      use_streams ? STREAM_ENQUEUE_SCRIPT : ENQUEUE_SCRIPT, queue_key,
+      PENDING_KEY, body_key, coalesce_key, value, sizeof(rec) + title_length,
+      entry, issue_body, (size_t)rec.body_length, body_ttl_seconds);
+  free(value);
+  if (!reply) {
+    syslog(LOG_ERR, "Failed to enqueue issue in Redis");
+    return -1;
+  }
+  if (reply->type == REDIS_REPLY_ERROR) {
+    syslog(LOG_ERR, "Redis error enqueuing issue %s: %s", coalesce_key,
+           reply->str);
+    freeReplyObject(reply);
+    return -1;
+  }
+  if (reply->type == REDIS_REPLY_INTEGER && reply->integer == 0) {
+    syslog(LOG_INFO, "Coalesced pending event for %s", coalesce_key);
+    metrics_counter_add("cis_queue_coalesced_total", 1);
+  } else {
+    char metric[96];
+    snprintf(metric, sizeof(metric), "cis_queue_enqueued_total{class=\"%s\"}",
+             priority_class);
+    metrics_counter_add(metric, 1);
+  }
+  freeReplyObject(reply);
+  TRACE3(issue__enqueue, issue_number, rec.body_length, priority_class);
+  return 0;
+}
+
+// Function to enqueue issue in Redis, spilling to the local queue while
+// Redis is unreachable
+int enqueue_issue(redisContext *redis_ctx, const char *repo_full_name,
+                  int issue_number, const char *priority_class,
+                  const char *issue_title, const char *issue_body) {
+  if (use_local) {
+    return local_queue_append(priority_class, repo_full_name, issue_number,
+                              issue_title, issue_body);
+  }
+  if (enqueue_redis(redis_ctx, repo_full_name, issue_number, priority_class,
+                    issue_title, issue_body) == 0) {
+    __atomic_add_fetch(&enqueued_since_sample, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  if (!spill_to_local || !local_queue_is_open()) {
+    return -1;
+  }
+  if (local_queue_append(priority_class, repo_full_name, issue_number,
+                         issue_title, issue_body) != 0) {
+    return -1;
+  }
+  syslog(LOG_INFO, "Redis unavailable, spooled %s#%d to the local queue",
+         repo_full_name, issue_number);
+  metrics_counter_add("cis_local_queue_spilled_total", 1);
+  return 1;
+}
+
+// Pick the class to serve next. Starving classes (oldest entry waiting
+// longer than starvation_seconds) win, oldest first; otherwise non-empty
+// classes are served by smooth weighted round robin.
+static int pick_class(const long long *depth, const long long *head_age_ms) {
+  long long starvation_ms = (long long)starvation_seconds * 1000;
+  int starving = -1;
+  for (int i = 0; i < class_count; i++) {
+    if (depth[i] > 0 && starvation_ms > 0 && head_age_ms[i] > starvation_ms &&
+        (starving < 0 || head_age_ms[i] > head_age_ms[starving])) {
+      starving = i;
+    }
+  }
+  if (starving >= 0) {
+    return starving;
+  }
+
+  int total = 0;
+  int chosen = -1;
+  for (int i = 0; i < class_count; i++) {
+    if (depth[i] == 0) {
+      continue;
+    }
+    classes[i].current_weight += classes[i].weight;
+    total += classes[i].weight;
+    if (chosen < 0 ||
+        classes[i].current_weight > classes[chosen].current_weight) {
+      chosen = i;
+    }
+  }
+  if (chosen >= 0) {
+    classes[chosen].current_weight -= total;
+  }
+  return chosen;
+}
+
+static void record_dequeue(int class_index, long long wait_ms) {
+  char metric[96];
+  snprintf(metric, sizeof(metric), "cis_queue_dequeued_total{class=\"%s\"}",
+           classes[class_index].name);
+  metrics_counter_add(metric, 1);
+  snprintf(metric, sizeof(metric), "cis_queue_wait_ms_total{class=\"%s\"}",
+           classes[class_index].name);
+  metrics_counter_add(metric, wait_ms);
+  snprintf(metric, sizeof(metric), "cis_queue_wait_ms_max{class=\"%s\"}",
+           classes[class_index].name);
+  metrics_gauge_max(metric, wait_ms);
+  syslog(LOG_INFO, "Dequeued %s issue after %lld ms in queue",
+         classes[class_index].name, wait_ms);
+}
+
+// Sample depth and head age of every class in one round trip
+static int sample_classes(redisContext *redis_ctx, long long *depth,
+                          long long *head_age_ms) {
+  long long now = wall_ms();
+  char metric[96];
+  long long total = 0;
+
+  for (int i = 0; i < class_count; i++) {
+    char key[MAX_KEY];
+    class_key(key, sizeof(key), local_node(), i);
+    if (use_streams) {
+      redisAppendCommand(redis_ctx, "XLEN %s", key);
+      redisAppendCommand(redis_ctx, "XRANGE %s - + COUNT 1", key);
+    } else {
+      redisAppendCommand(redis_ctx, "LLEN %s", key);
+      redisAppendCommand(redis_ctx, "LINDEX %s 0", key);
+    }
+  }
+  for (int i = 0; i < class_count; i++) {
+    redisReply *reply = NULL;
+    if (redisGetReply(redis_ctx, (void **)&reply) != REDIS_OK || !reply) {
+      syslog(LOG_ERR, "Failed to read queue depth from Redis");
+      return -1;
+    }
+    depth[i] = reply->type == REDIS_REPLY_INTEGER ? reply->integer : 0;
+    total += depth[i];
+    freeReplyObject(reply);
+
+    reply = NULL;
+    if (redisGetReply(redis_ctx, (void **)&reply) != REDIS_OK || !reply) {
+      syslog(LOG_ERR, "Failed to read queue head from Redis");
+      return -1;
+    }
+    head_age_ms[i] = 0;
+    if (reply->type == REDIS_REPLY_STRING) {
+      head_age_ms[i] = now - atoll(reply->str);
+    } else if (reply->type == REDIS_REPLY_ARRAY && reply->elements > 0 &&
+               reply->element[0]->type == REDIS_REPLY_ARRAY &&
+               reply->element[0]->elements > 0) {
+      // Stream ids start with the millisecond timestamp of the XADD
+      head_age_ms[i] = now - atoll(reply->element[0]->element[0]->str);
+    }
+    freeReplyObject(reply);
+
+    snprintf(metric, sizeof(metric), "cis_queue_depth{class=\"%s\"}",
+             classes[i].name);
+    metrics_gauge_set(metric, depth[i]);
+    snprintf(metric, sizeof(metric), "cis_queue_oldest_age_ms{class=\"%s\"}",
+             classes[i].name);
+    metrics_gauge_set(metric, head_age_ms[i]);
+  }
+  __atomic_store_n(&sampled_depth, total, __ATOMIC_RELAXED);
+  __atomic_store_n(&enqueued_since_sample, 0, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// Function to estimate the queue depth
+long long queue_depth_estimate(void) {
+  long long depth = local_queue_is_open() ? local_queue_depth() : 0;
+  if (!use_local) {
+    depth += __atomic_load_n(&sampled_depth, __ATOMIC_RELAXED) +
+             __atomic_load_n(&enqueued_since_sample, __ATOMIC_RELAXED);
+  }
+  return depth;
+}
+
+// An issue payload in the JSON format of earlier releases
+struct legacy_issue {
+  cJSON *json; // Owns the strings below
+  const char *repo_full_name;
+  int issue_number;
+  const char *issue_title;
+  const char *issue_body;
+};
+
+// Parse a legacy payload. Returns 0 on success; free issue->json after.
+static int parse_legacy(const char *text, struct legacy_issue *issue) {
+  issue->json = cJSON_Parse(text);
+  cJSON *repo = cJSON_GetObjectItem(issue->json, "repository");
+  cJSON *number = cJSON_GetObjectItem(issue->json, "issue_number");
+  cJSON *title = cJSON_GetObjectItem(issue->json, "issue_title");
+  cJSON *body = cJSON_GetObjectItem(issue->json, "issue_body");
+  if (!cJSON_IsString(repo) || !cJSON_IsNumber(number) ||
+      !cJSON_IsString(title) || !cJSON_IsString(body)) {
+    syslog(LOG_ERR, "Dropping malformed legacy queue payload");
+    cJSON_Delete(issue->json);
+    issue->json = NULL;
+    return -1;
+  }
+  issue->repo_full_name = repo->valuestring;
+  issue->issue_number = number->valueint;
+  issue->issue_title = title->valuestring;
+  issue->issue_body = body->valuestring;
+  return 0;
+}
+
+// Turn a legacy payload into a queued issue carrying its body inline
+static struct queued_issue *item_from_legacy(redisContext *redis_ctx,
+                                             const char *text) {
+  struct legacy_issue issue;
+  if (parse_legacy(text, &issue) != 0) {
+    return NULL;
+  }
+  struct queued_issue *item = calloc(1, sizeof(*item));
+  if (item) {
+    item->record.version = RECORD_VERSION;
+    item->record.issue_number = issue.issue_number;
+    item->record.body_length = (uint32_t)strlen(issue.issue_body);
+    item->record.enqueued_ms = wall_ms();
+    item->redis_ctx = redis_ctx;
+    snprintf(item->repo_full_name, sizeof(item->repo_full_name), "%s",
+             issue.repo_full_name);
+    item->issue_title = strdup(issue.issue_title);
+    item->issue_body = strdup(issue.issue_body);
+  }
+  cJSON_Delete(issue.json);
+  if (!item || !item->issue_title || !item->issue_body) {
+    syslog(LOG_ERR, "Failed to duplicate issue data");
+    if (item) {
+      free(item->issue_title);
+      free(item->issue_body);
+    }
+    free(item);
+    return NULL;
+  }
+  return item;
+}
+
+// Turn a stored record back into a queued issue. The body stays in its
+// blob until queued_issue_body asks for it.
+static struct queued_issue *item_from_record(redisContext *redis_ctx,
+                                             const redisReply *value) {
+  if (value->type == REDIS_REPLY_STRING && value->len > 0 &&
+      value->str[0] == '{') {
+    return item_from_legacy(redis_ctx, value->str);
+  }
+  struct issue_record rec;
+  if (value->type != REDIS_REPLY_STRING || value->len < sizeof(rec)) {
+    syslog(LOG_ERR, "Dropping malformed queue record");
+    return NULL;
+  }
+  memcpy(&rec, value->str, sizeof(rec));
+  if (rec.version != RECORD_VERSION && rec.version != 1) {
+    syslog(LOG_ERR, "Dropping queue record with version %u", rec.version);
+    return NULL;
+  }
+
+  struct queued_issue *item = calloc(1, sizeof(*item));
+  if (!item) {
+    syslog(LOG_ERR, "Failed to allocate queued issue");
+    return NULL;
+  }
+  item->record = rec;
+  item->redis_ctx = redis_ctx;
+  item->issue_title =
+      strndup(value->str + sizeof(rec), value->len - sizeof(rec));
+  if (!item->issue_title ||
+      repo_name_for(redis_ctx, rec.repo_id, item->repo_full_name,
+                    sizeof(item->repo_full_name)) != 0) {
+    free(item->issue_title);
+    free(item);
+    return NULL;
+  }
+  return item;
+}
+
+// Function to fetch the body of a queued issue from the blob store
+const char *queued_issue_body(struct queued_issue *item) {
+  if (item->issue_body) {
+    return item->issue_body;
+  }
+  if (ensure_connected(item->redis_ctx) != 0) {
+    return NULL;
+  }
+  char body_key[MAX_KEY];
+  blob_key(body_key, sizeof(body_key), &item->record);
+  redisReply *reply = redisCommand(item->redis_ctx, "GET %s", body_key);
+  if (!reply || reply->type != REDIS_REPLY_STRING ||
+      reply->len != item->record.body_length) {
+    syslog(LOG_ERR, "Body of %s#%d is no longer available",
+           item->repo_full_name, item->record.issue_number);
+    freeReplyObject(reply);
+    return NULL;
+  }
+  item->issue_body = malloc(reply->len + 1);
+  if (item->issue_body) {
+    memcpy(item->issue_body, reply->str, reply->len);
+    item->issue_body[reply->len] = '\0';
+    metrics_counter_add("cis_queue_body_bytes_fetched_total", reply->len);
+  }
+  freeReplyObject(reply);
+  return item->issue_body;
+}
+
+static struct queued_issue *dequeue_list(redisContext *redis_ctx,
+                                         int class_index) {
+  char queue_key[MAX_KEY];
+  class_key(queue_key, sizeof(queue_key), local_node(), class_index);
+  redisReply *reply = redisCommand(redis_ctx, "EVAL %s 2 %s %s",
+                                   DEQUEUE_SCRIPT, queue_key, PENDING_KEY);
+  if (!reply) {
+    syslog(LOG_ERR, "Failed to dequeue issue from Redis");
+    return NULL;
+  }
+  if (reply->type == REDIS_REPLY_NIL) {
+    freeReplyObject(reply);
+    return NULL; // Another worker took it first
+  }
+  if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 1) {
+    syslog(LOG_ERR, "No record for queue entry %s", reply->element[0]->str);
+    freeReplyObject(reply);
+    return NULL;
+  }
+  if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+    syslog(LOG_ERR, "Unexpected dequeue reply from Redis: %s",
+           reply->type == REDIS_REPLY_ERROR ? reply->str : "bad type");
+    freeReplyObject(reply);
+    return NULL;
+  }
+
+  record_dequeue(class_index, wall_ms() - atoll(reply->element[0]->str));
+
+  struct queued_issue *item = item_from_record(redis_ctx, reply->element[1]);
+  if (item) {
+    snprintf(item->queue_key, sizeof(item->queue_key), "%s", queue_key);
+  }
+  freeReplyObject(reply);
+  return item;
+}
+
+// Extract the id and coalescing key of a [id, [field, value, ...]] entry
+static int parse_stream_entry(const redisReply *entry, char *id,
+                              size_t id_size, char *key, size_t key_size) {
+  if (entry->type != REDIS_REPLY_ARRAY || entry->elements < 2 ||
+      entry->element[0]->type != REDIS_REPLY_STRING) {
+    return -1;
+  }
+  snprintf(id, id_size, "%s", entry->element[0]->str);
+  const redisReply *fields = entry->element[1];
+  if (fields->type != REDIS_REPLY_ARRAY) {
+    return -1; // Entry was deleted while pending
+  }
+  for (size_t i = 0; i + 1 < fields->elements; i += 2) {
+    if (strcmp(fields->element[i]->str, "key") == 0) {
+      snprintf(key, key_size, "%s", fields->element[i + 1]->str);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static void inflight_add(const char *stream_key, const char *entry_id) {
+  pthread_mutex_lock(&inflight_lock);
+  for (int i = 0; i < MAX_INFLIGHT; i++) {
+    if (inflight[i].entry_id[0] == '\0') {
+      snprintf(inflight[i].stream_key, sizeof(inflight[i].stream_key), "%s",
+               stream_key);
+      snprintf(inflight[i].entry_id, sizeof(inflight[i].entry_id), "%s",
+               entry_id);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&inflight_lock);
+}
+
+static void inflight_remove(const char *stream_key, const char *entry_id) {
+  pthread_mutex_lock(&inflight_lock);
+  for (int i = 0; i < MAX_INFLIGHT; i++) {
+    if (strcmp(inflight[i].entry_id, entry_id) == 0 &&
+        strcmp(inflight[i].stream_key, stream_key) == 0) {
+      inflight[i].entry_id[0] = '\0';
+      break;
+    }
+  }
+  pthread_mutex_unlock(&inflight_lock);
+}
+
+// Turn a delivered stream entry into a queued issue, moving its record
+// from issue_pending to issue_inflight so a reclaiming node can find it
+static struct queued_issue *claim_stream_entry(redisContext *redis_ctx,
+                                               const char *stream_key,
+                                               const redisReply *entry,
+                                               int class_index) {
+  char entry_id[64];
+  char coalesce_key[320];
+  if (parse_stream_entry(entry, entry_id, sizeof(entry_id), coalesce_key,
+                         sizeof(coalesce_key)) != 0) {
+    syslog(LOG_ERR, "Dropping malformed entry from %s", stream_key);
+    if (entry->type == REDIS_REPLY_ARRAY && entry->elements > 0) {
+      freeReplyObject(redisCommand(redis_ctx, "XACK %s %s %s", stream_key,
+                                   consumer_group,
+                                   entry->element[0]->str));
+    }
+    return NULL;
+  }
+
+  redisReply *reply =
+      redisCommand(redis_ctx, "EVAL %s 2 %s %s %s %s", CLAIM_SCRIPT,
+                   PENDING_KEY, INFLIGHT_KEY, coalesce_key, entry_id);
+  if (!reply) {
+    syslog(LOG_ERR, "Failed to claim issue record from Redis");
+    return NULL;
+  }
+  if (reply->type != REDIS_REPLY_STRING) {
+    syslog(LOG_ERR, "No record for stream entry %s (%s)", entry_id,
+           coalesce_key);
+    freeReplyObject(reply);
+    freeReplyObject(redisCommand(redis_ctx, "XACK %s %s %s", stream_key,
+                                 consumer_group, entry_id));
+    return NULL;
+  }
+
+  struct queued_issue *item = item_from_record(redis_ctx, reply);
+  freeReplyObject(reply);
+  if (!item) {
+    freeReplyObject(redisCommand(redis_ctx, "XACK %s %s %s", stream_key,
+                                 consumer_group, entry_id));
+    return NULL;
+  }
+  snprintf(item->queue_key, sizeof(item->queue_key), "%s", stream_key);
+  snprintf(item->entry_id, sizeof(item->entry_id), "%s", entry_id);
+
+  inflight_add(stream_key, entry_id);
+  record_dequeue(class_index, wall_ms() - atoll(entry_id));
+  return item;
+}
+
+// Reclaim entries whose consumer stopped renewing them
+static struct queued_issue *reclaim_stream(redisContext *redis_ctx) {
+  static long long last_claim_ms = 0;
+  long long now = wall_ms();
+  long long interval_ms = (long long)claim_idle_seconds * 1000 / 4;
+  if (now - __atomic_load_n(&last_claim_ms, __ATOMIC_RELAXED) < interval_ms) {
+    return NULL;
+  }
+  __atomic_store_n(&last_claim_ms, now, __ATOMIC_RELAXED);
+
+  for (int i = 0; i < class_count; i++) {
+    char stream_key[MAX_KEY];
+    class_key(stream_key, sizeof(stream_key), local_node(), i);
+    redisReply *reply = redisCommand(
+        redis_ctx, "XAUTOCLAIM %s %s %s %lld 0-0 COUNT 1", stream_key,
+        consumer_group, consumer_name, (long long)claim_idle_seconds * 1000);
+    if (!reply) {
+      syslog(LOG_ERR, "Failed to reclaim entries from %s", stream_key);
+      return NULL;
+    }
+    struct queued_issue *item = NULL;
+    if (reply->type == REDIS_REPLY_ARRAY && reply->elements >= 2 &&
+        reply->element[1]->type == REDIS_REPLY_ARRAY &&
+        reply->element[1]->elements > 0) {
+      syslog(LOG_INFO, "Reclaimed abandoned entry from %s", stream_key);
+      metrics_counter_add("cis_stream_reclaimed_total", 1);
+      item = claim_stream_entry(redis_ctx, stream_key,
+                                reply->element[1]->element[0], i);
+    }
+    freeReplyObject(reply);
+    if (item) {
+      return item;
+    }
+  }
+  return NULL;
+}
+
+// Create the consumer group of a class stream, and the stream with it
+static int join_group(redisContext *redis_ctx, const char *stream_key) {
+  redisReply *reply = redisCommand(
+      redis_ctx, "XGROUP CREATE %s %s 0 MKSTREAM", stream_key,
+      consumer_group);
+  if (!reply) {
+    syslog(LOG_ERR, "Failed to create consumer group %s", consumer_group);
+    return -1;
+  }
+  if (reply->type == REDIS_REPLY_ERROR &&
+      strncmp(reply->str, "BUSYGROUP", 9) != 0) {
+    syslog(LOG_ERR, "Redis error creating consumer group: %s", reply->str);
+    freeReplyObject(reply);
+    return -1;
+  }
+  freeReplyObject(reply);
+  return 0;
+}
+
+static struct queued_issue *read_stream(redisContext *redis_ctx,
+                                        int class_index) {
+  char stream_key[MAX_KEY];
+  class_key(stream_key, sizeof(stream_key), local_node(), class_index);
+  redisReply *reply = redisCommand(
+      redis_ctx, "XREADGROUP GROUP %s %s COUNT 1 STREAMS %s >",
+      consumer_group, consumer_name, stream_key);
+  if (!reply) {
+    syslog(LOG_ERR, "Failed to read from %s", stream_key);
+    return NULL;
+  }
+  struct queued_issue *item = NULL;
+  if (reply->type == REDIS_REPLY_ARRAY && reply->elements > 0) {
+    const redisReply *entries = reply->element[0]->element[1];
+    if (entries->type == REDIS_REPLY_ARRAY && entries->elements > 0) {
+      item = claim_stream_entry(redis_ctx, stream_key, entries->element[0],
+                                class_index);
+    }
+  } else if (reply->type == REDIS_REPLY_ERROR &&
+             strncmp(reply->str, "NOGROUP", 7) == 0) {
+    // Another node took this node for dead and swept the stream
+    syslog(LOG_INFO, "Consumer group of %s is gone, joining again",
+           stream_key);
+    join_group(redis_ctx, stream_key);
+  } else if (reply->type == REDIS_REPLY_ERROR) {
+    syslog(LOG_ERR, "Redis error reading %s: %s", stream_key, reply->str);
+  }
+  freeReplyObject(reply);
+  return item;
+}
+
+// Function to name this process's consumer unless the config did
+void queue_name_consumer(void) {
+  if (consumer_name[0] == '\0') {
+    char host[64] = "cis";
+    gethostname(host, sizeof(host) - 1);
+    snprintf(consumer_name, sizeof(consumer_name), "%s-%d", host, getpid());
+  }
+}
+
+// Function to join the consumer groups for the stream backend
+int queue_init(redisContext *redis_ctx) {
+  if (!use_streams) {
+    return 0;
+  }
+  for (int i = 0; i < class_count; i++) {
+    char stream_key[MAX_KEY];
+    class_key(stream_key, sizeof(stream_key), local_node(), i);
+    if (join_group(redis_ctx, stream_key) != 0) {
+      return -1;
+    }
+  }
+  syslog(LOG_INFO, "Joined consumer group %s as %s", consumer_group,
+         consumer_name);
+  return 0;
+}
+
+static struct queued_issue *dequeue_local(void) {
+  struct local_record record;
+  if (local_queue_take(&record) != 1) {
+    return NULL;
+  }
+  // The local queue keeps title and body inline, so nothing is deferred
+  struct queued_issue *item = calloc(1, sizeof(*item));
+  if (item) {
+    item->record.version = RECORD_VERSION;
+    item->record.issue_number = record.issue_number;
+    item->record.body_length = (uint32_t)strlen(record.issue_body);
+    item->record.enqueued_ms = wall_ms();
+    snprintf(item->repo_full_name, sizeof(item->repo_full_name), "%s",
+             record.repo_full_name);
+    item->issue_title = strdup(record.issue_title);
+    item->issue_body = strdup(record.issue_body);
+    snprintf(item->queue_key, sizeof(item->queue_key), "local");
+  }
+  local_record_free(&record);
+  if (!item || !item->issue_title || !item->issue_body) {
+    syslog(LOG_ERR, "Failed to duplicate issue data");
+    if (item) {
+      free(item->issue_title);
+      free(item->issue_body);
+    }
+    free(item);
+    return NULL;
+  }
+  return item;
+}
+
+// Function to dequeue issue from Redis
+struct queued_issue *dequeue_issue(redisContext *redis_ctx) {
+  long long depth[MAX_PRIORITY_CLASSES] = {0};
+  long long head_age_ms[MAX_PRIORITY_CLASSES] = {0};
+
+  if (use_local) {
+    return dequeue_local();
+  }
+  if (ensure_connected(redis_ctx) != 0) {
+    return NULL;
+  }
+
+  if (use_streams) {
+    struct queued_issue *item = reclaim_stream(redis_ctx);
+    if (item) {
+      return item;
+    }
+  }
+
+  if (sample_classes(redis_ctx, depth, head_age_ms) != 0) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&scheduler_lock);
+  int chosen = pick_class(depth, head_age_ms);
+  pthread_mutex_unlock(&scheduler_lock);
+  if (chosen < 0) {
+    return NULL; // No issues in queue
+  }
+
+  if (!use_streams) {
+    return dequeue_list(redis_ctx, chosen);
+  }
+
+  // Stream lengths include entries other consumers hold, so fall back to
+  // the remaining classes in priority order if the chosen one has nothing
+  // new to deliver
+  struct queued_issue *item = read_stream(redis_ctx, chosen);
+  for (int i = 0; !item && i < class_count; i++) {
+    if (i != chosen && depth[i] > 0) {
+      item = read_stream(redis_ctx, i);
+    }
+  }
+  return item;
+}
+
+// Function to acknowledge a processed issue and release it
+void complete_issue(redisContext *redis_ctx, struct queued_issue *item) {
+  if (!item) {
+    return;
+  }
+  if (item->entry_id[0] != '\0' && ensure_connected(redis_ctx) == 0) {
+    redisAppendCommand(redis_ctx, "XACK %s %s %s", item->queue_key,
+                       consumer_group, item->entry_id);
+    redisAppendCommand(redis_ctx, "XDEL %s %s", item->queue_key,
+                       item->entry_id);
+    redisAppendCommand(redis_ctx, "HDEL %s %s", INFLIGHT_KEY, item->entry_id);
+    redisAppendCommand(redis_ctx, "HINCRBY %s %s 1", PROGRESS_KEY,
+                       consumer_name);
+    for (int i = 0; i < 4; i++) {
+      redisReply *reply = NULL;
+      if (redisGetReply(redis_ctx, (void **)&reply) != REDIS_OK) {
+        syslog(LOG_ERR, "Failed to acknowledge entry %s", item->entry_id);
+        break;
+      }
+      freeReplyObject(reply);
+    }
+    inflight_remove(item->queue_key, item->entry_id);
+    metrics_counter_add("cis_stream_acked_total", 1);
+  }
+  // Current blobs belong to this record alone. Legacy and local items carry
+  // their body inline and have no repository id.
+  if (item->record.version == RECORD_VERSION && item->record.repo_id != 0 &&
+      ensure_connected(redis_ctx) == 0) {
+    char body_key[MAX_KEY];
+    blob_key(body_key, sizeof(body_key), &item->record);
+    freeReplyObject(redisCommand(redis_ctx, "DEL %s", body_key));
+  }
+  free(item->issue_title);
+  free(item->issue_body);
+  free(item);
+}
+
+// Function to hand an unfinished issue back to the queue
+void release_issue(redisContext *redis_ctx, struct queued_issue *item) {
+  if (!item) {
+    return;
+  }
+  if (item->entry_id[0] != '\0') {
+    // Left pending and unrenewed, so the next consumer reclaims it once it
+    // has been idle for claim_idle_seconds
+    inflight_remove(item->queue_key, item->entry_id);
+  } else {
+    // List and local entries were removed on dequeue; enqueue them again
+    // into the class they came from
+    const char *priority_class = NULL;
+    for (int c = 0; c < class_count; c++) {
+      char queue_key[MAX_KEY];
+      class_key(queue_key, sizeof(queue_key), local_node(), c);
+      if (strcmp(queue_key, item->queue_key) == 0) {
+        priority_class = classes[c].name;
+        break;
+      }
+    }
+    const char *issue_body = queued_issue_body(item);
+    if (!issue_body ||
+        enqueue_issue(redis_ctx, item->repo_full_name,
+                      item->record.issue_number, priority_class,
+                      item->issue_title, issue_body) < 0) {
+      syslog(LOG_ERR, "Failed to requeue %s#%d", item->repo_full_name,
+             item->record.issue_number);
+    }
+  }
+  metrics_counter_add("cis_queue_released_total", 1);
+  free(item->issue_title);
+  free(item->issue_body);
+  free(item);
+}
+
+// Function to renew this node's claim on the entries it is processing
+void queue_keepalive(redisContext *redis_ctx) {
+  struct inflight_entry entries[MAX_INFLIGHT];
+  int count = 0;
+
+  pthread_mutex_lock(&inflight_lock);
+  for (int i = 0; i < MAX_INFLIGHT; i++) {
+    if (inflight[i].entry_id[0] != '\0') {
+      entries[count++] = inflight[i];
+    }
+  }
+  pthread_mutex_unlock(&inflight_lock);
+
+  // XCLAIM with min-idle 0 resets the idle time without moving ownership
+  for (int i = 0; i < count; i++) {
+    redisReply *reply =
+        redisCommand(redis_ctx, "XCLAIM %s %s %s 0 %s JUSTID",
+                     entries[i].stream_key, consumer_group, consumer_name,
+                     entries[i].entry_id);
+    if (!reply) {
+      syslog(LOG_ERR, "Failed to renew claim on %s", entries[i].entry_id);
+      return;
+    }
+    freeReplyObject(reply);
+  }
+
+  // Export pending entries per class so per-node progress can be compared
+  for (int c = 0; c < class_count; c++) {
+    char stream_key[MAX_KEY];
+    class_key(stream_key, sizeof(stream_key), local_node(), c);
+    redisReply *reply = redisCommand(redis_ctx, "XPENDING %s %s", stream_key,
+                                     consumer_group);
+    if (!reply) {
+      return;
+    }
+    if (reply->type == REDIS_REPLY_ARRAY && reply->elements > 0 &&
+        reply->element[0]->type == REDIS_REPLY_INTEGER) {
+      char metric[96];
+      snprintf(metric, sizeof(metric),
+               "cis_stream_pending{class=\"%s\"}", classes[c].name);
+      metrics_gauge_set(metric, reply->element[0]->integer);
+    }
+    freeReplyObject(reply);
+  }
+}
+
+int queue_uses_streams(void) { return use_streams; }
+
+int queue_claim_idle_seconds(void) { return claim_idle_seconds; }
+
+// Find the owner queue for a coalescing key ("owner/repo#number")
+static void owner_key(char *buf, size_t size, const char *coalesce_key,
+                      int class_index) {
+  char repo_full_name[320];
+  snprintf(repo_full_name, sizeof(repo_full_name), "%s", coalesce_key);
+  char *hash = strrchr(repo_full_name, '#');
+  if (hash) {
+    *hash = '\0';
+  }
+  char owner[64];
+  shard_owner(repo_full_name, owner, sizeof(owner));
+  class_key(buf, size, owner, class_index);
+}
+
+static int reroute_list(redisContext *redis_ctx, const char *src,
+                        int class_index) {
+  int moved = 0;
+  while (1) {
+    redisReply *head = redisCommand(redis_ctx, "LINDEX %s 0", src);
+    if (!head) {
+      return -1;
+    }
+    if (head->type != REDIS_REPLY_STRING) {
+      freeReplyObject(head);
+      return moved;
+    }
+    const char *space = strchr(head->str, ' ');
+    char dst[MAX_KEY];
+    owner_key(dst, sizeof(dst), space ? space + 1 : head->str, class_index);
+    redisReply *reply = redisCommand(redis_ctx, "EVAL %s 2 %s %s %s",
+                                     MOVE_HEAD_SCRIPT, src, dst, head->str);
+    freeReplyObject(head);
+    if (!reply || reply->type == REDIS_REPLY_ERROR) {
+      freeReplyObject(reply);
+      return -1;
+    }
+    moved += reply->integer == 1;
+    freeReplyObject(reply);
+  }
+}
+
+static int reroute_stream(redisContext *redis_ctx, const char *src,
+                          int class_index) {
+  int moved = 0;
+  while (1) {
+    redisReply *entries =
+        redisCommand(redis_ctx, "XRANGE %s - + COUNT 100", src);
+    if (!entries || entries->type != REDIS_REPLY_ARRAY) {
+      freeReplyObject(entries);
+      return -1;
+    }
+    if (entries->elements == 0) {
+      freeReplyObject(entries);
+      break;
+    }
+    for (size_t i = 0; i < entries->elements; i++) {
+      char entry_id[64];
+      char coalesce_key[320];
+      if (parse_stream_entry(entries->element[i], entry_id, sizeof(entry_id),
+                             coalesce_key, sizeof(coalesce_key)) != 0) {
+        freeReplyObject(redisCommand(redis_ctx, "XDEL %s %s", src,
+                                     entries->element[i]->element[0]->str));
+        continue;
+      }
+      char dst[MAX_KEY];
+      owner_key(dst, sizeof(dst), coalesce_key, class_index);
+      redisReply *reply = redisCommand(
+          redis_ctx, "EVAL %s 4 %s %s %s %s %s %s", MOVE_STREAM_ENTRY_SCRIPT,
+          src, dst, PENDING_KEY, INFLIGHT_KEY, entry_id, coalesce_key);
+      if (!reply || reply->type == REDIS_REPLY_ERROR) {
+        freeReplyObject(reply);
+        freeReplyObject(entries);
+        return -1;
+      }
+      freeReplyObject(reply);
+      moved++;
+    }
+    freeReplyObject(entries);
+  }
+  // Drop the dead node's consumer group state along with the empty stream.
+  // Should the node only have missed heartbeats, it joins again on its next
+  // read.
+  freeReplyObject(redisCommand(redis_ctx, "DEL %s", src));
+  return moved;
+}
+
+// Function to hand a departed node's queued issues to their new owners
+int queue_reroute_node(redisContext *redis_ctx, const char *node_id) {
+  int total = 0;
+  for (int i = 0; i < class_count; i++) {
+    char src[MAX_KEY];
+    class_key(src, sizeof(src), node_id, i);
+    int moved = use_streams ? reroute_stream(redis_ctx, src, i)
+                            : reroute_list(redis_ctx, src, i);
+    if (moved < 0) {
+      syslog(LOG_ERR, "Failed to re-route %s", src);
+      return -1;
+    }
+    total += moved;
+  }
+  if (total > 0) {
+    syslog(LOG_INFO, "Re-routed %d issue(s) from node %s", total, node_id);
+  }
+  return total;
+}
+
+// Enqueue a legacy payload into the default class. Returns 1 if it was
+// queued, 0 if it was malformed and -1 on failure.
+static int requeue_legacy(redisContext *redis_ctx, const char *text) {
+  struct legacy_issue issue;
+  if (parse_legacy(text, &issue) != 0) {
+    return 0;
+  }
+  int result = enqueue_redis(redis_ctx, issue.repo_full_name,
+                             issue.issue_number, NULL, issue.issue_title,
+                             issue.issue_body) == 0
+                   ? 1
+                   : -1;
+  cJSON_Delete(issue.json);
+  return result;
+}
+
+// Move one entry of the legacy list. Returns 1 if an issue was queued, 0 if
+// there was nothing to queue and -1 on failure.
+static int migrate_legacy_entry(redisContext *redis_ctx, const char *entry) {
+  if (entry[0] == '{') {
+    return requeue_legacy(redis_ctx, entry);
+  }
+  redisReply *reply = redisCommand(redis_ctx, "HGET %s %s", PENDING_KEY,
+                                   entry);
+  if (!reply) {
+    return -1;
+  }
+  int result = 0;
+  if (reply->type == REDIS_REPLY_STRING && reply->len > 0 &&
+      reply->str[0] == '{') {
+    // Enqueueing only pushes an entry if no record waits under the key, so
+    // the legacy record makes way first and is put back on failure
+    freeReplyObject(redisCommand(redis_ctx, "HDEL %s %s", PENDING_KEY, entry));
+    result = requeue_legacy(redis_ctx, reply->str);
+    if (result < 0) {
+      freeReplyObject(redisCommand(redis_ctx, "HSETNX %s %s %b", PENDING_KEY,
+                                   entry, reply->str, (size_t)reply->len));
+    }
+  }
+  freeReplyObject(reply);
+  return result;
+}
+
+// Function to move issues queued by earlier releases into the default class
+int queue_migrate_legacy(redisContext *redis_ctx) {
+  if (use_local || ensure_connected(redis_ctx) != 0) {
+    return use_local ? 0 : -1;
+  }
+  int moved = 0;
+  while (1) {
+    redisReply *head =
+        redisCommand(redis_ctx, "LINDEX %s 0", LEGACY_QUEUE_KEY);
+    if (!head) {
+      return -1;
+    }
+    if (head->type != REDIS_REPLY_STRING) {
+      freeReplyObject(head);
+      break; // Empty, or never used
+    }
+    // Entries are removed once queued. If another node migrates the same
+    // entry meanwhile, the second enqueue coalesces with the first.
+    int result = migrate_legacy_entry(redis_ctx, head->str);
+    if (result < 0) {
+      syslog(LOG_ERR, "Failed to migrate legacy queue entry");
+      freeReplyObject(head);
+      return -1;
+    }
+    redisReply *reply = redisCommand(redis_ctx, "LREM %s 1 %b",
+                                     LEGACY_QUEUE_KEY, head->str,
+                                     (size_t)head->len);
+    freeReplyObject(head);
+    if (!reply || reply->type == REDIS_REPLY_ERROR) {
+      freeReplyObject(reply);
+      return -1;
+    }
+    freeReplyObject(reply);
+    moved += result;
+  }
+  if (moved > 0) {
+    syslog(LOG_INFO, "Migrated %d issue(s) from the legacy queue", moved);
+  }
+  return moved;
+}
+
+// Function to open the local queue when it is the backend or spill target
+int queue_open_local(void) {
+  if (!use_local && !spill_to_local) {
+    return 0;
+  }
+  return local_queue_open(local_queue_path,
+                          (size_t)local_queue_size_mb * 1024 * 1024,
+                          group_commit_ms);
+}
+
+int queue_needs_redis(void) { return !use_local; }
+
+int queue_can_spill(void) { return spill_to_local && local_queue_is_open(); }
+
+// Function to replay spooled issues into Redis, in order, once it is back
+void *local_queue_drainer_thread(void *arg) {
+  redisContext *redis_ctx = (redisContext *)arg;
+  while (1) {
+    if (local_queue_depth() == 0 || ensure_connected(redis_ctx) != 0) {
+      sleep(1);
+      continue;
+    }
+    struct local_record record;
+    int rc = local_queue_peek(&record);
+    if (rc != 1) {
+      sleep(1);
+      continue;
+    }
+    if (enqueue_redis(redis_ctx, record.repo_full_name, record.issue_number,
+                      record.priority_class, record.issue_title,
+                      record.issue_body) == 0) {
+      local_queue_pop(&record);
+      metrics_counter_add("cis_local_queue_replayed_total", 1);
+    } else {
+      sleep(1);
+    }
+    local_record_free(&record);
+  }
+  return NULL;
+}
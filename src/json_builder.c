@@ -0,0 +1,382 @@
+#include "json_builder.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+typedef void (*escape_fn)(struct json_builder *jb, const char *src,
+                          size_t len);
+
+// Letter following the backslash for bytes that must be escaped, 'u' for
+// control characters without a short form and 0 for bytes copied as is
+static const char escape_table[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f',
+    'r', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', [34] = '"', [92] = '\\'};
+
+static escape_fn escaper = NULL;
+
+// Make room for extra bytes plus a terminating NUL
+static inline int reserve(struct json_builder *jb, size_t extra) {
+  if (jb->len + extra < jb->cap) {
+    return 0;
+  }
+  if (jb->failed) {
+    return -1;
+  }
+  size_t cap = jb->cap ? jb->cap : 256;
+  while (cap <= jb->len + extra) {
+    cap *= 2;
+  }
+  char *data = realloc(jb->data, cap);
+  if (!data) {
+    syslog(LOG_ERR, "Failed to grow JSON buffer to %zu bytes", cap);
+    jb->failed = 1;
+    return -1;
+  }
+  jb->data = data;
+  jb->cap = cap;
+  return 0;
+}
+
+static void append(struct json_builder *jb, const char *s, size_t len) {
+  if (reserve(jb, len) != 0) {
+    return;
+  }
+  memcpy(jb->data + jb->len, s, len);
+  jb->len += len;
+}
+
+// Write the escape sequence for one byte; the caller reserved 6 bytes
+static inline size_t escape_byte(char *out, unsigned char c) {
+  static const char hex[] = "0123456789abcdef";
+  char e = escape_table[c];
+  out[0] = '\\';
+  if (e != 'u') {
+    out[1] = e;
+    return 2;
+  }
+  out[1] = 'u';
+  out[2] = '0';
+  out[3] = '0';
+  out[4] = hex[c >> 4];
+  out[5] = hex[c & 15];
+  return 6;
+}
+
+static void escape_scalar(struct json_builder *jb, const char *src,
+                          size_t len) {
+  size_t i = 0;
+  while (i < len) {
+    // Copy the run of bytes that need no escaping in one go
+    size_t start = i;
+    while (i < len && !escape_table[(unsigned char)src[i]]) {
+      i++;
+    }
+    append(jb, src + start, i - start);
+    if (i < len) {
+      if (reserve(jb, 6) != 0) {
+        return;
+      }
+      jb->len += escape_byte(jb->data + jb->len, (unsigned char)src[i]);
+      i++;
+    }
+  }
+}
+
+#ifdef HAVE_X86_SIMD
+// Each block is stored whole before looking at the mask; only the clean
+// prefix is kept and the output position moves past it
+__attribute__((target("sse2"))) static void
+escape_sse2(struct json_builder *jb, const char *src, size_t len) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+  size_t i = 0;
+  while (i + 16 <= len) {
+    if (reserve(jb, 16) != 0) {
+      return;
+    }
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i hits = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+        _mm_cmpeq_epi8(_mm_min_epu8(v, control), v)); // v <= 0x1f
+    _mm_storeu_si128((__m128i *)(jb->data + jb->len), v);
+    unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+    if (mask == 0) {
+      jb->len += 16;
+      i += 16;
+      continue;
+    }
+    unsigned clean = (unsigned)__builtin_ctz(mask);
+    jb->len += clean;
+    i += clean;
+    if (reserve(jb, 6) != 0) {
+      return;
+    }
+    jb->len += escape_byte(jb->data + jb->len, (unsigned char)src[i]);
+    i++;
+  }
+  escape_scalar(jb, src + i, len - i);
+}
+
+__attribute__((target("avx2"))) static void
+escape_avx2(struct json_builder *jb, const char *src, size_t len) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i control = _mm256_set1_epi8(0x1f);
+  size_t i = 0;
+  while (i + 32 <= len) {
+    if (reserve(jb, 32) != 0) {
+      return;
+    }
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i hits = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                        _mm256_cmpeq_epi8(v, backslash)),
+        _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v));
+    _mm256_storeu_si256((__m256i *)(jb->data + jb->len), v);
+    unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+    if (mask == 0) {
+      jb->len += 32;
+      i += 32;
+      continue;
+    }
+    unsigned clean = (unsigned)__builtin_ctz(mask);
+    jb->len += clean;
+    i += clean;
+    if (reserve(jb, 6) != 0) {
+      return;
+    }
+    jb->len += escape_byte(jb->data + jb->len, (unsigned char)src[i]);
+    i++;
+  }
+  escape_sse2(jb, src + i, len - i);
+}
+#endif
+
+// Function to select the JSON string escaper
+int json_set_escape_impl(enum json_escape_impl impl) {
+  escape_fn fn = escape_scalar;
+  switch (impl) {
+  case JSON_ESCAPE_SCALAR:
+    break;
+#ifdef HAVE_X86_SIMD
+  case JSON_ESCAPE_AUTO:
+    if (__builtin_cpu_supports("avx2")) {
+      fn = escape_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+      fn = escape_sse2;
+    }
+    break;
+  case JSON_ESCAPE_SSE2:
+    if (!__builtin_cpu_supports("sse2")) {
+      return -1;
+    }
+    fn = escape_sse2;
+    break;
+  case JSON_ESCAPE_AVX2:
+    if (!__builtin_cpu_supports("avx2")) {
+      return -1;
+    }
+    fn = escape_avx2;
+    break;
+#else
+  case JSON_ESCAPE_AUTO:
+    break;
+  default:
+    return -1;
+#endif
+  }
+  __atomic_store_n(&escaper, fn, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void json_append_escaped(struct json_builder *jb, const char *value,
+                         size_t len) {
+  escape_fn fn = __atomic_load_n(&escaper, __ATOMIC_ACQUIRE);
+  if (!fn) {
+    json_set_escape_impl(JSON_ESCAPE_AUTO);
+    fn = __atomic_load_n(&escaper, __ATOMIC_ACQUIRE);
+  }
+  fn(jb, value, len);
+}
+
+void json_builder_init(struct json_builder *jb) {
+  memset(jb, 0, sizeof(*jb));
+}
+
+// Write the separator and key in front of a value
+static void begin_value(struct json_builder *jb, const char *key) {
+  if (jb->need_comma) {
+    append(jb, ",", 1);
+  }
+  if (key) {
+    append(jb, "\"", 1);
+    json_append_escaped(jb, key, strlen(key));
+    append(jb, "\":", 2);
+  }
+  jb->need_comma = 1;
+}
+
+void json_object_begin(struct json_builder *jb, const char *key) {
+  begin_value(jb, key);
+  append(jb, "{", 1);
+  jb->need_comma = 0;
+}
+
+void json_object_end(struct json_builder *jb) {
+  append(jb, "}", 1);
+  jb->need_comma = 1;
+}
+
+void json_array_begin(struct json_builder *jb, const char *key) {
+  begin_value(jb, key);
+  append(jb, "[", 1);
+  jb->need_comma = 0;
+}
+
+void json_array_end(struct json_builder *jb) {
+  append(jb, "]", 1);
+  jb->need_comma = 1;
+}
+
+void json_add_string_len(struct json_builder *jb, const char *key,
+                         const char *value, size_t len) {
+  begin_value(jb, key);
+  if (!value) {
+    append(jb, "null", 4);
+    return;
+  }
+  // Size for the common case up front; escapes grow the buffer as needed
+  if (reserve(jb, len + 2) != 0) {
+    return;
+  }
+  append(jb, "\"", 1);
+  json_append_escaped(jb, value, len);
+  append(jb, "\"", 1);
+}
+
+void json_add_string(struct json_builder *jb, const char *key,
+                     const char *value) {
+  json_add_string_len(jb, key, value, value ? strlen(value) : 0);
+}
+
+void json_add_int(struct json_builder *jb, const char *key, long long value) {
+  char number[32];
+  int n = snprintf(number, sizeof(number), "%lld", value);
+  begin_value(jb, key);
+  append(jb, number, (size_t)n);
+}
+
+void json_add_double(struct json_builder *jb, const char *key, double value) {
+  char number[32];
+  int n = snprintf(number, sizeof(number), "%.15g", value);
+  begin_value(jb, key);
+  if (value != value || value - value != 0) {
+    append(jb, "null", 4); // NaN and infinities have no JSON form
+  } else {
+    append(jb, number, (size_t)n);
+  }
+}
+
+void json_add_bool(struct json_builder *jb, const char *key, int value) {
+  begin_value(jb, key);
+  append(jb, value ? "true" : "false", value ? 4 : 5);
+}
+
+char *json_builder_finish(struct json_builder *jb) {
+  if (reserve(jb, 0) != 0) {
+    json_builder_free(jb);
+    return NULL;
+  }
+  jb->data[jb->len] = '\0';
+  char *data = jb->data;
+  json_builder_init(jb);
+  return data;
+}
+
+void json_builder_free(struct json_builder *jb) {
+  free(jb->data);
+  json_builder_init(jb);
+}
+
+// Escape with the current escaper and return the result
+static char *escape_to_string(const char *src, size_t len) {
+  struct json_builder jb;
+  json_builder_init(&jb);
+  json_append_escaped(&jb, src, len);
+  return json_builder_finish(&jb);
+}
+
+// Function to check the escapers against known vectors and each other
+int json_builder_self_test(void) {
+  static const struct {
+    const char *in;
+    const char *out;
+  } vectors[] = {
+      {"", ""},
+      {"plain text", "plain text"},
+      {"say \"hi\"", "say \\\"hi\\\""},
+      {"C:\\path", "C:\\\\path"},
+      {"a\nb\tc\rd\be\ff", "a\\nb\\tc\\rd\\be\\ff"},
+      {"\x01\x1f\x7f", "\\u0001\\u001f\x7f"},
+      {"h\xc3\xa9llo \xe2\x82\xac", "h\xc3\xa9llo \xe2\x82\xac"},
+      {"0123456789abcdef0123456789abcdef\"",
+       "0123456789abcdef0123456789abcdef\\\""},
+  };
+  static const enum json_escape_impl impls[] = {
+      JSON_ESCAPE_SCALAR, JSON_ESCAPE_SSE2, JSON_ESCAPE_AVX2};
+  static const char alphabet[] = "ab \"\\\n\t\x01\x1f\x80\xff/";
+  escape_fn saved = __atomic_load_n(&escaper, __ATOMIC_ACQUIRE);
+  int failures = 0;
+
+  for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+    if (json_set_escape_impl(impls[k]) != 0) {
+      continue; // Not supported on this CPU
+    }
+    for (size_t v = 0; v < sizeof(vectors) / sizeof(vectors[0]); v++) {
+      char *out = escape_to_string(vectors[v].in, strlen(vectors[v].in));
+      if (!out || strcmp(out, vectors[v].out) != 0) {
+        syslog(LOG_ERR, "JSON escaper %zu failed on vector %zu", k, v);
+        failures++;
+      }
+      free(out);
+    }
+  }
+
+  // Random inputs of every length around the vector widths must match the
+  // scalar escaper byte for byte
+  unsigned int seed = 12345;
+  char input[300];
+  for (size_t len = 0; len < sizeof(input); len++) {
+    for (size_t i = 0; i < len; i++) {
+      seed = seed * 1103515245 + 12345;
+      input[i] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+    }
+    json_set_escape_impl(JSON_ESCAPE_SCALAR);
+    char *expected = escape_to_string(input, len);
+    for (size_t k = 1; k < sizeof(impls) / sizeof(impls[0]); k++) {
+      if (json_set_escape_impl(impls[k]) != 0) {
+        continue;
+      }
+      char *out = escape_to_string(input, len);
+      if (!expected || !out || strcmp(out, expected) != 0) {
+        syslog(LOG_ERR, "JSON escaper %zu differs at length %zu", k, len);
+        failures++;
+      }
+      free(out);
+    }
+    free(expected);
+  }
+
+  __atomic_store_n(&escaper, saved, __ATOMIC_RELEASE);
+  return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,417 @@
+#include "local_queue.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "trace.h"
+
+#define WAL_MAGIC "CISWAL1"
+#define WAL_DATA_START 4096
+#define WAL_WRAP 0xFFFFFFFFu
+#define WAL_FIELDS 5
+
+// The first page holds the header; records follow as a ring. head == tail
+// means empty, tail < head means the writer has wrapped to the start.
+struct wal_header {
+  char magic[8];
+  uint64_t size;
+  uint64_t head;
+  uint64_t tail;
+};
+
+struct wal_record {
+  uint32_t len; // Payload bytes, or WAL_WRAP to continue at the start
+  uint32_t crc;
+};
+
+static int wal_fd = -1;
+static unsigned char *wal_base = NULL;
+static size_t wal_size = 0;
+static struct wal_header *header = NULL;
+static long long depth = 0;
+static int commit_delay_ms = 5;
+
+// Appends bump write_seq; the flusher publishes synced_seq after msync.
+// Appends numbered failed_from..failed_to were covered by a failed msync.
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t synced_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long long write_seq = 0;
+static unsigned long long synced_seq = 0;
+static unsigned long long failed_from = 0;
+static unsigned long long failed_to = 0;
+static pthread_t flusher_thread;
+static int flusher_started = 0;
+
+static uint32_t crc_table[256];
+
+static void init_crc_table(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t crc32(const unsigned char *data, size_t len) {
+  uint32_t c = 0xFFFFFFFFu;
+  for (size_t i = 0; i < len; i++) {
+    c = crc_table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+  }
+  return c ^ 0xFFFFFFFFu;
+}
+
+static size_t record_size(size_t len) {
+  return (sizeof(struct wal_record) + len + 7) & ~(size_t)7;
+}
+
+// Walk from head to tail checking every record; truncate at the first bad
+// one (a write that did not reach the disk before a crash)
+static void recover(void) {
+  uint64_t pos = header->head;
+  depth = 0;
+  while (pos != header->tail) {
+    struct wal_record *rec = (struct wal_record *)(wal_base + pos);
+    if (rec->len == WAL_WRAP) {
+      pos = WAL_DATA_START;
+      continue;
+    }
+    if (pos + record_size(rec->len) > wal_size ||
+        crc32((unsigned char *)(rec + 1), rec->len) != rec->crc) {
+      syslog(LOG_ERR, "Local queue corrupt at offset %llu, truncating",
+             (unsigned long long)pos);
+      header->tail = pos;
+      break;
+    }
+    pos += record_size(rec->len);
+    depth++;
+  }
+  metrics_gauge_set("cis_local_queue_depth", depth);
+}
+
+static void *flusher(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&wal_lock);
+  while (wal_base) {
+    while (wal_base && synced_seq == write_seq) {
+      pthread_cond_wait(&flush_cond, &wal_lock);
+    }
+    if (!wal_base) {
+      break;
+    }
+    pthread_mutex_unlock(&wal_lock);
+
+    // Give concurrent appenders a moment to join this commit
+    usleep(commit_delay_ms * 1000);
+
+    pthread_mutex_lock(&wal_lock);
+    unsigned long long seq = write_seq;
+    unsigned char *base = wal_base;
+    pthread_mutex_unlock(&wal_lock);
+    if (!base) {
+      pthread_mutex_lock(&wal_lock);
+      break;
+    }
+
+    // msync only writes back dirty pages, so one call covers every append
+    // made since the last commit
+    int rc = msync(base, wal_size, MS_SYNC);
+    metrics_counter_add("cis_local_queue_commits_total", 1);
+
+    pthread_mutex_lock(&wal_lock);
+    if (rc != 0) {
+      syslog(LOG_ERR, "Failed to sync local queue: %s", strerror(errno));
+      // A later failure widens the range over any commit in between, which
+      // can only fail an append that was in fact synced
+      if (failed_to == 0) {
+        failed_from = synced_seq + 1;
+      }
+      failed_to = seq;
+    }
+    synced_seq = seq;
+    pthread_cond_broadcast(&synced_cond);
+  }
+  pthread_mutex_unlock(&wal_lock);
+  return NULL;
+}
+
+// Function to open the local queue segment
+int local_queue_open(const char *path, size_t size, int group_commit_ms) {
+  init_crc_table();
+  commit_delay_ms = group_commit_ms >= 0 ? group_commit_ms : 0;
+
+  wal_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (wal_fd < 0) {
+    syslog(LOG_ERR, "Failed to open local queue %s: %s", path,
+           strerror(errno));
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(wal_fd, &st) != 0) {
+    close(wal_fd);
+    wal_fd = -1;
+    return -1;
+  }
+  int fresh = st.st_size == 0;
+  if (!fresh) {
+    size = (size_t)st.st_size; // An existing segment keeps its size
+  } else if (size < WAL_DATA_START * 2 || ftruncate(wal_fd, size) != 0) {
+    syslog(LOG_ERR, "Failed to size local queue %s", path);
+    close(wal_fd);
+    wal_fd = -1;
+    return -1;
+  }
+
+  void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, wal_fd, 0);
+  if (base == MAP_FAILED) {
+    syslog(LOG_ERR, "Failed to map local queue %s: %s", path,
+           strerror(errno));
+    close(wal_fd);
+    wal_fd = -1;
+    return -1;
+  }
+  wal_base = base;
+  wal_size = size;
+  header = (struct wal_header *)wal_base;
+
+  if (fresh) {
+    memcpy(header->magic, WAL_MAGIC, sizeof(header->magic));
+    header->size = size;
+    header->head = WAL_DATA_START;
+    header->tail = WAL_DATA_START;
+    msync(wal_base, WAL_DATA_START, MS_SYNC);
+  } else if (memcmp(header->magic, WAL_MAGIC, sizeof(header->magic)) != 0 ||
+             header->size != size || header->head < WAL_DATA_START ||
+             header->tail < WAL_DATA_START || header->head >= size ||
+             header->tail >= size) {
+    syslog(LOG_ERR, "Local queue %s has an invalid header", path);
+    local_queue_close();
+    return -1;
+  }
+  recover();
+
+  if (pthread_create(&flusher_thread, NULL, flusher, NULL) != 0) {
+    syslog(LOG_ERR, "Failed to start local queue flusher");
+    local_queue_close();
+    return -1;
+  }
+  flusher_started = 1;
+  syslog(LOG_INFO, "Opened local queue %s with %lld pending record(s)", path,
+         depth);
+  return 0;
+}
+
+int local_queue_is_open(void) { return wal_base != NULL; }
+
+// Reserve space for a record of the given size; called with wal_lock held
+static long long reserve(size_t need) {
+  uint64_t head = header->head;
+  uint64_t tail = header->tail;
+  if (head == tail) {
+    // Empty: restart at the beginning of the segment
+    header->head = header->tail = WAL_DATA_START;
+    head = tail = WAL_DATA_START;
+  }
+  if (tail >= head) {
+    if (tail + need + sizeof(struct wal_record) <= wal_size) {
+      return (long long)tail;
+    }
+    // Wrap if the free space before head can take the record
+    if (WAL_DATA_START + need < head) {
+      ((struct wal_record *)(wal_base + tail))->len = WAL_WRAP;
+      return WAL_DATA_START;
+    }
+    return -1;
+  }
+  return tail + need < head ? (long long)tail : -1;
+}
+
+// Function to append a record to the local queue
+int local_queue_append(const char *priority_class, const char *repo_full_name,
+                       int issue_number, const char *issue_title,
+                       const char *issue_body) {
+  char number[16];
+  snprintf(number, sizeof(number), "%d", issue_number);
+  const char *fields[WAL_FIELDS] = {priority_class ? priority_class : "",
+                                    repo_full_name, number, issue_title,
+                                    issue_body};
+  size_t lens[WAL_FIELDS];
+  size_t len = 0;
+  for (int i = 0; i < WAL_FIELDS; i++) {
+    lens[i] = strlen(fields[i]) + 1;
+    len += lens[i];
+  }
+  size_t need = record_size(len);
+
+  pthread_mutex_lock(&wal_lock);
+  if (!wal_base) {
+    pthread_mutex_unlock(&wal_lock);
+    return -1;
+  }
+  long long pos = reserve(need);
+  if (pos < 0) {
+    pthread_mutex_unlock(&wal_lock);
+    syslog(LOG_ERR, "Local queue is full, dropping issue %s#%d",
+           repo_full_name, issue_number);
+    metrics_counter_add("cis_local_queue_full_total", 1);
+    return -1;
+  }
+
+  // Fields are stored NUL-separated: class, repository, number, title, body
+  struct wal_record *rec = (struct wal_record *)(wal_base + pos);
+  unsigned char *payload = (unsigned char *)(rec + 1);
+  size_t offset = 0;
+  for (int i = 0; i < WAL_FIELDS; i++) {
+    memcpy(payload + offset, fields[i], lens[i]);
+    offset += lens[i];
+  }
+  rec->len = (uint32_t)len;
+  rec->crc = crc32(payload, len);
+  header->tail = (uint64_t)pos + need;
+  depth++;
+  metrics_gauge_set("cis_local_queue_depth", depth);
+  unsigned long long my_seq = ++write_seq;
+  pthread_cond_signal(&flush_cond);
+
+  // Group commit: wait for the flusher to cover this append. Closing the
+  // queue first leaves it unsynced.
+  while (synced_seq < my_seq && wal_base) {
+    pthread_cond_wait(&synced_cond, &wal_lock);
+  }
+  int failed = synced_seq < my_seq ||
+               (my_seq >= failed_from && my_seq <= failed_to);
+  pthread_mutex_unlock(&wal_lock);
+  if (!failed) {
+    TRACE3(issue__enqueue, issue_number, lens[WAL_FIELDS - 1] - 1, fields[0]);
+  }
+  return failed ? -1 : 0;
+}
+
+// Copy out the record at head; called with wal_lock held
+static int peek_locked(struct local_record *record) {
+  memset(record, 0, sizeof(*record));
+  if (!wal_base || header->head == header->tail) {
+    return 0;
+  }
+  struct wal_record *rec = (struct wal_record *)(wal_base + header->head);
+  if (rec->len == WAL_WRAP) {
+    header->head = WAL_DATA_START;
+    rec = (struct wal_record *)(wal_base + header->head);
+  }
+  if (header->head + record_size(rec->len) > wal_size ||
+      crc32((unsigned char *)(rec + 1), rec->len) != rec->crc) {
+    syslog(LOG_ERR, "Corrupt record in local queue at offset %llu",
+           (unsigned long long)header->head);
+    return -1;
+  }
+
+  record->buffer = malloc(rec->len);
+  if (!record->buffer) {
+    return -1;
+  }
+  memcpy(record->buffer, rec + 1, rec->len);
+  record->size = record_size(rec->len);
+  if (rec->len == 0 || record->buffer[rec->len - 1] != '\0') {
+    syslog(LOG_ERR, "Malformed record in local queue at offset %llu",
+           (unsigned long long)header->head);
+    free(record->buffer);
+    record->buffer = NULL;
+    return -1;
+  }
+
+  // Missing trailing fields read as empty strings
+  char *fields[WAL_FIELDS];
+  char *p = record->buffer;
+  char *end = record->buffer + rec->len;
+  for (int i = 0; i < WAL_FIELDS; i++) {
+    fields[i] = p < end ? p : end - 1;
+    p += strnlen(fields[i], (size_t)(end - fields[i])) + 1;
+  }
+  record->priority_class = fields[0][0] ? fields[0] : NULL;
+  record->repo_full_name = fields[1];
+  record->issue_number = atoi(fields[2]);
+  record->issue_title = fields[3];
+  record->issue_body = fields[4];
+  return 1;
+}
+
+// Advance head past a peeked record; called with wal_lock held
+static void pop_locked(const struct local_record *record) {
+  if (!wal_base || header->head == header->tail) {
+    return;
+  }
+  header->head += record->size;
+  depth--;
+  metrics_gauge_set("cis_local_queue_depth", depth);
+}
+
+int local_queue_peek(struct local_record *record) {
+  pthread_mutex_lock(&wal_lock);
+  int rc = peek_locked(record);
+  pthread_mutex_unlock(&wal_lock);
+  return rc;
+}
+
+void local_queue_pop(const struct local_record *record) {
+  pthread_mutex_lock(&wal_lock);
+  pop_locked(record);
+  pthread_mutex_unlock(&wal_lock);
+}
+
+int local_queue_take(struct local_record *record) {
+  pthread_mutex_lock(&wal_lock);
+  int rc = peek_locked(record);
+  if (rc == 1) {
+    pop_locked(record);
+  }
+  pthread_mutex_unlock(&wal_lock);
+  return rc;
+}
+
+void local_record_free(struct local_record *record) {
+  free(record->buffer);
+  record->buffer = NULL;
+}
+
+long long local_queue_depth(void) {
+  pthread_mutex_lock(&wal_lock);
+  long long d = depth;
+  pthread_mutex_unlock(&wal_lock);
+  return d;
+}
+
+void local_queue_close(void) {
+  pthread_mutex_lock(&wal_lock);
+  unsigned char *base = wal_base;
+  wal_base = NULL;
+  pthread_cond_broadcast(&flush_cond);
+  pthread_cond_broadcast(&synced_cond);
+  pthread_mutex_unlock(&wal_lock);
+
+  if (flusher_started) {
+    pthread_join(flusher_thread, NULL);
+    flusher_started = 0;
+  }
+  if (base) {
+    msync(base, wal_size, MS_SYNC);
+    munmap(base, wal_size);
+  }
+  header = NULL;
+  if (wal_fd >= 0) {
+    close(wal_fd);
+    wal_fd = -1;
+  }
+}
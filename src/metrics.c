@@ -0,0 +1,81 @@
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#define MAX_METRICS 512
+#define MAX_METRIC_NAME 128
+
+struct metric {
+  char name[MAX_METRIC_NAME];
+  long long value;
+};
+
+static struct metric metrics[MAX_METRICS];
+static int metric_count = 0;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Find or register a metric; must be called with metrics_lock held
+static struct metric *lookup_metric(const char *name) {
+  for (int i = 0; i < metric_count; i++) {
+    if (strcmp(metrics[i].name, name) == 0) {
+      return &metrics[i];
+    }
+  }
+  if (metric_count == MAX_METRICS) {
+    syslog(LOG_ERR, "Metric registry full, dropping %s", name);
+    return NULL;
+  }
+  struct metric *m = &metrics[metric_count++];
+  snprintf(m->name, sizeof(m->name), "%s", name);
+  m->value = 0;
+  return m;
+}
+
+void metrics_counter_add(const char *name, long long delta) {
+  pthread_mutex_lock(&metrics_lock);
+  struct metric *m = lookup_metric(name);
+  if (m) {
+    m->value += delta;
+  }
+  pthread_mutex_unlock(&metrics_lock);
+}
+
+void metrics_gauge_set(const char *name, long long value) {
+  pthread_mutex_lock(&metrics_lock);
+  struct metric *m = lookup_metric(name);
+  if (m) {
+    m->value = value;
+  }
+  pthread_mutex_unlock(&metrics_lock);
+}
+
+void metrics_gauge_max(const char *name, long long value) {
+  pthread_mutex_lock(&metrics_lock);
+  struct metric *m = lookup_metric(name);
+  if (m && value > m->value) {
+    m->value = value;
+  }
+  pthread_mutex_unlock(&metrics_lock);
+}
+
+char *metrics_render(void) {
+  pthread_mutex_lock(&metrics_lock);
+  size_t size = (size_t)metric_count * (MAX_METRIC_NAME + 24) + 1;
+  char *out = malloc(size);
+  if (!out) {
+    pthread_mutex_unlock(&metrics_lock);
+    return NULL;
+  }
+  size_t len = 0;
+  out[0] = '\0';
+  for (int i = 0; i < metric_count; i++) {
+    len += snprintf(out + len, size - len, "%s %lld\n", metrics[i].name,
+                    metrics[i].value);
+  }
+  pthread_mutex_unlock(&metrics_lock);
+  return out;
+}
@@ -0,0 +1,457 @@
+#include "output_validator.h"
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_applier.h"
+
+#define MAX_DEPTH 64
+#define MAX_KEY 16
+#define MAX_LITERAL 32
+#define MAX_PREFIXES 16
+
+// What the next structural character may be
+enum expect {
+  EXPECT_VALUE,
+  EXPECT_VALUE_OR_END, // Just after '['
+  EXPECT_KEY_OR_END,   // Just after '{'
+  EXPECT_KEY,
+  EXPECT_COLON,
+  EXPECT_COMMA_OR_END,
+  EXPECT_NOTHING // The root object is complete
+};
+
+enum lexeme { LEX_NONE, LEX_STRING, LEX_LITERAL };
+
+// What the string being read is for
+enum role { ROLE_KEY, ROLE_VALUE, ROLE_FILE, ROLE_CONTENT };
+
+struct output_validator {
+  char stack[MAX_DEPTH]; // '{' or '[' for every open container
+  int depth;
+  enum expect expect;
+  enum lexeme lexeme;
+  enum role role;
+  int escape;   // After a backslash
+  int unicode;  // Hex digits of a \u escape still to come
+  unsigned int code;
+  char key[MAX_KEY + 1];
+  size_t key_len;
+  char literal[MAX_LITERAL + 1];
+  size_t literal_len;
+
+  int seen_changes;
+  int changes_open; // stack[1] is the changes array
+  int change_open;  // stack[2] is one of its changes
+  int files;
+  int has_file;
+  int has_content;
+  long long content_bytes;
+  char path[PATH_MAX];
+  size_t path_len;
+
+  char error[256];
+};
+
+static int validate_enabled = 1;
+static int corrective_retries = 1;
+static int max_files = 20;
+static long long max_file_bytes = 262144;
+static char prefixes[MAX_PREFIXES][128];
+static int prefix_count = 0; // None allows any path inside the workspace
+
+// Function to handle [Validate] config entries
+int validator_config_handler(const char *name, const char *value) {
+  if (strcmp(name, "enabled") == 0) {
+    validate_enabled = atoi(value);
+  } else if (strcmp(name, "corrective_retries") == 0) {
+    corrective_retries = atoi(value) > 0 ? atoi(value) : 0;
+  } else if (strcmp(name, "max_files") == 0) {
+    max_files = atoi(value);
+  } else if (strcmp(name, "max_file_bytes") == 0) {
+    max_file_bytes = atoll(value);
+  } else if (strcmp(name, "allowed_paths") == 0) {
+    // Comma-separated prefixes, normalised like the paths they match
+    prefix_count = 0;
+    char list[1024];
+    snprintf(list, sizeof(list), "%s", value);
+    char *save = NULL;
+    for (char *item = strtok_r(list, ", ", &save);
+         item && prefix_count < MAX_PREFIXES;
+         item = strtok_r(NULL, ", ", &save)) {
+      if (file_path_normalise(item, prefixes[prefix_count],
+                              sizeof(prefixes[0])) == 0) {
+        prefix_count++;
+      }
+    }
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+int validator_enabled(void) { return validate_enabled; }
+
+int validator_retries(void) { return corrective_retries; }
+
+struct output_validator *validator_create(void) {
+  struct output_validator *v = malloc(sizeof(*v));
+  if (v) {
+    validator_reset(v);
+  }
+  return v;
+}
+
+void validator_free(struct output_validator *v) { free(v); }
+
+void validator_reset(struct output_validator *v) {
+  memset(v, 0, sizeof(*v));
+  v->expect = EXPECT_VALUE;
+}
+
+const char *validator_error(const struct output_validator *v) {
+  return v->error[0] ? v->error : NULL;
+}
+
+static int reject(struct output_validator *v, const char *format, ...) {
+  if (v->error[0] == '\0') {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(v->error, sizeof(v->error), format, args);
+    va_end(args);
+  }
+  return -1;
+}
+
+static int path_allowed(const char *path) {
+  if (prefix_count == 0) {
+    return 1;
+  }
+  for (int i = 0; i < prefix_count; i++) {
+    size_t len = strlen(prefixes[i]);
+    if (strncmp(path, prefixes[i], len) == 0 &&
+        (path[len] == '\0' || path[len] == '/')) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Take one decoded byte of the string being read
+static int string_byte(struct output_validator *v, unsigned char c) {
+  switch (v->role) {
+  case ROLE_KEY:
+    if (v->key_len < MAX_KEY) {
+      v->key[v->key_len] = (char)c;
+    }
+    v->key_len++; // Past MAX_KEY it matches no key we look for
+    break;
+  case ROLE_FILE:
+    if (c == '\0' || v->path_len + 1 >= sizeof(v->path)) {
+      return reject(v, "a \"file\" path is too long or not text");
+    }
+    v->path[v->path_len++] = (char)c;
+    break;
+  case ROLE_CONTENT:
+    if (++v->content_bytes > max_file_bytes) {
+      return reject(v, "file content is larger than %lld bytes",
+                    max_file_bytes);
+    }
+    break;
+  case ROLE_VALUE:
+    break;
+  }
+  return 0;
+}
+
+// Take the code point of a \u escape as UTF-8
+static int string_code(struct output_validator *v, unsigned int code) {
+  if (code >= 0xD800 && code <= 0xDFFF && v->role == ROLE_FILE) {
+    return reject(v, "a \"file\" path has an unsupported escape");
+  }
+  unsigned char bytes[3];
+  int count;
+  if (code < 0x80) {
+    bytes[0] = (unsigned char)code;
+    count = 1;
+  } else if (code < 0x800) {
+    bytes[0] = (unsigned char)(0xC0 | (code >> 6));
+    bytes[1] = (unsigned char)(0x80 | (code & 0x3F));
+    count = 2;
+  } else {
+    bytes[0] = (unsigned char)(0xE0 | (code >> 12));
+    bytes[1] = (unsigned char)(0x80 | ((code >> 6) & 0x3F));
+    bytes[2] = (unsigned char)(0x80 | (code & 0x3F));
+    count = 3;
+  }
+  for (int i = 0; i < count; i++) {
+    if (string_byte(v, bytes[i]) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int string_end(struct output_validator *v) {
+  v->lexeme = LEX_NONE;
+  if (v->role == ROLE_KEY) {
+    v->key[v->key_len <= MAX_KEY ? v->key_len : 0] = '\0';
+    v->expect = EXPECT_COLON;
+    return 0;
+  }
+  if (v->role == ROLE_FILE) {
+    v->path[v->path_len] = '\0';
+    char normalised[PATH_MAX];
+    if (file_path_normalise(v->path, normalised, sizeof(normalised)) != 0) {
+      return reject(v, "invalid path \"%.200s\"", v->path);
+    }
+    if (!path_allowed(normalised)) {
+      return reject(v, "path \"%.200s\" is outside the allowed paths",
+                    normalised);
+    }
+    v->has_file = 1;
+  } else if (v->role == ROLE_CONTENT) {
+    v->has_content = 1;
+  }
+  v->expect = EXPECT_COMMA_OR_END;
+  return 0;
+}
+
+static int literal_end(struct output_validator *v) {
+  v->lexeme = LEX_NONE;
+  v->literal[v->literal_len] = '\0';
+  const char *s = v->literal;
+  if (strcmp(s, "true") != 0 && strcmp(s, "false") != 0 &&
+      strcmp(s, "null") != 0) {
+    char *end = NULL;
+    strtod(s, &end);
+    if (!(s[0] == '-' || (s[0] >= '0' && s[0] <= '9')) || *end != '\0') {
+      return reject(v, "invalid JSON value \"%s\"", s);
+    }
+  }
+  v->expect = EXPECT_COMMA_OR_END;
+  return 0;
+}
+
+static int open_container(struct output_validator *v, char c) {
+  if (v->depth == MAX_DEPTH) {
+    return reject(v, "JSON nested too deeply");
+  }
+  v->stack[v->depth++] = c;
+  v->expect = c == '{' ? EXPECT_KEY_OR_END : EXPECT_VALUE_OR_END;
+  return 0;
+}
+
+static int close_container(struct output_validator *v) {
+  v->depth--;
+  if (v->depth == 2 && v->change_open) {
+    v->change_open = 0;
+    if (!v->has_file || !v->has_content) {
+      return reject(v, "a change lacks \"file\" or \"content\"");
+    }
+  } else if (v->depth == 1 && v->changes_open) {
+    v->changes_open = 0;
+    if (v->files == 0) {
+      return reject(v, "\"changes\" is empty");
+    }
+  } else if (v->depth == 0) {
+    if (!v->seen_changes) {
+      return reject(v, "the object has no \"changes\" array");
+    }
+    v->expect = EXPECT_NOTHING;
+    return 0;
+  }
+  v->expect = EXPECT_COMMA_OR_END;
+  return 0;
+}
+
+// The first character of a value, checked against where it appears
+static int value_start(struct output_validator *v, char c) {
+  enum role role = ROLE_VALUE;
+  if (v->depth == 0 && c != '{') {
+    return reject(v, "the answer does not start with a JSON object");
+  } else if (v->depth == 1 && strcmp(v->key, "changes") == 0) {
+    if (c != '[') {
+      return reject(v, "\"changes\" is not an array");
+    }
+    v->seen_changes = 1;
+    v->changes_open = 1;
+  } else if (v->depth == 2 && v->changes_open) {
+    if (c != '{') {
+      return reject(v, "a change is not an object");
+    }
+    if (++v->files > max_files) {
+      return reject(v, "more than %d files are changed", max_files);
+    }
+    v->change_open = 1;
+    v->has_file = v->has_content = 0;
+    v->content_bytes = 0;
+  } else if (v->depth == 3 && v->change_open &&
+             (strcmp(v->key, "file") == 0 ||
+              strcmp(v->key, "content") == 0)) {
+    if (c != '"') {
+      return reject(v, "\"%s\" is not a string", v->key);
+    }
+    if (v->key[0] == 'f') {
+      role = ROLE_FILE;
+      v->path_len = 0;
+    } else {
+      role = ROLE_CONTENT;
+      v->content_bytes = 0;
+    }
+  }
+
+  if (c == '{' || c == '[') {
+    return open_container(v, c);
+  } else if (c == '"') {
+    v->lexeme = LEX_STRING;
+    v->role = role;
+    return 0;
+  } else if (c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' ||
+             c == 'n') {
+    v->lexeme = LEX_LITERAL;
+    v->literal[0] = c;
+    v->literal_len = 1;
+    return 0;
+  }
+  return reject(v, "unexpected '%c' where a JSON value belongs", c);
+}
+
+// One character outside strings and literals
+static int structural(struct output_validator *v, char c) {
+  if (v->expect == EXPECT_NOTHING) {
+    return 0; // Trailing text is ignored, as cJSON_Parse does
+  }
+  if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+    return 0;
+  }
+  char top = v->depth > 0 ? v->stack[v->depth - 1] : '\0';
+  switch (v->expect) {
+  case EXPECT_VALUE_OR_END:
+    if (c == ']') {
+      return close_container(v);
+    }
+    return value_start(v, c);
+  case EXPECT_VALUE:
+    return value_start(v, c);
+  case EXPECT_KEY_OR_END:
+    if (c == '}') {
+      return close_container(v);
+    }
+    // fall through
+  case EXPECT_KEY:
+    if (c != '"') {
+      return reject(v, "unexpected '%c' where a key belongs", c);
+    }
+    v->lexeme = LEX_STRING;
+    v->role = ROLE_KEY;
+    v->key_len = 0;
+    return 0;
+  case EXPECT_COLON:
+    if (c != ':') {
+      return reject(v, "expected ':' after a key");
+    }
+    v->expect = EXPECT_VALUE;
+    return 0;
+  case EXPECT_COMMA_OR_END:
+    if (c == ',') {
+      v->expect = top == '{' ? EXPECT_KEY : EXPECT_VALUE;
+      return 0;
+    }
+    if ((c == '}' && top == '{') || (c == ']' && top == '[')) {
+      return close_container(v);
+    }
+    return reject(v, "unexpected '%c' after a value", c);
+  case EXPECT_NOTHING:
+    break;
+  }
+  return 0;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+static int string_char(struct output_validator *v, char c) {
+  if (v->unicode > 0) {
+    int digit = hex_value(c);
+    if (digit < 0) {
+      return reject(v, "invalid \\u escape");
+    }
+    v->code = v->code << 4 | (unsigned int)digit;
+    return --v->unicode == 0 ? string_code(v, v->code) : 0;
+  }
+  if (v->escape) {
+    v->escape = 0;
+    static const char from[] = "\"\\/bfnrt";
+    static const char to[] = "\"\\/\b\f\n\r\t";
+    const char *p = c ? strchr(from, c) : NULL;
+    if (c == 'u') {
+      v->unicode = 4;
+      v->code = 0;
+      return 0;
+    } else if (!p) {
+      return reject(v, "invalid escape \\%c", c);
+    }
+    return string_byte(v, (unsigned char)to[p - from]);
+  }
+  if (c == '\\') {
+    v->escape = 1;
+    return 0;
+  } else if (c == '"') {
+    return string_end(v);
+  }
+  return string_byte(v, (unsigned char)c);
+}
+
+// Function to feed the next piece of an answer
+int validator_feed(struct output_validator *v, const char *text, size_t len) {
+  if (v->error[0]) {
+    return -1;
+  }
+  for (size_t i = 0; i < len && v->expect != EXPECT_NOTHING; i++) {
+    char c = text[i];
+    int result;
+    if (v->lexeme == LEX_STRING) {
+      result = string_char(v, c);
+    } else if (v->lexeme == LEX_LITERAL &&
+               (c == '+' || c == '-' || c == '.' || (c >= '0' && c <= '9') ||
+                (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))) {
+      if (v->literal_len == MAX_LITERAL) {
+        return reject(v, "invalid JSON value");
+      }
+      v->literal[v->literal_len++] = c;
+      result = 0;
+    } else {
+      result = v->lexeme == LEX_LITERAL ? literal_end(v) : 0;
+      if (result == 0) {
+        result = structural(v, c);
+      }
+    }
+    if (result != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Function to check that a whole answer was valid
+int validator_finish(struct output_validator *v) {
+  if (v->error[0]) {
+    return -1;
+  }
+  if (v->expect != EXPECT_NOTHING) {
+    return reject(v, "the answer ended before its JSON object was complete");
+  }
+  return 0;
+}
@@ -0,0 +1,403 @@
+#include "prompt_pack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "metrics.h"
+#include "tokenizer.h"
+
+#define MAX_BUDGET_OVERRIDES 16
+#define DEFAULT_CONTEXT_TOKENS 4096
+// Slack for tokens merging differently where content meets the template
+#define PROMPT_MARGIN_TOKENS 16
+#define MIN_CONTENT_TOKENS 64
+#define MARKER_TOKENS 12 // "[... N lines omitted ...]"
+
+enum section_priority { PRIORITY_LOW, PRIORITY_NORMAL };
+
+struct budget_override {
+  char key[64];
+  int tokens;
+};
+
+struct line {
+  const char *text;
+  size_t len; // Including the newline
+  size_t tokens;
+  enum section_priority priority;
+  int dropped;
+};
+
+// A run of lines with the same priority
+struct section {
+  size_t start;
+  size_t end;
+  size_t tokens;
+  enum section_priority priority;
+  int elided;
+};
+
+static char bpe_ranks_path[256] = "";
+static int context_tokens = 0; // 0 to look the model up
+static int default_max_tokens = 1000;
+static struct budget_override context_overrides[MAX_BUDGET_OVERRIDES];
+static int context_override_count = 0;
+static struct budget_override stage_max_tokens[MAX_BUDGET_OVERRIDES];
+static int stage_max_tokens_count = 0;
+
+// Context windows of the models the providers offer
+static const struct {
+  const char *model;
+  int tokens;
+} known_models[] = {
+    {"text-davinci-003", 4097},   {"text-davinci-002", 4097},
+    {"gpt-3.5-turbo-instruct", 4096}, {"davinci-002", 16384},
+    {"babbage-002", 16384},       {"claude-2", 100000},
+    {"claude-2.1", 200000},       {"claude-instant-1", 100000},
+};
+
+static void add_override(struct budget_override *list, int *count,
+                         const char *key, const char *value) {
+  if (*count == MAX_BUDGET_OVERRIDES) {
+    syslog(LOG_ERR, "Too many token budget overrides, ignoring %s", key);
+    return;
+  }
+  snprintf(list[*count].key, sizeof(list[*count].key), "%s", key);
+  list[*count].tokens = atoi(value);
+  (*count)++;
+}
+
+static int find_override(const struct budget_override *list, int count,
+                         const char *key, int fallback) {
+  for (int i = 0; i < count; i++) {
+    if (strcmp(list[i].key, key) == 0) {
+      return list[i].tokens;
+    }
+  }
+  return fallback;
+}
+
+// Function to handle token budget config entries
+int prompt_config_handler(const char *name, const char *value) {
+  if (strcmp(name, "bpe_ranks") == 0) {
+    snprintf(bpe_ranks_path, sizeof(bpe_ranks_path), "%s", value);
+  } else if (strcmp(name, "context_tokens") == 0) {
+    context_tokens = atoi(value);
+  } else if (strncmp(name, "context_tokens.", 15) == 0) {
+    add_override(context_overrides, &context_override_count, name + 15,
+                 value);
+  } else if (strcmp(name, "max_tokens") == 0) {
+    default_max_tokens = atoi(value) > 0 ? atoi(value) : 1;
+  } else if (strncmp(name, "max_tokens.", 11) == 0) {
+    add_override(stage_max_tokens, &stage_max_tokens_count, name + 11,
+                 value);
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+int prompt_init(void) {
+  if (bpe_ranks_path[0] == '\0') {
+    syslog(LOG_INFO, "No bpe_ranks configured, estimating prompt tokens");
+    return 0;
+  }
+  return tokenizer_load(bpe_ranks_path);
+}
+
+static int context_tokens_for(const char *model) {
+  int tokens =
+      find_override(context_overrides, context_override_count, model, 0);
+  if (tokens > 0) {
+    return tokens;
+  }
+  if (context_tokens > 0) {
+    return context_tokens;
+  }
+  for (size_t i = 0; i < sizeof(known_models) / sizeof(known_models[0]);
+       i++) {
+    if (strcmp(known_models[i].model, model) == 0) {
+      return known_models[i].tokens;
+    }
+  }
+  return DEFAULT_CONTEXT_TOKENS;
+}
+
+// Code fences open and close with ``` or ~~~ after at most three spaces
+static int is_fence(const char *line, size_t len) {
+  size_t i = 0;
+  while (i < 3 && i < len && line[i] == ' ') {
+    i++;
+  }
+  return len - i >= 3 && (strncmp(line + i, "```", 3) == 0 ||
+                          strncmp(line + i, "~~~", 3) == 0);
+}
+
+// Split content into lines. Fenced code and quoted replies are the first
+// to go: they are usually logs, stack traces and earlier messages, while
+// the prose states the problem.
+static struct line *split_lines(const char *content, size_t *count) {
+  size_t n = 1;
+  for (const char *p = content; *p; p++) {
+    n += *p == '\n';
+  }
+  struct line *lines = malloc(n * sizeof(*lines));
+  if (!lines) {
+    return NULL;
+  }
+
+  size_t i = 0;
+  int in_fence = 0;
+  for (const char *p = content; *p;) {
+    const char *newline = strchr(p, '\n');
+    size_t len = newline ? (size_t)(newline - p) + 1 : strlen(p);
+    int fence = is_fence(p, len);
+    struct line *line = &lines[i++];
+    line->text = p;
+    line->len = len;
+    line->tokens = tokenizer_count(p, len);
+    line->priority =
+        in_fence || fence || p[0] == '>' ? PRIORITY_LOW : PRIORITY_NORMAL;
+    line->dropped = 0;
+    if (fence) {
+      in_fence = !in_fence;
+    }
+    p += len;
+  }
+  *count = i;
+  return lines;
+}
+
+// Drop the middle of a section until need tokens are saved, keeping two
+// thirds of what is left at the head and a third at the tail. Returns the
+// tokens saved once the omission marker is paid for.
+static size_t elide_section(struct line *lines, const struct section *s,
+                            size_t need) {
+  if (s->end - s->start < 2) {
+    return 0; // Nothing to keep around a single line; truncation handles it
+  }
+  size_t keep = s->tokens > need + MARKER_TOKENS
+                    ? s->tokens - need - MARKER_TOKENS
+                    : 0;
+  size_t head = s->start, used = 0;
+  while (head < s->end && used + lines[head].tokens <= keep * 2 / 3) {
+    used += lines[head++].tokens;
+  }
+  size_t tail = s->end;
+  size_t tail_keep = keep - keep * 2 / 3;
+  used = 0;
+  while (tail > head && used + lines[tail - 1].tokens <= tail_keep) {
+    used += lines[--tail].tokens;
+  }
+
+  size_t saved = 0;
+  for (size_t i = head; i < tail; i++) {
+    lines[i].dropped = 1;
+    saved += lines[i].tokens;
+  }
+  return saved > MARKER_TOKENS ? saved - MARKER_TOKENS : 0;
+}
+
+// Join the kept lines, replacing each dropped run with a marker
+static char *join_lines(const struct line *lines, size_t count) {
+  size_t size = 1;
+  for (size_t i = 0; i < count; i++) {
+    size += lines[i].dropped ? 48 : lines[i].len;
+  }
+  char *out = malloc(size);
+  if (!out) {
+    return NULL;
+  }
+  size_t len = 0;
+  for (size_t i = 0; i < count;) {
+    if (!lines[i].dropped) {
+      memcpy(out + len, lines[i].text, lines[i].len);
+      len += lines[i++].len;
+      continue;
+    }
+    size_t run = 0;
+    while (i < count && lines[i].dropped) {
+      run++;
+      i++;
+    }
+    len += (size_t)snprintf(out + len, size - len,
+                            "[... %zu lines omitted ...]\n", run);
+  }
+  out[len] = '\0';
+  return out;
+}
+
+// Last resort for content without lines to drop, such as one huge line:
+// cut bytes off the end, on a UTF-8 boundary, until it fits
+static void truncate_to_budget(char *content, size_t budget) {
+  size_t len = strlen(content);
+  size_t tokens = tokenizer_count(content, len);
+  while (tokens > budget && len > 0) {
+    size_t cut = (size_t)((double)len * budget / tokens * 0.95);
+    while (cut > 0 && ((unsigned char)content[cut] & 0xC0) == 0x80) {
+      cut--;
+    }
+    len = cut < len ? cut : len - 1;
+    content[len] = '\0';
+    tokens = tokenizer_count(content, len);
+  }
+}
+
+// Shrink content by eliding sections, lowest priority and largest first
+static char *pack_content(const char *content, size_t budget,
+                          size_t *elided) {
+  size_t count = 0;
+  struct line *lines = split_lines(content, &count);
+  if (!lines) {
+    return NULL;
+  }
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    total += lines[i].tokens;
+  }
+  *elided = 0;
+  if (total <= budget) {
+    free(lines);
+    return strdup(content);
+  }
+
+  struct section *sections = malloc(count * sizeof(*sections));
+  if (!sections) {
+    free(lines);
+    return NULL;
+  }
+  size_t section_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (i == 0 || lines[i].priority != lines[i - 1].priority) {
+      sections[section_count++] =
+          (struct section){i, i, 0, lines[i].priority, 0};
+    }
+    struct section *s = &sections[section_count - 1];
+    s->end = i + 1;
+    s->tokens += lines[i].tokens;
+  }
+
+  size_t excess = total - budget;
+  for (int priority = PRIORITY_LOW; priority <= PRIORITY_NORMAL; priority++) {
+    while (excess > 0) {
+      struct section *largest = NULL;
+      for (size_t i = 0; i < section_count; i++) {
+        struct section *s = &sections[i];
+        if ((int)s->priority == priority && !s->elided &&
+            (!largest || s->tokens > largest->tokens)) {
+          largest = s;
+        }
+      }
+      if (!largest) {
+        break;
+      }
+      largest->elided = 1;
+      size_t saved = elide_section(lines, largest, excess);
+      *elided += saved;
+      excess = saved < excess ? excess - saved : 0;
+    }
+  }
+  char *packed = join_lines(lines, count);
+  free(sections);
+  free(lines);
+  if (packed && excess > 0) {
+    truncate_to_budget(packed, budget);
+    *elided += excess;
+  }
+  return packed;
+}
+
+// Function to render a stage prompt within the model's token budget
+char *prompt_pack(const char *stage, const char *model, const char *template,
+                  const char *content, int *max_tokens) {
+  int context = context_tokens_for(model);
+  int stage_max = find_override(stage_max_tokens, stage_max_tokens_count,
+                                stage, default_max_tokens);
+  long long budget = (long long)context - stage_max - PROMPT_MARGIN_TOKENS -
+                     (long long)tokenizer_count(template, strlen(template));
+  if (budget < MIN_CONTENT_TOKENS) {
+    budget = MIN_CONTENT_TOKENS;
+  }
+
+  size_t elided = 0;
+  char *packed = pack_content(content, (size_t)budget, &elided);
+  if (!packed) {
+    syslog(LOG_ERR, "Failed to allocate %s prompt", stage);
+    return NULL;
+  }
+
+  int prompt_len = snprintf(NULL, 0, template, packed);
+  char *prompt = prompt_len >= 0 ? malloc((size_t)prompt_len + 1) : NULL;
+  if (!prompt) {
+    syslog(LOG_ERR, "Failed to allocate %s prompt", stage);
+    free(packed);
+    return NULL;
+  }
+  snprintf(prompt, (size_t)prompt_len + 1, template, packed);
+  free(packed);
+
+  // Whatever the prompt leaves of the context, up to the stage's limit
+  long long prompt_tokens = (long long)tokenizer_count(prompt, prompt_len);
+  long long room = context - prompt_tokens - PROMPT_MARGIN_TOKENS;
+  *max_tokens = room < stage_max ? (int)(room > 1 ? room : 1) : stage_max;
+
+  if (elided > 0) {
+    char metric[128];
+    snprintf(metric, sizeof(metric), "cis_prompt_packed_total{stage=\"%s\"}",
+             stage);
+    metrics_counter_add(metric, 1);
+    snprintf(metric, sizeof(metric),
+             "cis_prompt_elided_tokens_total{stage=\"%s\"}", stage);
+    metrics_counter_add(metric, (long long)elided);
+    syslog(LOG_INFO, "Packed %s prompt to %lld tokens, eliding %zu", stage,
+           prompt_tokens, elided);
+  }
+  return prompt;
+}
+
+int prompt_pack_self_test(void) {
+  int failures = 0;
+  int max_tokens = 0;
+
+  // Short content is left alone and keeps the stage's full budget
+  char *prompt =
+      prompt_pack("self_test", "text-davinci-003", "Issue:\n%s", "Short.",
+                  &max_tokens);
+  if (!prompt || strcmp(prompt, "Issue:\nShort.") != 0 ||
+      max_tokens != default_max_tokens) {
+    syslog(LOG_ERR, "Prompt packing changed a short prompt");
+    failures++;
+  }
+  free(prompt);
+
+  // A long log inside a code fence is elided before the prose around it
+  size_t size = 256 * 1024;
+  char *content = malloc(size);
+  if (!content) {
+    return -1;
+  }
+  size_t len = (size_t)snprintf(content, size,
+                                "The service crashes on startup.\n```\n");
+  for (int i = 0; len + 64 < size / 2; i++) {
+    len += (size_t)snprintf(content + len, size - len,
+                            "frame %d: at worker_loop (worker.c:%d)\n", i,
+                            i * 7);
+  }
+  snprintf(content + len, size - len, "```\nIt started after upgrading.\n");
+  prompt = prompt_pack("self_test", "text-davinci-003", "Issue:\n%s", content,
+                       &max_tokens);
+  int context = context_tokens_for("text-davinci-003");
+  if (!prompt ||
+      (long long)tokenizer_count(prompt, strlen(prompt)) + max_tokens >
+          context ||
+      !strstr(prompt, "crashes on startup") ||
+      !strstr(prompt, "after upgrading") || !strstr(prompt, "omitted")) {
+    syslog(LOG_ERR, "Prompt packing failed to fit an oversized prompt");
+    failures++;
+  }
+  free(prompt);
+  free(content);
+  return failures ? -1 : 0;
+}
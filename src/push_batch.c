@@ -0,0 +1,277 @@
+#include "push_batch.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#define MAX_PUSH_REFS 32
+
+struct push_member {
+  char refname[256];   // refs/heads/<branch>
+  char objects[512];   // The workspace's object directory
+  git_oid commit;
+  int status;          // 0 once the remote accepted the ref
+  char error[256];
+};
+
+// Branches bound for one remote. Followers block on changed until the
+// leader has pushed and filled in every member's status.
+struct push {
+  char remote_url[512];
+  struct push_member members[MAX_PUSH_REFS];
+  int count;
+  int done;
+  int waiting; // Members yet to collect their status
+  pthread_cond_t changed;
+  struct push *next;
+};
+
+static int window_ms = 250;
+static int max_refs = 16;
+
+static struct push *open_pushes = NULL;
+static pthread_mutex_t push_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to handle push config entries
+int push_config_handler(const char *name, const char *value) {
+  if (strcmp(name, "window_ms") == 0) {
+    window_ms = atoi(value);
+  } else if (strcmp(name, "max_refs") == 0) {
+    max_refs = atoi(value);
+    if (max_refs < 1) {
+      max_refs = 1;
+    } else if (max_refs > MAX_PUSH_REFS) {
+      max_refs = MAX_PUSH_REFS;
+    }
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static void fail_member(struct push_member *m, const char *reason) {
+  m->status = -1;
+  snprintf(m->error, sizeof(m->error), "%s", reason);
+}
+
+static const char *last_git_error(void) {
+  const git_error *e = git_error_last();
+  return e && e->message ? e->message : "unknown error";
+}
+
+// Record what the remote said about each ref; status is NULL on success
+static int update_reference(const char *refname, const char *status,
+                            void *data) {
+  struct push *p = data;
+  for (int i = 0; i < p->count; i++) {
+    if (strcmp(p->members[i].refname, refname) == 0) {
+      if (status) {
+        fail_member(&p->members[i], status);
+      } else {
+        p->members[i].status = 0;
+      }
+    }
+  }
+  return 0;
+}
+
+// Push every member of a sealed batch from the leader's repository
+static void send_push(struct push *p, git_repository *repo) {
+  git_odb *odb = NULL;
+  git_remote *remote = NULL;
+  char *specs[MAX_PUSH_REFS];
+  char spec_buf[MAX_PUSH_REFS][520];
+  git_strarray refspecs = {specs, 0};
+
+  if (git_repository_odb(&odb, repo) != 0 ||
+      git_remote_lookup(&remote, repo, "origin") != 0) {
+    for (int i = 0; i < p->count; i++) {
+      fail_member(&p->members[i], last_git_error());
+    }
+    goto cleanup;
+  }
+
+  // Until the remote answers, every ref counts as failed
+  for (int i = 0; i < p->count; i++) {
+    struct push_member *m = &p->members[i];
+    fail_member(m, "not pushed");
+    if (i > 0) {
+      // Followers' commits live in their own workspaces
+      git_reference *ref = NULL;
+      if (git_odb_add_disk_alternate(odb, m->objects) != 0 ||
+          git_reference_create(&ref, repo, m->refname, &m->commit, 1,
+                               "batched push") != 0) {
+        fail_member(m, last_git_error());
+        continue;
+      }
+      git_reference_free(ref);
+    }
+    snprintf(spec_buf[refspecs.count], sizeof(spec_buf[0]), "%s:%s",
+             m->refname, m->refname);
+    specs[refspecs.count] = spec_buf[refspecs.count];
+    refspecs.count++;
+  }
+
+  git_push_options push_opts;
+  git_push_options_init(&push_opts, GIT_PUSH_OPTIONS_VERSION);
+  push_opts.callbacks.push_update_reference = update_reference;
+  push_opts.callbacks.payload = p;
+  if (refspecs.count > 0 &&
+      git_remote_push(remote, &refspecs, &push_opts) != 0) {
+    const char *reason = last_git_error();
+    for (int i = 0; i < p->count; i++) {
+      fail_member(&p->members[i], reason);
+    }
+  }
+
+  // The followers' refs were only borrowed for the push
+  for (int i = 1; i < p->count; i++) {
+    git_reference *ref = NULL;
+    if (git_reference_lookup(&ref, repo, p->members[i].refname) == 0) {
+      git_reference_delete(ref);
+      git_reference_free(ref);
+    }
+  }
+
+cleanup:
+  if (remote)
+    git_remote_free(remote);
+  if (odb)
+    git_odb_free(odb);
+}
+
+// Copy a member's status out and release the batch with its last member.
+// Called with push_lock held.
+static int collect(struct push *p, int index, char *error,
+                   size_t error_size) {
+  struct push_member *m = &p->members[index];
+  int result = m->status;
+  if (result != 0) {
+    snprintf(error, error_size, "%s", m->error);
+  }
+  if (--p->waiting == 0) {
+    pthread_cond_destroy(&p->changed);
+    free(p);
+  }
+  return result;
+}
+
+// Whether a batch can take this ref
+static int can_join(const struct push *p, const char *remote_url,
+                    const char *refname) {
+  if (strcmp(p->remote_url, remote_url) != 0 || p->count == max_refs) {
+    return 0;
+  }
+  for (int i = 0; i < p->count; i++) {
+    if (strcmp(p->members[i].refname, refname) == 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Function to push a branch as part of a batch
+int push_batch_run(git_repository *repo, const char *branch_name,
+                   const git_oid *commit, char *error, size_t error_size) {
+  git_remote *origin = NULL;
+  if (git_remote_lookup(&origin, repo, "origin") != 0) {
+    snprintf(error, error_size, "%s", last_git_error());
+    return -1;
+  }
+  char remote_url[512];
+  snprintf(remote_url, sizeof(remote_url), "%s",
+           git_remote_url(origin) ? git_remote_url(origin) : "");
+  git_remote_free(origin);
+
+  struct push_member self;
+  memset(&self, 0, sizeof(self));
+  snprintf(self.refname, sizeof(self.refname), "refs/heads/%s", branch_name);
+  snprintf(self.objects, sizeof(self.objects), "%sobjects",
+           git_repository_path(repo));
+  git_oid_cpy(&self.commit, commit);
+
+  pthread_mutex_lock(&push_lock);
+  struct push *p = open_pushes;
+  while (p && !can_join(p, remote_url, self.refname)) {
+    p = p->next;
+  }
+
+  if (p) {
+    // Join as a follower and wait for the leader's push
+    int index = p->count++;
+    p->members[index] = self;
+    p->waiting++;
+    if (p->count == max_refs) {
+      pthread_cond_broadcast(&p->changed);
+    }
+    while (!p->done) {
+      pthread_cond_wait(&p->changed, &push_lock);
+    }
+    int result = collect(p, index, error, error_size);
+    pthread_mutex_unlock(&push_lock);
+    return result;
+  }
+
+  // Lead a new batch
+  p = calloc(1, sizeof(*p));
+  if (!p) {
+    pthread_mutex_unlock(&push_lock);
+    snprintf(error, error_size, "out of memory");
+    return -1;
+  }
+  snprintf(p->remote_url, sizeof(p->remote_url), "%s", remote_url);
+  p->members[0] = self;
+  p->count = 1;
+  p->waiting = 1;
+  pthread_cond_init(&p->changed, NULL);
+  p->next = open_pushes;
+  open_pushes = p;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += window_ms / 1000;
+  deadline.tv_nsec += (long)(window_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  while (p->count < max_refs &&
+         pthread_cond_timedwait(&p->changed, &push_lock, &deadline) !=
+             ETIMEDOUT) {
+  }
+
+  // Seal the batch so nobody joins while the push is in flight
+  for (struct push **q = &open_pushes; *q; q = &(*q)->next) {
+    if (*q == p) {
+      *q = p->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&push_lock);
+
+  send_push(p, repo);
+  int pushed = 0;
+  for (int i = 0; i < p->count; i++) {
+    pushed += p->members[i].status == 0;
+  }
+  syslog(LOG_INFO, "Pushed %d of %d branches to %s in one push", pushed,
+         p->count, p->remote_url);
+  metrics_counter_add("cis_push_batches_total", 1);
+  metrics_counter_add("cis_push_refs_total", pushed);
+  if (pushed < p->count) {
+    metrics_counter_add("cis_push_failures_total", p->count - pushed);
+  }
+
+  pthread_mutex_lock(&push_lock);
+  p->done = 1;
+  pthread_cond_broadcast(&p->changed);
+  int result = collect(p, 0, error, error_size);
+  pthread_mutex_unlock(&push_lock);
+  return result;
+}
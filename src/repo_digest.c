@@ -0,0 +1,571 @@
+#include "repo_digest.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <git2.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define MAX_DIGESTS 64
+#define MAX_SUMMARY 120
+#define MAX_SUMMARY_BLOB (256 * 1024)
+#define SUMMARY_SCAN 4096 // Bytes of a file looked at for its summary
+#define MAX_LAYOUT_DIRS 30
+
+struct digest_entry {
+  char *path;
+  char *summary; // Empty unless the file is a key module
+};
+
+// A repository's digest and the commit it describes. lock is held while
+// the digest is brought up to date, so workers of the same repository wait
+// for one update instead of each doing their own.
+struct digest {
+  char repo[256];
+  char oid[GIT_OID_HEXSZ + 1];
+  struct digest_entry *entries; // Sorted by path
+  int count;
+  int capacity;
+  char *rendered;
+  unsigned long long used;
+  pthread_mutex_t lock;
+};
+
+static int enabled = 1;
+static char cache_dir[256] = "/tmp/cis-digest";
+static int max_chars = 4000;
+
+static struct digest digests[MAX_DIGESTS];
+static int digest_count = 0;
+static unsigned long long digest_clock = 0;
+static pthread_mutex_t digests_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *build_files[] = {
+    "Makefile",     "CMakeLists.txt", "meson.build",    "configure.ac",
+    "package.json", "Cargo.toml",     "go.mod",         "pyproject.toml",
+    "setup.py",     "pom.xml",        "build.gradle",   "WORKSPACE",
+    "BUILD.bazel",  "Gemfile",        "composer.json",  "SConstruct",
+};
+
+static const char *module_extensions[] = {
+    ".h",  ".hh", ".hpp", ".c",  ".cc", ".cpp", ".py", ".go",
+    ".rs", ".java", ".js", ".ts", ".rb", ".md",
+};
+
+// Function to handle digest config entries
+int digest_config_handler(const char *name, const char *value) {
+  if (strcmp(name, "enabled") == 0) {
+    enabled = atoi(value);
+  } else if (strcmp(name, "cache_dir") == 0) {
+    snprintf(cache_dir, sizeof(cache_dir), "%s", value);
+  } else if (strcmp(name, "max_chars") == 0) {
+    max_chars = atoi(value);
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static int is_key_module(const char *path) {
+  const char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  if (strncasecmp(base, "README", 6) == 0 && !strchr(path, '/')) {
+    return 1;
+  }
+  const char *ext = strrchr(base, '.');
+  for (size_t i = 0; ext && i < sizeof(module_extensions) /
+                                   sizeof(module_extensions[0]);
+       i++) {
+    if (strcmp(ext, module_extensions[i]) == 0) {
+      return strcmp(ext, ".md") != 0; // Only the top-level README
+    }
+  }
+  return 0;
+}
+
+// Strip a comment marker; returns NULL for lines that are not comments
+static const char *comment_text(const char *line, size_t *len) {
+  static const char *markers[] = {"///", "//!", "//", "/**", "/*", "*",
+                                  "#",   "--",  "\"\"\""};
+  for (size_t i = 0; i < sizeof(markers) / sizeof(markers[0]); i++) {
+    size_t n = strlen(markers[i]);
+    if (*len >= n && strncmp(line, markers[i], n) == 0) {
+      if (markers[i][0] == '#' && *len > 1 && isalpha((unsigned char)line[1])) {
+        return NULL; // A preprocessor directive, not a comment
+      }
+      *len -= n;
+      return line + n;
+    }
+  }
+  return NULL;
+}
+
+// The first descriptive comment of a file (or the first prose line of a
+// README), trimmed to MAX_SUMMARY
+static char *summarise(const char *path, const char *text, size_t size) {
+  int prose = strncasecmp(path, "README", 6) == 0;
+  size_t limit = size < SUMMARY_SCAN ? size : SUMMARY_SCAN;
+  for (size_t pos = 0; pos < limit;) {
+    const char *line = text + pos;
+    const char *eol = memchr(line, '\n', limit - pos);
+    size_t len = eol ? (size_t)(eol - line) : limit - pos;
+    pos += len + 1;
+    while (len > 0 && isspace((unsigned char)*line)) {
+      line++;
+      len--;
+    }
+    const char *body = prose ? (line[0] == '#' ? NULL : line)
+                             : comment_text(line, &len);
+    if (!body) {
+      continue;
+    }
+    while (len > 0 && (isspace((unsigned char)*body) || *body == '*')) {
+      body++;
+      len--;
+    }
+    while (len > 0 && (isspace((unsigned char)body[len - 1]) ||
+                       body[len - 1] == '/' || body[len - 1] == '*')) {
+      len--;
+    }
+    int words = len > 0;
+    for (size_t i = 0; i < len; i++) {
+      words += body[i] == ' ';
+    }
+    if (words < 3 || strncasecmp(body, "copyright", 9) == 0 ||
+        strncasecmp(body, "SPDX", 4) == 0 || memchr(body, '\t', len)) {
+      continue;
+    }
+    return strndup(body, len < MAX_SUMMARY ? len : MAX_SUMMARY);
+  }
+  return strdup("");
+}
+
+static char *blob_summary(git_repository *repo, const char *path,
+                          const git_oid *id) {
+  if (!is_key_module(path)) {
+    return strdup("");
+  }
+  git_blob *blob = NULL;
+  if (git_blob_lookup(&blob, repo, id) != 0) {
+    return strdup("");
+  }
+  char *summary = strdup("");
+  git_object_size_t size = git_blob_rawsize(blob);
+  if (size > 0 && size <= MAX_SUMMARY_BLOB) {
+    free(summary);
+    summary = summarise(path, git_blob_rawcontent(blob), (size_t)size);
+  }
+  git_blob_free(blob);
+  return summary;
+}
+
+// Position of path in the sorted entries, or where it would go
+static int find_entry(const struct digest *d, const char *path, int *found) {
+  int lo = 0, hi = d->count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    int cmp = strcmp(d->entries[mid].path, path);
+    if (cmp == 0) {
+      *found = 1;
+      return mid;
+    }
+    if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  *found = 0;
+  return lo;
+}
+
+static void remove_entry(struct digest *d, const char *path) {
+  int found;
+  int i = find_entry(d, path, &found);
+  if (found) {
+    free(d->entries[i].path);
+    free(d->entries[i].summary);
+    memmove(&d->entries[i], &d->entries[i + 1],
+            (size_t)(d->count - i - 1) * sizeof(d->entries[0]));
+    d->count--;
+  }
+}
+
+// Insert or replace an entry; takes ownership of summary
+static int set_entry(struct digest *d, const char *path, char *summary) {
+  int found;
+  int i = find_entry(d, path, &found);
+  if (!summary) {
+    return -1;
+  }
+  if (found) {
+    free(d->entries[i].summary);
+    d->entries[i].summary = summary;
+    return 0;
+  }
+  if (d->count == d->capacity) {
+    int capacity = d->capacity ? d->capacity * 2 : 256;
+    struct digest_entry *entries =
+        realloc(d->entries, (size_t)capacity * sizeof(*entries));
+    if (!entries) {
+      free(summary);
+      return -1;
+    }
+    d->entries = entries;
+    d->capacity = capacity;
+  }
+  char *copy = strdup(path);
+  if (!copy) {
+    free(summary);
+    return -1;
+  }
+  memmove(&d->entries[i + 1], &d->entries[i],
+          (size_t)(d->count - i) * sizeof(d->entries[0]));
+  d->entries[i].path = copy;
+  d->entries[i].summary = summary;
+  d->count++;
+  return 0;
+}
+
+static void clear_entries(struct digest *d) {
+  for (int i = 0; i < d->count; i++) {
+    free(d->entries[i].path);
+    free(d->entries[i].summary);
+  }
+  d->count = 0;
+  free(d->rendered);
+  d->rendered = NULL;
+  d->oid[0] = '\0';
+}
+
+struct walk {
+  git_repository *repo;
+  struct digest *digest;
+  int failed;
+};
+
+static int walk_entry(const char *root, const git_tree_entry *entry,
+                      void *payload) {
+  struct walk *w = payload;
+  if (git_tree_entry_type(entry) != GIT_OBJECT_BLOB) {
+    return 0;
+  }
+  char path[4096];
+  snprintf(path, sizeof(path), "%s%s", root, git_tree_entry_name(entry));
+  if (strpbrk(path, "\t\n")) {
+    return 0; // Cannot be stored in the cache file
+  }
+  char *summary = blob_summary(w->repo, path, git_tree_entry_id(entry));
+  if (set_entry(w->digest, path, summary) != 0) {
+    w->failed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+// Refresh the entries of the paths changed between two trees
+static int update_entries(struct digest *d, git_repository *repo,
+                          git_tree *old_tree, git_tree *new_tree) {
+  git_diff *diff = NULL;
+  if (git_diff_tree_to_tree(&diff, repo, old_tree, new_tree, NULL) != 0) {
+    return -1;
+  }
+  int result = 0;
+  size_t deltas = git_diff_num_deltas(diff);
+  for (size_t i = 0; i < deltas && result == 0; i++) {
+    const git_diff_delta *delta = git_diff_get_delta(diff, i);
+    if (delta->status != GIT_DELTA_ADDED) {
+      remove_entry(d, delta->old_file.path);
+    }
+    if (delta->status != GIT_DELTA_DELETED &&
+        !strpbrk(delta->new_file.path, "\t\n")) {
+      result = set_entry(d, delta->new_file.path,
+                         blob_summary(repo, delta->new_file.path,
+                                      &delta->new_file.id));
+    }
+  }
+  metrics_counter_add("cis_digest_refreshed_paths_total", (long long)deltas);
+  git_diff_free(diff);
+  return result;
+}
+
+static void append(char *buf, size_t size, size_t *len, const char *format,
+                   const char *a, long long n) {
+  if (*len < size) {
+    int written = snprintf(buf + *len, size - *len, format, a, n);
+    *len += written > 0 ? (size_t)written : 0;
+  }
+}
+
+// Render the digest text: build files, top-level layout, key modules
+static char *render(const struct digest *d) {
+  size_t size = (size_t)(max_chars > 0 ? max_chars : 1) + 1;
+  char *buf = malloc(size);
+  if (!buf) {
+    return NULL;
+  }
+  size_t len = 0;
+  buf[0] = '\0';
+
+  append(buf, size, &len, "%sBuild system:", "", 0);
+  int builds = 0;
+  for (size_t i = 0; i < sizeof(build_files) / sizeof(build_files[0]); i++) {
+    int found;
+    find_entry(d, build_files[i], &found);
+    if (found) {
+      append(buf, size, &len, " %s", build_files[i], 0);
+      builds++;
+    }
+  }
+  append(buf, size, &len, "%s\nLayout:\n", builds ? "" : " unknown", 0);
+
+  // Entries are sorted, so each top-level directory is one run
+  int dirs = 0;
+  for (int i = 0; i < d->count;) {
+    const char *slash = strchr(d->entries[i].path, '/');
+    if (!slash) {
+      i++;
+      continue;
+    }
+    size_t prefix = (size_t)(slash - d->entries[i].path) + 1;
+    int j = i;
+    while (j < d->count &&
+           strncmp(d->entries[j].path, d->entries[i].path, prefix) == 0) {
+      j++;
+    }
+    if (dirs++ < MAX_LAYOUT_DIRS) {
+      char name[256];
+      snprintf(name, sizeof(name), "%.*s", (int)prefix, d->entries[i].path);
+      append(buf, size, &len, "  %s (%lld files)\n", name, j - i);
+    }
+    i = j;
+  }
+
+  append(buf, size, &len, "%sKey modules:\n", "", 0);
+  for (int i = 0; i < d->count; i++) {
+    if (d->entries[i].summary[0] == '\0') {
+      continue;
+    }
+    size_t before = len;
+    append(buf, size, &len, "  %s: ", d->entries[i].path, 0);
+    append(buf, size, &len, "%s\n", d->entries[i].summary, 0);
+    if (len >= size) {
+      len = before; // Out of room; keep whole lines only
+      break;
+    }
+  }
+  buf[len < size ? len : size - 1] = '\0';
+  return buf;
+}
+
+static void cache_path(const struct digest *d, char *path, size_t size) {
+  snprintf(path, size, "%s/", cache_dir);
+  size_t len = strlen(path);
+  for (const char *p = d->repo; *p && len < size - 1; p++) {
+    path[len++] = *p == '/' ? '_' : *p;
+  }
+  path[len] = '\0';
+  snprintf(path + len, size - len, ".digest");
+}
+
+static void load_digest(struct digest *d) {
+  char path[512];
+  cache_path(d, path, sizeof(path));
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return;
+  }
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t n = getline(&line, &cap, file);
+  if (n == GIT_OID_HEXSZ + 1 && line[GIT_OID_HEXSZ] == '\n') {
+    memcpy(d->oid, line, GIT_OID_HEXSZ);
+    d->oid[GIT_OID_HEXSZ] = '\0';
+    while ((n = getline(&line, &cap, file)) > 0) {
+      line[n - 1] = line[n - 1] == '\n' ? '\0' : line[n - 1];
+      char *tab = strchr(line, '\t');
+      if (!tab) {
+        continue;
+      }
+      *tab = '\0';
+      if (set_entry(d, line, strdup(tab + 1)) != 0) {
+        clear_entries(d);
+        break;
+      }
+    }
+  }
+  free(line);
+  fclose(file);
+  if (d->oid[0]) {
+    d->rendered = render(d);
+  }
+}
+
+// Write the cache file through a temporary name, so readers never see half
+static void save_digest(const struct digest *d) {
+  char path[512], tmp[540];
+  cache_path(d, path, sizeof(path));
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  if (mkdir(cache_dir, 0700) != 0 && errno != EEXIST) {
+    return;
+  }
+  FILE *file = fopen(tmp, "w");
+  if (!file) {
+    syslog(LOG_ERR, "Failed to write digest cache %s: %s", tmp,
+           strerror(errno));
+    return;
+  }
+  fprintf(file, "%s\n", d->oid);
+  for (int i = 0; i < d->count; i++) {
+    fprintf(file, "%s\t%s\n", d->entries[i].path, d->entries[i].summary);
+  }
+  if (fclose(file) != 0 || rename(tmp, path) != 0) {
+    unlink(tmp);
+  }
+}
+
+// Find a repository's digest slot, reusing the least recently used one
+// that nobody is updating. Returns it locked, or NULL if all are busy.
+static struct digest *lock_digest(const char *repo) {
+  pthread_mutex_lock(&digests_lock);
+  struct digest *d = NULL;
+  for (int i = 0; i < digest_count; i++) {
+    if (strcmp(digests[i].repo, repo) == 0) {
+      d = &digests[i];
+      break;
+    }
+  }
+  if (!d && digest_count < MAX_DIGESTS) {
+    d = &digests[digest_count++];
+    pthread_mutex_init(&d->lock, NULL);
+    snprintf(d->repo, sizeof(d->repo), "%s", repo);
+  } else if (!d) {
+    for (int i = 0; i < digest_count; i++) {
+      if ((!d || digests[i].used < d->used) &&
+          pthread_mutex_trylock(&digests[i].lock) == 0) {
+        if (d) {
+          pthread_mutex_unlock(&d->lock);
+        }
+        d = &digests[i];
+      }
+    }
+    if (d) {
+      clear_entries(d);
+      snprintf(d->repo, sizeof(d->repo), "%s", repo);
+      d->used = ++digest_clock;
+      pthread_mutex_unlock(&digests_lock);
+      return d; // Already locked by the trylock
+    }
+  }
+  if (d) {
+    d->used = ++digest_clock;
+  }
+  pthread_mutex_unlock(&digests_lock);
+  if (d) {
+    pthread_mutex_lock(&d->lock);
+    if (strcmp(d->repo, repo) != 0) {
+      // Evicted while we waited; go round again
+      pthread_mutex_unlock(&d->lock);
+      return lock_digest(repo);
+    }
+  }
+  return d;
+}
+
+// Bring a locked digest up to date with HEAD. Returns 0 on success.
+static int refresh(struct digest *d, git_repository *repo,
+                   const git_oid *head) {
+  char head_hex[GIT_OID_HEXSZ + 1];
+  git_oid_tostr(head_hex, sizeof(head_hex), head);
+  if (!d->oid[0]) {
+    load_digest(d);
+  }
+  if (d->rendered && strcmp(d->oid, head_hex) == 0) {
+    metrics_counter_add("cis_digest_hits_total", 1);
+    return 0;
+  }
+
+  git_commit *commit = NULL, *old_commit = NULL;
+  git_tree *tree = NULL, *old_tree = NULL;
+  git_oid old;
+  int result = -1;
+  if (git_commit_lookup(&commit, repo, head) != 0 ||
+      git_commit_tree(&tree, commit) != 0) {
+    goto cleanup;
+  }
+  // The old commit may be missing, e.g. after a force push or in a
+  // shallow clone; then the digest is rebuilt from scratch
+  if (d->oid[0] && git_oid_fromstr(&old, d->oid) == 0 &&
+      git_commit_lookup(&old_commit, repo, &old) == 0 &&
+      git_commit_tree(&old_tree, old_commit) == 0 &&
+      update_entries(d, repo, old_tree, tree) == 0) {
+    metrics_counter_add("cis_digest_updates_total", 1);
+  } else {
+    clear_entries(d);
+    struct walk w = {repo, d, 0};
+    if (git_tree_walk(tree, GIT_TREEWALK_PRE, walk_entry, &w) != 0 ||
+        w.failed) {
+      clear_entries(d);
+      goto cleanup;
+    }
+    metrics_counter_add("cis_digest_builds_total", 1);
+  }
+  memcpy(d->oid, head_hex, sizeof(d->oid));
+  free(d->rendered);
+  d->rendered = render(d);
+  save_digest(d);
+  result = d->rendered ? 0 : -1;
+
+cleanup:
+  if (old_tree)
+    git_tree_free(old_tree);
+  if (old_commit)
+    git_commit_free(old_commit);
+  if (tree)
+    git_tree_free(tree);
+  if (commit)
+    git_commit_free(commit);
+  return result;
+}
+
+// Function to get a repository's digest
+char *repo_digest_get(const char *repo_full_name, const char *local_path) {
+  if (!enabled) {
+    return NULL;
+  }
+  git_libgit2_init();
+  git_repository *repo = NULL;
+  git_reference *head = NULL;
+  char *digest = NULL;
+  if (git_repository_open(&repo, local_path) != 0 ||
+      git_repository_head(&head, repo) != 0 || !git_reference_target(head)) {
+    goto cleanup;
+  }
+
+  struct digest *d = lock_digest(repo_full_name);
+  if (!d) {
+    goto cleanup;
+  }
+  if (refresh(d, repo, git_reference_target(head)) == 0) {
+    digest = strdup(d->rendered);
+  } else {
+    syslog(LOG_ERR, "Failed to build the digest of %s", repo_full_name);
+  }
+  pthread_mutex_unlock(&d->lock);
+
+cleanup:
+  if (head)
+    git_reference_free(head);
+  if (repo)
+    git_repository_free(repo);
+  git_libgit2_shutdown();
+  return digest;
+}
@@ -0,0 +1,329 @@
+#include "review_fanout.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+
+#include "metrics.h"
+
+#define MAX_REVIEWERS 8
+
+enum verdict {
+  VERDICT_APPROVED,
+  VERDICT_REJECTED,
+  VERDICT_MISSING, // The review did not say either way
+  VERDICT_FAILED   // No review was obtained
+};
+
+static const char *verdict_names[] = {"approved", "not approved",
+                                      "no verdict", "failed"};
+
+struct reviewer {
+  char name[32];
+  char stage[48]; // <name>_review, for deadlines and metrics
+  char *template;
+};
+
+struct review_task {
+  const struct reviewer *reviewer;
+  int blocking;
+  const char *implementation;
+  int issue_number;
+  review_send_fn send;
+  char *text;
+  enum verdict verdict;
+  pthread_t thread;
+  int threaded;
+};
+
+static struct reviewer reviewers[MAX_REVIEWERS];
+static int reviewer_count = 0;
+static char reviewer_order[256] = ""; // Empty for every reviewer with a prompt
+static char advisory_reviewers[256] = "";
+
+// Function to handle review config entries
+int review_config_handler(const char *name, const char *value) {
+  if (strcmp(name, "reviewers") == 0) {
+    snprintf(reviewer_order, sizeof(reviewer_order), "%s", value);
+  } else if (strcmp(name, "advisory") == 0) {
+    snprintf(advisory_reviewers, sizeof(advisory_reviewers), "%s", value);
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static struct reviewer *find_reviewer(const char *name) {
+  for (int i = 0; i < reviewer_count; i++) {
+    if (strcmp(reviewers[i].name, name) == 0) {
+      return &reviewers[i];
+    }
+  }
+  return NULL;
+}
+
+// Function to handle review prompt config entries
+int review_prompt_config_handler(const char *name, const char *value) {
+  char reviewer_name[32];
+  size_t len = strlen(name);
+  if (strcmp(name, "review_changes_prompt") == 0) {
+    strcpy(reviewer_name, "correctness");
+  } else if (len > 14 && len - 14 < sizeof(reviewer_name) &&
+             strcmp(name + len - 14, "_review_prompt") == 0) {
+    snprintf(reviewer_name, sizeof(reviewer_name), "%.*s", (int)(len - 14),
+             name);
+  } else {
+    return 0;
+  }
+
+  struct reviewer *r = find_reviewer(reviewer_name);
+  if (!r) {
+    if (reviewer_count == MAX_REVIEWERS) {
+      syslog(LOG_ERR, "Too many reviewers, ignoring %s", name);
+      return 1;
+    }
+    r = &reviewers[reviewer_count++];
+    snprintf(r->name, sizeof(r->name), "%s", reviewer_name);
+    snprintf(r->stage, sizeof(r->stage), "%s_review", reviewer_name);
+  }
+  free(r->template);
+  r->template = strdup(value);
+  return 1;
+}
+
+// Whether name appears in a comma-separated list
+static int in_list(const char *list, const char *name) {
+  size_t len = strlen(name);
+  for (const char *p = list; *p;) {
+    while (*p == ',' || *p == ' ') {
+      p++;
+    }
+    size_t item = strcspn(p, ", ");
+    if (item == len && strncmp(p, name, len) == 0) {
+      return 1;
+    }
+    p += item;
+  }
+  return 0;
+}
+
+// Function to get the length of word at p if it stands alone there
+// (case-insensitive), or 0 if it does not
+static size_t match_word(const char *text, const char *p, const char *word) {
+  size_t len = strlen(word);
+  if (p > text && isalnum((unsigned char)p[-1])) {
+    return 0;
+  }
+  if (strncasecmp(p, word, len) != 0 || isalnum((unsigned char)p[len])) {
+    return 0;
+  }
+  return len;
+}
+
+// Function to check for "Not Approved" as whole words at p
+static int match_rejection(const char *text, const char *p) {
+  size_t len = match_word(text, p, "not");
+  if (len == 0 || !isspace((unsigned char)p[len])) {
+    return 0;
+  }
+  p += len;
+  while (isspace((unsigned char)*p)) {
+    p++;
+  }
+  return match_word(text, p, "approved") != 0;
+}
+
+// The verdict is a standalone token: "Not Approved" as whole words anywhere
+// rejects, and "Approved" approves only as the first word of a line
+// (markdown emphasis allowed). Anything else, such as "cannot be approved",
+// "Disapproved" or "Unapproved", is no verdict at all.
+static enum verdict parse_verdict(const char *text) {
+  enum verdict verdict = VERDICT_MISSING;
+  int line_start = 1;
+  for (const char *p = text; *p; p++) {
+    if (match_rejection(text, p)) {
+      return VERDICT_REJECTED;
+    }
+    if (*p == '\n') {
+      line_start = 1;
+      continue;
+    }
+    if (line_start && match_word(text, p, "approved")) {
+      verdict = VERDICT_APPROVED;
+    }
+    if (!strchr(" \t\r*_#>-", *p)) {
+      line_start = 0;
+    }
+  }
+  return verdict;
+}
+
+static void *review_thread(void *arg) {
+  struct review_task *task = arg;
+  task->text = task->send(task->reviewer->stage, task->reviewer->template,
+                          task->implementation, task->issue_number);
+  task->verdict = task->text ? parse_verdict(task->text) : VERDICT_FAILED;
+  return NULL;
+}
+
+// Pick the reviewers to run, in the configured order
+static int plan_reviews(struct review_task *tasks) {
+  int count = 0;
+  if (reviewer_order[0] == '\0') {
+    for (int i = 0; i < reviewer_count; i++) {
+      tasks[count++].reviewer = &reviewers[i];
+    }
+    return count;
+  }
+  char order[sizeof(reviewer_order)];
+  strcpy(order, reviewer_order);
+  char *saveptr = NULL;
+  for (char *name = strtok_r(order, ", ", &saveptr);
+       name && count < MAX_REVIEWERS; name = strtok_r(NULL, ", ", &saveptr)) {
+    struct reviewer *r = find_reviewer(name);
+    if (!r) {
+      syslog(LOG_ERR, "No %s_review_prompt configured for reviewer %s", name,
+             name);
+      continue;
+    }
+    tasks[count++].reviewer = r;
+  }
+  return count;
+}
+
+// Merge verdicts: a failed blocking review fails the phase, otherwise any
+// blocking review short of approval rejects it. Advisory reviews are only
+// reported, so without a blocking review the phase fails rather than let
+// unreviewed changes through.
+static int merge_verdict(const struct review_task *tasks, int count) {
+  int result = 1;
+  int blocking = 0;
+  for (int i = 0; i < count; i++) {
+    blocking += tasks[i].blocking;
+    if (!tasks[i].blocking || tasks[i].verdict == VERDICT_APPROVED) {
+      continue;
+    }
+    if (tasks[i].verdict == VERDICT_FAILED) {
+      return -1;
+    }
+    result = 0;
+  }
+  return blocking > 0 ? result : -1;
+}
+
+static char *merge_text(const struct review_task *tasks, int count,
+                        int result) {
+  size_t size = 64;
+  for (int i = 0; i < count; i++) {
+    size += 96 + (tasks[i].text ? strlen(tasks[i].text) : 0);
+  }
+  char *merged = malloc(size);
+  if (!merged) {
+    return NULL;
+  }
+  size_t len = (size_t)snprintf(merged, size, "Verdict: %s\n",
+                                result > 0   ? "Approved"
+                                : result == 0 ? "Not Approved"
+                                              : "Review failed");
+  for (int i = 0; i < count; i++) {
+    len += (size_t)snprintf(merged + len, size - len, "\n[%s] %s%s\n%s\n",
+                            tasks[i].reviewer->name,
+                            verdict_names[tasks[i].verdict],
+                            tasks[i].blocking ? "" : " (advisory)",
+                            tasks[i].text ? tasks[i].text : "");
+  }
+  return merged;
+}
+
+// Function to run the review phase
+int review_run(const char *implementation, int issue_number,
+               review_send_fn send, char **merged) {
+  struct review_task tasks[MAX_REVIEWERS];
+  memset(tasks, 0, sizeof(tasks));
+  int count = plan_reviews(tasks);
+
+  for (int i = 0; i < count; i++) {
+    tasks[i].blocking = !in_list(advisory_reviewers, tasks[i].reviewer->name);
+    tasks[i].implementation = implementation;
+    tasks[i].issue_number = issue_number;
+    tasks[i].send = send;
+    tasks[i].threaded = pthread_create(&tasks[i].thread, NULL, review_thread,
+                                       &tasks[i]) == 0;
+    if (!tasks[i].threaded) {
+      review_thread(&tasks[i]); // Run it here rather than skip it
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    if (tasks[i].threaded) {
+      pthread_join(tasks[i].thread, NULL);
+    }
+  }
+
+  int result = merge_verdict(tasks, count);
+  if (result < 0 && count == 0) {
+    syslog(LOG_ERR, "No reviewer with a prompt is configured");
+  }
+  for (int i = 0; i < count; i++) {
+    char metric[128];
+    snprintf(metric, sizeof(metric),
+             "cis_review_verdicts_total{reviewer=\"%s\",verdict=\"%s\"}",
+             tasks[i].reviewer->name, verdict_names[tasks[i].verdict]);
+    metrics_counter_add(metric, 1);
+  }
+  *merged = merge_text(tasks, count, result);
+  for (int i = 0; i < count; i++) {
+    free(tasks[i].text);
+  }
+  return result;
+}
+
+int review_self_test(void) {
+  static const struct {
+    const char *text;
+    enum verdict verdict;
+  } vectors[] = {
+      {"Looks good.\nApproved", VERDICT_APPROVED},
+      {"NOT APPROVED: the loop never ends", VERDICT_REJECTED},
+      {"Approved once the typo is fixed? Not approved yet.", VERDICT_REJECTED},
+      {"The code is fine.", VERDICT_MISSING},
+      {"This change cannot be approved.", VERDICT_MISSING},
+      {"Disapproved: breaks the build", VERDICT_MISSING},
+      {"Unapproved", VERDICT_MISSING},
+      {"It would be approved\nif it built.", VERDICT_MISSING},
+      {"Nice work.\n\n**Approved**\n", VERDICT_APPROVED},
+      {"Summary\n- Not\n  approved", VERDICT_REJECTED},
+  };
+  int failures = 0;
+  for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    if (parse_verdict(vectors[i].text) != vectors[i].verdict) {
+      syslog(LOG_ERR, "Review verdict %zu parsed incorrectly", i);
+      failures++;
+    }
+  }
+
+  // Advisory rejections do not block; a failed blocking review wins over a
+  // rejection
+  struct review_task tasks[3];
+  memset(tasks, 0, sizeof(tasks));
+  tasks[0] = (struct review_task){.blocking = 0, .verdict = VERDICT_REJECTED};
+  tasks[1] = (struct review_task){.blocking = 1, .verdict = VERDICT_APPROVED};
+  tasks[2] = (struct review_task){.blocking = 1, .verdict = VERDICT_APPROVED};
+  failures += merge_verdict(tasks, 3) != 1;
+  tasks[2].verdict = VERDICT_MISSING;
+  failures += merge_verdict(tasks, 3) != 0;
+  tasks[1].verdict = VERDICT_FAILED;
+  failures += merge_verdict(tasks, 3) != -1;
+
+  // Nothing approves when no blocking reviewer ran
+  failures += merge_verdict(tasks, 0) != -1;
+  failures += merge_verdict(tasks, 1) != -1;
+  if (failures) {
+    syslog(LOG_ERR, "Review verdict self test failed");
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,275 @@
+#include "shard.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "issue_queue.h"
+#include "metrics.h"
+
+#define MAX_NODES 64
+#define MAX_VIRTUAL_NODES 512
+#define NODES_KEY "cis:nodes"
+#define DEPARTED_KEY "cis:departed"
+
+// Note when a node was first found dead, and forget it once it has been
+// dead for ARGV[3] seconds, unless it came back meanwhile
+static const char *DEPARTED_SCRIPT =
+    "if redis.call('EXISTS', KEYS[3]) == 1 then "
+    "redis.call('HDEL', KEYS[1], ARGV[1]) return 0 end "
+    "redis.call('HSETNX', KEYS[1], ARGV[1], ARGV[2]) "
+    "local since = tonumber(redis.call('HGET', KEYS[1], ARGV[1])) "
+    "if tonumber(ARGV[2]) - since < tonumber(ARGV[3]) then return 0 end "
+    "redis.call('SREM', KEYS[2], ARGV[1]) "
+    "redis.call('HDEL', KEYS[1], ARGV[1]) "
+    "return 1";
+
+struct ring_point {
+  uint64_t hash;
+  int node;
+};
+
+static int sharding = 0;
+static char node_id[64] = "";
+static int heartbeat_seconds = 5;
+static int node_ttl_seconds = 15;
+static int virtual_nodes = 128;
+
+// Current membership and ring, rebuilt only when membership changes
+static char nodes[MAX_NODES][64];
+static int node_count = 0;
+static struct ring_point *ring = NULL;
+static int ring_size = 0;
+static pthread_rwlock_t ring_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+int shard_config_handler(const char *name, const char *value) {
+  if (strcmp(name, "sharding") == 0) {
+    sharding = atoi(value);
+  } else if (strcmp(name, "node_id") == 0) {
+    snprintf(node_id, sizeof(node_id), "%s", value);
+  } else if (strcmp(name, "heartbeat_seconds") == 0) {
+    heartbeat_seconds = atoi(value) > 0 ? atoi(value) : 1;
+  } else if (strcmp(name, "node_ttl_seconds") == 0) {
+    node_ttl_seconds = atoi(value) > 0 ? atoi(value) : 1;
+  } else if (strcmp(name, "virtual_nodes") == 0) {
+    virtual_nodes = atoi(value);
+    if (virtual_nodes < 1 || virtual_nodes > MAX_VIRTUAL_NODES) {
+      virtual_nodes = 128;
+    }
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+int shard_enabled(void) { return sharding; }
+
+const char *shard_node_id(void) {
+  if (node_id[0] == '\0') {
+    // Hostnames are stable across restarts, which keeps ownership stable
+    gethostname(node_id, sizeof(node_id) - 1);
+  }
+  return node_id;
+}
+
+// FNV-1a followed by a splitmix64 finaliser to spread nearby keys
+static uint64_t hash_key(const char *key) {
+  uint64_t h = 1469598103934665603ULL;
+  for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+    h ^= *p;
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+static int compare_points(const void *a, const void *b) {
+  const struct ring_point *pa = a;
+  const struct ring_point *pb = b;
+  if (pa->hash != pb->hash) {
+    return pa->hash < pb->hash ? -1 : 1;
+  }
+  return pa->node - pb->node;
+}
+
+static int compare_node_ids(const void *a, const void *b) {
+  return strcmp((const char *)a, (const char *)b);
+}
+
+// Replace the membership and rebuild the ring; alive must be sorted
+static void rebuild_ring(char alive[][64], int alive_count) {
+  struct ring_point *points =
+      malloc(sizeof(*points) * (size_t)alive_count * virtual_nodes);
+  if (alive_count > 0 && !points) {
+    syslog(LOG_ERR, "Failed to allocate hash ring");
+    return;
+  }
+  int count = 0;
+  for (int n = 0; n < alive_count; n++) {
+    for (int v = 0; v < virtual_nodes; v++) {
+      char vnode[96];
+      snprintf(vnode, sizeof(vnode), "%s#%d", alive[n], v);
+      points[count].hash = hash_key(vnode);
+      points[count].node = n;
+      count++;
+    }
+  }
+  qsort(points, count, sizeof(*points), compare_points);
+
+  pthread_rwlock_wrlock(&ring_lock);
+  free(ring);
+  ring = points;
+  ring_size = count;
+  memcpy(nodes, alive, sizeof(nodes[0]) * alive_count);
+  node_count = alive_count;
+  pthread_rwlock_unlock(&ring_lock);
+
+  metrics_gauge_set("cis_cluster_nodes", alive_count);
+  syslog(LOG_INFO, "Cluster membership changed: %d node(s)", alive_count);
+}
+
+void shard_owner(const char *repo_full_name, char *owner, size_t size) {
+  pthread_rwlock_rdlock(&ring_lock);
+  if (ring_size == 0) {
+    pthread_rwlock_unlock(&ring_lock);
+    snprintf(owner, size, "%s", shard_node_id());
+    return;
+  }
+  // First point clockwise from the key's hash
+  uint64_t h = hash_key(repo_full_name);
+  int lo = 0, hi = ring_size;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (ring[mid].hash < h) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == ring_size) {
+    lo = 0;
+  }
+  snprintf(owner, size, "%s", nodes[ring[lo].node]);
+  pthread_rwlock_unlock(&ring_lock);
+}
+
+// Move the queued work of a node that stopped heart-beating to the new
+// owners. Nodes that have not noticed yet keep routing to it for up to a
+// heartbeat, so it stays a member and is swept on every refresh until all
+// rings have dropped it. A short lock keeps live nodes from sweeping it at
+// the same time.
+static void adopt_dead_node(redisContext *redis_ctx, const char *dead) {
+  redisReply *reply = redisCommand(
+      redis_ctx, "SET cis:reroute:%s %s NX EX 60", dead, shard_node_id());
+  int locked = reply && reply->type == REDIS_REPLY_STATUS;
+  freeReplyObject(reply);
+  if (!locked) {
+    return;
+  }
+
+  int moved = queue_reroute_node(redis_ctx, dead);
+  if (moved >= 0) {
+    metrics_counter_add("cis_cluster_rerouted_total", moved);
+    int grace = node_ttl_seconds + 2 * heartbeat_seconds;
+    reply = redisCommand(redis_ctx, "EVAL %s 3 %s %s cis:node:%s %s %lld %d",
+                         DEPARTED_SCRIPT, DEPARTED_KEY, NODES_KEY, dead, dead,
+                         (long long)time(NULL), grace);
+    if (reply && reply->type == REDIS_REPLY_INTEGER && reply->integer == 1) {
+      syslog(LOG_INFO, "Node %s left the cluster", dead);
+    }
+    freeReplyObject(reply);
+  }
+  freeReplyObject(redisCommand(redis_ctx, "DEL cis:reroute:%s", dead));
+}
+
+// Function to heartbeat and refresh cluster membership
+int shard_refresh(redisContext *redis_ctx) {
+  const char *self = shard_node_id();
+  redisAppendCommand(redis_ctx, "SET cis:node:%s %lld EX %d", self,
+                     (long long)time(NULL), node_ttl_seconds);
+  redisAppendCommand(redis_ctx, "SADD %s %s", NODES_KEY, self);
+  redisAppendCommand(redis_ctx, "HDEL %s %s", DEPARTED_KEY, self);
+  redisAppendCommand(redis_ctx, "SMEMBERS %s", NODES_KEY);
+  redisReply *replies[4] = {NULL, NULL, NULL, NULL};
+  for (int i = 0; i < 4; i++) {
+    if (redisGetReply(redis_ctx, (void **)&replies[i]) != REDIS_OK) {
+      syslog(LOG_ERR, "Failed to send cluster heartbeat");
+      for (int j = 0; j < i; j++) {
+        freeReplyObject(replies[j]);
+      }
+      return -1;
+    }
+  }
+  freeReplyObject(replies[0]);
+  freeReplyObject(replies[1]);
+  freeReplyObject(replies[2]);
+  redisReply *members = replies[3];
+  if (members->type != REDIS_REPLY_ARRAY) {
+    freeReplyObject(members);
+    return -1;
+  }
+
+  // A member is alive while its heartbeat key exists
+  size_t member_count = members->elements;
+  if (member_count > MAX_NODES) {
+    syslog(LOG_ERR, "More than %d cluster nodes, ignoring the rest",
+           MAX_NODES);
+    member_count = MAX_NODES;
+  }
+  for (size_t i = 0; i < member_count; i++) {
+    redisAppendCommand(redis_ctx, "EXISTS cis:node:%s",
+                       members->element[i]->str);
+  }
+  char alive[MAX_NODES][64];
+  char dead[MAX_NODES][64];
+  int alive_count = 0, dead_count = 0;
+  for (size_t i = 0; i < member_count; i++) {
+    redisReply *exists = NULL;
+    if (redisGetReply(redis_ctx, (void **)&exists) != REDIS_OK) {
+      freeReplyObject(members);
+      return -1;
+    }
+    if (exists->type == REDIS_REPLY_INTEGER && exists->integer == 1) {
+      snprintf(alive[alive_count++], 64, "%s", members->element[i]->str);
+    } else {
+      snprintf(dead[dead_count++], 64, "%s", members->element[i]->str);
+    }
+    freeReplyObject(exists);
+  }
+  freeReplyObject(members);
+
+  qsort(alive, alive_count, sizeof(alive[0]), compare_node_ids);
+  pthread_rwlock_rdlock(&ring_lock);
+  int changed = alive_count != node_count;
+  for (int i = 0; !changed && i < alive_count; i++) {
+    changed = strcmp(alive[i], nodes[i]) != 0;
+  }
+  pthread_rwlock_unlock(&ring_lock);
+  if (changed) {
+    rebuild_ring(alive, alive_count);
+  }
+
+  for (int i = 0; i < dead_count; i++) {
+    adopt_dead_node(redis_ctx, dead[i]);
+  }
+  return 0;
+}
+
+void *shard_heartbeat_thread(void *arg) {
+  redisContext *redis_ctx = (redisContext *)arg;
+  syslog(LOG_INFO, "Cluster heartbeat started for node %s", shard_node_id());
+  while (1) {
+    sleep(heartbeat_seconds);
+    shard_refresh(redis_ctx);
+  }
+  return NULL;
+}
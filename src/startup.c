@@ -0,0 +1,49 @@
+#include "startup.h"
+
+#include <stdio.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "clock.h"
+#include "metrics.h"
+
+static void *startup_thread(void *arg) {
+  struct startup_task *task = arg;
+  long long started = now_ms();
+  task->result = task->run(task->arg);
+  task->elapsed_ms = now_ms() - started;
+  return NULL;
+}
+
+// Function to run startup tasks in parallel
+int startup_run(struct startup_task *tasks, int count) {
+  long long started = now_ms();
+  for (int i = 0; i < count; i++) {
+    tasks[i].threaded = pthread_create(&tasks[i].thread, NULL, startup_thread,
+                                       &tasks[i]) == 0;
+    if (!tasks[i].threaded) {
+      startup_thread(&tasks[i]); // Run it here rather than skip it
+    }
+  }
+
+  int result = 0;
+  for (int i = 0; i < count; i++) {
+    if (tasks[i].threaded) {
+      pthread_join(tasks[i].thread, NULL);
+    }
+    char metric[96];
+    snprintf(metric, sizeof(metric), "cis_startup_ms{task=\"%s\"}",
+             tasks[i].name);
+    metrics_gauge_set(metric, tasks[i].elapsed_ms);
+    if (tasks[i].result != 0) {
+      syslog(LOG_ERR, "Startup task %s failed after %lld ms", tasks[i].name,
+             tasks[i].elapsed_ms);
+      result = -1;
+    } else {
+      syslog(LOG_INFO, "Startup task %s took %lld ms", tasks[i].name,
+             tasks[i].elapsed_ms);
+    }
+  }
+  metrics_gauge_set("cis_startup_ms{task=\"total\"}", now_ms() - started);
+  return result;
+}
@@ -0,0 +1,69 @@
+#include "systemd_support.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define LISTEN_FDS_START 3 // First fd passed by systemd
+
+// Function to take the socket-activated listen fd
+int systemd_listen_fd(void) {
+  const char *pid = getenv("LISTEN_PID");
+  const char *fds = getenv("LISTEN_FDS");
+  int fd = -1;
+  if (pid && fds && atol(pid) == (long)getpid() && atoi(fds) > 0) {
+    if (atoi(fds) > 1) {
+      syslog(LOG_WARNING, "systemd passed %s sockets, serving on the first",
+             fds);
+    }
+    fd = LISTEN_FDS_START;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    syslog(LOG_INFO, "Serving on the socket passed by systemd");
+  }
+  // Not for our children
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  return fd;
+}
+
+// Function to notify the service manager
+int systemd_notify(const char *state) {
+  const char *path = getenv("NOTIFY_SOCKET");
+  if (!path || path[0] == '\0') {
+    return 0;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  size_t length = strlen(path);
+  if (length >= sizeof(addr.sun_path) ||
+      (path[0] != '/' && path[0] != '@')) {
+    syslog(LOG_ERR, "Unsupported NOTIFY_SOCKET %s", path);
+    return -1;
+  }
+  memcpy(addr.sun_path, path, length);
+  if (path[0] == '@') {
+    addr.sun_path[0] = '\0'; // Abstract namespace
+  }
+
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  socklen_t size = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + length);
+  int result = 0;
+  if (sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr,
+             size) < 0) {
+    syslog(LOG_ERR, "Failed to notify systemd: %s", strerror(errno));
+    result = -1;
+  }
+  close(fd);
+  return result;
+}
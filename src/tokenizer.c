@@ -0,0 +1,291 @@
+#include "tokenizer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+// Longest piece handed to the merge loop. Longer pre-tokenizer chunks (runs
+// of punctuation, minified code) are split so the quadratic loop stays cheap.
+#define MAX_PIECE 256
+#define NO_RANK INT32_MAX
+
+// Open-addressing table from token bytes to merge rank
+struct rank_entry {
+  uint32_t offset; // Into arena
+  uint32_t len;    // 0 for an empty slot
+  int32_t rank;
+};
+
+static struct rank_entry *table = NULL;
+static size_t table_mask = 0;
+static unsigned char *arena = NULL;
+
+static uint64_t hash_bytes(const unsigned char *p, size_t len) {
+  uint64_t hash = 1469598103934665603ULL; // FNV-1a
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static int32_t rank_of(const unsigned char *p, size_t len) {
+  size_t slot = hash_bytes(p, len) & table_mask;
+  while (table[slot].len != 0) {
+    if (table[slot].len == len &&
+        memcmp(arena + table[slot].offset, p, len) == 0) {
+      return table[slot].rank;
+    }
+    slot = (slot + 1) & table_mask;
+  }
+  return NO_RANK;
+}
+
+static int base64_value(unsigned char c) {
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A';
+  } else if (c >= 'a' && c <= 'z') {
+    return c - 'a' + 26;
+  } else if (c >= '0' && c <= '9') {
+    return c - '0' + 52;
+  } else if (c == '+') {
+    return 62;
+  } else if (c == '/') {
+    return 63;
+  }
+  return -1;
+}
+
+// Decode base64 into out; returns the decoded length or -1 on invalid input
+static long base64_decode(const char *in, size_t len, unsigned char *out) {
+  uint32_t bits = 0;
+  int nbits = 0;
+  long n = 0;
+  for (size_t i = 0; i < len && in[i] != '='; i++) {
+    int v = base64_value((unsigned char)in[i]);
+    if (v < 0) {
+      return -1;
+    }
+    bits = (bits << 6) | (uint32_t)v;
+    nbits += 6;
+    if (nbits >= 8) {
+      nbits -= 8;
+      out[n++] = (unsigned char)(bits >> nbits);
+    }
+  }
+  return n;
+}
+
+// Function to load BPE merge ranks
+int tokenizer_load(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    syslog(LOG_ERR, "Failed to open BPE ranks %s", path);
+    return -1;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+  char *data = size > 0 ? malloc((size_t)size + 1) : NULL;
+  if (!data || fread(data, 1, (size_t)size, file) != (size_t)size) {
+    syslog(LOG_ERR, "Failed to read BPE ranks %s", path);
+    free(data);
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+  data[size] = '\0';
+
+  size_t lines = 0;
+  for (long i = 0; i < size; i++) {
+    lines += data[i] == '\n';
+  }
+  size_t capacity = 1024;
+  while (capacity < (lines + 1) * 2) {
+    capacity *= 2;
+  }
+
+  tokenizer_free();
+  table = calloc(capacity, sizeof(*table));
+  arena = malloc((size_t)size); // Decoded tokens are shorter than the file
+  table_mask = capacity - 1;
+  if (!table || !arena) {
+    syslog(LOG_ERR, "Failed to allocate BPE ranks");
+    free(data);
+    tokenizer_free();
+    return -1;
+  }
+
+  size_t used = 0, loaded = 0;
+  char *line = data;
+  while (*line) {
+    char *end = strchr(line, '\n');
+    if (end) {
+      *end = '\0';
+    }
+    char *space = strchr(line, ' ');
+    long len = space ? base64_decode(line, (size_t)(space - line),
+                                     arena + used)
+                     : -1;
+    if (len <= 0) {
+      if (*line) {
+        syslog(LOG_ERR, "Malformed BPE rank in %s: %.40s", path, line);
+        free(data);
+        tokenizer_free();
+        return -1;
+      }
+    } else {
+      size_t slot = hash_bytes(arena + used, (size_t)len) & table_mask;
+      while (table[slot].len != 0) {
+        slot = (slot + 1) & table_mask;
+      }
+      table[slot].offset = (uint32_t)used;
+      table[slot].len = (uint32_t)len;
+      table[slot].rank = (int32_t)atol(space + 1);
+      used += (size_t)len;
+      loaded++;
+    }
+    if (!end) {
+      break;
+    }
+    line = end + 1;
+  }
+  free(data);
+  syslog(LOG_INFO, "Loaded %zu BPE ranks from %s", loaded, path);
+  return 0;
+}
+
+int tokenizer_loaded(void) { return table != NULL; }
+
+void tokenizer_free(void) {
+  free(table);
+  free(arena);
+  table = NULL;
+  arena = NULL;
+  table_mask = 0;
+}
+
+static inline int is_space(unsigned char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Non-ASCII bytes count as letters, which keeps UTF-8 words together
+static inline int is_letter(unsigned char c) {
+  return (unsigned int)((c | 0x20) - 'a') < 26u || c >= 0x80;
+}
+
+static inline int is_digit(unsigned char c) {
+  return (unsigned int)(c - '0') < 10u;
+}
+
+// End of the pre-tokenizer chunk starting at i, following the GPT-2 split
+// pattern: contractions, an optional space followed by a run of letters,
+// digits or punctuation, and whitespace runs that leave their last space to
+// the following word
+static size_t chunk_end(const unsigned char *s, size_t i, size_t len) {
+  unsigned char c = s[i];
+  if (c == '\'' && i + 1 < len) {
+    unsigned char n = s[i + 1];
+    if (n == 's' || n == 't' || n == 'm' || n == 'd') {
+      return i + 2;
+    }
+    if (i + 2 < len && ((n == 'r' && s[i + 2] == 'e') ||
+                        (n == 'v' && s[i + 2] == 'e') ||
+                        (n == 'l' && s[i + 2] == 'l'))) {
+      return i + 3;
+    }
+  }
+
+  size_t j = i;
+  if (c == ' ' && i + 1 < len && !is_space(s[i + 1])) {
+    c = s[++j];
+  }
+  if (is_letter(c)) {
+    while (j < len && is_letter(s[j])) {
+      j++;
+    }
+  } else if (is_digit(c)) {
+    while (j < len && is_digit(s[j])) {
+      j++;
+    }
+  } else if (!is_space(c)) {
+    while (j < len && !is_space(s[j]) && !is_letter(s[j]) &&
+           !is_digit(s[j])) {
+      j++;
+    }
+  } else {
+    while (j < len && is_space(s[j])) {
+      j++;
+    }
+    if (j < len && j - i > 1) {
+      j--;
+    }
+  }
+  return j;
+}
+
+// Run the merge loop over one piece and return the number of tokens left:
+// repeatedly merge the adjacent pair with the lowest rank until no pair is
+// a known token
+static size_t bpe_count(const unsigned char *p, size_t len) {
+  if (len <= 1 || rank_of(p, len) != NO_RANK) {
+    return len ? 1 : 0;
+  }
+
+  size_t starts[MAX_PIECE + 1];
+  int32_t ranks[MAX_PIECE + 1];
+  size_t n = len + 1; // Part boundaries
+  for (size_t i = 0; i < n; i++) {
+    starts[i] = i;
+  }
+  // ranks[i] is the rank of parts i and i + 1 merged
+  for (size_t i = 0; i + 2 < n; i++) {
+    ranks[i] = rank_of(p + i, 2);
+  }
+  ranks[n - 2] = NO_RANK;
+
+  while (n > 2) {
+    size_t best = 0;
+    for (size_t i = 1; i + 1 < n; i++) {
+      if (ranks[i] < ranks[best]) {
+        best = i;
+      }
+    }
+    if (ranks[best] == NO_RANK) {
+      break;
+    }
+    memmove(&starts[best + 1], &starts[best + 2],
+            (n - best - 2) * sizeof(starts[0]));
+    memmove(&ranks[best + 1], &ranks[best + 2],
+            (n - best - 3) * sizeof(ranks[0]));
+    n--;
+    ranks[n - 2] = NO_RANK;
+    if (best + 2 < n) {
+      ranks[best] = rank_of(p + starts[best], starts[best + 2] - starts[best]);
+    }
+    if (best > 0) {
+      ranks[best - 1] =
+          rank_of(p + starts[best - 1], starts[best + 1] - starts[best - 1]);
+    }
+  }
+  return n - 1;
+}
+
+size_t tokenizer_count(const char *text, size_t len) {
+  if (!table) {
+    return (len + 3) / 4;
+  }
+  const unsigned char *s = (const unsigned char *)text;
+  size_t tokens = 0;
+  for (size_t i = 0; i < len;) {
+    size_t end = chunk_end(s, i, len);
+    for (size_t pos = i; pos < end; pos += MAX_PIECE) {
+      size_t piece = end - pos < MAX_PIECE ? end - pos : MAX_PIECE;
+      tokens += bpe_count(s + pos, piece);
+    }
+    i = end;
+  }
+  return tokens;
+}
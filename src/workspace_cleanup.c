@@ -0,0 +1,427 @@
+#include "workspace_cleanup.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "metrics.h"
+
+#define MAX_CLEANUP_THREADS 32
+
+// Trash links naming a workspace that was moved aside next to itself
+// because the trash is on another filesystem
+#define SIBLING_SUFFIX ".sibling"
+
+// A directory being removed. pending counts its subdirectories still being
+// removed plus one while it is scanned; whoever drops it to zero removes the
+// directory and then releases its parent, so the tree is removed bottom-up
+// while any thread can work on any part of it.
+struct dir_node {
+  char *path;
+  struct dir_node *parent; // NULL for a trash entry
+  struct dir_node *root;
+  int pending;
+  long long freed_bytes; // Trash entries only
+  char *record;          // Trash link to remove with a sibling entry
+  long long started_ms;
+  struct dir_node *next; // In the work stack
+};
+
+static char trash_dir[256] = "/var/lib/cis/trash";
+static int cleanup_threads = 4;
+
+// Directories waiting to be scanned, depth first like fts
+static struct dir_node *work_stack = NULL;
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static int started = 0;
+static long long pending_workspaces = 0;
+static unsigned long discard_seq = 0;
+
+// Function to handle cleanup config entries
+int cleanup_config_handler(const char *name, const char *value) {
+  if (strcmp(name, "trash_dir") == 0) {
+    snprintf(trash_dir, sizeof(trash_dir), "%s", value);
+  } else if (strcmp(name, "threads") == 0) {
+    cleanup_threads = atoi(value);
+    if (cleanup_threads < 1) {
+      cleanup_threads = 1;
+    } else if (cleanup_threads > MAX_CLEANUP_THREADS) {
+      cleanup_threads = MAX_CLEANUP_THREADS;
+    }
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static void push_node(struct dir_node *node) {
+  pthread_mutex_lock(&work_lock);
+  node->next = work_stack;
+  work_stack = node;
+  pthread_cond_signal(&work_ready);
+  pthread_mutex_unlock(&work_lock);
+}
+
+static struct dir_node *new_node(char *path, struct dir_node *parent) {
+  struct dir_node *node = calloc(1, sizeof(*node));
+  if (!node) {
+    free(path);
+    return NULL;
+  }
+  node->path = path;
+  node->parent = parent;
+  node->root = parent ? parent->root : node;
+  node->pending = 1;
+  return node;
+}
+
+// Drop one reference; remove emptied directories up the tree
+static void release_node(struct dir_node *node) {
+  while (node && __atomic_sub_fetch(&node->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (rmdir(node->path) != 0 && errno != ENOENT) {
+      syslog(LOG_ERR, "Failed to remove %s: %s", node->path, strerror(errno));
+    }
+    struct dir_node *parent = node->parent;
+    if (!parent) {
+      syslog(LOG_INFO, "Removed %s (%lld bytes) in %lld ms", node->path,
+             node->freed_bytes, now_ms() - node->started_ms);
+      metrics_counter_add("cis_cleanup_workspaces_total", 1);
+      metrics_gauge_set("cis_cleanup_pending_workspaces",
+                        __atomic_sub_fetch(&pending_workspaces, 1,
+                                           __ATOMIC_RELAXED));
+      if (node->record) {
+        unlink(node->record);
+      }
+    }
+    free(node->record);
+    free(node->path);
+    free(node);
+    node = parent;
+  }
+}
+
+// Unlink everything in a directory but its subdirectories, which are queued
+// for other threads
+static void scan_node(struct dir_node *node) {
+  int fd = open(node->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+  if (!dir) {
+    if (errno != ENOENT) {
+      syslog(LOG_ERR, "Failed to open %s: %s", node->path, strerror(errno));
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    release_node(node);
+    return;
+  }
+
+  long long freed = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    const char *name = entry->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      continue;
+    }
+    // Never follow symlinks: they are unlinked like any other file
+    struct stat st;
+    if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      continue; // Already gone
+    }
+    if (S_ISDIR(st.st_mode)) {
+      char *path = malloc(strlen(node->path) + strlen(name) + 2);
+      struct dir_node *child = NULL;
+      if (path) {
+        sprintf(path, "%s/%s", node->path, name);
+        __atomic_add_fetch(&node->pending, 1, __ATOMIC_ACQ_REL);
+        child = new_node(path, node);
+        if (!child) {
+          __atomic_sub_fetch(&node->pending, 1, __ATOMIC_ACQ_REL);
+        }
+      }
+      if (child) {
+        push_node(child);
+      } else {
+        syslog(LOG_ERR, "Out of memory removing %s/%s", node->path, name);
+      }
+      continue;
+    }
+    if (unlinkat(fd, name, 0) == 0) {
+      freed += (long long)st.st_blocks * 512;
+    } else if (errno != ENOENT) {
+      syslog(LOG_ERR, "Failed to remove %s/%s: %s", node->path, name,
+             strerror(errno));
+    }
+  }
+  closedir(dir);
+
+  __atomic_add_fetch(&node->root->freed_bytes, freed, __ATOMIC_RELAXED);
+  metrics_counter_add("cis_cleanup_freed_bytes_total", freed);
+  release_node(node);
+}
+
+// Take the next directory to scan; blocks unless nowait is set
+static struct dir_node *pop_node(int nowait) {
+  pthread_mutex_lock(&work_lock);
+  while (!work_stack && !nowait) {
+    pthread_cond_wait(&work_ready, &work_lock);
+  }
+  struct dir_node *node = work_stack;
+  if (node) {
+    work_stack = node->next;
+  }
+  pthread_mutex_unlock(&work_lock);
+  return node;
+}
+
+static void *cleanup_thread(void *arg) {
+  (void)arg; // Suppress unused parameter warning
+  while (1) {
+    scan_node(pop_node(0));
+  }
+  return NULL;
+}
+
+// Queue a trash entry; files are simply unlinked. record, if not NULL, is
+// the trash link naming the entry and is removed once the entry is gone.
+static void queue_trash_entry(char *path, char *record) {
+  struct stat st;
+  if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    unlink(path);
+    if (record) {
+      unlink(record);
+    }
+    free(record);
+    free(path);
+    return;
+  }
+  struct dir_node *root = new_node(path, NULL);
+  if (!root) {
+    syslog(LOG_ERR, "Out of memory queueing workspace removal");
+    free(record);
+    return;
+  }
+  root->record = record;
+  root->started_ms = now_ms();
+  metrics_gauge_set("cis_cleanup_pending_workspaces",
+                    __atomic_add_fetch(&pending_workspaces, 1,
+                                       __ATOMIC_RELAXED));
+  push_node(root);
+
+  // Without the thread pool (e.g. in tests) the caller does the work
+  if (!started) {
+    struct dir_node *node;
+    while ((node = pop_node(1)) != NULL) {
+      scan_node(node);
+    }
+  }
+}
+
+// Function to check that a trash link names a sibling workspace_discard
+// made: an absolute path without ".." whose name ends in .trash.<pid>.<seq>
+static int valid_sibling(const char *target) {
+  if (target[0] != '/' || strstr(target, "/../") ||
+      strcmp(target + strlen(target) - 3, "/..") == 0) {
+    return 0;
+  }
+  const char *base = strrchr(target, '/') + 1;
+  const char *tag = strstr(base, ".trash.");
+  if (!tag || tag == base) {
+    return 0;
+  }
+  // Exactly <digits>.<digits> after the last ".trash."
+  const char *next;
+  while ((next = strstr(tag + 1, ".trash.")) != NULL) {
+    tag = next;
+  }
+  const char *p = tag + strlen(".trash.");
+  int fields = 0;
+  while (*p) {
+    if (!isdigit((unsigned char)*p)) {
+      return 0;
+    }
+    while (isdigit((unsigned char)*p)) {
+      p++;
+    }
+    fields++;
+    if (*p == '.' && fields == 1) {
+      p++;
+    } else if (*p) {
+      return 0;
+    }
+  }
+  return fields == 2;
+}
+
+// Function to check that the trash is a real directory only we can use:
+// anyone else able to plant links in it could have us delete their targets
+static int check_trash_dir(void) {
+  struct stat st;
+  if (lstat(trash_dir, &st) != 0) {
+    syslog(LOG_ERR, "Failed to inspect trash directory %s: %s", trash_dir,
+           strerror(errno));
+    return -1;
+  }
+  if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+      (st.st_mode & 07777) != 0700) {
+    syslog(LOG_ERR, "Refusing trash directory %s: it must be a directory "
+           "owned by uid %d with mode 0700", trash_dir, (int)geteuid());
+    errno = EPERM;
+    return -1;
+  }
+  return 0;
+}
+
+// Queue the workspace a trash link names, or drop the link if the
+// workspace is gone
+static void queue_sibling(char *record) {
+  char target[4096];
+  ssize_t len = readlink(record, target, sizeof(target) - 1);
+  if (len <= 0) {
+    unlink(record);
+    free(record);
+    return;
+  }
+  target[len] = '\0';
+  if (!valid_sibling(target)) {
+    syslog(LOG_ERR, "Ignoring trash link %s to %s", record, target);
+    unlink(record);
+    free(record);
+    return;
+  }
+  char *path = strdup(target);
+  if (!path) {
+    free(record);
+    return;
+  }
+  queue_trash_entry(path, record);
+}
+
+int cleanup_init(void) {
+  if (mkdir(trash_dir, 0700) != 0 && errno != EEXIST) {
+    syslog(LOG_ERR, "Failed to create trash directory %s: %s", trash_dir,
+           strerror(errno));
+    return -1;
+  }
+  if (check_trash_dir() != 0) {
+    return -1;
+  }
+  for (int i = 0; i < cleanup_threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, cleanup_thread, NULL) != 0) {
+      syslog(LOG_ERR, "Failed to start cleanup thread");
+      return -1;
+    }
+    pthread_detach(thread);
+  }
+  started = 1;
+
+  // Finish what a previous run left behind
+  DIR *dir = opendir(trash_dir);
+  struct dirent *entry;
+  while (dir && (entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    char *path = malloc(strlen(trash_dir) + strlen(entry->d_name) + 2);
+    if (!path) {
+      continue;
+    }
+    sprintf(path, "%s/%s", trash_dir, entry->d_name);
+    size_t len = strlen(path);
+    size_t suffix = strlen(SIBLING_SUFFIX);
+    if (len > suffix && strcmp(path + len - suffix, SIBLING_SUFFIX) == 0) {
+      queue_sibling(path);
+    } else {
+      queue_trash_entry(path, NULL);
+    }
+  }
+  if (dir) {
+    closedir(dir);
+  }
+  return 0;
+}
+
+// Function to discard a workspace
+int workspace_discard(const char *path) {
+  struct stat st;
+  if (lstat(path, &st) != 0) {
+    if (errno == ENOENT) {
+      return 0; // Nothing to clean up
+    }
+    syslog(LOG_ERR, "Failed to inspect %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  char base_buf[256];
+  snprintf(base_buf, sizeof(base_buf), "%s", path);
+  const char *base = basename(base_buf);
+  unsigned long seq = __atomic_add_fetch(&discard_seq, 1, __ATOMIC_RELAXED);
+
+  size_t size = strlen(trash_dir) + strlen(path) + 64;
+  char *target = malloc(size);
+  if (!target) {
+    return -1;
+  }
+  snprintf(target, size, "%s/%s.%d.%lu", trash_dir, base, (int)getpid(), seq);
+  int result = rename(path, target);
+  if (result != 0 && errno == ENOENT) {
+    // The trash directory is gone, e.g. removed by a tmp cleaner
+    if ((mkdir(trash_dir, 0700) == 0 || errno == EEXIST) &&
+        check_trash_dir() == 0) {
+      result = rename(path, target);
+    } else {
+      errno = ENOENT;
+    }
+  }
+  char *record = NULL;
+  if (result != 0 && errno == EXDEV) {
+    // Trash on another filesystem: a sibling name is just as atomic. A link
+    // in the trash records it, so a crash midway does not leak it.
+    record = malloc(size);
+    if (record && path[0] == '/') {
+      snprintf(record, size, "%s/%s.%d.%lu%s", trash_dir, base,
+               (int)getpid(), seq, SIBLING_SUFFIX);
+      snprintf(target, size, "%s.trash.%d.%lu", path, (int)getpid(), seq);
+      if (symlink(target, record) != 0) {
+        syslog(LOG_ERR, "Failed to record %s in the trash: %s", target,
+               strerror(errno));
+        free(record);
+        record = NULL;
+      }
+    } else {
+      free(record);
+      record = NULL;
+    }
+    snprintf(target, size, "%s.trash.%d.%lu", path, (int)getpid(), seq);
+    result = rename(path, target);
+  }
+  if (result != 0) {
+    int saved = errno;
+    if (record) {
+      unlink(record);
+    }
+    free(record);
+    free(target);
+    if (saved == ENOENT && lstat(path, &st) != 0) {
+      return 0; // Removed meanwhile
+    }
+    syslog(LOG_ERR, "Failed to move %s to the trash: %s", path,
+           strerror(saved));
+    return -1;
+  }
+  queue_trash_entry(target, record);
+  return 0;
+}
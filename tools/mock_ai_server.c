@@ -0,0 +1,327 @@
+// Local stand-in for an AI provider, for load-testing the pipeline offline.
+// Answers OpenAI completion requests (and Anthropic text completions on
+// paths ending in /complete) after a latency drawn from a configurable
+// distribution, optionally failing a share of requests with 503 or 429.
+// Batched analysis prompts get one answer per "=== ISSUE <n> ===" section.
+// With -j every answer is an approved change set instead, so the full
+// pipeline can apply, commit and push it (see bench/pipeline_bench.sh).
+//
+//   make mock-ai-server
+//   bin/mock_ai_server -p 8090 -l 800 -d lognormal -s 0.6 -e 0.02
+//
+// Then set api_provider=mock (or base_url=http://127.0.0.1:8090) in [AI].
+
+#include <math.h>
+#include <microhttpd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum distribution {
+  DIST_FIXED,
+  DIST_UNIFORM,
+  DIST_EXPONENTIAL,
+  DIST_LOGNORMAL
+};
+
+static int port = 8090;
+static double latency_ms = 200;
+static enum distribution dist = DIST_LOGNORMAL;
+static double sigma = 0.5;
+static double error_rate = 0;
+static double throttle_rate = 0;
+static int completion_tokens = 200;
+static unsigned int seed = 1;
+static int change_set = 0;
+
+static char *completion_text = NULL;
+static volatile sig_atomic_t keep_running = 1;
+static unsigned long long served = 0, failed = 0, throttled = 0;
+
+#define MAX_BATCH_ISSUES 64
+
+struct request_state {
+  size_t body_bytes;
+  char tail[32]; // End of the previous chunk, for markers split across them
+  int issues[MAX_BATCH_ISSUES];
+  int issue_count;
+};
+
+static double uniform01(unsigned int *state) {
+  return (rand_r(state) + 1.0) / ((double)RAND_MAX + 2.0);
+}
+
+static double draw_latency(unsigned int *state) {
+  switch (dist) {
+  case DIST_FIXED:
+    return latency_ms;
+  case DIST_UNIFORM:
+    return 2 * latency_ms * uniform01(state);
+  case DIST_EXPONENTIAL:
+    return -latency_ms * log(uniform01(state));
+  case DIST_LOGNORMAL:
+  default: {
+    // Box-Muller; mu is chosen so the mean stays at latency_ms
+    double z = sqrt(-2 * log(uniform01(state))) *
+               cos(2 * M_PI * uniform01(state));
+    double mu = log(latency_ms > 0 ? latency_ms : 1) - sigma * sigma / 2;
+    return exp(mu + sigma * z);
+  }
+  }
+}
+
+// Canned answer in the shape create_pr expects, padded to roughly
+// completion_tokens tokens of four bytes each. With -j it is a change set in
+// the shape apply_code_changes expects, whose verdict also passes review.
+// It is kept JSON-escaped so responses can be formatted without escaping it
+// again.
+static void build_completion_text(void) {
+  const char *head = change_set
+                         ? "{\\\"changes\\\":[{\\\"file\\\":"
+                           "\\\"MOCK_FIX.md\\\",\\\"content\\\":"
+                           "\\\"Generated by mock_ai_server.\\\\n"
+                         : "Title: Mock fix for the reported issue\\n"
+                           "Body: Generated by mock_ai_server.\\n";
+  const char *tail =
+      change_set ? "\\\"}],\\\"verdict\\\":\\\"Approved\\\"}" : "";
+  size_t size =
+      strlen(head) + (size_t)completion_tokens * 4 + strlen(tail) + 1;
+  completion_text = malloc(size);
+  strcpy(completion_text, head);
+  size_t len = strlen(head);
+  while (len + 5 + strlen(tail) < size) {
+    memcpy(completion_text + len, "mock ", 5);
+    len += 5;
+  }
+  strcpy(completion_text + len, tail);
+}
+
+// Note the issue numbers of batch delimiters in a chunk of the request
+static void scan_batch_markers(struct request_state *request,
+                               const char *data, size_t size) {
+  static const char marker[] = "=== ISSUE ";
+  size_t tail_len = strlen(request->tail);
+  char *window = malloc(tail_len + size + 1);
+  memcpy(window, request->tail, tail_len);
+  memcpy(window + tail_len, data, size);
+  window[tail_len + size] = '\0';
+
+  // Markers that already ended inside the carried tail were counted with
+  // the previous chunk
+  for (char *p = strstr(window, marker); p; p = strstr(p + 1, marker)) {
+    char *end;
+    long number = strtol(p + sizeof(marker) - 1, &end, 10);
+    if (end != p + sizeof(marker) - 1 && strncmp(end, " ===", 4) == 0 &&
+        (size_t)(end + 4 - window) > tail_len &&
+        request->issue_count < MAX_BATCH_ISSUES) {
+      request->issues[request->issue_count++] = (int)number;
+    }
+  }
+
+  // Keep the end of the window in case a marker straddles the boundary
+  size_t keep = tail_len + size < sizeof(request->tail) - 1
+                    ? tail_len + size
+                    : sizeof(request->tail) - 1;
+  memcpy(request->tail, window + tail_len + size - keep, keep);
+  request->tail[keep] = '\0';
+  free(window);
+}
+
+// Completion text for a request: the canned answer, or one per issue of a
+// batched prompt
+static char *request_completion(const struct request_state *request) {
+  if (request->issue_count == 0) {
+    return strdup(completion_text);
+  }
+  size_t each = strlen(completion_text) + 32;
+  char *text = malloc(each * (size_t)request->issue_count + 1);
+  size_t len = 0;
+  for (int i = 0; i < request->issue_count; i++) {
+    len += (size_t)sprintf(text + len, "=== ISSUE %d ===\\n%s\\n",
+                           request->issues[i], completion_text);
+  }
+  text[len] = '\0';
+  return text;
+}
+
+static enum MHD_Result send_text(struct MHD_Connection *connection,
+                                 unsigned int status, char *body,
+                                 const char *retry_after) {
+  struct MHD_Response *response = MHD_create_response_from_buffer(
+      strlen(body), body, MHD_RESPMEM_MUST_FREE);
+  MHD_add_response_header(response, "Content-Type", "application/json");
+  if (retry_after) {
+    MHD_add_response_header(response, "Retry-After", retry_after);
+  }
+  enum MHD_Result ret = MHD_queue_response(connection, status, response);
+  MHD_destroy_response(response);
+  return ret;
+}
+
+static enum MHD_Result handle_request(void *cls,
+                                      struct MHD_Connection *connection,
+                                      const char *url, const char *method,
+                                      const char *version,
+                                      const char *upload_data,
+                                      size_t *upload_data_size,
+                                      void **con_cls) {
+  (void)cls;     // Suppress unused parameter warning
+  (void)version; // Suppress unused parameter warning
+  static __thread unsigned int state = 0;
+  if (state == 0) {
+    state = seed ^ (unsigned int)(size_t)&state;
+  }
+
+  if (strcmp(method, "POST") != 0) {
+    return send_text(connection, MHD_HTTP_METHOD_NOT_ALLOWED,
+                     strdup("{\"error\":\"POST only\"}"), NULL);
+  }
+  if (*con_cls == NULL) {
+    *con_cls = calloc(1, sizeof(struct request_state));
+    return *con_cls ? MHD_YES : MHD_NO;
+  }
+  struct request_state *request = *con_cls;
+  if (*upload_data_size != 0) {
+    request->body_bytes += *upload_data_size;
+    scan_batch_markers(request, upload_data, *upload_data_size);
+    *upload_data_size = 0;
+    return MHD_YES;
+  }
+
+  usleep((useconds_t)(draw_latency(&state) * 1000));
+
+  double roll = uniform01(&state);
+  if (roll < error_rate) {
+    __atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+    return send_text(connection, MHD_HTTP_SERVICE_UNAVAILABLE,
+                     strdup("{\"error\":\"overloaded\"}"), "1");
+  }
+  if (roll < error_rate + throttle_rate) {
+    __atomic_add_fetch(&throttled, 1, __ATOMIC_RELAXED);
+    return send_text(connection, MHD_HTTP_TOO_MANY_REQUESTS,
+                     strdup("{\"error\":\"rate limited\"}"), "2");
+  }
+
+  char *text = request_completion(request);
+  int issues = request->issue_count ? request->issue_count : 1;
+  size_t size = strlen(text) + 256;
+  char *body = malloc(size);
+  size_t url_len = strlen(url);
+  if (url_len >= 9 && strcmp(url + url_len - 9, "/complete") == 0) {
+    snprintf(body, size,
+             "{\"completion\":\"%s\",\"stop_reason\":\"stop_sequence\"}",
+             text);
+  } else {
+    snprintf(body, size,
+             "{\"object\":\"text_completion\",\"choices\":[{\"text\":\"%s\","
+             "\"index\":0,\"finish_reason\":\"stop\"}],\"usage\":"
+             "{\"prompt_tokens\":%zu,\"completion_tokens\":%d}}",
+             text, request->body_bytes / 4, completion_tokens * issues);
+  }
+  free(text);
+  __atomic_add_fetch(&served, 1, __ATOMIC_RELAXED);
+  return send_text(connection, MHD_HTTP_OK, body, NULL);
+}
+
+static void request_completed(void *cls, struct MHD_Connection *connection,
+                              void **con_cls,
+                              enum MHD_RequestTerminationCode code) {
+  (void)cls;        // Suppress unused parameter warning
+  (void)connection; // Suppress unused parameter warning
+  (void)code;       // Suppress unused parameter warning
+  free(*con_cls);
+  *con_cls = NULL;
+}
+
+static void stop(int sig) {
+  (void)sig; // Suppress unused parameter warning
+  keep_running = 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-p port] [-l mean_latency_ms] "
+          "[-d fixed|uniform|exponential|lognormal] [-s lognormal_sigma]\n"
+          "          [-e error_rate] [-r throttle_rate] "
+          "[-t completion_tokens] [-S seed] [-j]\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "p:l:d:s:e:r:t:S:j")) != -1) {
+    switch (opt) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'l':
+      latency_ms = atof(optarg);
+      break;
+    case 'd':
+      if (strcmp(optarg, "fixed") == 0) {
+        dist = DIST_FIXED;
+      } else if (strcmp(optarg, "uniform") == 0) {
+        dist = DIST_UNIFORM;
+      } else if (strcmp(optarg, "exponential") == 0) {
+        dist = DIST_EXPONENTIAL;
+      } else if (strcmp(optarg, "lognormal") == 0) {
+        dist = DIST_LOGNORMAL;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 's':
+      sigma = atof(optarg);
+      break;
+    case 'e':
+      error_rate = atof(optarg);
+      break;
+    case 'r':
+      throttle_rate = atof(optarg);
+      break;
+    case 't':
+      completion_tokens = atoi(optarg);
+      break;
+    case 'S':
+      seed = (unsigned int)atoi(optarg);
+      break;
+    case 'j':
+      change_set = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  build_completion_text();
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  // A thread per connection lets simulated latency overlap like it would
+  // on a real provider
+  struct MHD_Daemon *daemon = MHD_start_daemon(
+      MHD_USE_THREAD_PER_CONNECTION | MHD_USE_INTERNAL_POLLING_THREAD,
+      (uint16_t)port, NULL, NULL, &handle_request, NULL,
+      MHD_OPTION_NOTIFY_COMPLETED, request_completed, NULL, MHD_OPTION_END);
+  if (!daemon) {
+    fprintf(stderr, "Failed to listen on port %d\n", port);
+    return 1;
+  }
+  printf("mock AI server on port %d: mean latency %.0f ms, error rate %.3f, "
+         "throttle rate %.3f\n",
+         port, latency_ms, error_rate, throttle_rate);
+  fflush(stdout);
+
+  while (keep_running) {
+    pause();
+  }
+  MHD_stop_daemon(daemon);
+  printf("served %llu, failed %llu, throttled %llu\n", served, failed,
+         throttled);
+  free(completion_text);
+  return 0;
+}
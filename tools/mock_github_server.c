@@ -0,0 +1,169 @@
+// Local stand-in for the parts of the GitHub REST API the service uses, for
+// running the full pipeline offline. Answers repository lookups with a
+// default branch of "main" (with an ETag, so revalidations get a 304) and
+// accepts pull requests with 201, numbering them per server. Every answer
+// carries X-RateLimit headers with a budget that never runs out.
+//
+//   make mock-github-server
+//   bin/mock_github_server -p 8091 -l 50
+//
+// Then set api_url=http://127.0.0.1:8091 in [GitHub].
+
+#include <microhttpd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPO_ETAG "\"mock-repo-v1\""
+
+static int port = 8091;
+static double latency_ms = 0;
+static char default_branch[64] = "main";
+
+static volatile sig_atomic_t keep_running = 1;
+static unsigned long long lookups = 0, revalidated = 0, pulls = 0;
+
+static enum MHD_Result send_json(struct MHD_Connection *connection,
+                                 unsigned int status, char *body,
+                                 const char *etag) {
+  struct MHD_Response *response = MHD_create_response_from_buffer(
+      strlen(body), body, MHD_RESPMEM_MUST_FREE);
+  char reset[32];
+  snprintf(reset, sizeof(reset), "%ld", (long)time(NULL) + 3600);
+  MHD_add_response_header(response, "Content-Type", "application/json");
+  MHD_add_response_header(response, "X-RateLimit-Limit", "1000000");
+  MHD_add_response_header(response, "X-RateLimit-Remaining", "999999");
+  MHD_add_response_header(response, "X-RateLimit-Reset", reset);
+  if (etag) {
+    MHD_add_response_header(response, "ETag", etag);
+  }
+  enum MHD_Result ret = MHD_queue_response(connection, status, response);
+  MHD_destroy_response(response);
+  return ret;
+}
+
+// Split "/repos/<owner>/<repo>[/pulls]" into its parts. Returns 1 for a
+// repository, 2 for its pulls and 0 for anything else.
+static int parse_path(const char *url, char *owner, char *repo) {
+  char rest[64] = "";
+  int fields = sscanf(url, "/repos/%127[^/]/%127[^/]/%63s", owner, repo, rest);
+  if (fields == 2) {
+    return 1;
+  } else if (fields == 3 && strcmp(rest, "pulls") == 0) {
+    return 2;
+  }
+  return 0;
+}
+
+static enum MHD_Result handle_request(void *cls,
+                                      struct MHD_Connection *connection,
+                                      const char *url, const char *method,
+                                      const char *version,
+                                      const char *upload_data,
+                                      size_t *upload_data_size,
+                                      void **con_cls) {
+  (void)cls;         // Suppress unused parameter warning
+  (void)version;     // Suppress unused parameter warning
+  (void)upload_data; // Suppress unused parameter warning
+  static int first_call_marker;
+  if (*con_cls == NULL) {
+    *con_cls = &first_call_marker;
+    return MHD_YES;
+  }
+  if (*upload_data_size != 0) {
+    *upload_data_size = 0; // The pull request body is not checked
+    return MHD_YES;
+  }
+
+  if (latency_ms > 0) {
+    usleep((useconds_t)(latency_ms * 1000));
+  }
+
+  char owner[128], repo[128];
+  int kind = parse_path(url, owner, repo);
+  size_t size = sizeof(owner) + sizeof(repo) + 256;
+  char *body = malloc(size);
+  if (!body) {
+    return MHD_NO;
+  }
+  if (kind == 1 && strcmp(method, "GET") == 0) {
+    __atomic_add_fetch(&lookups, 1, __ATOMIC_RELAXED);
+    const char *match = MHD_lookup_connection_value(
+        connection, MHD_HEADER_KIND, "If-None-Match");
+    if (match && strcmp(match, REPO_ETAG) == 0) {
+      __atomic_add_fetch(&revalidated, 1, __ATOMIC_RELAXED);
+      body[0] = '\0';
+      return send_json(connection, MHD_HTTP_NOT_MODIFIED, body, REPO_ETAG);
+    }
+    snprintf(body, size,
+             "{\"full_name\":\"%s/%s\",\"default_branch\":\"%s\"}", owner,
+             repo, default_branch);
+    return send_json(connection, MHD_HTTP_OK, body, REPO_ETAG);
+  }
+  if (kind == 2 && strcmp(method, "POST") == 0) {
+    unsigned long long number =
+        __atomic_add_fetch(&pulls, 1, __ATOMIC_RELAXED);
+    snprintf(body, size,
+             "{\"number\":%llu,\"html_url\":"
+             "\"http://127.0.0.1:%d/%s/%s/pull/%llu\"}",
+             number, port, owner, repo, number);
+    return send_json(connection, MHD_HTTP_CREATED, body, NULL);
+  }
+  snprintf(body, size, "{\"message\":\"Not Found\"}");
+  return send_json(connection, MHD_HTTP_NOT_FOUND, body, NULL);
+}
+
+static void stop(int sig) {
+  (void)sig; // Suppress unused parameter warning
+  keep_running = 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-p port] [-l latency_ms] [-b default_branch]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "p:l:b:")) != -1) {
+    switch (opt) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'l':
+      latency_ms = atof(optarg);
+      break;
+    case 'b':
+      snprintf(default_branch, sizeof(default_branch), "%s", optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  struct MHD_Daemon *daemon = MHD_start_daemon(
+      MHD_USE_THREAD_PER_CONNECTION | MHD_USE_INTERNAL_POLLING_THREAD,
+      (uint16_t)port, NULL, NULL, &handle_request, NULL, MHD_OPTION_END);
+  if (!daemon) {
+    fprintf(stderr, "Failed to listen on port %d\n", port);
+    return 1;
+  }
+  printf("mock GitHub server on port %d: latency %.0f ms, default branch %s\n",
+         port, latency_ms, default_branch);
+  fflush(stdout);
+
+  while (keep_running) {
+    pause();
+  }
+  MHD_stop_daemon(daemon);
+  printf("repository lookups %llu (%llu revalidated), pull requests %llu\n",
+         lookups, revalidated, pulls);
+  return 0;
+}